@@ -0,0 +1,12 @@
+local size = 2048
+
+Image.create(size, size)
+Image.background(20, 20, 30)
+Image.no_stroke()
+
+math.randomseed(2)
+
+for _ = 1, 20000 do
+    Image.fill(math.random(0, 255), math.random(0, 255), math.random(0, 255), 12)
+    Image.ellipse(math.random() * size, math.random() * size, 50 + math.random() * 400, 50 + math.random() * 400)
+end
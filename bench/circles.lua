@@ -0,0 +1,12 @@
+local size = 2048
+
+Image.create(size, size)
+Image.background(255, 255, 255)
+Image.no_stroke()
+
+math.randomseed(1)
+
+for _ = 1, 200000 do
+    Image.fill(math.random(0, 255), math.random(0, 255), math.random(0, 255))
+    Image.circle(math.random() * size, math.random() * size, 1 + math.random() * 8)
+end
@@ -0,0 +1,92 @@
+#!/bin/bash
+# MIT License
+#
+# Copyright (c) 2025 James Hatfield
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+# Description:
+# Compares the benchmark results of two commits recorded by run.sh. The last
+# run of each benchmark per commit is used.
+#
+# Usage:
+# ```
+# compare.sh <results.jsonl> [base-commit] [commit]
+# ```
+# Without commits the two most recently recorded commits are compared.
+#
+set -e
+
+RESULTS="${1}"
+
+if [ ! -f "${RESULTS}" ] ; then
+    echo "error: results file '${RESULTS}' does not exist!" >&2
+    exit 1
+fi
+
+COMMITS="$(sed -n 's/.*"commit":"\([^"]*\)".*/\1/p' "${RESULTS}" | awk '!seen[$0]++' | tail -n 2)"
+BASE="${2:-$(echo "${COMMITS}" | head -n 1)}"
+HEAD="${3:-$(echo "${COMMITS}" | tail -n 1)}"
+
+awk -v base="${BASE}" -v head="${HEAD}" '
+    function field(line, key) {
+        if (!match(line, "\"" key "\":\"?[^,\"}]*")) {
+            return ""
+        }
+        value = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+        sub(/^"/, "", value)
+        return value
+    }
+    function change(old, new) {
+        return old > 0 ? sprintf("%+.1f%%", (new - old) * 100 / old) : "n/a"
+    }
+    {
+        commit = field($0, "commit")
+        name = field($0, "name")
+        if (commit != base && commit != head) {
+            next
+        }
+        if (!(name in names)) {
+            names[name] = 1
+            order[++count] = name
+        }
+        for (i = 1; i <= num_metrics; i++) {
+            values[commit, name, metrics[i]] = field($0, metrics[i])
+        }
+        seen[commit, name] = 1
+    }
+    BEGIN {
+        num_metrics = split("wall_ms primitives_per_s encoded_mb_per_s peak_rss_kb", metrics, " ")
+    }
+    END {
+        printf "%s -> %s\n", base, head
+        printf "%-20s %-18s %14s %14s %9s\n", "benchmark", "metric", base, head, "change"
+        for (n = 1; n <= count; n++) {
+            name = order[n]
+            if (!((base, name) in seen) || !((head, name) in seen)) {
+                continue
+            }
+            for (i = 1; i <= num_metrics; i++) {
+                old = values[base, name, metrics[i]]
+                new = values[head, name, metrics[i]]
+                printf "%-20s %-18s %14s %14s %9s\n", name, metrics[i], old, new, change(old, new)
+            }
+        }
+    }
+' "${RESULTS}"
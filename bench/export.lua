@@ -0,0 +1,13 @@
+local size = 4096
+local bands = 64
+
+Image.create(size, size)
+Image.no_stroke()
+
+for i = 0, bands - 1 do
+    Image.fill((i * 4) % 256, (i * 29) % 256, 255 - (i * 4) % 256)
+    Image.rect(0, i * size / bands, size, size / bands)
+end
+
+Image.fill(255, 255, 255, 128)
+Image.circle(size / 2, size / 2, size / 3)
@@ -0,0 +1,334 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xpm.h"
+#include "timing.h"
+#include "imagelib.h"
+#include "arg_parse.h"
+
+#define BENCH_MAX_REPEAT 1000
+
+enum bench_kind
+{
+    BENCH_PALETTIZE,
+    BENCH_XPM,
+    BENCH_IMG_PNG,
+    BENCH_IMG_JPG,
+    BENCH_IMG_BMP,
+    BENCH_IMG_TGA,
+    BENCH_IMG_XPM,
+};
+
+struct bench_case
+{
+    const char *name;
+    enum bench_kind kind;
+};
+
+struct bench_input
+{
+    int size;
+    int colors;
+    unsigned char *rgba;
+    struct imc_image_lib_state *image;
+};
+
+struct bench_stats
+{
+    double min;
+    double median;
+    double mean;
+    double stddev;
+    size_t bytes;
+};
+
+static const struct bench_case BENCH_CASES[] =
+{
+    { "palettize", BENCH_PALETTIZE },
+    { "write_xpm", BENCH_XPM },
+    { "img.png", BENCH_IMG_PNG },
+    { "img.jpg", BENCH_IMG_JPG },
+    { "img.bmp", BENCH_IMG_BMP },
+    { "img.tga", BENCH_IMG_TGA },
+    { "img.xpm", BENCH_IMG_XPM },
+};
+
+static const int BENCH_SIZES[] = { 256, 1024, 2048 };
+
+/* the xpm palette tops out at 184 colors */
+static const int BENCH_COLORS[] = { 2, 32, 160 };
+
+#define ARRAY_LEN(ARR) (sizeof(ARR) / sizeof((ARR)[0]))
+
+static void bench_sink(void *closure, void *, int size)
+{
+    *(size_t *)closure += size;
+}
+
+static uint32_t bench_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+
+    return x;
+}
+
+/* 4x4 blocks of colors from a fixed palette, so encoders see both runs and noise */
+static bool bench_input_init(struct bench_input *input, int size, int colors)
+{
+    int width;
+    int height;
+    int stride;
+    unsigned char *argb;
+
+    input->size = size;
+    input->colors = colors;
+    input->rgba = malloc((size_t)size * size * 4);
+    input->image = IMC_IMG_new();
+
+    if (!input->rgba || !input->image || !IMC_IMG_create(input->image, size, size))
+    {
+        printf("error: failed to create %dx%d input!!\n", size, size);
+        return false;
+    }
+
+    argb = IMC_IMG_get_data(input->image, &width, &height, &stride);
+
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            const uint32_t color = bench_hash(bench_hash((y / 4) * size + x / 4) % colors + 1);
+            unsigned char *rgba = &input->rgba[((size_t)y * size + x) * 4];
+
+            rgba[0] = color;
+            rgba[1] = color >> 8;
+            rgba[2] = color >> 16;
+            rgba[3] = 255;
+
+            ((uint32_t *)(argb + (size_t)y * stride))[x] = 0xFF000000 | (rgba[0] << 16) | (rgba[1] << 8) | rgba[2];
+        }
+    }
+
+    return true;
+}
+
+static void bench_input_free(struct bench_input *input)
+{
+    free(input->rgba);
+    IMC_IMG_free(input->image);
+}
+
+static bool bench_run_once(const struct bench_case *bench, struct bench_input *input, size_t *bytes)
+{
+    *bytes = 0;
+
+    switch (bench->kind)
+    {
+        case BENCH_PALETTIZE:
+            return IMC_palettize_xpm(input->size, input->size, input->rgba, bytes);
+        case BENCH_XPM:
+            return IMC_write_xpm_to_func(bench_sink, bytes, input->size, input->size, input->rgba);
+        case BENCH_IMG_PNG:
+            return IMC_IMG_write_png_stream(input->image, bench_sink, bytes);
+        case BENCH_IMG_JPG:
+            return IMC_IMG_write_jpg_stream(input->image, bench_sink, bytes);
+        case BENCH_IMG_BMP:
+            return IMC_IMG_write_bmp_stream(input->image, bench_sink, bytes);
+        case BENCH_IMG_TGA:
+            return IMC_IMG_write_tga_stream(input->image, bench_sink, bytes);
+        case BENCH_IMG_XPM:
+            return IMC_IMG_write_xpm_stream(input->image, bench_sink, bytes);
+    }
+
+    return false;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static bool bench_run(const struct bench_case *bench, struct bench_input *input, int warmup, int repeat,
+                      struct bench_stats *stats)
+{
+    double times[BENCH_MAX_REPEAT];
+    double sum = 0;
+    double sq_sum = 0;
+
+    for (int i = 0; i < warmup + repeat; i++)
+    {
+        const uint64_t begin = IMC_time_ns();
+
+        if (!bench_run_once(bench, input, &stats->bytes))
+        {
+            printf("error: %s failed on %dx%d with %d colors!!\n", bench->name, input->size, input->size, input->colors);
+            return false;
+        }
+
+        if (i >= warmup)
+        {
+            times[i - warmup] = IMC_time_ms(IMC_time_ns() - begin);
+        }
+    }
+
+    qsort(times, repeat, sizeof(double), bench_compare);
+
+    for (int i = 0; i < repeat; i++)
+    {
+        sum += times[i];
+    }
+
+    stats->mean = sum / repeat;
+
+    for (int i = 0; i < repeat; i++)
+    {
+        sq_sum += (times[i] - stats->mean) * (times[i] - stats->mean);
+    }
+
+    stats->min = times[0];
+    stats->median = repeat % 2 ? times[repeat / 2] : (times[repeat / 2 - 1] + times[repeat / 2]) / 2;
+    stats->stddev = repeat > 1 ? sqrt(sq_sum / (repeat - 1)) : 0;
+
+    return true;
+}
+
+static bool parse_count(const cstr *str, int fallback, int min, int max, const char *option, int *result)
+{
+    char *end;
+    long value;
+
+    if (cstr_is_empty(str))
+    {
+        *result = fallback;
+        return true;
+    }
+
+    value = strtol(cstr_str(str), &end, 10);
+
+    if (*end != '\0' || value < min || value > max)
+    {
+        printf("error: --%s must be between %d and %d!!\n", option, min, max);
+        return false;
+    }
+
+    *result = value;
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int rc = EXIT_FAILURE;
+    int warmup;
+    int repeat;
+    cstr filter = cstr_init();
+    cstr warmup_str = cstr_init();
+    cstr repeat_str = cstr_init();
+    struct bench_input input = {};
+    struct arg_conf args_arr[] =
+    {
+        {
+            .string_val = &filter,
+            .short_opt = 'f',
+            .long_opt = "filter",
+            .description = "Only run benchmarks whose name contains this string.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &warmup_str,
+            .short_opt = 'w',
+            .long_opt = "warmup",
+            .description = "Untimed runs before measuring each benchmark (default: 2).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &repeat_str,
+            .short_opt = 'r',
+            .long_opt = "repeat",
+            .description = "Timed runs of each benchmark (default: 10).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {},
+    };
+    struct arg_parse parser =
+    {
+        .name = argv[0],
+        .args = args_arr,
+        .help = true,
+    };
+
+    if (!ARG_parse(parser, argc, argv))
+    {
+        goto failure;
+    }
+
+    if (!parse_count(&warmup_str, 2, 0, BENCH_MAX_REPEAT, "warmup", &warmup)
+        || !parse_count(&repeat_str, 10, 1, BENCH_MAX_REPEAT, "repeat", &repeat))
+    {
+        goto failure;
+    }
+
+    printf("%-24s %10s %10s %10s %8s %10s %10s\n", "benchmark", "min ms", "median ms", "mean ms", "stddev", "MB/s", "out KiB");
+
+    for (size_t s = 0; s < ARRAY_LEN(BENCH_SIZES); s++)
+    {
+        for (size_t c = 0; c < ARRAY_LEN(BENCH_COLORS); c++)
+        {
+            bool initialized = false;
+
+            for (size_t b = 0; b < ARRAY_LEN(BENCH_CASES); b++)
+            {
+                char name[64];
+                struct bench_stats stats = {};
+
+                snprintf(name, sizeof(name), "%s/%d/%dc", BENCH_CASES[b].name, BENCH_SIZES[s], BENCH_COLORS[c]);
+
+                if (!cstr_is_empty(&filter) && !strstr(name, cstr_str(&filter)))
+                {
+                    continue;
+                }
+
+                if (!initialized && !bench_input_init(&input, BENCH_SIZES[s], BENCH_COLORS[c]))
+                {
+                    goto failure;
+                }
+
+                initialized = true;
+
+                if (!bench_run(&BENCH_CASES[b], &input, warmup, repeat, &stats))
+                {
+                    goto failure;
+                }
+
+                /* throughput over the raw 32-bit pixels going in */
+                printf("%-24s %10.3f %10.3f %10.3f %7.1f%% %10.1f %10.1f\n", name, stats.min, stats.median, stats.mean,
+                       stats.mean > 0 ? stats.stddev / stats.mean * 100 : 0,
+                       (double)BENCH_SIZES[s] * BENCH_SIZES[s] * 4 / (1024 * 1024) / (stats.median / 1000),
+                       BENCH_CASES[b].kind == BENCH_PALETTIZE ? 0 : stats.bytes / 1024.00);
+            }
+
+            if (initialized)
+            {
+                bench_input_free(&input);
+                input = (struct bench_input){};
+            }
+        }
+    }
+
+    rc = EXIT_SUCCESS;
+failure:
+    bench_input_free(&input);
+    cstr_drop(&filter);
+    cstr_drop(&warmup_str);
+    cstr_drop(&repeat_str);
+    return rc;
+}
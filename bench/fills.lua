@@ -0,0 +1,11 @@
+local size = 4096
+
+Image.create(size, size)
+Image.no_stroke()
+
+for i = 1, 400 do
+    local inset = (i % 64) * 8
+
+    Image.fill((i * 37) % 256, (i * 91) % 256, (i * 13) % 256)
+    Image.rect(inset, inset, size - inset * 2, size - inset * 2)
+end
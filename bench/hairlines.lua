@@ -0,0 +1,16 @@
+local size = 2048
+local step = 8
+
+Image.create(size, size)
+Image.background(0, 0, 0)
+Image.stroke(255, 255, 255, 160)
+Image.stroke_weight(0.5)
+Image.stroke_cap("project")
+
+for y = 0, size, step do
+    for x = 0, size, step do
+        local angle = math.sin(x * 0.004) * math.cos(y * 0.003) * math.pi * 2
+
+        Image.line(x, y, x + math.cos(angle) * step * 2, y + math.sin(angle) * step * 2)
+    end
+end
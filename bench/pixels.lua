@@ -0,0 +1,12 @@
+local size = 512
+
+Image.create(size, size)
+
+for y = 0, size - 1 do
+    for x = 0, size - 1 do
+        local v = math.floor((math.sin(x * 0.05) + math.cos(y * 0.07) + 2) * 63.75)
+
+        Image.stroke(v, (x + y) % 256, 255 - v)
+        Image.point(x + 0.5, y + 0.5)
+    end
+end
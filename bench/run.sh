@@ -0,0 +1,95 @@
+#!/bin/bash
+# MIT License
+#
+# Copyright (c) 2025 James Hatfield
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+# Description:
+# Runs a benchmark script through imc and appends the results as one JSON
+# line to a results file, so runs of different commits can be compared with
+# compare.sh.
+#
+# Profiling wraps every Image call, so the script runs twice. The plain run
+# gives the wall time and the primitive rate. The profiled run gives the
+# primitive count, the encode time, the peak rss and the time spent outside
+# the script, which is taken off the plain wall time to get its script time.
+#
+# Usage:
+# ```
+# run.sh <imc> <script.lua> <format> <results.jsonl>
+# ```
+# IMC_BENCH_RESULTS overrides the results file.
+#
+set -e
+
+IMC="${1}"
+SCRIPT="${2}"
+FORMAT="${3}"
+RESULTS="${IMC_BENCH_RESULTS:-${4}}"
+NAME="$(basename "${SCRIPT}" .lua)-${FORMAT}"
+COMMIT="$(git -C "$(dirname "${SCRIPT}")" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+TMP_DIR="$(mktemp -d)"
+
+trap 'rm -rf "${TMP_DIR}"' EXIT
+
+run_imc() {
+    local begin
+    local end
+
+    begin="$(date +%s%N)"
+    "${IMC}" -i "${SCRIPT}" -o "${TMP_DIR}/out.${FORMAT}" "$@" > "${TMP_DIR}/log"
+    end="$(date +%s%N)"
+
+    if [ ! -s "${TMP_DIR}/out.${FORMAT}" ] ; then
+        cat "${TMP_DIR}/log" >&2
+        echo "error: ${NAME} produced no image!" >&2
+        exit 1
+    fi
+
+    awk -v ns="$((end - begin))" 'BEGIN { printf "%.3f", ns / 1000000 }'
+}
+
+PROFILED_MS="$(run_imc --profile-out "${TMP_DIR}/profile.json")"
+rm -f "${TMP_DIR}/out.${FORMAT}"
+WALL_MS="$(run_imc)"
+
+ENCODED_BYTES="$(stat -c %s "${TMP_DIR}/out.${FORMAT}")"
+
+read -r RSS_KB PROFILED_SCRIPT_MS PRIMITIVES ENCODE_MS <<< "$(awk '
+    /"peak_rss_kb"/ { rss = $2 + 0 }
+    /"name": / {
+        split($0, f, /[:,]/)
+        name = f[2]
+        gsub(/[ "]/, "", name)
+        if (name == "script") { script = f[6] + 0 }
+        if (name ~ /^Image\.(background|circle|ellipse|line|point|quad|rect|square|triangle)$/) { prims += f[4] }
+        if (name ~ /^(convert|encode)\./) { encode += f[6] }
+    }
+    END { printf "%d %.3f %d %.3f\n", rss, script, prims, encode }
+' "${TMP_DIR}/profile.json")"
+
+SCRIPT_MS="$(awk -v wall="${WALL_MS}" -v profiled="${PROFILED_MS}" -v script="${PROFILED_SCRIPT_MS}" \
+    'BEGIN { ms = wall - (profiled - script); printf "%.3f", (ms > 0 ? ms : 0) }')"
+PRIMITIVES_PER_S="$(awk -v n="${PRIMITIVES}" -v ms="${SCRIPT_MS}" 'BEGIN { printf "%.1f", (ms > 0 ? n * 1000 / ms : 0) }')"
+ENCODED_MB_PER_S="$(awk -v b="${ENCODED_BYTES}" -v ms="${ENCODE_MS}" 'BEGIN { printf "%.2f", (ms > 0 ? b / 1000 / ms : 0) }')"
+
+echo "${NAME}: ${WALL_MS} ms, ${PRIMITIVES_PER_S} primitives/s, ${ENCODED_MB_PER_S} MB/s encoded, ${RSS_KB} KiB peak rss"
+
+echo "{\"commit\":\"${COMMIT}\",\"date\":\"$(date -u +%Y-%m-%dT%H:%M:%SZ)\",\"name\":\"${NAME}\",\"wall_ms\":${WALL_MS},\"script_ms\":${SCRIPT_MS},\"primitives\":${PRIMITIVES},\"primitives_per_s\":${PRIMITIVES_PER_S},\"encode_ms\":${ENCODE_MS},\"encoded_bytes\":${ENCODED_BYTES},\"encoded_mb_per_s\":${ENCODED_MB_PER_S},\"peak_rss_kb\":${RSS_KB}}" >> "${RESULTS}"
@@ -0,0 +1,26 @@
+#ifndef IMC_ARENA_H
+#define IMC_ARENA_H
+#include <stddef.h>
+
+struct imc_arena;
+
+struct imc_arena_stats
+{
+    size_t current;
+    size_t peak;
+    size_t total;
+    size_t allocations;
+    size_t reserved;
+};
+
+struct imc_arena *IMC_ARENA_new(size_t limit);
+
+void *IMC_ARENA_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+void IMC_ARENA_reset(struct imc_arena *arena);
+
+struct imc_arena_stats IMC_ARENA_get_stats(const struct imc_arena *arena);
+
+void IMC_ARENA_free(struct imc_arena *arena);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef IMC_ASSETS_H
+#define IMC_ASSETS_H
+#include <plutovg.h>
+
+/* decoded image shared by every run in the process, released with IMC_ASSET_release */
+struct imc_asset;
+
+/*
+ * decodes filename into a premultiplied ARGB32 surface, or hands out the decoded copy of an earlier
+ * load when the file has the same size and mtime
+ */
+struct imc_asset *IMC_ASSET_load(const char *filename);
+
+plutovg_surface_t *IMC_ASSET_surface(const struct imc_asset *asset);
+
+void IMC_ASSET_release(struct imc_asset *asset);
+
+void IMC_ASSET_print_stats();
+
+/* drops every asset that is not in use */
+void IMC_ASSET_purge();
+
+#endif
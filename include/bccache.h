@@ -0,0 +1,13 @@
+#ifndef IMC_BCCACHE_H
+#define IMC_BCCACHE_H
+#include "lua.h"
+
+struct imc_bc_cache;
+
+struct imc_bc_cache *IMC_BC_open(const char *dir);
+
+int IMC_BC_loadfile(struct imc_bc_cache *cache, lua_State *L, const char *filename);
+
+void IMC_BC_free(struct imc_bc_cache *cache);
+
+#endif
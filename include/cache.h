@@ -0,0 +1,18 @@
+#ifndef IMC_CACHE_H
+#define IMC_CACHE_H
+
+struct imc_cache;
+
+struct imc_cache *IMC_CACHE_open(const char *dir);
+
+bool IMC_CACHE_lookup(struct imc_cache *cache, const char *input_file, const char *params, const char *output_file);
+
+bool IMC_CACHE_add_dep(struct imc_cache *cache, const char *filename);
+
+bool IMC_CACHE_store(struct imc_cache *cache, const char *output_file);
+
+void IMC_CACHE_print_stats(struct imc_cache *cache);
+
+void IMC_CACHE_free(struct imc_cache *cache);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef IMC_COMPARE_H
+#define IMC_COMPARE_H
+#include <stddef.h>
+
+struct imc_vm_conf;
+
+struct imc_cmp_conf
+{
+    int tolerance;
+    size_t max_mismatch;
+    const char *heatmap_dir;
+};
+
+struct imc_cmp_diff
+{
+    size_t mismatched;
+    int max_diff;
+};
+
+void IMC_CMP_diff(const unsigned char *a, const unsigned char *b, size_t num_pixels, int tolerance,
+                  struct imc_cmp_diff *diff);
+
+bool IMC_CMP_write_heatmap(const char *filename, const unsigned char *a, const unsigned char *b, int width, int height,
+                           int tolerance);
+
+/*
+ * Render each script and diff its RGBA output against the reference image. A render fails when more than
+ * max_mismatch pixels have a channel that differs by more than tolerance, which also writes a heatmap to
+ * <heatmap_dir or the reference's directory>/<reference name>.diff.png.
+ *
+ * List files hold one "<script> <reference>" pair per line, blank lines and lines starting with # are skipped.
+ */
+bool IMC_CMP_run(const struct imc_vm_conf *vm_conf, const struct imc_cmp_conf *conf, const char *script,
+                 const char *reference);
+
+bool IMC_CMP_run_list(const struct imc_vm_conf *vm_conf, const struct imc_cmp_conf *conf, const char *list_file,
+                      int num_workers);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef IMC_DENSITY_H
+#define IMC_DENSITY_H
+#include "lua.h"
+
+struct imc_image_lib_state;
+
+bool IMC_DENSITY_load(lua_State *state, struct imc_image_lib_state *imgst);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef IMC_FILTERS_H
+#define IMC_FILTERS_H
+#include <stdint.h>
+
+#define IMC_FILTER_MAX_SIGMA 128
+#define IMC_FILTER_MAX_RADIUS (3 * IMC_FILTER_MAX_SIGMA)
+
+struct imc_fsurface;
+
+enum imc_filter_kind
+{
+    IMC_FILTER_GAUSSIAN,
+    IMC_FILTER_BOX,
+    IMC_FILTER_CONVOLVE,
+    IMC_FILTER_COLOR_MATRIX,
+    IMC_FILTER_THRESHOLD,
+    IMC_FILTER_GRAIN,
+};
+
+struct imc_filter_stage
+{
+    enum imc_filter_kind kind;
+
+    /* gaussian sigma, box radius, threshold level or grain amount */
+    float amount;
+
+    /* side of the convolution kernel, 3 or 5 */
+    int size;
+    uint32_t seed;
+
+    /* surface pixels per image pixel, spreads convolution taps and grain cells apart */
+    int scale;
+
+    /* convolution weights row by row, or a 4x5 color matrix with the offsets in the last column */
+    float values[25];
+};
+
+/* a premultiplied ARGB32 image, or the float surface instead when fsurface is set */
+struct imc_filter_target
+{
+    int width;
+    int height;
+    unsigned char *argb;
+    int stride;
+    struct imc_fsurface *fsurface;
+};
+
+/*
+ * runs the stages in order on single precision copies of the image, split into row bands across threads,
+ * returns false when the working buffers could not be allocated
+ */
+bool IMC_FILTER_apply(const struct imc_filter_target *target, const struct imc_filter_stage *stages, int count);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef IMC_FSURFACE_H
+#define IMC_FSURFACE_H
+#include <plutovg.h>
+
+enum imc_fsurface_format
+{
+    IMC_FSURFACE_F16,
+    IMC_FSURFACE_F32,
+};
+
+/* premultiplied RGBA working surface with half or single precision channels */
+struct imc_fsurface;
+
+struct imc_fsurface *IMC_FSURF_create(int width, int height, enum imc_fsurface_format format);
+
+void IMC_FSURF_clear(struct imc_fsurface *fs, const plutovg_color_t *color);
+
+/*
+ * blends color into the rectangle using the alpha channel of an ARGB32 coverage mask as
+ * per-pixel coverage, the mask is cleared to zero as it is consumed
+ */
+void IMC_FSURF_composite(struct imc_fsurface *fs, unsigned char *mask, int stride, int x, int y, int width,
+                         int height, const plutovg_color_t *color, plutovg_operator_t op);
+
+/*
+ * blends a premultiplied ARGB32 image into the rectangle with a per-pixel source, the image is cleared to
+ * zero as it is consumed
+ */
+void IMC_FSURF_blend(struct imc_fsurface *fs, unsigned char *argb, int stride, int x, int y, int width, int height,
+                     plutovg_operator_t op);
+
+/* src-over blends color into one pixel at the given coverage */
+void IMC_FSURF_plot(struct imc_fsurface *fs, int x, int y, const plutovg_color_t *color, float coverage);
+
+/* converts to premultiplied ARGB32 */
+void IMC_FSURF_resolve(const struct imc_fsurface *fs, unsigned char *argb, int stride);
+
+void IMC_FSURF_import(struct imc_fsurface *fs, const unsigned char *argb, int stride);
+
+/* copies rows y to y + rows out to or back from packed single precision RGBA */
+void IMC_FSURF_read_rows(const struct imc_fsurface *fs, int y, int rows, float *rgba);
+
+void IMC_FSURF_write_rows(struct imc_fsurface *fs, int y, int rows, const float *rgba);
+
+void IMC_FSURF_free(struct imc_fsurface *fs);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef IMC_GEOMETRY_H
+#define IMC_GEOMETRY_H
+#include "lua.h"
+
+bool IMC_GEOMETRY_load(lua_State *state);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef IMC_GLYPHS_H
+#define IMC_GLYPHS_H
+#include <plutovg.h>
+
+#define IMC_GLYPH_SUBPIXEL 4
+
+/*
+ * coverage of one glyph at one horizontal sub-pixel offset, stored at x, y in the atlas, left and top
+ * place it relative to the whole pixel the pen and baseline fall in
+ */
+struct imc_glyph
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    int left;
+    int top;
+    float advance;
+};
+
+/* 8-bit coverage atlas of rasterized glyphs keyed by face, size, codepoint and sub-pixel bucket */
+struct imc_glyph_cache;
+
+struct imc_glyph_cache *IMC_GLYPH_create();
+
+/*
+ * finds or rasterizes the glyph, returns nullptr when it does not fit the atlas, the result and the atlas
+ * contents stay valid until the next lookup
+ */
+const struct imc_glyph *IMC_GLYPH_lookup(struct imc_glyph_cache *cache, plutovg_font_face_t *face, float size,
+                                         plutovg_codepoint_t codepoint, int bucket);
+
+const unsigned char *IMC_GLYPH_atlas(const struct imc_glyph_cache *cache, int *stride);
+
+void IMC_GLYPH_free(struct imc_glyph_cache *cache);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef IMC_HASH_H
+#define IMC_HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMC_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+static inline uint64_t IMC_hash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+bool IMC_hash_file(const char *filename, uint64_t *hash);
+
+#endif
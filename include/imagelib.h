@@ -1,21 +1,78 @@
 #ifndef IMC_IMAGELIB_H
 #define IMC_IMAGELIB_H
+#include <stddef.h>
 #include "lua.h"
 
 struct imc_image_lib_state;
+struct imc_fsurface;
+
+typedef void (*imc_write_func_t)(void *closure, void *data, int size);
+
+struct imc_image_lib_state *IMC_IMG_new();
 
 struct imc_image_lib_state *IMC_IMG_load(lua_State *state);
 
+bool IMC_IMG_create(struct imc_image_lib_state *state, int width, int height);
+
+/* the size scripts see, the surface is scale times that */
+bool IMC_IMG_get_size(struct imc_image_lib_state *state, int *width, int *height);
+
+/*
+ * renders on a surface scale times the size scripts ask for, whole scales above 1 are box filtered back down
+ * on export and scales below 1 export smaller images, set before the script runs since it drops the image
+ */
+void IMC_IMG_set_scale(struct imc_image_lib_state *state, float scale);
+
+float IMC_IMG_get_scale(struct imc_image_lib_state *state);
+
+/* draft renders skip Image.filter, aliased ones plot and blit without smoothing where imc draws directly */
+void IMC_IMG_set_draft(struct imc_image_lib_state *state, bool draft, bool aliased);
+
+/* process-wide, trades output size and jpg quality for encoding speed */
+void IMC_IMG_set_fast_encoding(bool fast);
+
+/*
+ * premultiplied ARGB32 pixels of the current surface at its full scaled size, for float surfaces this is the
+ * 8-bit result and the float surface is replaced with whatever it holds before the next draw
+ */
+unsigned char *IMC_IMG_get_data(struct imc_image_lib_state *state, int *width, int *height, int *stride);
+
+/* the float working surface at its full scaled size for drawing into directly, nullptr for 8-bit images */
+struct imc_fsurface *IMC_IMG_get_float(struct imc_image_lib_state *state, int *width, int *height);
+
+/*
+ * antialiased one pixel wide lines in the stroke color, segments holds x0, y0, x1, y1 per line, drawn
+ * src-over without going through the canvas
+ */
+bool IMC_IMG_hairlines(struct imc_image_lib_state *state, const float *segments, size_t count);
+
+/* unpremultiplied RGBA copy of the current surface, released with free() */
+unsigned char *IMC_IMG_to_rgba(struct imc_image_lib_state *state, int *width, int *height);
+
 bool IMC_IMG_write_png(struct imc_image_lib_state *state, const char *filename);
 
+bool IMC_IMG_write_png_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure);
+
 bool IMC_IMG_write_jpg(struct imc_image_lib_state *state, const char *filename);
 
+bool IMC_IMG_write_jpg_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure);
+
 bool IMC_IMG_write_bmp(struct imc_image_lib_state *state, const char *filename);
 
+bool IMC_IMG_write_bmp_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure);
+
 bool IMC_IMG_write_tga(struct imc_image_lib_state *state, const char *filename);
 
+bool IMC_IMG_write_tga_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure);
+
 bool IMC_IMG_write_xpm(struct imc_image_lib_state *state, const char *filename);
 
+bool IMC_IMG_write_xpm_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure);
+
+void IMC_IMG_reset(struct imc_image_lib_state *state);
+
+const char *IMC_IMG_current_call(struct imc_image_lib_state *state);
+
 void IMC_IMG_free(struct imc_image_lib_state *state);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef IMC_JITDIAG_H
+#define IMC_JITDIAG_H
+#include "lua.h"
+
+bool IMC_JIT_configure(lua_State *L, const char *options);
+
+bool IMC_JIT_report_attach(lua_State *L);
+
+void IMC_JIT_report_print(lua_State *L);
+
+#endif
@@ -1,23 +1,83 @@
 #ifndef IMC_LANG_VM_H
 #define IMC_LANG_VM_H
+#include "imagelib.h"
+
 struct imc_lang_vm;
 
-struct imc_lang_vm *IMC_VM_new();
+struct imc_bc_cache;
+
+struct imc_vm_conf
+{
+    struct imc_bc_cache *bytecode_cache;
+    bool use_arena;
+    size_t mem_limit;
+    bool lua_profile;
+    bool jit_report;
+    const char *jit_options;
+    int supersample;
+
+    /* draft renders at this fraction of the size when above 0, in place of supersampling */
+    float preview;
+    bool aliased;
+};
+
+/* registry table keyed by every file a run read, which the output cache and watch mode track */
+#define IMC_VM_DEPS_KEY "imc.deps"
+
+typedef bool (*imc_dep_func_t)(void *closure, const char *filename);
+
+struct imc_lang_vm *IMC_VM_new(const struct imc_vm_conf *conf);
+
+bool IMC_VM_reset(struct imc_lang_vm *vm);
+
+/*
+ * prepares the vm for the next job: with an arena the whole state, surface and font cache included, is released
+ * in one reset and rebuilt, otherwise this is IMC_VM_reset; on failure the vm can only be freed
+ */
+bool IMC_VM_recycle(struct imc_lang_vm *vm);
 
 bool IMC_VM_run_src(struct imc_lang_vm *vm, const char *src);
 
 bool IMC_VM_run_src_file(struct imc_lang_vm *vm, const char *filename);
 
+const char *IMC_VM_get_error(struct imc_lang_vm *vm);
+
+bool IMC_VM_set_param(struct imc_lang_vm *vm, const char *name, const char *value);
+
+void IMC_VM_interrupt(struct imc_lang_vm *vm);
+
+void IMC_VM_clear_interrupt(struct imc_lang_vm *vm);
+
+bool IMC_VM_foreach_dep(struct imc_lang_vm *vm, imc_dep_func_t func, void *closure);
+
+unsigned char *IMC_VM_to_rgba(struct imc_lang_vm *vm, int *width, int *height);
+
 bool IMC_VM_write_png(struct imc_lang_vm *vm, const char *filename);
 
+bool IMC_VM_write_png_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+
 bool IMC_VM_write_jpg(struct imc_lang_vm *vm, const char *filename);
 
+bool IMC_VM_write_jpg_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+
 bool IMC_VM_write_bmp(struct imc_lang_vm *vm, const char *filename);
 
+bool IMC_VM_write_bmp_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+
 bool IMC_VM_write_tga(struct imc_lang_vm *vm, const char *filename);
 
+bool IMC_VM_write_tga_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+
 bool IMC_VM_write_xpm(struct imc_lang_vm *vm, const char *filename);
 
+bool IMC_VM_write_xpm_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+
+void IMC_VM_print_mem_stats(struct imc_lang_vm *vm);
+
+void IMC_VM_print_jit_report(struct imc_lang_vm *vm);
+
+bool IMC_VM_write_lua_profile(struct imc_lang_vm *vm, const char *filename);
+
 void IMC_VM_free(struct imc_lang_vm *vm);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef IMC_LUABUF_H
+#define IMC_LUABUF_H
+#include <stddef.h>
+
+#include "lua.h"
+
+/* sets up the FFI array check for the state, called before any script runs */
+bool IMC_LBUF_load(lua_State *state);
+
+/*
+ * the Lua table or FFI double array at idx, returns how many numbers it holds and sets data to the array,
+ * or to nullptr for a table; anything else, pointers whose length is unknown included, raises an argument error
+ */
+size_t IMC_LBUF_check(lua_State *state, int idx, double **data);
+
+#endif
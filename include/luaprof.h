@@ -0,0 +1,19 @@
+#ifndef IMC_LUAPROF_H
+#define IMC_LUAPROF_H
+#include "lua.h"
+
+struct imc_lua_prof;
+
+struct imc_image_lib_state;
+
+struct imc_lua_prof *IMC_LPROF_new();
+
+void IMC_LPROF_start(struct imc_lua_prof *prof, lua_State *L, struct imc_image_lib_state *imgst);
+
+void IMC_LPROF_stop(struct imc_lua_prof *prof, lua_State *L);
+
+bool IMC_LPROF_write(struct imc_lua_prof *prof, const char *filename);
+
+void IMC_LPROF_free(struct imc_lua_prof *prof);
+
+#endif
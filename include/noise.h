@@ -0,0 +1,21 @@
+#ifndef IMC_NOISE_H
+#define IMC_NOISE_H
+#include <stddef.h>
+#include "lua.h"
+
+struct imc_noise_state;
+
+struct imc_noise_state *IMC_NOISE_load(lua_State *state);
+
+/* 2D simplex noise in [-1, 1] with the seed last set through Noise.seed */
+double IMC_NOISE_simplex2(const struct imc_noise_state *state, double x, double y);
+
+/* IMC_NOISE_simplex2 at count points, evaluated a vector of points at a time */
+void IMC_NOISE_simplex2_many(const struct imc_noise_state *state, const double *x, const double *y, double *out,
+                             size_t count);
+
+void IMC_NOISE_reset(struct imc_noise_state *state);
+
+void IMC_NOISE_free(struct imc_noise_state *state);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef IMC_PARTICLES_H
+#define IMC_PARTICLES_H
+#include "lua.h"
+
+struct imc_image_lib_state;
+struct imc_noise_state;
+
+bool IMC_PARTICLES_load(lua_State *state, struct imc_image_lib_state *imgst, struct imc_noise_state *noisest);
+
+#endif
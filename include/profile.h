@@ -0,0 +1,19 @@
+#ifndef IMC_PROFILE_H
+#define IMC_PROFILE_H
+#include <stdint.h>
+
+void IMC_PROF_enable();
+
+bool IMC_PROF_is_enabled();
+
+int IMC_PROF_counter(const char *name);
+
+uint64_t IMC_PROF_begin();
+
+void IMC_PROF_add(int counter, uint64_t begin);
+
+void IMC_PROF_end(const char *name, uint64_t begin);
+
+bool IMC_PROF_report(const char *json_file);
+
+#endif
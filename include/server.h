@@ -0,0 +1,26 @@
+#ifndef IMC_SERVER_H
+#define IMC_SERVER_H
+
+/*
+ * Requests are a few header lines followed by the script:
+ *
+ *   format png
+ *   deadline 500
+ *   param seed 42
+ *   source <length>\n<script bytes>   or   file <path>\n
+ *
+ * and are answered with "ok <length>\n<image bytes>" or "error <message>\n".
+ * Params are visible to the script through the global Params table. A request deadline can only be shorter
+ * than the one the server was started with.
+ *
+ * Scripts run with the full standard library, io and os included, and file reads any path the server can,
+ * so a request is as trusted as a shell of the user running the server. The socket is created with mode
+ * 0600 and connections from any other user except root are refused, put it in a private directory if
+ * that is not enough. scripts/imc-request.sh is a minimal local client.
+ */
+
+struct imc_vm_conf;
+
+bool IMC_SERVER_run(const struct imc_vm_conf *conf, const char *socket_path, int num_workers, int queue_size, int deadline_ms);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef IMC_SPATIAL_H
+#define IMC_SPATIAL_H
+#include "lua.h"
+
+bool IMC_SPATIAL_load(lua_State *state);
+
+#endif
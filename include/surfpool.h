@@ -0,0 +1,20 @@
+#ifndef IMC_SURFPOOL_H
+#define IMC_SURFPOOL_H
+#include <stddef.h>
+#include <plutovg.h>
+
+/* recycles surface memory between frames, sizes are rounded up to buckets so near sizes share buffers */
+struct imc_surface_pool;
+
+struct imc_surface_pool *IMC_POOL_new(size_t limit);
+
+/* a cleared surface of exactly width by height, possibly with a wider stride than it needs */
+plutovg_surface_t *IMC_POOL_acquire(struct imc_surface_pool *pool, int width, int height);
+
+void IMC_POOL_release(struct imc_surface_pool *pool, plutovg_surface_t *surface);
+
+void IMC_POOL_stats(const struct imc_surface_pool *pool, size_t *hits, size_t *misses, size_t *bytes);
+
+void IMC_POOL_free(struct imc_surface_pool *pool);
+
+#endif
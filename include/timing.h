@@ -0,0 +1,20 @@
+#ifndef IMC_TIMING_H
+#define IMC_TIMING_H
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t IMC_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline double IMC_time_ms(uint64_t ns)
+{
+    return ns / 1000000.00;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef IMC_TRACE_H
+#define IMC_TRACE_H
+#include <stdint.h>
+
+/*
+ * Events are written as a Chrome trace-event JSON array which can be opened in
+ * chrome://tracing or ui.perfetto.dev. Each thread buffers its own events and
+ * appends them to the file when the buffer fills up or on IMC_TRACE_flush().
+ * Back to back Image.* calls on a thread are merged into one draw burst event.
+ */
+
+bool IMC_TRACE_open(const char *filename);
+
+bool IMC_TRACE_is_enabled();
+
+void IMC_TRACE_thread_name(const char *name);
+
+void IMC_TRACE_event(const char *name, uint64_t begin, uint64_t end);
+
+void IMC_TRACE_flush();
+
+void IMC_TRACE_close();
+
+#endif
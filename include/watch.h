@@ -0,0 +1,18 @@
+#ifndef IMC_WATCH_H
+#define IMC_WATCH_H
+#include <signal.h>
+
+struct imc_watch;
+
+struct imc_watch *IMC_WATCH_new();
+
+bool IMC_WATCH_add(struct imc_watch *watch, const char *filename);
+
+void IMC_WATCH_clear(struct imc_watch *watch);
+
+/* blocks until a watched file changes, false on failure or once a signal handler has set stop */
+bool IMC_WATCH_wait(struct imc_watch *watch, const volatile sig_atomic_t *stop);
+
+void IMC_WATCH_free(struct imc_watch *watch);
+
+#endif
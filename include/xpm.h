@@ -1,6 +1,13 @@
 #ifndef IMC_XPM_H
 #define IMC_XPM_H
+#include <stddef.h>
+
+typedef void (*imc_xpm_write_func_t)(void *closure, void *data, int size);
+
+bool IMC_palettize_xpm(int width, int height, const void *data, size_t *num_colors);
 
 bool IMC_write_xpm(const char *filename, int width, int height, const void *data);
 
+bool IMC_write_xpm_to_func(imc_xpm_write_func_t func, void *closure, int width, int height, const void *data);
+
 #endif
@@ -0,0 +1,82 @@
+#!/bin/bash
+# MIT License
+#
+# Copyright (c) 2025 James Hatfield
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+#
+# Description:
+# Sends a script to an imc --serve socket and writes the rendered image. The
+# format follows the output extension, extra name=value arguments become
+# Params entries. Needs socat.
+#
+# Usage:
+# ```
+# imc-request.sh <socket> <script.lua> <output> [name=value ...]
+# ```
+# IMC_REQUEST_DEADLINE sets the request deadline in milliseconds.
+#
+set -e
+
+SOCKET="${1}"
+SCRIPT="${2}"
+OUTPUT="${3}"
+FORMAT="${OUTPUT##*.}"
+TMP_FILE="$(mktemp)"
+
+if [ -z "${SOCKET}" ] || [ ! -f "${SCRIPT}" ] || [ -z "${OUTPUT}" ] ; then
+    echo "usage: ${0} <socket> <script.lua> <output> [name=value ...]" >&2
+    exit 1
+fi
+
+shift 3
+trap 'rm -f "${TMP_FILE}"' EXIT
+
+{
+    echo "format ${FORMAT}"
+
+    if [ -n "${IMC_REQUEST_DEADLINE}" ] ; then
+        echo "deadline ${IMC_REQUEST_DEADLINE}"
+    fi
+
+    for PARAM in "${@}" ; do
+        echo "param ${PARAM%%=*} ${PARAM#*=}"
+    done
+
+    echo "source $(stat -c %s "${SCRIPT}")"
+    cat "${SCRIPT}"
+} | socat -t 3600 - "UNIX-CONNECT:${SOCKET}" > "${TMP_FILE}"
+
+HEADER="$(head -n 1 "${TMP_FILE}")"
+
+case "${HEADER}" in
+    ok\ *)
+        tail -c +$((${#HEADER} + 2)) "${TMP_FILE}" > "${OUTPUT}"
+
+        if [ "$(stat -c %s "${OUTPUT}")" != "${HEADER#ok }" ] ; then
+            echo "error: truncated response!" >&2
+            exit 1
+        fi
+        ;;
+    *)
+        echo "error: ${HEADER#error }!" >&2
+        exit 1
+        ;;
+esac
@@ -0,0 +1,327 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_SMALL_STEP 16
+#define ARENA_SMALL_MAX 256
+#define ARENA_NUM_SMALL (ARENA_SMALL_MAX / ARENA_SMALL_STEP)
+#define ARENA_NUM_CLASSES (ARENA_NUM_SMALL + 2)
+#define ARENA_POOLED_MAX 1024
+
+#define MIN(a, b) (a <= b ? a : b)
+
+struct arena_block
+{
+    struct arena_block *next;
+};
+
+struct imc_arena
+{
+    size_t limit;
+    struct imc_arena_stats stats;
+    struct arena_block *free_lists[ARENA_NUM_CLASSES];
+
+    char **chunks;
+    size_t num_chunks;
+    size_t used_chunks;
+    size_t chunks_capacity;
+    size_t chunk_offset;
+
+    /* malloc'd blocks lua believes are pooled after a failed shrink, freed instead of pooled when released */
+    void **strays;
+    size_t num_strays;
+    size_t strays_capacity;
+};
+
+static inline int size_class(size_t size)
+{
+    if (size <= ARENA_SMALL_MAX)
+    {
+        return (size - 1) / ARENA_SMALL_STEP;
+    }
+
+    return size <= ARENA_POOLED_MAX / 2 ? ARENA_NUM_SMALL : ARENA_NUM_SMALL + 1;
+}
+
+static inline size_t class_size(int cls)
+{
+    if (cls < ARENA_NUM_SMALL)
+    {
+        return (cls + 1) * ARENA_SMALL_STEP;
+    }
+
+    return cls == ARENA_NUM_SMALL ? ARENA_POOLED_MAX / 2 : ARENA_POOLED_MAX;
+}
+
+static void *arena_bump(struct imc_arena *arena, size_t size)
+{
+    void *res;
+
+    if (!arena->used_chunks || arena->chunk_offset + size > ARENA_CHUNK_SIZE)
+    {
+        if (arena->used_chunks == arena->num_chunks)
+        {
+            char *chunk;
+
+            if (arena->num_chunks == arena->chunks_capacity)
+            {
+                size_t capacity = arena->chunks_capacity ? arena->chunks_capacity * 2 : 16;
+                char **chunks = realloc(arena->chunks, capacity * sizeof(char *));
+
+                if (!chunks)
+                {
+                    return nullptr;
+                }
+
+                arena->chunks = chunks;
+                arena->chunks_capacity = capacity;
+            }
+
+            chunk = malloc(ARENA_CHUNK_SIZE);
+
+            if (!chunk)
+            {
+                return nullptr;
+            }
+
+            arena->chunks[arena->num_chunks++] = chunk;
+            arena->stats.reserved += ARENA_CHUNK_SIZE;
+        }
+
+        arena->used_chunks++;
+        arena->chunk_offset = 0;
+    }
+
+    res = arena->chunks[arena->used_chunks - 1] + arena->chunk_offset;
+    arena->chunk_offset += size;
+
+    return res;
+}
+
+static void *arena_take(struct imc_arena *arena, size_t size)
+{
+    int cls;
+    struct arena_block *block;
+
+    if (size > ARENA_POOLED_MAX)
+    {
+        return malloc(size);
+    }
+
+    cls = size_class(size);
+    block = arena->free_lists[cls];
+
+    if (block)
+    {
+        arena->free_lists[cls] = block->next;
+        return block;
+    }
+
+    return arena_bump(arena, class_size(cls));
+}
+
+static bool arena_adopt_stray(struct imc_arena *arena, void *ptr)
+{
+    if (arena->num_strays == arena->strays_capacity)
+    {
+        size_t capacity = arena->strays_capacity ? arena->strays_capacity * 2 : 16;
+        void **strays = realloc(arena->strays, capacity * sizeof(void *));
+
+        if (!strays)
+        {
+            return false;
+        }
+
+        arena->strays = strays;
+        arena->strays_capacity = capacity;
+    }
+
+    arena->strays[arena->num_strays++] = ptr;
+
+    return true;
+}
+
+static bool arena_free_stray(struct imc_arena *arena, void *ptr)
+{
+    for (size_t i = 0; i < arena->num_strays; i++)
+    {
+        if (arena->strays[i] == ptr)
+        {
+            free(ptr);
+            arena->strays[i] = arena->strays[--arena->num_strays];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void arena_release(struct imc_arena *arena, void *ptr, size_t size)
+{
+    int cls;
+    struct arena_block *block = ptr;
+
+    if (size > ARENA_POOLED_MAX)
+    {
+        free(ptr);
+        return;
+    }
+
+    if (arena->num_strays && arena_free_stray(arena, ptr))
+    {
+        return;
+    }
+
+    cls = size_class(size);
+    block->next = arena->free_lists[cls];
+    arena->free_lists[cls] = block;
+}
+
+struct imc_arena *IMC_ARENA_new(size_t limit)
+{
+    struct imc_arena *res = calloc(1, sizeof(struct imc_arena));
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    res->limit = limit;
+
+    return res;
+}
+
+void *IMC_ARENA_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    void *res;
+    struct imc_arena *arena = ud;
+
+    if (!ptr)
+    {
+        osize = 0;
+    }
+
+    if (!nsize)
+    {
+        if (ptr)
+        {
+            arena_release(arena, ptr, osize);
+            arena->stats.current -= osize;
+        }
+
+        return nullptr;
+    }
+
+    if (nsize > osize && arena->limit && arena->stats.current + (nsize - osize) > arena->limit)
+    {
+        return nullptr;
+    }
+
+    if (osize > ARENA_POOLED_MAX && nsize > ARENA_POOLED_MAX)
+    {
+        res = realloc(ptr, nsize);
+    }
+    else if (ptr && osize <= ARENA_POOLED_MAX && nsize <= ARENA_POOLED_MAX && size_class(osize) == size_class(nsize))
+    {
+        res = ptr;
+    }
+    else
+    {
+        res = arena_take(arena, nsize);
+
+        if (res && ptr)
+        {
+            memcpy(res, ptr, MIN(osize, nsize));
+            arena_release(arena, ptr, osize);
+        }
+    }
+
+    if (!res && nsize <= osize)
+    {
+        /*
+         * lua expects shrinking to always succeed, the old block is big enough; a malloc'd one will be released
+         * with a pooled size from now on, untracked it would only be leaked at the next reset
+         */
+        if (osize > ARENA_POOLED_MAX && nsize <= ARENA_POOLED_MAX)
+        {
+            arena_adopt_stray(arena, ptr);
+        }
+
+        res = ptr;
+    }
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    if (!ptr)
+    {
+        arena->stats.allocations++;
+    }
+
+    if (nsize > osize)
+    {
+        arena->stats.total += nsize - osize;
+    }
+
+    arena->stats.current += nsize - osize;
+
+    if (arena->stats.current > arena->stats.peak)
+    {
+        arena->stats.peak = arena->stats.current;
+    }
+
+    return res;
+}
+
+void IMC_ARENA_reset(struct imc_arena *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+
+    for (size_t i = 0; i < arena->num_strays; i++)
+    {
+        free(arena->strays[i]);
+    }
+
+    arena->num_strays = 0;
+    arena->used_chunks = 0;
+    arena->chunk_offset = 0;
+    arena->stats.current = 0;
+}
+
+struct imc_arena_stats IMC_ARENA_get_stats(const struct imc_arena *arena)
+{
+    struct imc_arena_stats empty = {};
+
+    return arena ? arena->stats : empty;
+}
+
+void IMC_ARENA_free(struct imc_arena *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < arena->num_chunks; i++)
+    {
+        free(arena->chunks[i]);
+    }
+
+    for (size_t i = 0; i < arena->num_strays; i++)
+    {
+        free(arena->strays[i]);
+    }
+
+    free(arena->chunks);
+    free(arena->strays);
+    free(arena);
+}
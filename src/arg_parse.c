@@ -5,6 +5,8 @@
 
 #define MIN(a, b) (a <= b ? a : b)
 
+#define LONG_ONLY_VAL(IDX) (256 + (IDX))
+
 static int current_mutex_id = 0;
 
 struct arg_mutex ARG_mutex_new()
@@ -83,7 +85,7 @@ static bool parse_internal(struct arg_parse argp, int argc, char **argv, bool al
         if (argp.args[i].long_opt)
         {
             long_opts[cur_long_opt].name = argp.args[i].long_opt;
-            long_opts[cur_long_opt].val = argp.args[i].short_opt;
+            long_opts[cur_long_opt].val = argp.args[i].short_opt ? argp.args[i].short_opt : LONG_ONLY_VAL(i);
             long_opts[cur_long_opt].has_arg = no_argument;
 
             if (argp.args[i].type == ARG_TYPE_ARG_REQUIRED)
@@ -138,7 +140,14 @@ static bool parse_internal(struct arg_parse argp, int argc, char **argv, bool al
                 }
                 break;
             case ':':
-                printf("error: missing required argument for '-%c'\n", optopt);
+                if (optopt > 0 && optopt < LONG_ONLY_VAL(0))
+                {
+                    printf("error: missing required argument for '-%c'\n", optopt);
+                }
+                else
+                {
+                    printf("error: missing required argument for '%s'\n", argv[optind - 1]);
+                }
                 goto parse_failure;
             default:
 handle_arg:
@@ -146,7 +155,8 @@ handle_arg:
                 bool found = false;
                 for (int i = 0; argp.args[i].flag_val; i++)
                 {
-                    if (argp.args[i].short_opt == c)
+                    if ((argp.args[i].short_opt && argp.args[i].short_opt == c) ||
+                        (!argp.args[i].short_opt && LONG_ONLY_VAL(i) == c))
                     {
                         found = true;
                         if (argp.args[i].type == ARG_TYPE_FLAG)
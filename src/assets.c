@@ -0,0 +1,274 @@
+#include "assets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <stb_image.h>
+
+/* unused decoded images are kept until they add up to this many bytes */
+#define ASSET_CACHE_LIMIT ((size_t)512 * 1024 * 1024)
+
+struct imc_asset
+{
+    char *path;
+    uint64_t mtime_ns;
+    uint64_t file_size;
+    size_t bytes;
+    int refs;
+    bool stale;
+    uint64_t last_use;
+    plutovg_surface_t *surface;
+    struct imc_asset *next;
+};
+
+static struct
+{
+    struct imc_asset *head;
+    size_t bytes;
+    uint64_t clock;
+    size_t hits;
+    size_t misses;
+
+    /* VMs on compare and serve worker threads share the cache */
+    pthread_mutex_t lock;
+} assets =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void asset_destroy(struct imc_asset *asset)
+{
+    plutovg_surface_destroy(asset->surface);
+    free(asset->path);
+    free(asset);
+}
+
+static void asset_unlink(struct imc_asset *asset)
+{
+    for (struct imc_asset **link = &assets.head; *link; link = &(*link)->next)
+    {
+        if (*link == asset)
+        {
+            *link = asset->next;
+            assets.bytes -= asset->bytes;
+            return;
+        }
+    }
+}
+
+/* least recently used first, assets in use stay whatever the total */
+static void asset_trim(size_t limit)
+{
+    while (assets.bytes > limit)
+    {
+        struct imc_asset *oldest = nullptr;
+
+        for (struct imc_asset *asset = assets.head; asset; asset = asset->next)
+        {
+            if (!asset->refs && (!oldest || asset->last_use < oldest->last_use))
+            {
+                oldest = asset;
+            }
+        }
+
+        if (!oldest)
+        {
+            return;
+        }
+
+        asset_unlink(oldest);
+        asset_destroy(oldest);
+    }
+}
+
+static plutovg_surface_t *asset_decode(const char *filename)
+{
+    int width;
+    int height;
+    unsigned char *rgba = stbi_load(filename, &width, &height, nullptr, 4);
+    plutovg_surface_t *surface;
+
+    if (!rgba)
+    {
+        printf("error: failed to decode image '%s': %s!!\n", filename, stbi_failure_reason());
+        return nullptr;
+    }
+
+    surface = plutovg_surface_create(width, height);
+
+    if (surface)
+    {
+        plutovg_convert_rgba_to_argb(plutovg_surface_get_data(surface), rgba, width, height,
+                                     plutovg_surface_get_stride(surface));
+    }
+
+    stbi_image_free(rgba);
+
+    return surface;
+}
+
+/* callers hold assets.lock */
+static struct imc_asset *asset_lookup(const char *resolved, uint64_t mtime_ns, uint64_t file_size)
+{
+    for (struct imc_asset *asset = assets.head; asset; asset = asset->next)
+    {
+        if (strcmp(asset->path, resolved) != 0)
+        {
+            continue;
+        }
+
+        if (asset->mtime_ns == mtime_ns && asset->file_size == file_size)
+        {
+            asset->refs++;
+            asset->last_use = ++assets.clock;
+            return asset;
+        }
+
+        /* changed on disk, whoever still holds the old copy keeps it until they let go */
+        asset_unlink(asset);
+
+        if (asset->refs)
+        {
+            asset->stale = true;
+        }
+        else
+        {
+            asset_destroy(asset);
+        }
+
+        break;
+    }
+
+    return nullptr;
+}
+
+struct imc_asset *IMC_ASSET_load(const char *filename)
+{
+    char resolved[PATH_MAX];
+    struct imc_asset *asset;
+    struct imc_asset *other;
+    struct stat st;
+    uint64_t mtime_ns;
+
+    if (!filename || stat(filename, &st) != 0 || !realpath(filename, resolved))
+    {
+        printf("error: failed to open image '%s'!!\n", filename ? filename : "");
+        return nullptr;
+    }
+
+    mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    pthread_mutex_lock(&assets.lock);
+    asset = asset_lookup(resolved, mtime_ns, st.st_size);
+
+    if (asset)
+    {
+        assets.hits++;
+    }
+    else
+    {
+        assets.misses++;
+    }
+
+    pthread_mutex_unlock(&assets.lock);
+
+    if (asset)
+    {
+        return asset;
+    }
+
+    /* decoding runs unlocked so other threads are not held up by a large image */
+    asset = calloc(1, sizeof(struct imc_asset));
+
+    if (!asset)
+    {
+        return nullptr;
+    }
+
+    asset->path = strdup(resolved);
+    asset->surface = asset->path ? asset_decode(resolved) : nullptr;
+
+    if (!asset->path || !asset->surface)
+    {
+        asset_destroy(asset);
+        return nullptr;
+    }
+
+    asset->mtime_ns = mtime_ns;
+    asset->file_size = st.st_size;
+    asset->bytes = (size_t)plutovg_surface_get_stride(asset->surface) * plutovg_surface_get_height(asset->surface);
+    asset->refs = 1;
+
+    pthread_mutex_lock(&assets.lock);
+
+    /* another thread may have decoded the same file in the meantime */
+    other = asset_lookup(resolved, mtime_ns, st.st_size);
+
+    if (other)
+    {
+        pthread_mutex_unlock(&assets.lock);
+        asset_destroy(asset);
+        return other;
+    }
+
+    asset->last_use = ++assets.clock;
+    asset->next = assets.head;
+    assets.head = asset;
+    assets.bytes += asset->bytes;
+
+    asset_trim(ASSET_CACHE_LIMIT);
+    pthread_mutex_unlock(&assets.lock);
+
+    return asset;
+}
+
+plutovg_surface_t *IMC_ASSET_surface(const struct imc_asset *asset)
+{
+    return asset->surface;
+}
+
+void IMC_ASSET_release(struct imc_asset *asset)
+{
+    if (!asset)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&assets.lock);
+
+    if (--asset->refs > 0)
+    {
+        pthread_mutex_unlock(&assets.lock);
+        return;
+    }
+
+    if (asset->stale)
+    {
+        pthread_mutex_unlock(&assets.lock);
+        asset_destroy(asset);
+        return;
+    }
+
+    asset_trim(ASSET_CACHE_LIMIT);
+    pthread_mutex_unlock(&assets.lock);
+}
+
+void IMC_ASSET_print_stats()
+{
+    pthread_mutex_lock(&assets.lock);
+    printf("assets: %zu hits, %zu misses, %.1f%% hit rate, %.1f MiB decoded\n", assets.hits, assets.misses,
+           assets.hits + assets.misses ? 100.00 * assets.hits / (assets.hits + assets.misses) : 0.00,
+           assets.bytes / (1024.00 * 1024.00));
+    pthread_mutex_unlock(&assets.lock);
+}
+
+void IMC_ASSET_purge()
+{
+    pthread_mutex_lock(&assets.lock);
+    asset_trim(0);
+    pthread_mutex_unlock(&assets.lock);
+}
@@ -0,0 +1,297 @@
+#include "bccache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <lauxlib.h>
+#include <luajit.h>
+
+#include <stc/cstr.h>
+
+#include "hash.h"
+
+#define BC_MAGIC "IMCBC01"
+
+struct bc_header
+{
+    char magic[8];
+    uint64_t runtime;
+    uint64_t mtime_ns;
+    uint64_t size;
+    uint64_t hash;
+};
+
+struct bc_buffer
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+struct imc_bc_cache
+{
+    cstr dir;
+    uint64_t runtime;
+};
+
+static bool read_file(const char *filename, char **data, size_t *size)
+{
+    struct stat st;
+    char *buf;
+    FILE *in = fopen(filename, "rb");
+
+    if (!in)
+    {
+        return false;
+    }
+
+    if (fstat(fileno(in), &st) != 0)
+    {
+        fclose(in);
+        return false;
+    }
+
+    buf = malloc(st.st_size + 1);
+
+    if (!buf || fread(buf, 1, st.st_size, in) != (size_t)st.st_size)
+    {
+        free(buf);
+        fclose(in);
+        return false;
+    }
+
+    fclose(in);
+
+    buf[st.st_size] = '\0';
+    *data = buf;
+    *size = st.st_size;
+
+    return true;
+}
+
+static int bc_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    struct bc_buffer *buf = ud;
+
+    (void)L;
+
+    if (buf->size + sz > buf->capacity)
+    {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        char *grown;
+
+        while (capacity < buf->size + sz)
+        {
+            capacity *= 2;
+        }
+
+        grown = realloc(buf->data, capacity);
+
+        if (!grown)
+        {
+            return 1;
+        }
+
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->size, p, sz);
+    buf->size += sz;
+
+    return 0;
+}
+
+static void bc_store(struct imc_bc_cache *cache, const char *entry_path, const struct bc_header *header,
+                     const struct bc_buffer *bytecode)
+{
+    cstr tmp_path = cstr_from_fmt("%s/.tmp-XXXXXX", cstr_str(&cache->dir));
+    int fd = mkstemp(cstr_data(&tmp_path));
+    bool ok;
+
+    if (fd < 0)
+    {
+        cstr_drop(&tmp_path);
+        return;
+    }
+
+    ok = write(fd, header, sizeof(*header)) == sizeof(*header) &&
+         write(fd, bytecode->data, bytecode->size) == (ssize_t)bytecode->size;
+
+    if (close(fd) != 0 || !ok || rename(cstr_str(&tmp_path), entry_path) != 0)
+    {
+        unlink(cstr_str(&tmp_path));
+    }
+
+    cstr_drop(&tmp_path);
+}
+
+static const char *skip_shebang(const char *src, size_t *size)
+{
+    const char *line_end;
+
+    if (*size == 0 || src[0] != '#')
+    {
+        return src;
+    }
+
+    line_end = memchr(src, '\n', *size);
+
+    if (!line_end)
+    {
+        *size = 0;
+        return src;
+    }
+
+    /* keep the newline so line numbers stay the same */
+    *size -= line_end - src;
+    return line_end;
+}
+
+static bool bc_load_cached(struct imc_bc_cache *cache, lua_State *L, const char *entry_path, const char *filename,
+                           const char *chunkname, const struct stat *st)
+{
+    bool valid = false;
+    char *cached = nullptr;
+    size_t cached_size = 0;
+    struct bc_header header;
+
+    if (!read_file(entry_path, &cached, &cached_size) || cached_size <= sizeof(header))
+    {
+        free(cached);
+        return false;
+    }
+
+    memcpy(&header, cached, sizeof(header));
+
+    if (memcmp(header.magic, BC_MAGIC, sizeof(header.magic)) == 0 &&
+        header.runtime == cache->runtime &&
+        header.size == (uint64_t)st->st_size)
+    {
+        const uint64_t mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+        uint64_t hash = IMC_HASH_INIT;
+
+        if (header.mtime_ns == mtime_ns)
+        {
+            valid = true;
+        }
+        else if (IMC_hash_file(filename, &hash) && hash == header.hash)
+        {
+            valid = true;
+        }
+    }
+
+    if (valid && luaL_loadbuffer(L, cached + sizeof(header), cached_size - sizeof(header), chunkname) != LUA_OK)
+    {
+        lua_pop(L, 1);
+        valid = false;
+    }
+
+    free(cached);
+
+    return valid;
+}
+
+struct imc_bc_cache *IMC_BC_open(const char *dir)
+{
+    struct imc_bc_cache *res;
+
+    if (!dir)
+    {
+        return nullptr;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        printf("error: failed to create bytecode cache directory '%s' (%m)!!\n", dir);
+        return nullptr;
+    }
+
+    res = calloc(1, sizeof(struct imc_bc_cache));
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    res->dir = cstr_from(dir);
+    res->runtime = IMC_hash(IMC_HASH_INIT, LUAJIT_VERSION, sizeof(LUAJIT_VERSION));
+
+    return res;
+}
+
+int IMC_BC_loadfile(struct imc_bc_cache *cache, lua_State *L, const char *filename)
+{
+    int status;
+    struct stat st;
+    char resolved[PATH_MAX];
+    char *src = nullptr;
+    const char *chunk;
+    size_t src_size = 0;
+    size_t chunk_size;
+    cstr entry_path;
+    cstr chunkname;
+    struct bc_header header =
+    {
+        .magic = BC_MAGIC,
+    };
+    struct bc_buffer bytecode = {};
+
+    if (!cache || !filename || stat(filename, &st) != 0 || !realpath(filename, resolved))
+    {
+        return luaL_loadfile(L, filename);
+    }
+
+    entry_path = cstr_from_fmt("%s/%016" PRIx64 ".ljbc", cstr_str(&cache->dir),
+                               IMC_hash(IMC_HASH_INIT, resolved, strlen(resolved)));
+    chunkname = cstr_from_fmt("@%s", filename);
+
+    if (bc_load_cached(cache, L, cstr_str(&entry_path), filename, cstr_str(&chunkname), &st))
+    {
+        status = LUA_OK;
+        goto out;
+    }
+
+    if (!read_file(filename, &src, &src_size))
+    {
+        status = luaL_loadfile(L, filename);
+        goto out;
+    }
+
+    chunk_size = src_size;
+    chunk = skip_shebang(src, &chunk_size);
+    status = luaL_loadbuffer(L, chunk, chunk_size, cstr_str(&chunkname));
+
+    if (status == LUA_OK && lua_dump(L, bc_writer, &bytecode) == 0)
+    {
+        header.runtime = cache->runtime;
+        header.mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        header.size = src_size;
+        header.hash = IMC_hash(IMC_HASH_INIT, src, src_size);
+
+        bc_store(cache, cstr_str(&entry_path), &header, &bytecode);
+    }
+
+out:
+    free(src);
+    free(bytecode.data);
+    cstr_drop(&entry_path);
+    cstr_drop(&chunkname);
+    return status;
+}
+
+void IMC_BC_free(struct imc_bc_cache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+
+    cstr_drop(&cache->dir);
+    free(cache);
+}
@@ -0,0 +1,360 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <stc/cstr.h>
+
+#include "hash.h"
+
+#define CACHE_MANIFEST_HEADER "imc-cache 1\n"
+
+struct imc_cache
+{
+    cstr dir;
+    cstr deps;
+    uint64_t key;
+    bool have_key;
+};
+
+static cstr cache_path(struct imc_cache *cache, const char *ext)
+{
+    return cstr_from_fmt("%s/%016" PRIx64 ".%s", cstr_str(&cache->dir), cache->key, ext);
+}
+
+static bool copy_file(const char *src, const char *dst)
+{
+    ssize_t read_size;
+    char buf[65536];
+    int in = open(src, O_RDONLY);
+    int out = -1;
+
+    if (in < 0)
+    {
+        return false;
+    }
+
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+
+    while ((read_size = read(in, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t off = 0; off < read_size;)
+        {
+            ssize_t written = write(out, buf + off, read_size - off);
+
+            if (written < 0)
+            {
+                goto copy_failure;
+            }
+
+            off += written;
+        }
+    }
+
+    if (read_size < 0)
+    {
+        goto copy_failure;
+    }
+
+    close(in);
+    return close(out) == 0;
+copy_failure:
+    close(in);
+    close(out);
+    return false;
+}
+
+static void update_stats(struct imc_cache *cache, bool hit)
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    cstr stats_path = cstr_from_fmt("%s/stats", cstr_str(&cache->dir));
+    int fd = open(cstr_str(&stats_path), O_RDWR | O_CREAT, 0644);
+    FILE *stats;
+
+    cstr_drop(&stats_path);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    stats = fdopen(fd, "r+");
+
+    if (!stats)
+    {
+        close(fd);
+        return;
+    }
+
+    flock(fd, LOCK_EX);
+
+    if (fscanf(stats, "hits %zu\nmisses %zu\n", &hits, &misses) != 2)
+    {
+        hits = 0;
+        misses = 0;
+    }
+
+    if (hit)
+    {
+        hits++;
+    }
+    else
+    {
+        misses++;
+    }
+
+    rewind(stats);
+    fprintf(stats, "hits %zu\nmisses %zu\n", hits, misses);
+    fflush(stats);
+
+    flock(fd, LOCK_UN);
+    fclose(stats);
+}
+
+static bool check_manifest(const char *manifest_path)
+{
+    bool valid = true;
+    char *line = nullptr;
+    size_t line_cap = 0;
+    FILE *manifest = fopen(manifest_path, "r");
+
+    if (!manifest)
+    {
+        return false;
+    }
+
+    if (getline(&line, &line_cap, manifest) < 0 || strcmp(line, CACHE_MANIFEST_HEADER) != 0)
+    {
+        valid = false;
+    }
+
+    while (valid && getline(&line, &line_cap, manifest) > 0)
+    {
+        int path_off = 0;
+        uint64_t stored_hash;
+        uint64_t current_hash = IMC_HASH_INIT;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (sscanf(line, "dep %" SCNx64 " %n", &stored_hash, &path_off) != 1 || !path_off)
+        {
+            valid = false;
+        }
+        else if (!IMC_hash_file(line + path_off, &current_hash) || current_hash != stored_hash)
+        {
+            valid = false;
+        }
+    }
+
+    free(line);
+    fclose(manifest);
+
+    return valid;
+}
+
+struct imc_cache *IMC_CACHE_open(const char *dir)
+{
+    struct imc_cache *res;
+
+    if (!dir)
+    {
+        return nullptr;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        printf("error: failed to create cache directory '%s' (%m)!!\n", dir);
+        return nullptr;
+    }
+
+    res = calloc(1, sizeof(struct imc_cache));
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    res->dir = cstr_from(dir);
+    res->deps = cstr_init();
+
+    return res;
+}
+
+bool IMC_CACHE_lookup(struct imc_cache *cache, const char *input_file, const char *params, const char *output_file)
+{
+    bool hit = false;
+    cstr manifest_path;
+    cstr object_path;
+    const char version[] = "imc " IMC_VERSION;
+
+    if (!cache || !input_file || !params || !output_file)
+    {
+        return false;
+    }
+
+    cache->key = IMC_hash(IMC_HASH_INIT, version, sizeof(version));
+    cache->key = IMC_hash(cache->key, params, strlen(params) + 1);
+
+    if (!IMC_hash_file(input_file, &cache->key))
+    {
+        return false;
+    }
+
+    cache->have_key = true;
+    cstr_clear(&cache->deps);
+
+    manifest_path = cache_path(cache, "manifest");
+    object_path = cache_path(cache, "out");
+
+    if (check_manifest(cstr_str(&manifest_path)))
+    {
+        if (unlink(output_file) != 0 && errno != ENOENT)
+        {
+            hit = false;
+        }
+        else if (link(cstr_str(&object_path), output_file) == 0)
+        {
+            hit = true;
+        }
+        else
+        {
+            hit = copy_file(cstr_str(&object_path), output_file);
+        }
+    }
+
+    update_stats(cache, hit);
+
+    cstr_drop(&manifest_path);
+    cstr_drop(&object_path);
+
+    return hit;
+}
+
+bool IMC_CACHE_add_dep(struct imc_cache *cache, const char *filename)
+{
+    char resolved[PATH_MAX];
+    uint64_t hash = IMC_HASH_INIT;
+
+    if (!cache || !filename)
+    {
+        return false;
+    }
+
+    if (!realpath(filename, resolved) || !IMC_hash_file(resolved, &hash))
+    {
+        return false;
+    }
+
+    cstr_append_fmt(&cache->deps, "dep %016" PRIx64 " %s\n", hash, resolved);
+
+    return true;
+}
+
+bool IMC_CACHE_store(struct imc_cache *cache, const char *output_file)
+{
+    bool result = false;
+    cstr manifest_path;
+    cstr object_path;
+    cstr tmp_path;
+    FILE *manifest;
+
+    if (!cache || !output_file || !cache->have_key)
+    {
+        return false;
+    }
+
+    manifest_path = cache_path(cache, "manifest");
+    object_path = cache_path(cache, "out");
+    tmp_path = cstr_from_fmt("%s.%d.tmp", cstr_str(&object_path), (int)getpid());
+
+    if (!copy_file(output_file, cstr_str(&tmp_path)) ||
+        rename(cstr_str(&tmp_path), cstr_str(&object_path)) != 0)
+    {
+        unlink(cstr_str(&tmp_path));
+        goto out;
+    }
+
+    cstr_drop(&tmp_path);
+    tmp_path = cstr_from_fmt("%s.%d.tmp", cstr_str(&manifest_path), (int)getpid());
+
+    manifest = fopen(cstr_str(&tmp_path), "w");
+
+    if (!manifest)
+    {
+        goto out;
+    }
+
+    fputs(CACHE_MANIFEST_HEADER, manifest);
+    fputs(cstr_str(&cache->deps), manifest);
+
+    if (fclose(manifest) != 0 || rename(cstr_str(&tmp_path), cstr_str(&manifest_path)) != 0)
+    {
+        unlink(cstr_str(&tmp_path));
+        goto out;
+    }
+
+    result = true;
+out:
+    cstr_drop(&manifest_path);
+    cstr_drop(&object_path);
+    cstr_drop(&tmp_path);
+    return result;
+}
+
+void IMC_CACHE_print_stats(struct imc_cache *cache)
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    cstr stats_path;
+    FILE *stats;
+
+    if (!cache)
+    {
+        return;
+    }
+
+    stats_path = cstr_from_fmt("%s/stats", cstr_str(&cache->dir));
+    stats = fopen(cstr_str(&stats_path), "r");
+
+    cstr_drop(&stats_path);
+
+    if (stats)
+    {
+        if (fscanf(stats, "hits %zu\nmisses %zu\n", &hits, &misses) != 2)
+        {
+            hits = 0;
+            misses = 0;
+        }
+
+        fclose(stats);
+    }
+
+    printf("cache: %zu hits, %zu misses, %.1f%% hit rate\n",
+           hits, misses, hits + misses ? 100.00 * hits / (hits + misses) : 0.00);
+}
+
+void IMC_CACHE_free(struct imc_cache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+
+    cstr_drop(&cache->dir);
+    cstr_drop(&cache->deps);
+    free(cache);
+}
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+
+#include "compare.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <stc/cstr.h>
+#include <stb_image.h>
+#include <stb_image_write.h>
+
+#include "trace.h"
+#include "langvm.h"
+#include "timing.h"
+#include "profile.h"
+
+typedef uint8_t cmp_u8x16 __attribute__((vector_size(16)));
+typedef uint32_t cmp_u32x4 __attribute__((vector_size(16)));
+
+struct cmp_job
+{
+    char *script;
+    char *reference;
+    bool passed;
+    cstr message;
+};
+
+struct cmp_run
+{
+    const struct imc_vm_conf *vm_conf;
+    const struct imc_cmp_conf *conf;
+    struct cmp_job *jobs;
+    size_t num_jobs;
+    size_t capacity;
+    atomic_size_t next;
+};
+
+struct cmp_worker
+{
+    int id;
+    pthread_t thread;
+    struct cmp_run *run;
+};
+
+static inline int cmp_abs_diff(int a, int b)
+{
+    return a > b ? a - b : b - a;
+}
+
+static inline int cmp_pixel_diff(const unsigned char *a, const unsigned char *b)
+{
+    int max = 0;
+
+    for (int c = 0; c < 4; c++)
+    {
+        const int diff = cmp_abs_diff(a[c], b[c]);
+
+        max = diff > max ? diff : max;
+    }
+
+    return max;
+}
+
+/* four RGBA pixels per vector, a pixel is mismatched when any of its channel bytes is over the tolerance */
+void IMC_CMP_diff(const unsigned char *a, const unsigned char *b, size_t num_pixels, int tolerance,
+                  struct imc_cmp_diff *diff)
+{
+    size_t i = 0;
+    cmp_u8x16 max = {};
+    cmp_u32x4 count = {};
+    const cmp_u8x16 tol = (cmp_u8x16){} + (uint8_t)tolerance;
+
+    for (; i + 4 <= num_pixels; i += 4)
+    {
+        cmp_u8x16 va;
+        cmp_u8x16 vb;
+        cmp_u8x16 gt;
+        cmp_u8x16 delta;
+
+        memcpy(&va, a + i * 4, sizeof(va));
+        memcpy(&vb, b + i * 4, sizeof(vb));
+
+        gt = (cmp_u8x16)(va > vb);
+        delta = ((va - vb) & gt) | ((vb - va) & ~gt);
+
+        gt = (cmp_u8x16)(delta > max);
+        max = (delta & gt) | (max & ~gt);
+
+        count += (cmp_u32x4)((cmp_u32x4)(delta > tol) != 0) & 1;
+    }
+
+    diff->mismatched = 0;
+    diff->max_diff = 0;
+
+    for (int lane = 0; lane < 4; lane++)
+    {
+        diff->mismatched += count[lane];
+    }
+
+    for (int lane = 0; lane < 16; lane++)
+    {
+        diff->max_diff = max[lane] > diff->max_diff ? max[lane] : diff->max_diff;
+    }
+
+    for (; i < num_pixels; i++)
+    {
+        const int pixel = cmp_pixel_diff(a + i * 4, b + i * 4);
+
+        diff->mismatched += pixel > tolerance;
+        diff->max_diff = pixel > diff->max_diff ? pixel : diff->max_diff;
+    }
+}
+
+/* mismatched pixels go from yellow to red as the difference grows, everything else is the dimmed reference */
+bool IMC_CMP_write_heatmap(const char *filename, const unsigned char *a, const unsigned char *b, int width, int height,
+                           int tolerance)
+{
+    int result;
+    const size_t num_pixels = (size_t)width * height;
+    unsigned char *heatmap = malloc(num_pixels * 3);
+
+    if (!heatmap)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        const unsigned char *ref = b + i * 4;
+        unsigned char *out = heatmap + i * 3;
+        const int diff = cmp_pixel_diff(a + i * 4, ref);
+
+        if (diff > tolerance)
+        {
+            out[0] = 255;
+            out[1] = 255 - diff;
+            out[2] = 0;
+        }
+        else
+        {
+            out[0] = out[1] = out[2] = ((ref[0] * 77 + ref[1] * 150 + ref[2] * 29) >> 8) * ref[3] / (255 * 3);
+        }
+    }
+
+    result = stbi_write_png(filename, width, height, 3, heatmap, width * 3);
+
+    free(heatmap);
+
+    return result != 0;
+}
+
+static cstr cmp_heatmap_path(const struct imc_cmp_conf *conf, const char *reference)
+{
+    const char *slash = strrchr(reference, '/');
+    const char *name = slash ? slash + 1 : reference;
+    const char *ext = strrchr(name, '.');
+    const int name_len = ext && ext != name ? (int)(ext - name) : (int)strlen(name);
+
+    if (conf->heatmap_dir)
+    {
+        return cstr_from_fmt("%s/%.*s.diff.png", conf->heatmap_dir, name_len, name);
+    }
+
+    return cstr_from_fmt("%.*s%.*s.diff.png", (int)(name - reference), reference, name_len, name);
+}
+
+/* false when the vm could not be recycled and has to be dropped */
+static bool cmp_job_run(struct imc_lang_vm *vm, const struct imc_cmp_conf *conf, struct cmp_job *job)
+{
+    int width;
+    int height;
+    int ref_width;
+    int ref_height;
+    uint64_t begin;
+    struct imc_cmp_diff diff;
+    unsigned char *rendered = nullptr;
+    unsigned char *reference = nullptr;
+    cstr heatmap = cstr_init();
+
+    if (!IMC_VM_recycle(vm))
+    {
+        job->message = cstr_from("failed to recycle vm");
+        return false;
+    }
+
+    if (!IMC_VM_run_src_file(vm, job->script))
+    {
+        job->message = cstr_from_fmt("script failed: %s", IMC_VM_get_error(vm));
+        goto out;
+    }
+
+    rendered = IMC_VM_to_rgba(vm, &width, &height);
+
+    if (!rendered)
+    {
+        job->message = cstr_from("failed to read the rendered image");
+        goto out;
+    }
+
+    begin = IMC_PROF_begin();
+    reference = stbi_load(job->reference, &ref_width, &ref_height, nullptr, 4);
+    IMC_PROF_end("compare.decode", begin);
+
+    if (!reference)
+    {
+        job->message = cstr_from_fmt("failed to load reference (%s)", stbi_failure_reason());
+        goto out;
+    }
+
+    if (width != ref_width || height != ref_height)
+    {
+        job->message = cstr_from_fmt("rendered %dx%d but the reference is %dx%d", width, height, ref_width, ref_height);
+        goto out;
+    }
+
+    begin = IMC_PROF_begin();
+    IMC_CMP_diff(rendered, reference, (size_t)width * height, conf->tolerance, &diff);
+    IMC_PROF_end("compare.diff", begin);
+
+    if (diff.mismatched <= conf->max_mismatch)
+    {
+        job->passed = true;
+        goto out;
+    }
+
+    heatmap = cmp_heatmap_path(conf, job->reference);
+
+    begin = IMC_PROF_begin();
+
+    if (!IMC_CMP_write_heatmap(cstr_str(&heatmap), rendered, reference, width, height, conf->tolerance))
+    {
+        cstr_assign(&heatmap, "(failed to write heatmap)");
+    }
+
+    IMC_PROF_end("compare.heatmap", begin);
+
+    job->message = cstr_from_fmt("%zu of %zu pixels differ by more than %d (max %d), heatmap %s", diff.mismatched,
+                                 (size_t)width * height, conf->tolerance, diff.max_diff, cstr_str(&heatmap));
+out:
+    free(rendered);
+    stbi_image_free(reference);
+    cstr_drop(&heatmap);
+    return true;
+}
+
+static void *cmp_worker_main(void *arg)
+{
+    struct cmp_worker *worker = arg;
+    struct cmp_run *run = worker->run;
+    cstr name = cstr_from_fmt("compare %d", worker->id);
+    struct imc_lang_vm *vm = IMC_VM_new(run->vm_conf);
+
+    IMC_TRACE_thread_name(cstr_str(&name));
+    cstr_drop(&name);
+
+    for (;;)
+    {
+        const size_t index = atomic_fetch_add(&run->next, 1);
+        uint64_t begin;
+
+        if (index >= run->num_jobs)
+        {
+            break;
+        }
+
+        if (!vm)
+        {
+            run->jobs[index].message = cstr_from("failed to create vm");
+            continue;
+        }
+
+        begin = IMC_PROF_begin();
+
+        if (!cmp_job_run(vm, run->conf, &run->jobs[index]))
+        {
+            IMC_VM_free(vm);
+            vm = nullptr;
+        }
+
+        IMC_PROF_end("compare.job", begin);
+
+        IMC_TRACE_flush();
+    }
+
+    IMC_VM_free(vm);
+    return nullptr;
+}
+
+static bool cmp_add_job(struct cmp_run *run, const char *script, const char *reference)
+{
+    if (run->num_jobs == run->capacity)
+    {
+        const size_t capacity = run->capacity ? run->capacity * 2 : 64;
+        struct cmp_job *jobs = realloc(run->jobs, capacity * sizeof(struct cmp_job));
+
+        if (!jobs)
+        {
+            printf("error: failed to allocate compare jobs!!\n");
+            return false;
+        }
+
+        run->jobs = jobs;
+        run->capacity = capacity;
+    }
+
+    run->jobs[run->num_jobs] = (struct cmp_job)
+    {
+        .script = strdup(script),
+        .reference = strdup(reference),
+        .message = cstr_init(),
+    };
+
+    if (!run->jobs[run->num_jobs].script || !run->jobs[run->num_jobs].reference)
+    {
+        free(run->jobs[run->num_jobs].script);
+        free(run->jobs[run->num_jobs].reference);
+        printf("error: failed to allocate compare jobs!!\n");
+        return false;
+    }
+
+    run->num_jobs++;
+
+    return true;
+}
+
+static bool cmp_read_list(struct cmp_run *run, const char *list_file)
+{
+    bool result = false;
+    char *line = nullptr;
+    size_t line_size = 0;
+    int line_num = 0;
+    FILE *in = fopen(list_file, "r");
+
+    if (!in)
+    {
+        printf("error: failed to open compare list '%s' (%m)!!\n", list_file);
+        return false;
+    }
+
+    while (getline(&line, &line_size, in) != -1)
+    {
+        char *save;
+        char *script = strtok_r(line, " \t\r\n", &save);
+        char *reference = strtok_r(nullptr, " \t\r\n", &save);
+
+        line_num++;
+
+        if (!script || script[0] == '#')
+        {
+            continue;
+        }
+
+        if (!reference || strtok_r(nullptr, " \t\r\n", &save))
+        {
+            printf("error: %s:%d: expected '<script> <reference>'!!\n", list_file, line_num);
+            goto out;
+        }
+
+        if (!cmp_add_job(run, script, reference))
+        {
+            goto out;
+        }
+    }
+
+    result = true;
+out:
+    free(line);
+    fclose(in);
+    return result;
+}
+
+static bool cmp_execute(struct cmp_run *run, int num_workers)
+{
+    size_t failed = 0;
+    int started = 0;
+    const uint64_t start = IMC_time_ns();
+    struct cmp_worker *workers;
+
+    if ((size_t)num_workers > run->num_jobs)
+    {
+        num_workers = run->num_jobs ? run->num_jobs : 1;
+    }
+
+    workers = calloc(num_workers, sizeof(struct cmp_worker));
+
+    if (!workers)
+    {
+        return false;
+    }
+
+    for (; started < num_workers; started++)
+    {
+        workers[started].id = started;
+        workers[started].run = run;
+
+        if (pthread_create(&workers[started].thread, nullptr, cmp_worker_main, &workers[started]) != 0)
+        {
+            printf("error: failed to start compare thread!!\n");
+            break;
+        }
+    }
+
+    if (started == 0)
+    {
+        /* no threads at all, compare on this one */
+        struct cmp_worker self = { .run = run };
+
+        cmp_worker_main(&self);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, nullptr);
+    }
+
+    free(workers);
+
+    for (size_t i = 0; i < run->num_jobs; i++)
+    {
+        if (!run->jobs[i].passed)
+        {
+            printf("FAIL %s (%s): %s\n", run->jobs[i].reference, run->jobs[i].script, cstr_str(&run->jobs[i].message));
+            failed++;
+        }
+    }
+
+    printf("compare: %zu passed, %zu failed in %.2f ms\n", run->num_jobs - failed, failed,
+           IMC_time_ms(IMC_time_ns() - start));
+
+    return failed == 0;
+}
+
+static void cmp_run_free(struct cmp_run *run)
+{
+    for (size_t i = 0; i < run->num_jobs; i++)
+    {
+        free(run->jobs[i].script);
+        free(run->jobs[i].reference);
+        cstr_drop(&run->jobs[i].message);
+    }
+
+    free(run->jobs);
+}
+
+bool IMC_CMP_run(const struct imc_vm_conf *vm_conf, const struct imc_cmp_conf *conf, const char *script,
+                 const char *reference)
+{
+    bool result;
+    struct cmp_run run =
+    {
+        .vm_conf = vm_conf,
+        .conf = conf,
+    };
+
+    result = cmp_add_job(&run, script, reference) && cmp_execute(&run, 1);
+
+    cmp_run_free(&run);
+
+    return result;
+}
+
+bool IMC_CMP_run_list(const struct imc_vm_conf *vm_conf, const struct imc_cmp_conf *conf, const char *list_file,
+                      int num_workers)
+{
+    bool result;
+    struct cmp_run run =
+    {
+        .vm_conf = vm_conf,
+        .conf = conf,
+    };
+
+    result = cmp_read_list(&run, list_file) && cmp_execute(&run, num_workers);
+
+    cmp_run_free(&run);
+
+    return result;
+}
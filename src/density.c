@@ -0,0 +1,664 @@
+#include "density.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <lauxlib.h>
+
+#include "fsurface.h"
+#include "imagelib.h"
+#include "luabuf.h"
+#include "profile.h"
+
+#define DENSITY_METATABLE "imc.density"
+#define DENSITY_MAX_THREADS 16
+#define DENSITY_PARALLEL_MIN 65536
+
+/* points each thread sorts into bands per round, keeps the scratch small whatever the image size */
+#define DENSITY_CHUNK 65536
+
+typedef float density_f32x4 __attribute__((vector_size(4 * sizeof(float))));
+typedef int32_t density_i32x4 __attribute__((vector_size(4 * sizeof(int32_t))));
+
+/* hit count and r, g, b sums of every pixel, the sums are double so they stay exact next to large counts */
+struct density
+{
+    int width;
+    int height;
+    int threads;
+    uint32_t *counts;
+    double *colors;
+};
+
+/*
+ * threads sort their slice of a round into bands of rows, then each applies what every thread found in its
+ * own band, so no two threads write the same pixel
+ */
+struct density_shared
+{
+    struct density *dens;
+    const double *points;
+    size_t num_points;
+    int stride;
+    const float *color;
+    int threads;
+
+    /* per thread the pixel indices of its hits grouped by band, with the r, g, b of each for rgb points */
+    uint32_t *indices;
+    float *hit_colors;
+    size_t starts[DENSITY_MAX_THREADS][DENSITY_MAX_THREADS + 1];
+
+    /* threads wait on ready until it is known how many of them could be started */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool started;
+    pthread_barrier_t barrier;
+};
+
+struct density_job
+{
+    pthread_t thread;
+    struct density_shared *shared;
+    int index;
+};
+
+static inline bool density_index(const struct density *dens, const double *point, size_t *index)
+{
+    if (!(point[0] >= 0 && point[0] < dens->width && point[1] >= 0 && point[1] < dens->height))
+    {
+        return false;
+    }
+
+    *index = (size_t)point[1] * dens->width + (size_t)point[0];
+
+    return true;
+}
+
+static inline void density_hit(struct density *dens, size_t index, const float *color)
+{
+    double *sum = dens->colors + index * 3;
+
+    dens->counts[index] += dens->counts[index] != UINT32_MAX;
+    sum[0] += color[0];
+    sum[1] += color[1];
+    sum[2] += color[2];
+}
+
+/* 0 to 255 into 0 to 1, nan included */
+static inline float density_unit(double value)
+{
+    return (value > 0 ? (value < 255 ? value : 255) : 0) / 255.0f;
+}
+
+static inline void density_point_color(const double *point, int stride, const float *color, float *out)
+{
+    if (stride == 5)
+    {
+        out[0] = density_unit(point[2]);
+        out[1] = density_unit(point[3]);
+        out[2] = density_unit(point[4]);
+    }
+    else
+    {
+        out[0] = color[0];
+        out[1] = color[1];
+        out[2] = color[2];
+    }
+}
+
+static void density_add(struct density *dens, const double *points, size_t num_points, int stride,
+                        const float *color)
+{
+    for (size_t i = 0; i < num_points; i++)
+    {
+        const double *point = points + i * stride;
+        float rgb[3];
+        size_t index;
+
+        if (!density_index(dens, point, &index))
+        {
+            continue;
+        }
+
+        density_point_color(point, stride, color, rgb);
+        density_hit(dens, index, rgb);
+    }
+}
+
+static void *density_job_main(void *arg)
+{
+    struct density_job *job = arg;
+    struct density_shared *shared = job->shared;
+    struct density *dens = shared->dens;
+    const bool rgb = shared->stride == 5;
+    uint32_t *indices = shared->indices + (size_t)job->index * DENSITY_CHUNK;
+    float *colors = rgb ? shared->hit_colors + (size_t)job->index * DENSITY_CHUNK * 3 : nullptr;
+    size_t *starts = shared->starts[job->index];
+    size_t round_size;
+
+    pthread_mutex_lock(&shared->lock);
+
+    while (!shared->started)
+    {
+        pthread_cond_wait(&shared->ready, &shared->lock);
+    }
+
+    pthread_mutex_unlock(&shared->lock);
+
+    round_size = (size_t)shared->threads * DENSITY_CHUNK;
+
+    for (size_t round = 0; round < shared->num_points; round += round_size)
+    {
+        const size_t begin = round + (size_t)job->index * DENSITY_CHUNK;
+        const size_t end = begin + DENSITY_CHUNK < shared->num_points ? begin + DENSITY_CHUNK : shared->num_points;
+        size_t next[DENSITY_MAX_THREADS];
+        size_t index;
+
+        memset(starts, 0, (DENSITY_MAX_THREADS + 1) * sizeof(size_t));
+
+        /* count the hits of every band, then place them */
+        for (size_t i = begin; i < end; i++)
+        {
+            if (density_index(dens, shared->points + i * shared->stride, &index))
+            {
+                starts[(index / dens->width) * shared->threads / dens->height + 1]++;
+            }
+        }
+
+        for (int b = 0; b < shared->threads; b++)
+        {
+            starts[b + 1] += starts[b];
+            next[b] = starts[b];
+        }
+
+        for (size_t i = begin; i < end; i++)
+        {
+            const double *point = shared->points + i * shared->stride;
+            size_t slot;
+
+            if (!density_index(dens, point, &index))
+            {
+                continue;
+            }
+
+            slot = next[(index / dens->width) * shared->threads / dens->height]++;
+            indices[slot] = index;
+
+            if (rgb)
+            {
+                density_point_color(point, shared->stride, shared->color, colors + slot * 3);
+            }
+        }
+
+        pthread_barrier_wait(&shared->barrier);
+
+        for (int t = 0; t < shared->threads; t++)
+        {
+            const uint32_t *hits = shared->indices + (size_t)t * DENSITY_CHUNK;
+            const float *hit_colors = rgb ? shared->hit_colors + (size_t)t * DENSITY_CHUNK * 3 : nullptr;
+
+            for (size_t k = shared->starts[t][job->index]; k < shared->starts[t][job->index + 1]; k++)
+            {
+                density_hit(dens, hits[k], rgb ? hit_colors + k * 3 : shared->color);
+            }
+        }
+
+        /* the next round overwrites the hits */
+        pthread_barrier_wait(&shared->barrier);
+    }
+
+    return nullptr;
+}
+
+static void density_accumulate(struct density *dens, const double *points, size_t num_points, int stride,
+                               const float *color)
+{
+    struct density_job jobs[DENSITY_MAX_THREADS];
+    struct density_shared shared =
+    {
+        .dens = dens,
+        .points = points,
+        .num_points = num_points,
+        .stride = stride,
+        .color = color,
+    };
+    const int threads = dens->threads > dens->height ? dens->height : dens->threads;
+    int started = 1;
+
+    if (num_points < DENSITY_PARALLEL_MIN || threads < 2)
+    {
+        density_add(dens, points, num_points, stride, color);
+        return;
+    }
+
+    shared.indices = malloc((size_t)threads * DENSITY_CHUNK * sizeof(uint32_t));
+    shared.hit_colors = stride == 5 ? malloc((size_t)threads * DENSITY_CHUNK * 3 * sizeof(float)) : nullptr;
+
+    if (!shared.indices || (stride == 5 && !shared.hit_colors))
+    {
+        free(shared.indices);
+        free(shared.hit_colors);
+        density_add(dens, points, num_points, stride, color);
+        return;
+    }
+
+    pthread_mutex_init(&shared.lock, nullptr);
+    pthread_cond_init(&shared.ready, nullptr);
+
+    for (; started < threads; started++)
+    {
+        jobs[started] = (struct density_job){ .shared = &shared, .index = started };
+
+        if (pthread_create(&jobs[started].thread, nullptr, density_job_main, &jobs[started]) != 0)
+        {
+            break;
+        }
+    }
+
+    /* the bands are split between however many threads there are, this one included */
+    shared.threads = started;
+    pthread_barrier_init(&shared.barrier, nullptr, started);
+
+    pthread_mutex_lock(&shared.lock);
+    shared.started = true;
+    pthread_cond_broadcast(&shared.ready);
+    pthread_mutex_unlock(&shared.lock);
+
+    jobs[0] = (struct density_job){ .shared = &shared, .index = 0 };
+    density_job_main(&jobs[0]);
+
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(jobs[i].thread, nullptr);
+    }
+
+    pthread_barrier_destroy(&shared.barrier);
+    pthread_cond_destroy(&shared.ready);
+    pthread_mutex_destroy(&shared.lock);
+
+    free(shared.indices);
+    free(shared.hit_colors);
+}
+
+/* log2 and exp2 to about 1e-5, plenty for 8-bit output */
+static inline density_f32x4 density_log2(density_f32x4 x)
+{
+    const density_i32x4 bits = (density_i32x4)x;
+    const density_f32x4 exponent = __builtin_convertvector(((bits >> 23) & 255) - 127, density_f32x4);
+    const density_f32x4 t = (density_f32x4)((bits & 0x7FFFFF) | 0x3F800000) - 1.0f;
+
+    return exponent + t * (1.44182550f + t * (-0.70867891f + t * (0.41541119f + t * (-0.19440832f + t * 0.04587895f))));
+}
+
+static inline density_f32x4 density_exp2(density_f32x4 x)
+{
+    const density_i32x4 low = x < -126.0f;
+    const density_f32x4 floor = (density_f32x4){} - 126.0f;
+    density_i32x4 whole;
+    density_f32x4 t;
+    density_f32x4 p;
+
+    /* clamp so the exponent stays a normal float */
+    x = (density_f32x4)(((density_i32x4)x & ~low) | ((density_i32x4)floor & low));
+    whole = __builtin_convertvector(x, density_i32x4);
+    whole += (density_i32x4)(x < __builtin_convertvector(whole, density_f32x4));
+    t = x - __builtin_convertvector(whole, density_f32x4);
+    p = 1.00000727f + t * (0.69293141f + t * (0.24170999f + t * (0.05166703f + t * 0.01367656f)));
+
+    return (density_f32x4)((density_i32x4)p + (whole << 23));
+}
+
+/* the 8-bit surface, or the float one with a row of single precision RGBA to blend in */
+struct density_target
+{
+    int width;
+    int height;
+    unsigned char *argb;
+    int stride;
+    struct imc_fsurface *fsurface;
+    float *row;
+};
+
+/*
+ * alpha = (log(1 + count * exposure) / log(1 + max * exposure)) ^ (1 / gamma), the pixel color is the
+ * average of the colors that landed on it, drawn over the surface with src-over; surface pixels take the
+ * bin their center falls in when the image is drawn scaled
+ */
+static void density_tonemap(struct density *dens, const struct density_target *target, float scale, float gamma,
+                            float exposure)
+{
+    uint32_t max = 0;
+    const int scaled_width = ceilf(dens->width * scale);
+    const int scaled_height = ceilf(dens->height * scale);
+    const int width = scaled_width < target->width ? scaled_width : target->width;
+    const int height = scaled_height < target->height ? scaled_height : target->height;
+    density_f32x4 norm;
+
+    for (size_t i = 0; i < (size_t)dens->width * dens->height; i++)
+    {
+        max = dens->counts[i] > max ? dens->counts[i] : max;
+    }
+
+    if (max == 0)
+    {
+        return;
+    }
+
+    norm = (density_f32x4){} + 1.0f / density_log2((density_f32x4){} + 1.0f + (float)max * exposure)[0];
+
+    for (int y = 0; y < height; y++)
+    {
+        const int bin_y = (y + 0.50f) / scale;
+        const size_t row_index = (size_t)(bin_y < dens->height ? bin_y : dens->height - 1) * dens->width;
+        const uint32_t *bins = dens->counts + row_index;
+        const double *sums = dens->colors + row_index * 3;
+        uint32_t *row = target->fsurface ? nullptr : (uint32_t *)(target->argb + (size_t)y * target->stride);
+
+        if (target->fsurface)
+        {
+            IMC_FSURF_read_rows(target->fsurface, y, 1, target->row);
+        }
+
+        for (int x = 0; x < width; x += 4)
+        {
+            const int lanes = width - x < 4 ? width - x : 4;
+            density_f32x4 counts = {};
+            density_f32x4 alpha;
+            int columns[4];
+
+            for (int l = 0; l < lanes; l++)
+            {
+                const int bin_x = (x + l + 0.50f) / scale;
+
+                columns[l] = bin_x < dens->width ? bin_x : dens->width - 1;
+                counts[l] = bins[columns[l]];
+            }
+
+            alpha = density_log2(1.0f + counts * exposure) * norm;
+            alpha = density_exp2(density_log2(alpha) / gamma);
+
+            for (int l = 0; l < lanes; l++)
+            {
+                const double *sum = sums + columns[l] * 3;
+                const float a = alpha[l] > 0 ? (alpha[l] < 1.0f ? alpha[l] : 1.0f) : 0;
+                const float keep = 1.0f - a;
+                float color[3];
+                float out[4];
+                uint32_t dst;
+
+                if (counts[l] == 0)
+                {
+                    continue;
+                }
+
+                for (int c = 0; c < 3; c++)
+                {
+                    color[c] = sum[c] / bins[columns[l]];
+                    color[c] = color[c] > 0 ? (color[c] < 1.0f ? color[c] : 1.0f) : 0;
+                }
+
+                if (target->fsurface)
+                {
+                    float *pixel = target->row + (size_t)(x + l) * 4;
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        pixel[c] = color[c] * a + pixel[c] * keep;
+                    }
+
+                    pixel[3] = a + pixel[3] * keep;
+                    continue;
+                }
+
+                dst = row[x + l];
+
+                for (int c = 0; c < 3; c++)
+                {
+                    out[c] = color[c] * a * 255.0f + ((dst >> (16 - c * 8)) & 255) * keep;
+                }
+
+                out[3] = a * 255.0f + (dst >> 24) * keep;
+
+                row[x + l] = (uint32_t)(out[3] + 0.5f) << 24 | (uint32_t)(out[0] + 0.5f) << 16
+                             | (uint32_t)(out[1] + 0.5f) << 8 | (uint32_t)(out[2] + 0.5f);
+            }
+        }
+
+        if (target->fsurface)
+        {
+            IMC_FSURF_write_rows(target->fsurface, y, 1, target->row);
+        }
+    }
+}
+
+static struct density *density_check(lua_State *L)
+{
+    struct density *dens = luaL_checkudata(L, 1, DENSITY_METATABLE);
+
+    if (!dens->counts)
+    {
+        luaL_error(L, "density buffer was freed");
+    }
+
+    return dens;
+}
+
+static float density_color_arg(lua_State *L, int idx)
+{
+    return density_unit(luaL_optnumber(L, idx, 255));
+}
+
+/* points come as a table or FFI double array of x, y pairs, or of x, y, r, g, b records */
+static void density_lua_accumulate(lua_State *L, int stride)
+{
+    struct density *dens = density_check(L);
+    double *array;
+    const size_t length = IMC_LBUF_check(L, 2, &array);
+    const lua_Integer num_points = luaL_checkinteger(L, 3);
+    const float color[3] = { density_color_arg(L, 4), density_color_arg(L, 5), density_color_arg(L, 6) };
+    const uint64_t begin = IMC_PROF_begin();
+    double *points = nullptr;
+
+    luaL_argcheck(L, num_points >= 0, 3, "count must not be negative");
+    luaL_argcheck(L, (size_t)num_points <= length / stride, 3, "count is larger than the buffer");
+
+    if (!array)
+    {
+        points = malloc(num_points * stride * sizeof(double));
+
+        if (!points && num_points)
+        {
+            luaL_error(L, "failed to allocate %f points", (lua_Number)num_points);
+            return;
+        }
+
+        for (lua_Integer i = 0; i < num_points * stride; i++)
+        {
+            lua_rawgeti(L, 2, i + 1);
+            points[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+
+        density_accumulate(dens, points, num_points, stride, color);
+        free(points);
+    }
+    else
+    {
+        density_accumulate(dens, array, num_points, stride, color);
+    }
+
+    IMC_PROF_end("Density.accumulate", begin);
+}
+
+static int density_accumulate_fn(lua_State *L)
+{
+    density_lua_accumulate(L, 2);
+
+    return 0;
+}
+
+static int density_accumulate_rgb_fn(lua_State *L)
+{
+    density_lua_accumulate(L, 5);
+
+    return 0;
+}
+
+static int density_plot_fn(lua_State *L)
+{
+    struct density *dens = density_check(L);
+    const double point[2] = { luaL_checknumber(L, 2), luaL_checknumber(L, 3) };
+    const float color[3] = { density_color_arg(L, 4), density_color_arg(L, 5), density_color_arg(L, 6) };
+
+    density_add(dens, point, 1, 2, color);
+
+    return 0;
+}
+
+static int density_clear_fn(lua_State *L)
+{
+    struct density *dens = density_check(L);
+
+    memset(dens->counts, 0, (size_t)dens->width * dens->height * sizeof(uint32_t));
+    memset(dens->colors, 0, (size_t)dens->width * dens->height * 3 * sizeof(double));
+
+    return 0;
+}
+
+/* float images are blended in at full precision, 8-bit ones in place */
+static int density_tonemap_fn(lua_State *L)
+{
+    struct density *dens = density_check(L);
+    struct imc_image_lib_state *imgst = lua_touserdata(L, lua_upvalueindex(1));
+    const float gamma = luaL_optnumber(L, 2, 2.2);
+    const float exposure = luaL_optnumber(L, 3, 1.0);
+    const uint64_t begin = IMC_PROF_begin();
+    struct density_target target = {};
+
+    luaL_argcheck(L, gamma > 0, 2, "gamma must be positive");
+    luaL_argcheck(L, exposure > 0, 3, "exposure must be positive");
+
+    target.fsurface = IMC_IMG_get_float(imgst, &target.width, &target.height);
+
+    if (target.fsurface)
+    {
+        target.row = aligned_alloc(16, (size_t)target.width * 4 * sizeof(float));
+
+        if (!target.row)
+        {
+            luaL_error(L, "failed to allocate a tone mapping row");
+            return 0;
+        }
+    }
+    else if (!(target.argb = IMC_IMG_get_data(imgst, &target.width, &target.height, &target.stride)))
+    {
+        luaL_error(L, "failed to initialize internal state");
+        return 0;
+    }
+
+    density_tonemap(dens, &target, IMC_IMG_get_scale(imgst), gamma, exposure);
+    free(target.row);
+
+    IMC_PROF_end("Density.tonemap", begin);
+
+    return 0;
+}
+
+static int density_gc_fn(lua_State *L)
+{
+    struct density *dens = luaL_checkudata(L, 1, DENSITY_METATABLE);
+
+    free(dens->counts);
+    free(dens->colors);
+    dens->counts = nullptr;
+    dens->colors = nullptr;
+
+    return 0;
+}
+
+/* Density.new([width, height[, threads]]), the size defaults to the current image */
+static int density_new_fn(lua_State *L)
+{
+    struct imc_image_lib_state *imgst = lua_touserdata(L, lua_upvalueindex(1));
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int width;
+    int height;
+    int threads;
+    struct density *dens;
+
+    if (!IMC_IMG_get_size(imgst, &width, &height))
+    {
+        luaL_error(L, "failed to initialize internal state");
+        return 0;
+    }
+
+    width = luaL_optint(L, 1, width);
+    height = luaL_optint(L, 2, height);
+    threads = luaL_optint(L, 3, cpus > 0 ? cpus : 1);
+
+    luaL_argcheck(L, width > 0, 1, "width must be positive");
+    luaL_argcheck(L, height > 0, 2, "height must be positive");
+    luaL_argcheck(L, (uint64_t)width * height <= UINT32_MAX, 2, "density buffer is too large");
+
+    dens = lua_newuserdata(L, sizeof(struct density));
+    *dens = (struct density)
+    {
+        .width = width,
+        .height = height,
+        .threads = threads < 1 ? 1 : (threads > DENSITY_MAX_THREADS ? DENSITY_MAX_THREADS : threads),
+    };
+
+    luaL_getmetatable(L, DENSITY_METATABLE);
+    lua_setmetatable(L, -2);
+
+    dens->counts = calloc((size_t)width * height, sizeof(uint32_t));
+    dens->colors = calloc((size_t)width * height * 3, sizeof(double));
+
+    if (!dens->counts || !dens->colors)
+    {
+        luaL_error(L, "failed to allocate a %dx%d density buffer", width, height);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void register_func(lua_State *L, struct imc_image_lib_state *imgst, const char *name, lua_CFunction func)
+{
+    lua_pushlightuserdata(L, imgst);
+    lua_pushcclosure(L, func, 1);
+    lua_setfield(L, -2, name);
+}
+
+bool IMC_DENSITY_load(lua_State *state, struct imc_image_lib_state *imgst)
+{
+    if (!state || !imgst)
+    {
+        return false;
+    }
+
+    luaL_newmetatable(state, DENSITY_METATABLE);
+
+    lua_newtable(state);
+    register_func(state, imgst, "plot", density_plot_fn);
+    register_func(state, imgst, "accumulate", density_accumulate_fn);
+    register_func(state, imgst, "accumulate_rgb", density_accumulate_rgb_fn);
+    register_func(state, imgst, "clear", density_clear_fn);
+    register_func(state, imgst, "tonemap", density_tonemap_fn);
+    lua_setfield(state, -2, "__index");
+
+    lua_pushcfunction(state, density_gc_fn);
+    lua_setfield(state, -2, "__gc");
+
+    lua_pop(state, 1);
+
+    lua_newtable(state);
+    register_func(state, imgst, "new", density_new_fn);
+    lua_setglobal(state, "Density");
+
+    return true;
+}
@@ -0,0 +1,537 @@
+#include "filters.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fsurface.h"
+
+#define FILTER_MAX_THREADS 16
+#define FILTER_PARALLEL_MIN 65536
+#define FILTER_BAND_MIN 16
+
+typedef float filter_f32x4 __attribute__((vector_size(4 * sizeof(float))));
+typedef int32_t filter_i32x4 __attribute__((vector_size(4 * sizeof(int32_t))));
+
+struct filter_shared
+{
+    const struct imc_filter_target *target;
+    const struct imc_filter_stage *stages;
+    int count;
+    int threads;
+
+    /* the image and a second buffer of the same size that neighbourhood stages write into */
+    filter_f32x4 *buffers[2];
+
+    /* one row per thread for the running column sums of the box blur */
+    filter_f32x4 *rows;
+
+    /* threads wait on ready until it is known how many of them could be started */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool started;
+    pthread_barrier_t barrier;
+};
+
+struct filter_job
+{
+    pthread_t thread;
+    struct filter_shared *shared;
+    int index;
+};
+
+static inline int filter_clamp(int value, int max)
+{
+    return value < 0 ? 0 : (value > max ? max : value);
+}
+
+static inline filter_f32x4 filter_positive(filter_f32x4 value)
+{
+    const filter_f32x4 zero = {};
+
+    return (filter_f32x4)((filter_i32x4)value & (value > zero));
+}
+
+static void filter_load(const struct imc_filter_target *target, filter_f32x4 *pixels, int y0, int y1)
+{
+    if (target->fsurface)
+    {
+        IMC_FSURF_read_rows(target->fsurface, y0, y1 - y0, (float *)(pixels + (size_t)y0 * target->width));
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        const uint32_t *row = (const uint32_t *)(target->argb + (size_t)y * target->stride);
+        filter_f32x4 *dst = pixels + (size_t)y * target->width;
+
+        for (int x = 0; x < target->width; x++)
+        {
+            const uint32_t pixel = row[x];
+            const filter_i32x4 channels = { (pixel >> 16) & 255, (pixel >> 8) & 255, pixel & 255, pixel >> 24 };
+
+            dst[x] = __builtin_convertvector(channels, filter_f32x4) * (1.0f / 255.0f);
+        }
+    }
+}
+
+static void filter_store(const struct imc_filter_target *target, const filter_f32x4 *pixels, int y0, int y1)
+{
+    if (target->fsurface)
+    {
+        IMC_FSURF_write_rows(target->fsurface, y0, y1 - y0, (const float *)(pixels + (size_t)y0 * target->width));
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        uint32_t *row = (uint32_t *)(target->argb + (size_t)y * target->stride);
+        const filter_f32x4 *src = pixels + (size_t)y * target->width;
+
+        for (int x = 0; x < target->width; x++)
+        {
+            filter_f32x4 value = filter_positive(src[x]);
+            const filter_f32x4 alpha = (filter_f32x4){} + (value[3] < 1.0f ? value[3] : 1.0f);
+            filter_i32x4 out;
+
+            value = (filter_f32x4)(((filter_i32x4)value & (value < alpha)) | ((filter_i32x4)alpha & (value >= alpha)));
+            out = __builtin_convertvector(value * 255.0f + 0.5f, filter_i32x4);
+
+            row[x] = (uint32_t)out[3] << 24 | (uint32_t)out[0] << 16 | (uint32_t)out[1] << 8 | (uint32_t)out[2];
+        }
+    }
+}
+
+static int filter_gaussian_weights(float sigma, float *weights)
+{
+    const int radius = sigma > 0 ? filter_clamp(ceilf(sigma * 3), IMC_FILTER_MAX_RADIUS) : 0;
+    float total = 0;
+
+    for (int k = -radius; k <= radius; k++)
+    {
+        weights[k + radius] = sigma > 0 ? expf(-(k * k) / (2 * sigma * sigma)) : 1;
+        total += weights[k + radius];
+    }
+
+    for (int k = 0; k <= radius * 2; k++)
+    {
+        weights[k] /= total;
+    }
+
+    return radius;
+}
+
+static void filter_gaussian_row(const filter_f32x4 *src, filter_f32x4 *dst, int width, const float *weights,
+                                int radius)
+{
+    for (int x = 0; x < width; x++)
+    {
+        filter_f32x4 sum = {};
+
+        if (x >= radius && x + radius < width)
+        {
+            for (int k = -radius; k <= radius; k++)
+            {
+                sum += weights[k + radius] * src[x + k];
+            }
+        }
+        else
+        {
+            for (int k = -radius; k <= radius; k++)
+            {
+                sum += weights[k + radius] * src[filter_clamp(x + k, width - 1)];
+            }
+        }
+
+        dst[x] = sum;
+    }
+}
+
+/* the vertical pass accumulates whole rows so the inner loop runs along memory */
+static void filter_gaussian_column(const filter_f32x4 *src, filter_f32x4 *dst, int width, int height, int y,
+                                   const float *weights, int radius)
+{
+    memset(dst, 0, (size_t)width * sizeof(filter_f32x4));
+
+    for (int k = -radius; k <= radius; k++)
+    {
+        const filter_f32x4 *row = src + (size_t)filter_clamp(y + k, height - 1) * width;
+        const float weight = weights[k + radius];
+
+        for (int x = 0; x < width; x++)
+        {
+            dst[x] += weight * row[x];
+        }
+    }
+}
+
+static void filter_box_row(const filter_f32x4 *src, filter_f32x4 *dst, int width, int radius)
+{
+    const float scale = 1.0f / (radius * 2 + 1);
+    filter_f32x4 sum = {};
+
+    for (int k = -radius; k <= radius; k++)
+    {
+        sum += src[filter_clamp(k, width - 1)];
+    }
+
+    for (int x = 0; x < width; x++)
+    {
+        dst[x] = sum * scale;
+        sum += src[filter_clamp(x + radius + 1, width - 1)] - src[filter_clamp(x - radius, width - 1)];
+    }
+}
+
+/* a running sum of rows slides down the band, sums holds one row */
+static void filter_box_columns(const filter_f32x4 *src, filter_f32x4 *dst, filter_f32x4 *sums, int width,
+                               int height, int y0, int y1, int radius)
+{
+    const float scale = 1.0f / (radius * 2 + 1);
+
+    memset(sums, 0, (size_t)width * sizeof(filter_f32x4));
+
+    for (int k = -radius; k <= radius; k++)
+    {
+        const filter_f32x4 *row = src + (size_t)filter_clamp(y0 + k, height - 1) * width;
+
+        for (int x = 0; x < width; x++)
+        {
+            sums[x] += row[x];
+        }
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        const filter_f32x4 *next = src + (size_t)filter_clamp(y + radius + 1, height - 1) * width;
+        const filter_f32x4 *last = src + (size_t)filter_clamp(y - radius, height - 1) * width;
+        filter_f32x4 *out = dst + (size_t)y * width;
+
+        for (int x = 0; x < width; x++)
+        {
+            out[x] = sums[x] * scale;
+            sums[x] += next[x] - last[x];
+        }
+    }
+}
+
+static void filter_convolve_row(const filter_f32x4 *src, filter_f32x4 *dst, int width, int height, int y,
+                                const struct imc_filter_stage *stage)
+{
+    const int half = stage->size / 2;
+    const int step = stage->scale > 1 ? stage->scale : 1;
+
+    memset(dst, 0, (size_t)width * sizeof(filter_f32x4));
+
+    for (int j = 0; j < stage->size; j++)
+    {
+        const filter_f32x4 *row = src + (size_t)filter_clamp(y + (j - half) * step, height - 1) * width;
+
+        for (int i = 0; i < stage->size; i++)
+        {
+            const float weight = stage->values[j * stage->size + i];
+
+            if (weight == 0)
+            {
+                continue;
+            }
+
+            for (int x = 0; x < width; x++)
+            {
+                dst[x] += weight * row[filter_clamp(x + (i - half) * step, width - 1)];
+            }
+        }
+    }
+
+    /* sharpening kernels overshoot below zero, which is not a color */
+    for (int x = 0; x < width; x++)
+    {
+        dst[x] = filter_positive(dst[x]);
+    }
+}
+
+static inline filter_f32x4 filter_unpremultiply(filter_f32x4 pixel)
+{
+    filter_f32x4 color = pixel / (pixel[3] > 0 ? pixel[3] : 1);
+
+    color[3] = pixel[3];
+
+    return color;
+}
+
+static inline filter_f32x4 filter_premultiply(filter_f32x4 color)
+{
+    filter_f32x4 pixel = color * color[3];
+
+    pixel[3] = color[3];
+
+    return pixel;
+}
+
+/* the matrix applies to straight colors, each column of it multiplies one input channel */
+static void filter_color_matrix_row(filter_f32x4 *pixels, int width, const float *m)
+{
+    const filter_f32x4 columns[5] =
+    {
+        { m[0], m[5], m[10], m[15] },
+        { m[1], m[6], m[11], m[16] },
+        { m[2], m[7], m[12], m[17] },
+        { m[3], m[8], m[13], m[18] },
+        { m[4], m[9], m[14], m[19] },
+    };
+
+    for (int x = 0; x < width; x++)
+    {
+        const filter_f32x4 color = filter_unpremultiply(pixels[x]);
+        filter_f32x4 out = columns[0] * color[0] + columns[1] * color[1] + columns[2] * color[2] +
+                           columns[3] * color[3] + columns[4];
+
+        out = filter_positive(out);
+        out[3] = out[3] < 1 ? out[3] : 1;
+
+        pixels[x] = filter_premultiply(out);
+    }
+}
+
+static void filter_threshold_row(filter_f32x4 *pixels, int width, float level)
+{
+    for (int x = 0; x < width; x++)
+    {
+        const filter_f32x4 color = filter_unpremultiply(pixels[x]);
+        const float luma = color[0] * 0.2126f + color[1] * 0.7152f + color[2] * 0.0722f;
+        const float value = luma >= level ? color[3] : 0;
+
+        pixels[x] = (filter_f32x4){ value, value, value, color[3] };
+    }
+}
+
+/* hashed from the pixel position so the grain does not depend on how rows were split between threads */
+static inline float filter_noise(uint32_t x, uint32_t y, uint32_t seed)
+{
+    uint32_t h = x * 0x8DA6B343u ^ y * 0xD8163841u ^ seed * 0xCB1AB31Fu;
+
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+
+    return h * (2.0f / 4294967295.0f) - 1.0f;
+}
+
+static void filter_grain_row(filter_f32x4 *pixels, int width, int y, float amount, uint32_t seed, int scale)
+{
+    for (int x = 0; x < width; x++)
+    {
+        const float delta = filter_noise(x / scale, y / scale, seed) * amount * pixels[x][3];
+
+        pixels[x] = filter_positive(pixels[x] + (filter_f32x4){ delta, delta, delta, 0 });
+    }
+}
+
+static void *filter_job_main(void *arg)
+{
+    struct filter_job *job = arg;
+    struct filter_shared *shared = job->shared;
+    const int width = shared->target->width;
+    const int height = shared->target->height;
+    filter_f32x4 *current = shared->buffers[0];
+    filter_f32x4 *other = shared->buffers[1];
+    float weights[IMC_FILTER_MAX_RADIUS * 2 + 1];
+    int y0;
+    int y1;
+
+    /* other rows are only read after everyone has loaded theirs */
+    bool dirty = true;
+
+    pthread_mutex_lock(&shared->lock);
+
+    while (!shared->started)
+    {
+        pthread_cond_wait(&shared->ready, &shared->lock);
+    }
+
+    pthread_mutex_unlock(&shared->lock);
+
+    y0 = (int)((long)height * job->index / shared->threads);
+    y1 = (int)((long)height * (job->index + 1) / shared->threads);
+
+    filter_load(shared->target, current, y0, y1);
+
+    /*
+     * pointwise stages run back to back on the band while it is in cache, neighbourhood stages read rows of
+     * other bands and wait for every thread before and after
+     */
+    for (int i = 0; i < shared->count; i++)
+    {
+        const struct imc_filter_stage *stage = &shared->stages[i];
+
+        switch (stage->kind)
+        {
+        case IMC_FILTER_GAUSSIAN:
+        {
+            const int radius = filter_gaussian_weights(stage->amount, weights);
+
+            for (int y = y0; y < y1; y++)
+            {
+                filter_gaussian_row(current + (size_t)y * width, other + (size_t)y * width, width, weights, radius);
+            }
+
+            pthread_barrier_wait(&shared->barrier);
+
+            for (int y = y0; y < y1; y++)
+            {
+                filter_gaussian_column(other, current + (size_t)y * width, width, height, y, weights, radius);
+            }
+
+            pthread_barrier_wait(&shared->barrier);
+            dirty = false;
+            break;
+        }
+        case IMC_FILTER_BOX:
+        {
+            const int radius = stage->amount > 0 ? fminf(stage->amount, IMC_FILTER_MAX_RADIUS) : 0;
+
+            for (int y = y0; y < y1; y++)
+            {
+                filter_box_row(current + (size_t)y * width, other + (size_t)y * width, width, radius);
+            }
+
+            pthread_barrier_wait(&shared->barrier);
+            filter_box_columns(other, current, shared->rows + (size_t)job->index * width, width, height, y0, y1,
+                               radius);
+            pthread_barrier_wait(&shared->barrier);
+            dirty = false;
+            break;
+        }
+        case IMC_FILTER_CONVOLVE:
+        {
+            filter_f32x4 *swap = current;
+
+            if (dirty)
+            {
+                pthread_barrier_wait(&shared->barrier);
+            }
+
+            for (int y = y0; y < y1; y++)
+            {
+                filter_convolve_row(current, other + (size_t)y * width, width, height, y, stage);
+            }
+
+            /* every thread swaps the same way, so they keep agreeing on which buffer is the image */
+            pthread_barrier_wait(&shared->barrier);
+            current = other;
+            other = swap;
+            dirty = false;
+            break;
+        }
+        case IMC_FILTER_COLOR_MATRIX:
+            for (int y = y0; y < y1; y++)
+            {
+                filter_color_matrix_row(current + (size_t)y * width, width, stage->values);
+            }
+
+            dirty = true;
+            break;
+        case IMC_FILTER_THRESHOLD:
+            for (int y = y0; y < y1; y++)
+            {
+                filter_threshold_row(current + (size_t)y * width, width, stage->amount);
+            }
+
+            dirty = true;
+            break;
+        case IMC_FILTER_GRAIN:
+            for (int y = y0; y < y1; y++)
+            {
+                filter_grain_row(current + (size_t)y * width, width, y, stage->amount, stage->seed,
+                                 stage->scale > 1 ? stage->scale : 1);
+            }
+
+            dirty = true;
+            break;
+        }
+    }
+
+    filter_store(shared->target, current, y0, y1);
+
+    return nullptr;
+}
+
+bool IMC_FILTER_apply(const struct imc_filter_target *target, const struct imc_filter_stage *stages, int count)
+{
+    const size_t num_pixels = (size_t)target->width * target->height;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct filter_job jobs[FILTER_MAX_THREADS];
+    struct filter_shared shared =
+    {
+        .target = target,
+        .stages = stages,
+        .count = count,
+    };
+    int threads = cpus > 0 ? cpus : 1;
+    int started = 1;
+    bool result = false;
+
+    if (count <= 0 || num_pixels == 0)
+    {
+        return true;
+    }
+
+    threads = threads > FILTER_MAX_THREADS ? FILTER_MAX_THREADS : threads;
+    threads = threads > target->height / FILTER_BAND_MIN ? target->height / FILTER_BAND_MIN : threads;
+    threads = num_pixels < FILTER_PARALLEL_MIN || threads < 1 ? 1 : threads;
+
+    shared.buffers[0] = aligned_alloc(16, num_pixels * sizeof(filter_f32x4));
+    shared.buffers[1] = aligned_alloc(16, num_pixels * sizeof(filter_f32x4));
+    shared.rows = aligned_alloc(16, (size_t)threads * target->width * sizeof(filter_f32x4));
+
+    if (!shared.buffers[0] || !shared.buffers[1] || !shared.rows)
+    {
+        goto failure;
+    }
+
+    pthread_mutex_init(&shared.lock, nullptr);
+    pthread_cond_init(&shared.ready, nullptr);
+
+    for (; started < threads; started++)
+    {
+        jobs[started] = (struct filter_job){ .shared = &shared, .index = started };
+
+        if (pthread_create(&jobs[started].thread, nullptr, filter_job_main, &jobs[started]) != 0)
+        {
+            break;
+        }
+    }
+
+    /* the bands are split between however many threads there are, this one included */
+    shared.threads = started;
+    pthread_barrier_init(&shared.barrier, nullptr, started);
+
+    pthread_mutex_lock(&shared.lock);
+    shared.started = true;
+    pthread_cond_broadcast(&shared.ready);
+    pthread_mutex_unlock(&shared.lock);
+
+    jobs[0] = (struct filter_job){ .shared = &shared, .index = 0 };
+    filter_job_main(&jobs[0]);
+
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(jobs[i].thread, nullptr);
+    }
+
+    pthread_barrier_destroy(&shared.barrier);
+    pthread_cond_destroy(&shared.ready);
+    pthread_mutex_destroy(&shared.lock);
+
+    result = true;
+
+failure:
+    free(shared.buffers[0]);
+    free(shared.buffers[1]);
+    free(shared.rows);
+
+    return result;
+}
@@ -0,0 +1,304 @@
+#include "fsurface.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef float fsurf_f32x4 __attribute__((vector_size(4 * sizeof(float))));
+typedef _Float16 fsurf_f16x4 __attribute__((vector_size(4 * sizeof(_Float16))));
+typedef int32_t fsurf_i32x4 __attribute__((vector_size(4 * sizeof(int32_t))));
+
+struct imc_fsurface
+{
+    int width;
+    int height;
+    enum imc_fsurface_format format;
+    void *data;
+};
+
+/* every pixel is one RGBA vector */
+static inline fsurf_f32x4 fsurf_load(const struct imc_fsurface *fs, size_t index)
+{
+    if (fs->format == IMC_FSURFACE_F16)
+    {
+        return __builtin_convertvector(((const fsurf_f16x4 *)fs->data)[index], fsurf_f32x4);
+    }
+
+    return ((const fsurf_f32x4 *)fs->data)[index];
+}
+
+static inline void fsurf_store(struct imc_fsurface *fs, size_t index, fsurf_f32x4 value)
+{
+    if (fs->format == IMC_FSURFACE_F16)
+    {
+        ((fsurf_f16x4 *)fs->data)[index] = __builtin_convertvector(value, fsurf_f16x4);
+        return;
+    }
+
+    ((fsurf_f32x4 *)fs->data)[index] = value;
+}
+
+static inline fsurf_f32x4 fsurf_premultiply(const plutovg_color_t *color)
+{
+    return (fsurf_f32x4){ color->r * color->a, color->g * color->a, color->b * color->a, color->a };
+}
+
+struct imc_fsurface *IMC_FSURF_create(int width, int height, enum imc_fsurface_format format)
+{
+    const size_t pixel_size = format == IMC_FSURFACE_F16 ? sizeof(fsurf_f16x4) : sizeof(fsurf_f32x4);
+    const size_t size = ((size_t)width * height * pixel_size + 15) & ~(size_t)15;
+    struct imc_fsurface *fs;
+
+    if (width <= 0 || height <= 0)
+    {
+        return nullptr;
+    }
+
+    fs = calloc(1, sizeof(struct imc_fsurface));
+
+    if (!fs)
+    {
+        return nullptr;
+    }
+
+    fs->width = width;
+    fs->height = height;
+    fs->format = format;
+    fs->data = aligned_alloc(16, size);
+
+    if (!fs->data)
+    {
+        free(fs);
+        return nullptr;
+    }
+
+    memset(fs->data, 0, size);
+
+    return fs;
+}
+
+void IMC_FSURF_clear(struct imc_fsurface *fs, const plutovg_color_t *color)
+{
+    const fsurf_f32x4 value = fsurf_premultiply(color);
+
+    for (size_t i = 0; i < (size_t)fs->width * fs->height; i++)
+    {
+        fsurf_store(fs, i, value);
+    }
+}
+
+/*
+ * every operator is src * (fa0 + fa1 * dst_alpha) + dst * (fb0 + fb1 * src_alpha), which matches how
+ * plutovg applies operators inside a span
+ */
+struct fsurf_operator
+{
+    float fa0;
+    float fa1;
+    float fb0;
+    float fb1;
+};
+
+static struct fsurf_operator fsurf_operator(plutovg_operator_t op)
+{
+    switch (op)
+    {
+        case PLUTOVG_OPERATOR_CLEAR:
+            break;
+        case PLUTOVG_OPERATOR_SRC:
+            return (struct fsurf_operator){ .fa0 = 1 };
+        case PLUTOVG_OPERATOR_DST:
+            return (struct fsurf_operator){ .fb0 = 1 };
+        case PLUTOVG_OPERATOR_SRC_OVER:
+            return (struct fsurf_operator){ .fa0 = 1, .fb0 = 1, .fb1 = -1 };
+        case PLUTOVG_OPERATOR_DST_OVER:
+            return (struct fsurf_operator){ .fa0 = 1, .fa1 = -1, .fb0 = 1 };
+        case PLUTOVG_OPERATOR_SRC_IN:
+            return (struct fsurf_operator){ .fa1 = 1 };
+        case PLUTOVG_OPERATOR_DST_IN:
+            return (struct fsurf_operator){ .fb1 = 1 };
+        case PLUTOVG_OPERATOR_SRC_OUT:
+            return (struct fsurf_operator){ .fa0 = 1, .fa1 = -1 };
+        case PLUTOVG_OPERATOR_DST_OUT:
+            return (struct fsurf_operator){ .fb0 = 1, .fb1 = -1 };
+        case PLUTOVG_OPERATOR_SRC_ATOP:
+            return (struct fsurf_operator){ .fa1 = 1, .fb0 = 1, .fb1 = -1 };
+        case PLUTOVG_OPERATOR_DST_ATOP:
+            return (struct fsurf_operator){ .fa0 = 1, .fa1 = -1, .fb1 = 1 };
+        case PLUTOVG_OPERATOR_XOR:
+            return (struct fsurf_operator){ .fa0 = 1, .fa1 = -1, .fb0 = 1, .fb1 = -1 };
+    }
+
+    return (struct fsurf_operator){};
+}
+
+/* the result is lerped towards by the coverage */
+void IMC_FSURF_composite(struct imc_fsurface *fs, unsigned char *mask, int stride, int x, int y, int width,
+                         int height, const plutovg_color_t *color, plutovg_operator_t op)
+{
+    const fsurf_f32x4 src = fsurf_premultiply(color);
+    const struct fsurf_operator f = fsurf_operator(op);
+    const float fb = f.fb0 + f.fb1 * src[3];
+    const int x0 = x < 0 ? 0 : x;
+    const int y0 = y < 0 ? 0 : y;
+    const int x1 = x + width > fs->width ? fs->width : x + width;
+    const int y1 = y + height > fs->height ? fs->height : y + height;
+
+    if (x0 >= x1)
+    {
+        return;
+    }
+
+    for (int row = y0; row < y1; row++)
+    {
+        uint32_t *coverage = (uint32_t *)(mask + (size_t)row * stride);
+        const size_t base = (size_t)row * fs->width;
+
+        for (int col = x0; col < x1; col++)
+        {
+            const uint32_t cov = coverage[col] >> 24;
+            fsurf_f32x4 dst;
+            fsurf_f32x4 res;
+
+            if (!cov)
+            {
+                continue;
+            }
+
+            dst = fsurf_load(fs, base + col);
+            res = src * (f.fa0 + f.fa1 * dst[3]) + dst * fb;
+            fsurf_store(fs, base + col, dst + (res - dst) * (cov * (1.0f / 255.0f)));
+        }
+
+        memset(coverage + x0, 0, (size_t)(x1 - x0) * sizeof(uint32_t));
+    }
+}
+
+/* pixels with nothing in them are skipped, which only changes the result for clear, src, src_in and dst_in */
+void IMC_FSURF_blend(struct imc_fsurface *fs, unsigned char *argb, int stride, int x, int y, int width, int height,
+                     plutovg_operator_t op)
+{
+    const struct fsurf_operator f = fsurf_operator(op);
+    const int x0 = x < 0 ? 0 : x;
+    const int y0 = y < 0 ? 0 : y;
+    const int x1 = x + width > fs->width ? fs->width : x + width;
+    const int y1 = y + height > fs->height ? fs->height : y + height;
+
+    if (x0 >= x1)
+    {
+        return;
+    }
+
+    for (int row = y0; row < y1; row++)
+    {
+        uint32_t *pixels = (uint32_t *)(argb + (size_t)row * stride);
+        const size_t base = (size_t)row * fs->width;
+
+        for (int col = x0; col < x1; col++)
+        {
+            const uint32_t pixel = pixels[col];
+            const fsurf_i32x4 channels = { (pixel >> 16) & 255, (pixel >> 8) & 255, pixel & 255, pixel >> 24 };
+            fsurf_f32x4 src;
+            fsurf_f32x4 dst;
+
+            if (!pixel)
+            {
+                continue;
+            }
+
+            src = __builtin_convertvector(channels, fsurf_f32x4) * (1.0f / 255.0f);
+            dst = fsurf_load(fs, base + col);
+            fsurf_store(fs, base + col, src * (f.fa0 + f.fa1 * dst[3]) + dst * (f.fb0 + f.fb1 * src[3]));
+        }
+
+        memset(pixels + x0, 0, (size_t)(x1 - x0) * sizeof(uint32_t));
+    }
+}
+
+void IMC_FSURF_plot(struct imc_fsurface *fs, int x, int y, const plutovg_color_t *color, float coverage)
+{
+    const size_t index = (size_t)y * fs->width + x;
+    const fsurf_f32x4 src = fsurf_premultiply(color) * coverage;
+
+    if (x < 0 || y < 0 || x >= fs->width || y >= fs->height)
+    {
+        return;
+    }
+
+    fsurf_store(fs, index, src + fsurf_load(fs, index) * (1 - src[3]));
+}
+
+void IMC_FSURF_resolve(const struct imc_fsurface *fs, unsigned char *argb, int stride)
+{
+    const fsurf_f32x4 zero = {};
+
+    for (int y = 0; y < fs->height; y++)
+    {
+        uint32_t *row = (uint32_t *)(argb + (size_t)y * stride);
+
+        for (int x = 0; x < fs->width; x++)
+        {
+            fsurf_f32x4 value = fsurf_load(fs, (size_t)y * fs->width + x);
+            fsurf_f32x4 alpha;
+            fsurf_i32x4 out;
+
+            value = (fsurf_f32x4)((fsurf_i32x4)value & (value > zero));
+            alpha = (fsurf_f32x4){} + (value[3] < 1.0f ? value[3] : 1.0f);
+
+            /* keep the color channels at or below alpha so the result stays valid premultiplied data */
+            value = (fsurf_f32x4)(((fsurf_i32x4)value & (value < alpha)) | ((fsurf_i32x4)alpha & (value >= alpha)));
+            out = __builtin_convertvector(value * 255.0f + 0.5f, fsurf_i32x4);
+
+            row[x] = (uint32_t)out[3] << 24 | (uint32_t)out[0] << 16 | (uint32_t)out[1] << 8 | (uint32_t)out[2];
+        }
+    }
+}
+
+void IMC_FSURF_import(struct imc_fsurface *fs, const unsigned char *argb, int stride)
+{
+    for (int y = 0; y < fs->height; y++)
+    {
+        const uint32_t *row = (const uint32_t *)(argb + (size_t)y * stride);
+
+        for (int x = 0; x < fs->width; x++)
+        {
+            const uint32_t pixel = row[x];
+            const fsurf_i32x4 channels = { (pixel >> 16) & 255, (pixel >> 8) & 255, pixel & 255, pixel >> 24 };
+
+            fsurf_store(fs, (size_t)y * fs->width + x, __builtin_convertvector(channels, fsurf_f32x4) * (1.0f / 255.0f));
+        }
+    }
+}
+
+void IMC_FSURF_read_rows(const struct imc_fsurface *fs, int y, int rows, float *rgba)
+{
+    const size_t begin = (size_t)y * fs->width;
+    const size_t end = begin + (size_t)rows * fs->width;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        ((fsurf_f32x4 *)rgba)[i - begin] = fsurf_load(fs, i);
+    }
+}
+
+void IMC_FSURF_write_rows(struct imc_fsurface *fs, int y, int rows, const float *rgba)
+{
+    const size_t begin = (size_t)y * fs->width;
+    const size_t end = begin + (size_t)rows * fs->width;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        fsurf_store(fs, i, ((const fsurf_f32x4 *)rgba)[i - begin]);
+    }
+}
+
+void IMC_FSURF_free(struct imc_fsurface *fs)
+{
+    if (!fs)
+    {
+        return;
+    }
+
+    free(fs->data);
+    free(fs);
+}
@@ -0,0 +1,981 @@
+#include "geometry.h"
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+
+#include "luabuf.h"
+#include "profile.h"
+
+#define GEOM_NONE -1
+#define GEOM_SNAP_RANGE 67108864.0
+#define GEOM_EDGE_STACK 1024
+#define GEOM_MAX_POINTS 50000000
+
+__extension__ typedef __int128 geom_i128;
+
+/*
+ * sweep-hull Delaunay triangulation with Lawson flips, triangle t owns halfedges 3t, 3t+1 and 3t+2, and
+ * halfedge e runs from triangles[e] to the next vertex of its triangle, halfedges[e] being its twin
+ */
+struct geom_delaunay
+{
+    size_t num_points;
+    int64_t *snapped;
+    int32_t *triangles;
+    int32_t *halfedges;
+    size_t num_triangles;
+
+    int32_t *hull_prev;
+    int32_t *hull_next;
+    int32_t *hull_tri;
+    int32_t *hull_hash;
+    int32_t hash_size;
+    int32_t hull_start;
+    double cx;
+    double cy;
+};
+
+struct geom_rng
+{
+    uint64_t state;
+};
+
+struct geom_dist
+{
+    double dist;
+    int32_t id;
+};
+
+static inline int32_t geom_next_edge(int32_t e)
+{
+    return e % 3 == 2 ? e - 2 : e + 1;
+}
+
+/* > 0 when c is left of a -> b, exact on the snapped grid */
+static inline int64_t geom_orient(const struct geom_delaunay *d, int32_t a, int32_t b, int32_t c)
+{
+    const int64_t *pa = &d->snapped[a * 2];
+    const int64_t *pb = &d->snapped[b * 2];
+    const int64_t *pc = &d->snapped[c * 2];
+
+    return (pb[0] - pa[0]) * (pc[1] - pa[1]) - (pb[1] - pa[1]) * (pc[0] - pa[0]);
+}
+
+/* true when p is strictly inside the circumcircle of the counter-clockwise triangle a, b, c */
+static inline bool geom_incircle(const struct geom_delaunay *d, int32_t a, int32_t b, int32_t c, int32_t p)
+{
+    const int64_t *pp = &d->snapped[p * 2];
+    const int64_t adx = d->snapped[a * 2] - pp[0];
+    const int64_t ady = d->snapped[a * 2 + 1] - pp[1];
+    const int64_t bdx = d->snapped[b * 2] - pp[0];
+    const int64_t bdy = d->snapped[b * 2 + 1] - pp[1];
+    const int64_t cdx = d->snapped[c * 2] - pp[0];
+    const int64_t cdy = d->snapped[c * 2 + 1] - pp[1];
+
+    return (geom_i128)(adx * adx + ady * ady) * (bdx * cdy - cdx * bdy)
+           + (geom_i128)(bdx * bdx + bdy * bdy) * (cdx * ady - adx * cdy)
+           + (geom_i128)(cdx * cdx + cdy * cdy) * (adx * bdy - bdx * ady) > 0;
+}
+
+static inline double geom_sx(const struct geom_delaunay *d, int32_t i)
+{
+    return d->snapped[i * 2];
+}
+
+static inline double geom_sy(const struct geom_delaunay *d, int32_t i)
+{
+    return d->snapped[i * 2 + 1];
+}
+
+static double geom_circumradius2(const struct geom_delaunay *d, int32_t a, int32_t b, int32_t c)
+{
+    const double dx = geom_sx(d, b) - geom_sx(d, a);
+    const double dy = geom_sy(d, b) - geom_sy(d, a);
+    const double ex = geom_sx(d, c) - geom_sx(d, a);
+    const double ey = geom_sy(d, c) - geom_sy(d, a);
+    const double bl = dx * dx + dy * dy;
+    const double cl = ex * ex + ey * ey;
+    const double det = dx * ey - dy * ex;
+    const double x = (ey * bl - dy * cl) * 0.5 / det;
+    const double y = (dx * cl - ex * bl) * 0.5 / det;
+
+    return det == 0 ? DBL_MAX : x * x + y * y;
+}
+
+static void geom_circumcenter(double ax, double ay, double bx, double by, double cx, double cy, double *x, double *y)
+{
+    const double dx = bx - ax;
+    const double dy = by - ay;
+    const double ex = cx - ax;
+    const double ey = cy - ay;
+    const double bl = dx * dx + dy * dy;
+    const double cl = ex * ex + ey * ey;
+    const double det = dx * ey - dy * ex;
+
+    *x = ax + (ey * bl - dy * cl) * 0.5 / det;
+    *y = ay + (dx * cl - ex * bl) * 0.5 / det;
+}
+
+static int32_t geom_hash_key(const struct geom_delaunay *d, int32_t i)
+{
+    const double dx = geom_sx(d, i) - d->cx;
+    const double dy = geom_sy(d, i) - d->cy;
+    const double p = dx / (fabs(dx) + fabs(dy) + DBL_MIN);
+    const double angle = (dy > 0 ? 3 - p : 1 + p) / 4;
+
+    return (int32_t)floor(angle * d->hash_size) % d->hash_size;
+}
+
+static inline void geom_link(struct geom_delaunay *d, int32_t a, int32_t b)
+{
+    d->halfedges[a] = b;
+
+    if (b != GEOM_NONE)
+    {
+        d->halfedges[b] = a;
+    }
+}
+
+static int32_t geom_add_triangle(struct geom_delaunay *d, int32_t i0, int32_t i1, int32_t i2, int32_t a, int32_t b,
+                                 int32_t c)
+{
+    const int32_t t = d->num_triangles * 3;
+
+    d->triangles[t] = i0;
+    d->triangles[t + 1] = i1;
+    d->triangles[t + 2] = i2;
+
+    geom_link(d, t, a);
+    geom_link(d, t + 1, b);
+    geom_link(d, t + 2, c);
+
+    d->num_triangles++;
+
+    return t;
+}
+
+/* flips until the edges around the new point are locally Delaunay, returns the hull-facing edge */
+static int32_t geom_legalize(struct geom_delaunay *d, int32_t a)
+{
+    int32_t stack[GEOM_EDGE_STACK];
+    int top = 0;
+    int32_t ar = 0;
+
+    while (true)
+    {
+        const int32_t b = d->halfedges[a];
+        const int32_t a0 = a - a % 3;
+        int32_t b0;
+        int32_t al;
+        int32_t bl;
+        int32_t br;
+        int32_t hbl;
+
+        ar = a0 + (a + 2) % 3;
+
+        if (b == GEOM_NONE)
+        {
+            if (top == 0)
+            {
+                break;
+            }
+
+            a = stack[--top];
+            continue;
+        }
+
+        b0 = b - b % 3;
+        al = a0 + (a + 1) % 3;
+        bl = b0 + (b + 2) % 3;
+
+        if (!geom_incircle(d, d->triangles[ar], d->triangles[a], d->triangles[al], d->triangles[bl]))
+        {
+            if (top == 0)
+            {
+                break;
+            }
+
+            a = stack[--top];
+            continue;
+        }
+
+        d->triangles[a] = d->triangles[bl];
+        d->triangles[b] = d->triangles[ar];
+
+        hbl = d->halfedges[bl];
+
+        /* the flipped edge was on the hull, point the hull at its new halfedge */
+        if (hbl == GEOM_NONE)
+        {
+            int32_t e = d->hull_start;
+
+            do
+            {
+                if (d->hull_tri[e] == bl)
+                {
+                    d->hull_tri[e] = a;
+                    break;
+                }
+
+                e = d->hull_prev[e];
+            }
+            while (e != d->hull_start);
+        }
+
+        geom_link(d, a, hbl);
+        geom_link(d, b, d->halfedges[ar]);
+        geom_link(d, ar, bl);
+
+        br = b0 + (b + 1) % 3;
+
+        if (top < GEOM_EDGE_STACK)
+        {
+            stack[top++] = br;
+        }
+    }
+
+    return ar;
+}
+
+static int geom_dist_compare(const void *a, const void *b)
+{
+    const double x = ((const struct geom_dist *)a)->dist;
+    const double y = ((const struct geom_dist *)b)->dist;
+
+    return (x > y) - (x < y);
+}
+
+static void geom_delaunay_free(struct geom_delaunay *d)
+{
+    free(d->snapped);
+    free(d->triangles);
+    free(d->halfedges);
+    free(d->hull_prev);
+    free(d->hull_next);
+    free(d->hull_tri);
+    free(d->hull_hash);
+    *d = (struct geom_delaunay){};
+}
+
+/*
+ * points are snapped to a 2^26 grid over their bounds so the orientation and incircle tests are exact,
+ * duplicates and points that do not extend the hull are left out of the triangulation
+ */
+static bool geom_delaunay(struct geom_delaunay *d, const double *points, size_t num_points)
+{
+    double min_x = DBL_MAX;
+    double min_y = DBL_MAX;
+    double max_x = -DBL_MAX;
+    double max_y = -DBL_MAX;
+    double scale;
+    double best = DBL_MAX;
+    int32_t i0 = GEOM_NONE;
+    int32_t i1 = GEOM_NONE;
+    int32_t i2 = GEOM_NONE;
+    struct geom_dist *order = nullptr;
+    const size_t max_triangles = num_points < 3 ? 1 : 2 * num_points - 5;
+
+    *d = (struct geom_delaunay){ .num_points = num_points, .hull_start = GEOM_NONE };
+
+    d->snapped = malloc(num_points * 2 * sizeof(int64_t) + 1);
+    d->triangles = malloc(max_triangles * 3 * sizeof(int32_t));
+    d->halfedges = malloc(max_triangles * 3 * sizeof(int32_t));
+
+    if (!d->snapped || !d->triangles || !d->halfedges)
+    {
+        goto failure;
+    }
+
+    for (size_t i = 0; i < num_points; i++)
+    {
+        min_x = points[i * 2] < min_x ? points[i * 2] : min_x;
+        min_y = points[i * 2 + 1] < min_y ? points[i * 2 + 1] : min_y;
+        max_x = points[i * 2] > max_x ? points[i * 2] : max_x;
+        max_y = points[i * 2 + 1] > max_y ? points[i * 2 + 1] : max_y;
+    }
+
+    scale = fmax(max_x - min_x, max_y - min_y);
+    scale = scale > 0 && isfinite(scale) ? GEOM_SNAP_RANGE / scale : 1;
+
+    for (size_t i = 0; i < num_points; i++)
+    {
+        d->snapped[i * 2] = llround((points[i * 2] - min_x) * scale);
+        d->snapped[i * 2 + 1] = llround((points[i * 2 + 1] - min_y) * scale);
+    }
+
+    if (num_points < 3)
+    {
+        return true;
+    }
+
+    /* seed with the point closest to the center, its nearest neighbour and the smallest circle through both */
+    for (size_t i = 0; i < num_points; i++)
+    {
+        const double dx = geom_sx(d, i) - GEOM_SNAP_RANGE / 2;
+        const double dy = geom_sy(d, i) - GEOM_SNAP_RANGE / 2;
+
+        if (dx * dx + dy * dy < best)
+        {
+            best = dx * dx + dy * dy;
+            i0 = i;
+        }
+    }
+
+    best = DBL_MAX;
+
+    for (size_t i = 0; i < num_points; i++)
+    {
+        const double dx = geom_sx(d, i) - geom_sx(d, i0);
+        const double dy = geom_sy(d, i) - geom_sy(d, i0);
+
+        if ((dx != 0 || dy != 0) && dx * dx + dy * dy < best)
+        {
+            best = dx * dx + dy * dy;
+            i1 = i;
+        }
+    }
+
+    best = DBL_MAX;
+
+    for (size_t i = 0; i1 != GEOM_NONE && i < num_points; i++)
+    {
+        const double radius = geom_orient(d, i0, i1, i) != 0 ? geom_circumradius2(d, i0, i1, i) : DBL_MAX;
+
+        if (radius < best)
+        {
+            best = radius;
+            i2 = i;
+        }
+    }
+
+    /* everything is collinear */
+    if (i2 == GEOM_NONE)
+    {
+        return true;
+    }
+
+    if (geom_orient(d, i0, i1, i2) < 0)
+    {
+        const int32_t tmp = i1;
+
+        i1 = i2;
+        i2 = tmp;
+    }
+
+    geom_circumcenter(geom_sx(d, i0), geom_sy(d, i0), geom_sx(d, i1), geom_sy(d, i1), geom_sx(d, i2), geom_sy(d, i2),
+                      &d->cx, &d->cy);
+
+    d->hash_size = ceil(sqrt(num_points));
+    d->hull_prev = malloc(num_points * sizeof(int32_t));
+    d->hull_next = malloc(num_points * sizeof(int32_t));
+    d->hull_tri = malloc(num_points * sizeof(int32_t));
+    d->hull_hash = malloc(d->hash_size * sizeof(int32_t));
+    order = malloc(num_points * sizeof(struct geom_dist));
+
+    if (!d->hull_prev || !d->hull_next || !d->hull_tri || !d->hull_hash || !order)
+    {
+        goto failure;
+    }
+
+    for (size_t i = 0; i < num_points; i++)
+    {
+        const double dx = geom_sx(d, i) - d->cx;
+        const double dy = geom_sy(d, i) - d->cy;
+
+        order[i] = (struct geom_dist){ .dist = dx * dx + dy * dy, .id = i };
+    }
+
+    qsort(order, num_points, sizeof(struct geom_dist), geom_dist_compare);
+
+    for (int32_t i = 0; i < d->hash_size; i++)
+    {
+        d->hull_hash[i] = GEOM_NONE;
+    }
+
+    d->hull_start = i0;
+
+    d->hull_next[i0] = d->hull_prev[i2] = i1;
+    d->hull_next[i1] = d->hull_prev[i0] = i2;
+    d->hull_next[i2] = d->hull_prev[i1] = i0;
+
+    d->hull_tri[i0] = 0;
+    d->hull_tri[i1] = 1;
+    d->hull_tri[i2] = 2;
+
+    d->hull_hash[geom_hash_key(d, i0)] = i0;
+    d->hull_hash[geom_hash_key(d, i1)] = i1;
+    d->hull_hash[geom_hash_key(d, i2)] = i2;
+
+    geom_add_triangle(d, i0, i1, i2, GEOM_NONE, GEOM_NONE, GEOM_NONE);
+
+    for (size_t k = 0; k < num_points; k++)
+    {
+        const int32_t i = order[k].id;
+        const int32_t key = geom_hash_key(d, i);
+        int32_t start = 0;
+        int32_t e;
+        int32_t n;
+        int32_t q;
+        int32_t t;
+
+        if (i == i0 || i == i1 || i == i2)
+        {
+            continue;
+        }
+
+        if (k > 0 && d->snapped[i * 2] == d->snapped[order[k - 1].id * 2]
+            && d->snapped[i * 2 + 1] == d->snapped[order[k - 1].id * 2 + 1])
+        {
+            continue;
+        }
+
+        for (int32_t j = 0; j < d->hash_size; j++)
+        {
+            start = d->hull_hash[(key + j) % d->hash_size];
+
+            if (start != GEOM_NONE && start != d->hull_next[start])
+            {
+                break;
+            }
+        }
+
+        /* the hull is counter-clockwise, so edges with the point on their right face it */
+        start = d->hull_prev[start];
+        e = start;
+
+        while (geom_orient(d, e, d->hull_next[e], i) >= 0)
+        {
+            e = d->hull_next[e];
+
+            if (e == start)
+            {
+                e = GEOM_NONE;
+                break;
+            }
+        }
+
+        if (e == GEOM_NONE)
+        {
+            continue;
+        }
+
+        t = geom_add_triangle(d, e, i, d->hull_next[e], GEOM_NONE, GEOM_NONE, d->hull_tri[e]);
+
+        d->hull_tri[i] = geom_legalize(d, t + 2);
+        d->hull_tri[e] = t;
+
+        n = d->hull_next[e];
+
+        while (q = d->hull_next[n], geom_orient(d, n, q, i) < 0)
+        {
+            t = geom_add_triangle(d, n, i, q, d->hull_tri[i], GEOM_NONE, d->hull_tri[n]);
+            d->hull_tri[i] = geom_legalize(d, t + 2);
+            d->hull_next[n] = n;
+            n = q;
+        }
+
+        if (e == start)
+        {
+            while (q = d->hull_prev[e], geom_orient(d, q, e, i) < 0)
+            {
+                t = geom_add_triangle(d, q, i, e, GEOM_NONE, d->hull_tri[e], d->hull_tri[q]);
+                geom_legalize(d, t + 2);
+                d->hull_tri[q] = t;
+                d->hull_next[e] = e;
+                e = q;
+            }
+        }
+
+        d->hull_start = d->hull_prev[i] = e;
+        d->hull_next[e] = d->hull_prev[n] = i;
+        d->hull_next[i] = n;
+
+        d->hull_hash[key] = i;
+        d->hull_hash[geom_hash_key(d, e)] = e;
+    }
+
+    free(order);
+
+    return true;
+failure:
+    free(order);
+    geom_delaunay_free(d);
+    return false;
+}
+
+static inline uint64_t geom_rng_next(struct geom_rng *rng)
+{
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return z ^ (z >> 31);
+}
+
+static inline double geom_rng_double(struct geom_rng *rng)
+{
+    return (geom_rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+/* Bridson's sampling over a background grid of r / sqrt(2) cells, each holding at most one point */
+static double *geom_poisson(double width, double height, double radius, uint64_t seed, int attempts, size_t *count)
+{
+    const double cell = radius / M_SQRT2;
+    const int32_t cols = ceil(width / cell);
+    const int32_t rows = ceil(height / cell);
+    struct geom_rng rng = { .state = seed };
+    int32_t *grid = malloc((size_t)cols * rows * sizeof(int32_t));
+    int32_t *active = malloc((size_t)cols * rows * sizeof(int32_t));
+    double *points = malloc((size_t)cols * rows * 2 * sizeof(double));
+    size_t num_active = 0;
+
+    *count = 0;
+
+    if (!grid || !active || !points)
+    {
+        goto failure;
+    }
+
+    for (size_t i = 0; i < (size_t)cols * rows; i++)
+    {
+        grid[i] = GEOM_NONE;
+    }
+
+    points[0] = geom_rng_double(&rng) * width;
+    points[1] = geom_rng_double(&rng) * height;
+    grid[(int32_t)(points[1] / cell) * cols + (int32_t)(points[0] / cell)] = 0;
+    active[num_active++] = 0;
+    *count = 1;
+
+    while (num_active > 0)
+    {
+        const size_t slot = geom_rng_next(&rng) % num_active;
+        const double *origin = &points[active[slot] * 2];
+        bool found = false;
+
+        for (int a = 0; a < attempts && !found; a++)
+        {
+            /* uniform over the area of the annulus between r and 2r */
+            const double angle = geom_rng_double(&rng) * 2 * M_PI;
+            const double dist = radius * sqrt(1 + geom_rng_double(&rng) * 3);
+            const double x = origin[0] + cos(angle) * dist;
+            const double y = origin[1] + sin(angle) * dist;
+            int32_t cx;
+            int32_t cy;
+            bool free_spot = true;
+
+            if (x < 0 || x >= width || y < 0 || y >= height)
+            {
+                continue;
+            }
+
+            cx = x / cell;
+            cy = y / cell;
+
+            for (int32_t gy = cy - 2 < 0 ? 0 : cy - 2; free_spot && gy <= cy + 2 && gy < rows; gy++)
+            {
+                for (int32_t gx = cx - 2 < 0 ? 0 : cx - 2; gx <= cx + 2 && gx < cols; gx++)
+                {
+                    const int32_t other = grid[gy * cols + gx];
+                    double dx;
+                    double dy;
+
+                    if (other == GEOM_NONE)
+                    {
+                        continue;
+                    }
+
+                    dx = points[other * 2] - x;
+                    dy = points[other * 2 + 1] - y;
+
+                    if (dx * dx + dy * dy < radius * radius)
+                    {
+                        free_spot = false;
+                        break;
+                    }
+                }
+            }
+
+            if (!free_spot)
+            {
+                continue;
+            }
+
+            points[*count * 2] = x;
+            points[*count * 2 + 1] = y;
+            grid[cy * cols + cx] = *count;
+            active[num_active++] = *count;
+            (*count)++;
+            found = true;
+        }
+
+        if (!found)
+        {
+            active[slot] = active[--num_active];
+        }
+    }
+
+    free(grid);
+    free(active);
+
+    return points;
+failure:
+    free(grid);
+    free(active);
+    free(points);
+    return nullptr;
+}
+
+/* keeps the part of the polygon on the side of the bisector of a -> b nearer to a */
+static size_t geom_clip(const double *poly, size_t count, double ax, double ay, double bx, double by, double *out)
+{
+    const double nx = bx - ax;
+    const double ny = by - ay;
+    const double offset = (nx * (ax + bx) + ny * (ay + by)) / 2;
+    size_t res = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const double *p = &poly[i * 2];
+        const double *q = &poly[((i + 1) % count) * 2];
+        const double dp = nx * p[0] + ny * p[1] - offset;
+        const double dq = nx * q[0] + ny * q[1] - offset;
+
+        if (dp <= 0)
+        {
+            out[res * 2] = p[0];
+            out[res * 2 + 1] = p[1];
+            res++;
+        }
+
+        if ((dp < 0 && dq > 0) || (dp > 0 && dq < 0))
+        {
+            const double t = dp / (dp - dq);
+
+            out[res * 2] = p[0] + (q[0] - p[0]) * t;
+            out[res * 2 + 1] = p[1] + (q[1] - p[1]) * t;
+            res++;
+        }
+    }
+
+    return res;
+}
+
+/* records come as a table or FFI double array, tables are copied into owned */
+static const double *geom_points_arg(lua_State *L, int idx, lua_Integer count, double **owned)
+{
+    double *array;
+    const size_t length = IMC_LBUF_check(L, idx, &array);
+
+    *owned = nullptr;
+    luaL_argcheck(L, (size_t)count <= length / 2, idx, "buffer holds fewer points than count");
+
+    if (array)
+    {
+        return array;
+    }
+
+    *owned = malloc((count * 2 + 1) * sizeof(double));
+
+    if (!*owned)
+    {
+        luaL_error(L, "failed to allocate %f points", (lua_Number)count);
+        return nullptr;
+    }
+
+    for (lua_Integer i = 0; i < count * 2; i++)
+    {
+        lua_rawgeti(L, idx, i + 1);
+        (*owned)[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return *owned;
+}
+
+static void geom_push_flat(lua_State *L, const double *values, size_t count)
+{
+    lua_createtable(L, count, 0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        lua_pushnumber(L, values[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/* Geometry.poisson(width, height, radius[, seed[, attempts]]), returns {x1, y1, x2, y2, ...} and the count */
+static int geom_poisson_fn(lua_State *L)
+{
+    const double width = luaL_checknumber(L, 1);
+    const double height = luaL_checknumber(L, 2);
+    const double radius = luaL_checknumber(L, 3);
+    const lua_Number seed = luaL_optnumber(L, 4, 0);
+    const int attempts = luaL_optint(L, 5, 30);
+    const uint64_t begin = IMC_PROF_begin();
+    size_t count;
+    double *points;
+
+    luaL_argcheck(L, width > 0, 1, "width must be positive");
+    luaL_argcheck(L, height > 0, 2, "height must be positive");
+    luaL_argcheck(L, radius > 0 && (width / radius) * (height / radius) < GEOM_MAX_POINTS, 3,
+                  "radius is too small for the area");
+    luaL_argcheck(L, attempts > 0, 5, "attempts must be positive");
+
+    points = geom_poisson(width, height, radius, (uint64_t)(int64_t)seed, attempts, &count);
+
+    if (!points)
+    {
+        luaL_error(L, "failed to allocate poisson samples");
+        return 0;
+    }
+
+    geom_push_flat(L, points, count * 2);
+    lua_pushinteger(L, count);
+    free(points);
+
+    IMC_PROF_end("Geometry.poisson", begin);
+
+    return 2;
+}
+
+/* Geometry.delaunay(points, n), returns 1-based point indices, three per triangle, and the triangle count */
+static int geom_delaunay_fn(lua_State *L)
+{
+    const lua_Integer count = luaL_checkinteger(L, 2);
+    const uint64_t begin = IMC_PROF_begin();
+    struct geom_delaunay d;
+    const double *points;
+    double *owned;
+
+    luaL_argcheck(L, count >= 0 && count < GEOM_MAX_POINTS, 2, "bad point count");
+    points = geom_points_arg(L, 1, count, &owned);
+
+    if (!geom_delaunay(&d, points, count))
+    {
+        free(owned);
+        luaL_error(L, "failed to allocate triangulation");
+        return 0;
+    }
+
+    lua_createtable(L, d.num_triangles * 3, 0);
+
+    for (size_t i = 0; i < d.num_triangles * 3; i++)
+    {
+        lua_pushinteger(L, d.triangles[i] + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushinteger(L, d.num_triangles);
+
+    geom_delaunay_free(&d);
+    free(owned);
+
+    IMC_PROF_end("Geometry.delaunay", begin);
+
+    return 2;
+}
+
+/*
+ * Geometry.voronoi(points, n[, x, y, width, height]), returns one flat convex polygon per point clipped to
+ * the box, which defaults to the bounds of the points, points left out of the triangulation get an empty cell
+ */
+static int geom_voronoi_fn(lua_State *L)
+{
+    const lua_Integer count = luaL_checkinteger(L, 2);
+    const uint64_t begin = IMC_PROF_begin();
+    struct geom_delaunay d = {};
+    const double *points;
+    double *owned;
+    size_t *offsets = nullptr;
+    int32_t *neighbours = nullptr;
+    int32_t *fill = nullptr;
+    bool *used = nullptr;
+    double *poly = nullptr;
+    double *scratch = nullptr;
+    double box[4];
+    size_t max_poly;
+
+    luaL_argcheck(L, count >= 0 && count < GEOM_MAX_POINTS, 2, "bad point count");
+    points = geom_points_arg(L, 1, count, &owned);
+
+    box[0] = DBL_MAX;
+    box[1] = DBL_MAX;
+    box[2] = -DBL_MAX;
+    box[3] = -DBL_MAX;
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        box[0] = fmin(box[0], points[i * 2]);
+        box[1] = fmin(box[1], points[i * 2 + 1]);
+        box[2] = fmax(box[2], points[i * 2]);
+        box[3] = fmax(box[3], points[i * 2 + 1]);
+    }
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        box[0] = luaL_checknumber(L, 3);
+        box[1] = luaL_checknumber(L, 4);
+        box[2] = box[0] + luaL_checknumber(L, 5);
+        box[3] = box[1] + luaL_checknumber(L, 6);
+    }
+
+    if (!geom_delaunay(&d, points, count))
+    {
+        goto failure;
+    }
+
+    /* neighbours in CSR form, or everything when there is no triangulation to take them from */
+    offsets = calloc(count + 1, sizeof(size_t));
+    fill = calloc(count + 1, sizeof(int32_t));
+    used = calloc(count + 1, sizeof(bool));
+
+    if (!offsets || !fill || !used)
+    {
+        goto failure;
+    }
+
+    for (size_t e = 0; e < d.num_triangles * 3; e++)
+    {
+        if (d.halfedges[e] == GEOM_NONE || (int32_t)e < d.halfedges[e])
+        {
+            offsets[d.triangles[e]]++;
+            offsets[d.triangles[geom_next_edge(e)]]++;
+        }
+
+        used[d.triangles[e]] = true;
+    }
+
+    max_poly = 4;
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        max_poly = offsets[i] + 4 > max_poly ? offsets[i] + 4 : max_poly;
+    }
+
+    for (lua_Integer i = 0, sum = 0; i <= count; i++)
+    {
+        const size_t degree = offsets[i];
+
+        offsets[i] = sum;
+        sum += degree;
+    }
+
+    neighbours = malloc((offsets[count] + 1) * sizeof(int32_t));
+    poly = malloc((d.num_triangles ? max_poly : (size_t)count + 4) * 2 * sizeof(double));
+    scratch = malloc((d.num_triangles ? max_poly : (size_t)count + 4) * 2 * sizeof(double));
+
+    if (!neighbours || !poly || !scratch)
+    {
+        goto failure;
+    }
+
+    for (size_t e = 0; e < d.num_triangles * 3; e++)
+    {
+        if (d.halfedges[e] == GEOM_NONE || (int32_t)e < d.halfedges[e])
+        {
+            const int32_t a = d.triangles[e];
+            const int32_t b = d.triangles[geom_next_edge(e)];
+
+            neighbours[offsets[a] + fill[a]++] = b;
+            neighbours[offsets[b] + fill[b]++] = a;
+        }
+    }
+
+    lua_createtable(L, count, 0);
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        const double x = points[i * 2];
+        const double y = points[i * 2 + 1];
+        size_t size = 4;
+        const double corners[8] = { box[0], box[1], box[2], box[1], box[2], box[3], box[0], box[3] };
+
+        memcpy(poly, corners, sizeof(corners));
+
+        if (d.num_triangles && !used[i])
+        {
+            size = 0;
+        }
+
+        for (size_t n = 0; d.num_triangles && size && n < offsets[i + 1] - offsets[i]; n++)
+        {
+            const int32_t other = neighbours[offsets[i] + n];
+            double *tmp = poly;
+
+            size = geom_clip(poly, size, x, y, points[other * 2], points[other * 2 + 1], scratch);
+            poly = scratch;
+            scratch = tmp;
+        }
+
+        for (lua_Integer other = 0; !d.num_triangles && size && other < count; other++)
+        {
+            double *tmp = poly;
+
+            if (other == i || (points[other * 2] == x && points[other * 2 + 1] == y))
+            {
+                continue;
+            }
+
+            size = geom_clip(poly, size, x, y, points[other * 2], points[other * 2 + 1], scratch);
+            poly = scratch;
+            scratch = tmp;
+        }
+
+        geom_push_flat(L, poly, size * 2);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    geom_delaunay_free(&d);
+    free(offsets);
+    free(fill);
+    free(used);
+    free(neighbours);
+    free(poly);
+    free(scratch);
+    free(owned);
+
+    IMC_PROF_end("Geometry.voronoi", begin);
+
+    return 1;
+failure:
+    geom_delaunay_free(&d);
+    free(offsets);
+    free(fill);
+    free(used);
+    free(neighbours);
+    free(poly);
+    free(scratch);
+    free(owned);
+    luaL_error(L, "failed to allocate voronoi cells");
+    return 0;
+}
+
+bool IMC_GEOMETRY_load(lua_State *state)
+{
+    if (!state)
+    {
+        return false;
+    }
+
+    lua_newtable(state);
+
+    lua_pushcfunction(state, geom_poisson_fn);
+    lua_setfield(state, -2, "poisson");
+
+    lua_pushcfunction(state, geom_delaunay_fn);
+    lua_setfield(state, -2, "delaunay");
+
+    lua_pushcfunction(state, geom_voronoi_fn);
+    lua_setfield(state, -2, "voronoi");
+
+    lua_setglobal(state, "Geometry");
+
+    return true;
+}
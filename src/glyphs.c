@@ -0,0 +1,297 @@
+#include "glyphs.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GLYPH_ATLAS_SIZE 1024
+#define GLYPH_MAX_SIZE 256
+#define GLYPH_MIN_SLOTS 256
+
+struct glyph_slot
+{
+    bool used;
+    const plutovg_font_face_t *face;
+    float size;
+    plutovg_codepoint_t codepoint;
+    int bucket;
+    struct imc_glyph glyph;
+};
+
+struct imc_glyph_cache
+{
+    unsigned char *atlas;
+
+    /* glyphs are packed left to right on shelves as tall as the tallest glyph placed on them */
+    int shelf_x;
+    int shelf_y;
+    int shelf_height;
+
+    struct glyph_slot *slots;
+    size_t capacity;
+    size_t count;
+
+    plutovg_path_t *path;
+};
+
+static size_t glyph_hash(const plutovg_font_face_t *face, float size, plutovg_codepoint_t codepoint, int bucket)
+{
+    uint32_t size_bits;
+    uint64_t h = (uintptr_t)face;
+
+    memcpy(&size_bits, &size, sizeof(uint32_t));
+
+    h = (h ^ size_bits) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ codepoint) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (uint64_t)bucket) * 0x9E3779B97F4A7C15ull;
+
+    return h ^ (h >> 32);
+}
+
+static struct glyph_slot *glyph_find(struct imc_glyph_cache *cache, const plutovg_font_face_t *face, float size,
+                                     plutovg_codepoint_t codepoint, int bucket)
+{
+    size_t i = glyph_hash(face, size, codepoint, bucket) & (cache->capacity - 1);
+
+    while (cache->slots[i].used)
+    {
+        const struct glyph_slot *slot = &cache->slots[i];
+
+        if (slot->face == face && slot->size == size && slot->codepoint == codepoint && slot->bucket == bucket)
+        {
+            break;
+        }
+
+        i = (i + 1) & (cache->capacity - 1);
+    }
+
+    return &cache->slots[i];
+}
+
+static bool glyph_grow(struct imc_glyph_cache *cache)
+{
+    struct glyph_slot *old = cache->slots;
+    const size_t old_capacity = cache->capacity;
+    struct glyph_slot *slots = calloc(old_capacity * 2, sizeof(struct glyph_slot));
+
+    if (!slots)
+    {
+        return false;
+    }
+
+    cache->slots = slots;
+    cache->capacity = old_capacity * 2;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].used)
+        {
+            *glyph_find(cache, old[i].face, old[i].size, old[i].codepoint, old[i].bucket) = old[i];
+        }
+    }
+
+    free(old);
+
+    return true;
+}
+
+/* a full atlas starts over, text that is still in use gets rasterized again on its next lookup */
+static void glyph_reset(struct imc_glyph_cache *cache)
+{
+    memset(cache->slots, 0, cache->capacity * sizeof(struct glyph_slot));
+    cache->count = 0;
+    cache->shelf_x = 0;
+    cache->shelf_y = 0;
+    cache->shelf_height = 0;
+}
+
+static bool glyph_place(struct imc_glyph_cache *cache, int width, int height, int *x, int *y)
+{
+    if (cache->shelf_x + width > GLYPH_ATLAS_SIZE)
+    {
+        cache->shelf_x = 0;
+        cache->shelf_y += cache->shelf_height;
+        cache->shelf_height = 0;
+    }
+
+    if (cache->shelf_y + height > GLYPH_ATLAS_SIZE)
+    {
+        return false;
+    }
+
+    *x = cache->shelf_x;
+    *y = cache->shelf_y;
+
+    cache->shelf_x += width;
+    cache->shelf_height = height > cache->shelf_height ? height : cache->shelf_height;
+
+    return true;
+}
+
+static bool glyph_rasterize(struct imc_glyph_cache *cache, plutovg_font_face_t *face, float size,
+                            plutovg_codepoint_t codepoint, int bucket, struct imc_glyph *glyph)
+{
+    const plutovg_color_t clear = PLUTOVG_MAKE_COLOR(0, 0, 0, 0);
+    const plutovg_color_t white = PLUTOVG_MAKE_COLOR(1, 1, 1, 1);
+    const float offset = (bucket + 0.50) / IMC_GLYPH_SUBPIXEL;
+    plutovg_surface_t *surface = nullptr;
+    plutovg_canvas_t *canvas = nullptr;
+    plutovg_rect_t extents;
+    const unsigned char *data;
+    int stride;
+
+    plutovg_path_reset(cache->path);
+    glyph->advance = plutovg_font_face_get_glyph_path(face, size, offset, 0, codepoint, cache->path);
+    plutovg_path_extents(cache->path, &extents, true);
+
+    /* blank glyphs only move the pen */
+    if (extents.w <= 0 || extents.h <= 0)
+    {
+        *glyph = (struct imc_glyph){ .advance = glyph->advance };
+        return true;
+    }
+
+    glyph->left = floorf(extents.x) - 1;
+    glyph->top = floorf(extents.y) - 1;
+    glyph->width = ceilf(extents.x + extents.w) + 1 - glyph->left;
+    glyph->height = ceilf(extents.y + extents.h) + 1 - glyph->top;
+
+    if (glyph->width > GLYPH_MAX_SIZE || glyph->height > GLYPH_MAX_SIZE)
+    {
+        return false;
+    }
+
+    if (!glyph_place(cache, glyph->width, glyph->height, &glyph->x, &glyph->y))
+    {
+        glyph_reset(cache);
+        glyph_place(cache, glyph->width, glyph->height, &glyph->x, &glyph->y);
+    }
+
+    surface = plutovg_surface_create(glyph->width, glyph->height);
+    canvas = surface ? plutovg_canvas_create(surface) : nullptr;
+
+    if (!surface || !canvas)
+    {
+        goto failure;
+    }
+
+    plutovg_surface_clear(surface, &clear);
+    plutovg_canvas_set_color(canvas, &white);
+    plutovg_canvas_translate(canvas, -glyph->left, -glyph->top);
+    plutovg_canvas_fill_path(canvas, cache->path);
+
+    data = plutovg_surface_get_data(surface);
+    stride = plutovg_surface_get_stride(surface);
+
+    for (int y = 0; y < glyph->height; y++)
+    {
+        const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+        unsigned char *dst = cache->atlas + (size_t)(glyph->y + y) * GLYPH_ATLAS_SIZE + glyph->x;
+
+        for (int x = 0; x < glyph->width; x++)
+        {
+            dst[x] = row[x] >> 24;
+        }
+    }
+
+    plutovg_canvas_destroy(canvas);
+    plutovg_surface_destroy(surface);
+
+    return true;
+
+failure:
+    plutovg_canvas_destroy(canvas);
+    plutovg_surface_destroy(surface);
+
+    return false;
+}
+
+struct imc_glyph_cache *IMC_GLYPH_create()
+{
+    struct imc_glyph_cache *cache = calloc(1, sizeof(struct imc_glyph_cache));
+
+    if (!cache)
+    {
+        return nullptr;
+    }
+
+    cache->atlas = calloc((size_t)GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 1);
+    cache->slots = calloc(GLYPH_MIN_SLOTS, sizeof(struct glyph_slot));
+    cache->capacity = GLYPH_MIN_SLOTS;
+    cache->path = plutovg_path_create();
+
+    if (!cache->atlas || !cache->slots || !cache->path)
+    {
+        goto failure;
+    }
+
+    return cache;
+
+failure:
+    IMC_GLYPH_free(cache);
+
+    return nullptr;
+}
+
+const struct imc_glyph *IMC_GLYPH_lookup(struct imc_glyph_cache *cache, plutovg_font_face_t *face, float size,
+                                         plutovg_codepoint_t codepoint, int bucket)
+{
+    struct glyph_slot *slot = glyph_find(cache, face, size, codepoint, bucket);
+    struct imc_glyph glyph;
+    const size_t count = cache->count;
+
+    if (slot->used)
+    {
+        return &slot->glyph;
+    }
+
+    if (!glyph_rasterize(cache, face, size, codepoint, bucket, &glyph))
+    {
+        return nullptr;
+    }
+
+    /* rasterizing may have emptied the table, and the table is kept under half full */
+    if (cache->count != count || (cache->count + 1) * 2 > cache->capacity)
+    {
+        if ((cache->count + 1) * 2 > cache->capacity && !glyph_grow(cache))
+        {
+            return nullptr;
+        }
+
+        slot = glyph_find(cache, face, size, codepoint, bucket);
+    }
+
+    *slot = (struct glyph_slot)
+    {
+        .used = true,
+        .face = face,
+        .size = size,
+        .codepoint = codepoint,
+        .bucket = bucket,
+        .glyph = glyph,
+    };
+    cache->count++;
+
+    return &slot->glyph;
+}
+
+const unsigned char *IMC_GLYPH_atlas(const struct imc_glyph_cache *cache, int *stride)
+{
+    *stride = GLYPH_ATLAS_SIZE;
+
+    return cache->atlas;
+}
+
+void IMC_GLYPH_free(struct imc_glyph_cache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+
+    plutovg_path_destroy(cache->path);
+    free(cache->atlas);
+    free(cache->slots);
+    free(cache);
+}
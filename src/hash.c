@@ -0,0 +1,29 @@
+#include "hash.h"
+
+#include <stdio.h>
+
+bool IMC_hash_file(const char *filename, uint64_t *hash)
+{
+    size_t read;
+    unsigned char buf[16384];
+    FILE *in = fopen(filename, "rb");
+
+    if (!in)
+    {
+        return false;
+    }
+
+    while ((read = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        *hash = IMC_hash(*hash, buf, read);
+    }
+
+    if (ferror(in))
+    {
+        fclose(in);
+        return false;
+    }
+
+    fclose(in);
+    return true;
+}
@@ -1,12 +1,23 @@
 #include "imagelib.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <lauxlib.h>
 #include <plutovg.h>
 #include <stb_image_write.h>
 
 #include "xpm.h"
+#include "assets.h"
+#include "fsurface.h"
+#include "filters.h"
+#include "glyphs.h"
+#include "langvm.h"
+#include "luabuf.h"
+#include "surfpool.h"
+#include "profile.h"
 
 #define SET_LUA_ERR(MSG) \
 luaL_error(L, MSG); \
@@ -29,12 +40,104 @@ if (!img_init_check(NAME))                                                  \
 
 #define CONSTRAIN(VAR, MIN, MAX) (VAR < MIN ? MIN : (VAR > MAX ? MAX : VAR))
 
+#define IMG_STAMP_SUBPIXEL 4
+#define IMG_STAMP_CACHE_SIZE 8
+#define IMG_STAMP_MAX_SIZE 1024
+#define IMG_TEXTURE_METATABLE "imc.texture"
+#define IMG_LAYER_METATABLE "imc.layer"
+#define IMG_LAYER_DEPTH 16
+#define IMG_POOL_LIMIT ((size_t)256 * 1024 * 1024)
+#define IMG_FILTER_MAX_STAGES 16
+
+/* process-wide like the stb encoder settings IMC_IMG_set_fast_encoding changes with it */
+static int img_jpg_quality = 100;
+
+typedef float img_f32x4 __attribute__((vector_size(4 * sizeof(float))));
+typedef int32_t img_i32x4 __attribute__((vector_size(4 * sizeof(int32_t))));
+
 enum color_mode
 {
     COLOR_MODE_RGB,
     COLOR_MODE_HSB,
 };
 
+enum surface_precision
+{
+    SURFACE_PRECISION_U8,
+    SURFACE_PRECISION_F16,
+    SURFACE_PRECISION_F32,
+};
+
+enum img_filter
+{
+    IMG_FILTER_BILINEAR,
+    IMG_FILTER_NEAREST,
+};
+
+/* Image.load handle, the grid cells are what Image.sprites draws */
+struct img_texture
+{
+    struct imc_asset *asset;
+    int cell_width;
+    int cell_height;
+};
+
+/* what drawing goes into, swapped out while a layer is being drawn into */
+struct img_target
+{
+    plutovg_surface_t *surface;
+    plutovg_canvas_t *canvas;
+    struct imc_fsurface *fsurface;
+    plutovg_surface_t *scratch;
+    bool resolved;
+    bool exported;
+    int width;
+    int height;
+};
+
+/* width and height are what scripts see, the surface is scaled like the image */
+struct img_layer
+{
+    struct imc_image_lib_state *ims;
+    plutovg_surface_t *surface;
+    plutovg_canvas_t *canvas;
+    int width;
+    int height;
+    bool active;
+};
+
+enum img_stamp_kind
+{
+    IMG_STAMP_CIRCLE,
+    IMG_STAMP_ELLIPSE,
+    IMG_STAMP_RECT,
+    IMG_STAMP_SQUARE,
+    IMG_STAMP_TRIANGLE,
+    IMG_STAMP_QUAD,
+};
+
+/* everything the coverage of a stamp depends on */
+struct img_stamp_key
+{
+    enum img_stamp_kind kind;
+    float params[8];
+    bool stroke;
+    float stroke_weight;
+    plutovg_line_cap_t stroke_cap;
+};
+
+/* one coverage mask per sub-pixel offset bucket, x and y place the mask relative to the instance pixel */
+struct img_stamp_entry
+{
+    struct img_stamp_key key;
+    bool used;
+    int x;
+    int y;
+    int width;
+    int height;
+    unsigned char *masks[IMG_STAMP_SUBPIXEL * IMG_STAMP_SUBPIXEL];
+};
+
 struct imc_image_lib_state
 {
     bool fill;
@@ -51,16 +154,106 @@ struct imc_image_lib_state
 
     plutovg_surface_t *surface;
     plutovg_canvas_t *canvas;
+
+    /*
+     * surfaces are scale times the size scripts see and their canvases scale everything to match, exports
+     * are box filtered back down from above 1 and come out smaller below it, width and height are the size
+     * scripts see of whatever is being drawn into
+     */
+    float scale;
+    int width;
+    int height;
+
+    /* draft renders skip Image.filter, aliased ones plot and blit without smoothing */
+    bool draft;
+    bool aliased;
+
+    /*
+     * with a float working surface the canvas draws coverage masks into scratch, which get blended into
+     * fsurface, and surface only holds the 8-bit result for export
+     */
+    struct imc_fsurface *fsurface;
+    plutovg_surface_t *scratch;
+    bool resolved;
+    bool exported;
     plutovg_font_face_cache_t *font_cache;
+    plutovg_font_face_t *font_face;
+    float font_size;
+    struct imc_glyph_cache *glyphs;
+
+    enum img_filter blit_filter;
+
+    struct imc_surface_pool *pool;
+    struct img_layer *layers[IMG_LAYER_DEPTH];
+    struct img_target saved_targets[IMG_LAYER_DEPTH];
+    int layer_depth;
+
+    struct img_stamp_entry stamps[IMG_STAMP_CACHE_SIZE];
+    int stamp_next;
+
+    const char *current_call;
 };
 
-static bool img_init(struct imc_image_lib_state *ims, int width, int height)
+static void img_layer_pop(struct imc_image_lib_state *ims)
+{
+    struct img_layer *layer = ims->layers[--ims->layer_depth];
+    const struct img_target *saved = &ims->saved_targets[ims->layer_depth];
+
+    layer->active = false;
+
+    ims->surface = saved->surface;
+    ims->canvas = saved->canvas;
+    ims->fsurface = saved->fsurface;
+    ims->scratch = saved->scratch;
+    ims->resolved = saved->resolved;
+    ims->exported = saved->exported;
+    ims->width = saved->width;
+    ims->height = saved->height;
+}
+
+/* a size in image pixels as surface pixels */
+static inline int img_scaled(const struct imc_image_lib_state *ims, int size)
+{
+    const int scaled = lroundf(size * ims->scale);
+
+    return scaled > 0 ? scaled : 1;
+}
+
+/* whole surface pixels per image pixel, 1 unless supersampling */
+static inline int img_supersample(const struct imc_image_lib_state *ims)
+{
+    return ims->scale > 1 ? (int)ims->scale : 1;
+}
+
+/* anything that replaces or exports the image works on the image itself, not a layer left open */
+static void img_layer_unwind(struct imc_image_lib_state *ims)
+{
+    while (ims->layer_depth > 0)
+    {
+        img_layer_pop(ims);
+    }
+}
+
+static bool img_init(struct imc_image_lib_state *ims, int width, int height, enum surface_precision precision)
 {
     const plutovg_color_t default_bg = PLUTOVG_MAKE_COLOR(0, 0, 0, 0);
 
+    img_layer_unwind(ims);
+
+    ims->width = width;
+    ims->height = height;
+    width = img_scaled(ims, width);
+    height = img_scaled(ims, height);
+
     plutovg_canvas_destroy(ims->canvas);
     ims->canvas = nullptr;
 
+    IMC_FSURF_free(ims->fsurface);
+    ims->fsurface = nullptr;
+
+    plutovg_surface_destroy(ims->scratch);
+    ims->scratch = nullptr;
+
     if (ims->surface && plutovg_surface_get_width(ims->surface) != width)
     {
         plutovg_surface_destroy(ims->surface);
@@ -84,21 +277,42 @@ static bool img_init(struct imc_image_lib_state *ims, int width, int height)
 
     plutovg_surface_clear(ims->surface, &default_bg);
 
-    ims->canvas = plutovg_canvas_create(ims->surface);
+    if (precision != SURFACE_PRECISION_U8)
+    {
+        ims->fsurface = IMC_FSURF_create(width, height,
+                                         precision == SURFACE_PRECISION_F16 ? IMC_FSURFACE_F16 : IMC_FSURFACE_F32);
+        ims->scratch = plutovg_surface_create(width, height);
+
+        if (!ims->fsurface || !ims->scratch)
+        {
+            return false;
+        }
+
+        plutovg_surface_clear(ims->scratch, &default_bg);
+    }
+
+    ims->resolved = true;
+    ims->exported = false;
+    ims->canvas = plutovg_canvas_create(ims->scratch ? ims->scratch : ims->surface);
 
     if (!ims->canvas)
     {
         return false;
     }
 
-    ims->font_cache = plutovg_font_face_cache_create();
+    plutovg_canvas_scale(ims->canvas, ims->scale, ims->scale);
 
     if (!ims->font_cache)
     {
-        return false;
-    }
+        ims->font_cache = plutovg_font_face_cache_create();
 
-    plutovg_font_face_cache_load_sys(ims->font_cache);
+        if (!ims->font_cache)
+        {
+            return false;
+        }
+
+        plutovg_font_face_cache_load_sys(ims->font_cache);
+    }
 
     plutovg_canvas_set_font_face_cache(ims->canvas, ims->font_cache);
 
@@ -109,7 +323,7 @@ static bool img_init(struct imc_image_lib_state *ims, int width, int height)
 
 static inline bool img_init_default(struct imc_image_lib_state *ims)
 {
-    return img_init(ims, 512, 512);
+    return img_init(ims, 512, 512, SURFACE_PRECISION_U8);
 }
 
 static inline bool img_init_check(struct imc_image_lib_state *ims)
@@ -121,10 +335,19 @@ static int img_create(lua_State *L)
 {
     GET_IMG_STATE(L, ims);
 
+    const char *list[] =
+    {
+        [SURFACE_PRECISION_U8]  = "u8",
+        [SURFACE_PRECISION_F16] = "f16",
+        [SURFACE_PRECISION_F32] = "f32",
+        nullptr,
+    };
+
     lua_Integer width = luaL_optint(L, 1, 512);
     lua_Integer height = luaL_optint(L, 2, 512);
+    enum surface_precision precision = luaL_checkoption(L, 3, "u8", list);
 
-    if (!img_init(ims, width, height))
+    if (!img_init(ims, width, height, precision))
     {
         SET_LUA_ERR("failed to create image");
     }
@@ -132,12 +355,167 @@ static int img_create(lua_State *L)
     return 0;
 }
 
+static void img_resolve(struct imc_image_lib_state *ims)
+{
+    uint64_t begin;
+
+    if (!ims->fsurface || ims->resolved || ims->exported)
+    {
+        return;
+    }
+
+    begin = IMC_PROF_begin();
+    IMC_FSURF_resolve(ims->fsurface, plutovg_surface_get_data(ims->surface), plutovg_surface_get_stride(ims->surface));
+    IMC_PROF_end("convert.float_to_argb", begin);
+
+    ims->resolved = true;
+}
+
+/* picks up whatever was written into the 8-bit surface since it was handed out */
+static void img_touch_float(struct imc_image_lib_state *ims)
+{
+    if (ims->exported)
+    {
+        IMC_FSURF_import(ims->fsurface, plutovg_surface_get_data(ims->surface),
+                         plutovg_surface_get_stride(ims->surface));
+        ims->exported = false;
+    }
+
+    ims->resolved = false;
+}
+
+/*
+ * with a float surface the path is drawn opaque into scratch and its coverage blended in with the real
+ * alpha, so layering many faint shapes does not round at every step
+ */
+static void img_paint(struct imc_image_lib_state *ims, const plutovg_color_t *color, bool stroke)
+{
+    plutovg_color_t opaque = *color;
+    plutovg_operator_t op;
+    plutovg_rect_t extents;
+    uint64_t begin;
+    float pad;
+
+    if (!ims->fsurface)
+    {
+        if (stroke)
+        {
+            plutovg_canvas_stroke(ims->canvas);
+        }
+        else
+        {
+            plutovg_canvas_fill(ims->canvas);
+        }
+
+        return;
+    }
+
+    /* miter joins reach at most half the default limit of 10 line widths out, in device pixels */
+    pad = 2.00;
+
+    if (stroke)
+    {
+        plutovg_matrix_t matrix;
+
+        plutovg_canvas_get_matrix(ims->canvas, &matrix);
+        pad += ims->stroke_weight * 5.00 *
+               sqrtf(matrix.a * matrix.a + matrix.b * matrix.b + matrix.c * matrix.c + matrix.d * matrix.d);
+    }
+
+    plutovg_canvas_fill_extents(ims->canvas, &extents);
+
+    opaque.a = 1.00;
+    op = plutovg_canvas_get_operator(ims->canvas);
+    plutovg_canvas_set_operator(ims->canvas, PLUTOVG_OPERATOR_SRC_OVER);
+    plutovg_canvas_set_color(ims->canvas, &opaque);
+
+    if (stroke)
+    {
+        plutovg_canvas_stroke(ims->canvas);
+    }
+    else
+    {
+        plutovg_canvas_fill(ims->canvas);
+    }
+
+    plutovg_canvas_set_operator(ims->canvas, op);
+
+    img_touch_float(ims);
+
+    begin = IMC_PROF_begin();
+    IMC_FSURF_composite(ims->fsurface, plutovg_surface_get_data(ims->scratch), plutovg_surface_get_stride(ims->scratch),
+                        floorf(extents.x - pad), floorf(extents.y - pad), ceilf(extents.w + pad * 2) + 1,
+                        ceilf(extents.h + pad * 2) + 1, color, op);
+    IMC_PROF_end("composite.float", begin);
+}
+
+struct img_plot_ctx
+{
+    struct imc_image_lib_state *ims;
+    uint32_t *data;
+    int width;
+    int height;
+    int stride;
+    float color[4];
+};
+
+static inline void img_plot(const struct img_plot_ctx *ctx, int x, int y, float coverage)
+{
+    uint32_t *pixel;
+    uint32_t dst;
+    float keep;
+
+    if (ctx->ims->aliased)
+    {
+        coverage = coverage >= 0.50f ? 1 : 0;
+    }
+
+    if (x < 0 || y < 0 || x >= ctx->width || y >= ctx->height || coverage <= 0)
+    {
+        return;
+    }
+
+    if (ctx->ims->fsurface)
+    {
+        IMC_FSURF_plot(ctx->ims->fsurface, x, y, &ctx->ims->stroke_color, coverage);
+        return;
+    }
+
+    pixel = &ctx->data[(size_t)y * ctx->stride + x];
+    dst = *pixel;
+    keep = 1 - ctx->color[3] * coverage;
+
+    *pixel = (uint32_t)(ctx->color[3] * coverage * 255 + (dst >> 24) * keep + 0.5f) << 24
+             | (uint32_t)(ctx->color[0] * coverage * 255 + ((dst >> 16) & 255) * keep + 0.5f) << 16
+             | (uint32_t)(ctx->color[1] * coverage * 255 + ((dst >> 8) & 255) * keep + 0.5f) << 8
+             | (uint32_t)(ctx->color[2] * coverage * 255 + (dst & 255) * keep + 0.5f);
+}
+
+static inline struct img_plot_ctx img_plot_ctx_make(struct imc_image_lib_state *ims, const plutovg_color_t *color)
+{
+    return (struct img_plot_ctx)
+    {
+        .ims = ims,
+        .data = (uint32_t *)plutovg_surface_get_data(ims->surface),
+        .width = plutovg_surface_get_width(ims->surface),
+        .height = plutovg_surface_get_height(ims->surface),
+        .stride = plutovg_surface_get_stride(ims->surface) / 4,
+        .color = { color->r * color->a, color->g * color->a, color->b * color->a, color->a },
+    };
+}
+
+/* the scale of a matrix that only scales uniformly and translates, zero for anything else */
+static inline float img_matrix_scale(const plutovg_matrix_t *matrix)
+{
+    return matrix->b == 0 && matrix->c == 0 && matrix->a == matrix->d && matrix->a > 0 ? matrix->a : 0;
+}
+
 static int img_get_width(lua_State *L)
 {
     GET_IMG_STATE(L, ims);
     INIT_IMG_STATE(ims);
 
-    lua_pushinteger(L, plutovg_surface_get_width(ims->surface));
+    lua_pushinteger(L, ims->width);
 
     return 1;
 }
@@ -147,7 +525,7 @@ static int img_get_height(lua_State *L)
     GET_IMG_STATE(L, ims);
     INIT_IMG_STATE(ims);
 
-    lua_pushinteger(L, plutovg_surface_get_height(ims->surface));
+    lua_pushinteger(L, ims->height);
 
     return 1;
 }
@@ -228,7 +606,16 @@ static int img_background(lua_State *L)
         plutovg_color_init_hsla(&color, h, s, l, a);
     }
 
-    plutovg_surface_clear(ims->surface, &color);
+    if (ims->fsurface)
+    {
+        IMC_FSURF_clear(ims->fsurface, &color);
+        ims->exported = false;
+        ims->resolved = false;
+    }
+    else
+    {
+        plutovg_surface_clear(ims->surface, &color);
+    }
 
     return 0;
 }
@@ -403,7 +790,7 @@ static int img_circle(lua_State *L)
     {
         plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
         plutovg_canvas_circle(ims->canvas, x, y, r);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -412,7 +799,7 @@ static int img_circle(lua_State *L)
         plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
         plutovg_canvas_circle(ims->canvas, x, y, r);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -432,7 +819,7 @@ static int img_ellipse(lua_State *L)
     {
         plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
         plutovg_canvas_ellipse(ims->canvas, x, y, w, h);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -441,7 +828,7 @@ static int img_ellipse(lua_State *L)
         plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
         plutovg_canvas_ellipse(ims->canvas, x, y, w, h);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -464,7 +851,7 @@ static int img_line(lua_State *L)
         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
         plutovg_canvas_move_to(ims->canvas, x1, y1);
         plutovg_canvas_line_to(ims->canvas, x2, y2);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -483,7 +870,7 @@ static int img_point(lua_State *L)
         plutovg_canvas_set_color(ims->canvas, &ims->stroke_color);
         plutovg_canvas_set_line_width(ims->canvas, 1.00);
         plutovg_canvas_rect(ims->canvas, x, y, 1.00, 1.00);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -511,7 +898,7 @@ static int img_quad(lua_State *L)
         plutovg_canvas_line_to(ims->canvas, x3, y3);
         plutovg_canvas_line_to(ims->canvas, x4, y4);
         plutovg_canvas_line_to(ims->canvas, x1, y1);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -524,7 +911,7 @@ static int img_quad(lua_State *L)
         plutovg_canvas_line_to(ims->canvas, x3, y3);
         plutovg_canvas_line_to(ims->canvas, x4, y4);
         plutovg_canvas_line_to(ims->canvas, x1, y1);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -558,7 +945,7 @@ static int img_rect(lua_State *L)
     {
         plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
         plutovg_canvas_round_rect(ims->canvas, a, b, c, d, rx, ry);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -567,7 +954,7 @@ static int img_rect(lua_State *L)
         plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
         plutovg_canvas_round_rect(ims->canvas, a, b, c, d, rx, ry);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -586,7 +973,7 @@ static int img_square(lua_State *L)
     {
         plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
         plutovg_canvas_rect(ims->canvas, x, y, s, s);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -595,7 +982,7 @@ static int img_square(lua_State *L)
         plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
         plutovg_canvas_rect(ims->canvas, x, y, s, s);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
@@ -620,7 +1007,7 @@ static int img_triangle(lua_State *L)
         plutovg_canvas_line_to(ims->canvas, x2, y2);
         plutovg_canvas_line_to(ims->canvas, x3, y3);
         plutovg_canvas_line_to(ims->canvas, x1, y1);
-        plutovg_canvas_fill(ims->canvas);
+        img_paint(ims, &ims->fill_color, false);
     }
 
     if (ims->stroke)
@@ -632,148 +1019,1891 @@ static int img_triangle(lua_State *L)
         plutovg_canvas_line_to(ims->canvas, x2, y2);
         plutovg_canvas_line_to(ims->canvas, x3, y3);
         plutovg_canvas_line_to(ims->canvas, x1, y1);
-        plutovg_canvas_stroke(ims->canvas);
+        img_paint(ims, &ims->stroke_color, true);
     }
 
     return 0;
 }
 
-// static int img_text(lua_State *L)
-// {
-//     GET_IMG_STATE(L, ims);
-//     INIT_IMG_STATE(ims);
+/* the same paths as the matching Image functions, placed at x, y */
+static void img_stamp_path(plutovg_canvas_t *canvas, const struct img_stamp_key *key, float x, float y)
+{
+    const float *p = key->params;
 
-//     const char *text = luaL_checkstring(L, 1);
-//     float x = luaL_checknumber(L, 2);
-//     float y = luaL_checknumber(L, 3);
+    switch (key->kind)
+    {
+        case IMG_STAMP_CIRCLE:
+            plutovg_canvas_circle(canvas, x, y, p[0]);
+            break;
+        case IMG_STAMP_ELLIPSE:
+            plutovg_canvas_ellipse(canvas, x, y, p[0] / 2.00, p[1] / 2.00);
+            break;
+        case IMG_STAMP_RECT:
+            plutovg_canvas_round_rect(canvas, x, y, p[0], p[1], p[2], p[3]);
+            break;
+        case IMG_STAMP_SQUARE:
+            plutovg_canvas_rect(canvas, x, y, p[0], p[0]);
+            break;
+        case IMG_STAMP_TRIANGLE:
+        case IMG_STAMP_QUAD:
+            plutovg_canvas_move_to(canvas, x + p[0], y + p[1]);
+
+            for (int i = 2; i < (key->kind == IMG_STAMP_QUAD ? 8 : 6); i += 2)
+            {
+                plutovg_canvas_line_to(canvas, x + p[i], y + p[i + 1]);
+            }
+
+            plutovg_canvas_line_to(canvas, x + p[0], y + p[1]);
+            break;
+    }
+}
 
-//     // plutovg_canvas_select_font_face(ims->canvas, "FiraCode Nerd Font", false, false);
-//     plutovg_canvas_select_font_face(ims->canvas, "Georgia", false, false);
-//     plutovg_canvas_set_font_size(ims->canvas, 24);
+static void img_stamp_bounds(const struct img_stamp_key *key, float *box)
+{
+    const float *p = key->params;
 
-//     if (ims->fill)
-//     {
-//         plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
-//         plutovg_canvas_add_text(ims->canvas, text, -1, PLUTOVG_TEXT_ENCODING_UTF8, x, y);
-//         plutovg_canvas_fill(ims->canvas);
-//     }
+    switch (key->kind)
+    {
+        case IMG_STAMP_CIRCLE:
+            box[0] = box[1] = -fabsf(p[0]);
+            box[2] = box[3] = fabsf(p[0]);
+            break;
+        case IMG_STAMP_ELLIPSE:
+            box[0] = -fabsf(p[0]) / 2.00;
+            box[1] = -fabsf(p[1]) / 2.00;
+            box[2] = -box[0];
+            box[3] = -box[1];
+            break;
+        case IMG_STAMP_RECT:
+        case IMG_STAMP_SQUARE:
+        {
+            const float w = p[0];
+            const float h = key->kind == IMG_STAMP_SQUARE ? p[0] : p[1];
+
+            box[0] = fminf(w, 0);
+            box[1] = fminf(h, 0);
+            box[2] = fmaxf(w, 0);
+            box[3] = fmaxf(h, 0);
+            break;
+        }
+        case IMG_STAMP_TRIANGLE:
+        case IMG_STAMP_QUAD:
+            box[0] = box[2] = p[0];
+            box[1] = box[3] = p[1];
+
+            for (int i = 2; i < (key->kind == IMG_STAMP_QUAD ? 8 : 6); i += 2)
+            {
+                box[0] = fminf(box[0], p[i]);
+                box[1] = fminf(box[1], p[i + 1]);
+                box[2] = fmaxf(box[2], p[i]);
+                box[3] = fmaxf(box[3], p[i + 1]);
+            }
+
+            break;
+    }
+}
 
-//     if (ims->stroke)
-//     {
-//         plutovg_canvas_set_color(ims->canvas, &ims->stroke_color);
-//         plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
-//         plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
-//         plutovg_canvas_add_text(ims->canvas, text, -1, PLUTOVG_TEXT_ENCODING_UTF8, x, y);
-//         plutovg_canvas_stroke(ims->canvas);
-//     }
+/* { "circle", r }, { "ellipse", w, h }, { "rect", w, h[, rx[, ry]] }, { "square", s }, { "triangle", ... }, { "quad", ... } */
+static void img_stamp_parse(lua_State *L, int index, struct img_stamp_key *key)
+{
+    static const struct
+    {
+        const char *name;
+        int min;
+        int max;
+    } kinds[] =
+    {
+        [IMG_STAMP_CIRCLE]      = { "circle", 1, 1 },
+        [IMG_STAMP_ELLIPSE]     = { "ellipse", 2, 2 },
+        [IMG_STAMP_RECT]        = { "rect", 2, 4 },
+        [IMG_STAMP_SQUARE]      = { "square", 1, 1 },
+        [IMG_STAMP_TRIANGLE]    = { "triangle", 6, 6 },
+        [IMG_STAMP_QUAD]        = { "quad", 8, 8 },
+    };
 
-//     return 0;
-// }
+    const char *name;
+    int count;
+    int kind;
 
-static void register_func(lua_State *L, struct imc_image_lib_state *state, const char *name, lua_CFunction func)
-{
-    lua_pushlightuserdata(L, state);
-    lua_pushcclosure(L, func, 1);
-    lua_setfield(L, -2, name);
-}
+    luaL_checktype(L, index, LUA_TTABLE);
+    memset(key, 0, sizeof(struct img_stamp_key));
 
-struct imc_image_lib_state *IMC_IMG_load(lua_State *state)
-{
-    struct imc_image_lib_state *res = calloc(1, sizeof(struct imc_image_lib_state));
+    lua_rawgeti(L, index, 1);
+    name = lua_tostring(L, -1);
+    lua_pop(L, 1);
 
-    if (!state || !res)
+    for (kind = 0; kind < (int)(sizeof(kinds) / sizeof(kinds[0])); kind++)
     {
-        return nullptr;
+        if (name && !strcmp(name, kinds[kind].name))
+        {
+            break;
+        }
     }
 
-    res->fill = true;
-    res->stroke = true;
-
-    res->stroke_cap = PLUTOVG_LINE_CAP_ROUND;
-    res->stroke_weight = 1.00;
+    luaL_argcheck(L, kind < (int)(sizeof(kinds) / sizeof(kinds[0])), index, "unknown shape");
 
-    res->fill_color = PLUTOVG_MAKE_COLOR(1, 1, 1, 1);
-    res->stroke_color = PLUTOVG_MAKE_COLOR(0, 0, 0, 1);
+    count = lua_objlen(L, index) - 1;
+    luaL_argcheck(L, count >= kinds[kind].min && count <= kinds[kind].max, index, "wrong number of shape parameters");
 
-    #define REGISTER_FN(NAME) register_func(state, res, #NAME, img_##NAME)
+    key->kind = kind;
 
-    lua_newtable(state);
-
-    REGISTER_FN(create);
-    REGISTER_FN(get_width);
-    REGISTER_FN(get_height);
-    REGISTER_FN(state_save);
-    REGISTER_FN(state_restore);
-    REGISTER_FN(mode_set_rgb);
-    REGISTER_FN(mode_set_hsb);
-    REGISTER_FN(background);
-    REGISTER_FN(fill);
-    REGISTER_FN(no_fill);
-    REGISTER_FN(stroke);
-    REGISTER_FN(no_stroke);
-    REGISTER_FN(stroke_weight);
-    REGISTER_FN(stroke_cap);
-    REGISTER_FN(set_compositing_mode);
-    REGISTER_FN(circle);
-    REGISTER_FN(ellipse);
-    REGISTER_FN(line);
-    REGISTER_FN(point);
-    REGISTER_FN(quad);
-    REGISTER_FN(rect);
-    REGISTER_FN(square);
-    REGISTER_FN(triangle);
-    // REGISTER_FN(text);
+    for (int i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, index, i + 2);
+        key->params[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
 
-    lua_setglobal(state, "Image");
+        luaL_argcheck(L, isfinite(key->params[i]), index, "shape parameters must be finite numbers");
+    }
 
-    return res;
+    /* a single corner radius is used for both axes, like Image.rect */
+    if (kind == IMG_STAMP_RECT && count == 3)
+    {
+        key->params[3] = key->params[2];
+    }
 }
 
-bool IMC_IMG_write_png(struct imc_image_lib_state *state, const char *filename)
+static unsigned char *img_stamp_rasterize(const struct img_stamp_entry *entry, int bucket)
 {
-    if (!state || !filename)
+    const plutovg_color_t clear = PLUTOVG_MAKE_COLOR(0, 0, 0, 0);
+    const plutovg_color_t white = PLUTOVG_MAKE_COLOR(1, 1, 1, 1);
+    const float fx = (bucket % IMG_STAMP_SUBPIXEL + 0.50) / IMG_STAMP_SUBPIXEL;
+    const float fy = (bucket / IMG_STAMP_SUBPIXEL + 0.50) / IMG_STAMP_SUBPIXEL;
+    plutovg_surface_t *surface = plutovg_surface_create(entry->width, entry->height);
+    plutovg_canvas_t *canvas = surface ? plutovg_canvas_create(surface) : nullptr;
+    unsigned char *mask = malloc((size_t)entry->width * entry->height);
+    const unsigned char *data;
+    int stride;
+
+    if (!surface || !canvas || !mask)
     {
-        return false;
+        goto failure;
     }
 
-    if (!img_init_check(state))
+    plutovg_surface_clear(surface, &clear);
+    plutovg_canvas_set_color(canvas, &white);
+    img_stamp_path(canvas, &entry->key, fx - entry->x, fy - entry->y);
+
+    if (entry->key.stroke)
     {
-        return false;
+        plutovg_canvas_set_line_width(canvas, entry->key.stroke_weight);
+        plutovg_canvas_set_line_cap(canvas, entry->key.stroke_cap);
+        plutovg_canvas_stroke(canvas);
+    }
+    else
+    {
+        plutovg_canvas_fill(canvas);
     }
 
-    if (!plutovg_surface_write_to_png(state->surface, filename))
+    data = plutovg_surface_get_data(surface);
+    stride = plutovg_surface_get_stride(surface);
+
+    for (int y = 0; y < entry->height; y++)
     {
-        return false;
+        const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+
+        for (int x = 0; x < entry->width; x++)
+        {
+            mask[(size_t)y * entry->width + x] = row[x] >> 24;
+        }
     }
 
-    return true;
+    plutovg_canvas_destroy(canvas);
+    plutovg_surface_destroy(surface);
+
+    return mask;
+
+failure:
+    free(mask);
+    plutovg_canvas_destroy(canvas);
+    plutovg_surface_destroy(surface);
+
+    return nullptr;
 }
 
-bool IMC_IMG_write_jpg(struct imc_image_lib_state *state, const char *filename)
+/* field by field, struct copies do not keep padding bytes */
+static bool img_stamp_key_equal(const struct img_stamp_key *a, const struct img_stamp_key *b)
 {
-    if (!state || !filename)
+    return a->kind == b->kind && a->stroke == b->stroke && a->stroke_weight == b->stroke_weight &&
+           a->stroke_cap == b->stroke_cap && !memcmp(a->params, b->params, sizeof(a->params));
+}
+
+/* finds or makes the cache entry for key without evicting keep, masks are rasterized on first use */
+static struct img_stamp_entry *img_stamp_lookup(struct imc_image_lib_state *ims, const struct img_stamp_key *key,
+                                                const struct img_stamp_entry *keep)
+{
+    const float pad = key->stroke ? key->stroke_weight * 5.00 + 2.00 : 2.00;
+    struct img_stamp_entry *entry;
+    float box[4];
+    int x;
+    int y;
+
+    for (int i = 0; i < IMG_STAMP_CACHE_SIZE; i++)
     {
-        return false;
+        if (ims->stamps[i].used && img_stamp_key_equal(&ims->stamps[i].key, key))
+        {
+            return &ims->stamps[i];
+        }
     }
 
-    if (!img_init_check(state))
+    img_stamp_bounds(key, box);
+    x = floorf(box[0] - pad);
+    y = floorf(box[1] - pad);
+
+    /* big shapes gain little from caching and would pin a lot of memory */
+    if (ceilf(box[2] + pad + 1) - x > IMG_STAMP_MAX_SIZE || ceilf(box[3] + pad + 1) - y > IMG_STAMP_MAX_SIZE)
     {
-        return false;
+        return nullptr;
     }
 
-    if (!plutovg_surface_write_to_jpg(state->surface, filename, 100))
+    if (&ims->stamps[ims->stamp_next] == keep)
     {
-        return false;
+        ims->stamp_next = (ims->stamp_next + 1) % IMG_STAMP_CACHE_SIZE;
     }
 
-    return true;
-}
+    entry = &ims->stamps[ims->stamp_next];
+    ims->stamp_next = (ims->stamp_next + 1) % IMG_STAMP_CACHE_SIZE;
 
-bool IMC_IMG_write_bmp(struct imc_image_lib_state *state, const char *filename)
+    for (int i = 0; i < IMG_STAMP_SUBPIXEL * IMG_STAMP_SUBPIXEL; i++)
+    {
+        free(entry->masks[i]);
+    }
+
+    *entry = (struct img_stamp_entry)
+    {
+        .used = true,
+        .x = x,
+        .y = y,
+        .width = ceilf(box[2] + pad + 1) - x,
+        .height = ceilf(box[3] + pad + 1) - y,
+    };
+    memcpy(&entry->key, key, sizeof(struct img_stamp_key));
+
+    return entry;
+}
+
+/*
+ * blends an 8-bit coverage mask placed at x, y, directly on u8 surfaces which only get here for src-over,
+ * and through scratch and the regular composite on float surfaces
+ */
+static void img_blend_mask(struct imc_image_lib_state *ims, const struct img_plot_ctx *ctx,
+                           const plutovg_color_t *color, plutovg_operator_t op, const unsigned char *mask,
+                           int mask_stride, int x, int y, int width, int height)
+{
+    const int col0 = x < 0 ? -x : 0;
+    const int row0 = y < 0 ? -y : 0;
+    const int col1 = x + width > ctx->width ? ctx->width - x : width;
+    const int row1 = y + height > ctx->height ? ctx->height - y : height;
+    unsigned char *data;
+    int stride;
+
+    if (col0 >= col1 || row0 >= row1)
+    {
+        return;
+    }
+
+    if (!ims->fsurface)
+    {
+        for (int row = row0; row < row1; row++)
+        {
+            for (int col = col0; col < col1; col++)
+            {
+                img_plot(ctx, x + col, y + row, mask[(size_t)row * mask_stride + col] * (1.0f / 255.0f));
+            }
+        }
+
+        return;
+    }
+
+    data = plutovg_surface_get_data(ims->scratch);
+    stride = plutovg_surface_get_stride(ims->scratch);
+
+    for (int row = row0; row < row1; row++)
+    {
+        uint32_t *line = (uint32_t *)(data + (size_t)(y + row) * stride);
+
+        for (int col = col0; col < col1; col++)
+        {
+            line[x + col] = mask[(size_t)row * mask_stride + col] * 0x01010101u;
+        }
+    }
+
+    IMC_FSURF_composite(ims->fsurface, data, stride, x + col0, y + row0, col1 - col0, row1 - row0, color, op);
+}
+
+/*
+ * blends the cached mask for the nearest sub-pixel bucket, off by at most half a bucket from where the
+ * canvas would put the shape, returns false when the mask cannot be made
+ */
+static bool img_stamp_blend(struct imc_image_lib_state *ims, struct img_stamp_entry *entry,
+                            const struct img_plot_ctx *ctx, const plutovg_color_t *color, plutovg_operator_t op,
+                            float x, float y)
+{
+    const float cx = floorf(x);
+    const float cy = floorf(y);
+    int bucket;
+    int ox;
+    int oy;
+
+    /* also skips nan */
+    if (!(fabsf(x) < 1e8f && fabsf(y) < 1e8f))
+    {
+        return true;
+    }
+
+    bucket = (int)((y - cy) * IMG_STAMP_SUBPIXEL) * IMG_STAMP_SUBPIXEL + (int)((x - cx) * IMG_STAMP_SUBPIXEL);
+    ox = (int)cx + entry->x;
+    oy = (int)cy + entry->y;
+
+    if (ox >= ctx->width || oy >= ctx->height || ox + entry->width <= 0 || oy + entry->height <= 0)
+    {
+        return true;
+    }
+
+    if (!entry->masks[bucket])
+    {
+        entry->masks[bucket] = img_stamp_rasterize(entry, bucket);
+
+        if (!entry->masks[bucket])
+        {
+            return false;
+        }
+    }
+
+    img_blend_mask(ims, ctx, color, op, entry->masks[bucket], entry->width, ox, oy, entry->width, entry->height);
+
+    return true;
+}
+
+/*
+ * Image.stamp(shape, positions[, count]), draws shape at every x, y pair of positions, a table or an FFI
+ * double array, rasterizing its coverage once per sub-pixel bucket instead of once per instance
+ */
+static int img_stamp(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    const plutovg_operator_t op = plutovg_canvas_get_operator(ims->canvas);
+    struct img_stamp_key shape;
+    struct img_stamp_entry *entries[2] = {};
+    const bool enabled[2] = { ims->fill, ims->stroke };
+    const plutovg_color_t *colors[2] = { &ims->fill_color, &ims->stroke_color };
+    struct img_plot_ctx ctxs[2];
+    plutovg_matrix_t matrix;
+    double *array;
+    size_t length;
+    bool table;
+    lua_Integer count;
+    float scale;
+    bool cached;
+
+    img_stamp_parse(L, 1, &shape);
+    length = IMC_LBUF_check(L, 2, &array);
+    table = !array;
+    count = table ? luaL_optinteger(L, 3, length / 2) : luaL_checkinteger(L, 3);
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    luaL_argcheck(L, (size_t)count <= length / 2, 3, "count is larger than the buffer");
+
+    /*
+     * masks are rasterized at device scale, so they are only valid when the canvas does no more than scale
+     * uniformly and translate, and u8 surfaces only blend src-over
+     */
+    plutovg_canvas_get_matrix(ims->canvas, &matrix);
+    scale = img_matrix_scale(&matrix);
+    cached = scale > 0 && (ims->fsurface || op == PLUTOVG_OPERATOR_SRC_OVER);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        struct img_stamp_key key = shape;
+
+        if (!enabled[pass] || !cached)
+        {
+            continue;
+        }
+
+        if (pass)
+        {
+            key.stroke = true;
+            key.stroke_weight = ims->stroke_weight;
+            key.stroke_cap = ims->stroke_cap;
+        }
+
+        for (int i = 0; i < 8; i++)
+        {
+            key.params[i] *= scale;
+        }
+
+        key.stroke_weight *= scale;
+        entries[pass] = img_stamp_lookup(ims, &key, entries[0]);
+        ctxs[pass] = img_plot_ctx_make(ims, colors[pass]);
+    }
+
+    if (ims->fsurface && (entries[0] || entries[1]))
+    {
+        img_touch_float(ims);
+    }
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        float x;
+        float y;
+
+        if (table)
+        {
+            lua_rawgeti(L, 2, i * 2 + 1);
+            lua_rawgeti(L, 2, i * 2 + 2);
+            x = lua_tonumber(L, -2);
+            y = lua_tonumber(L, -1);
+            lua_pop(L, 2);
+        }
+        else
+        {
+            x = array[i * 2];
+            y = array[i * 2 + 1];
+        }
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            if (!enabled[pass])
+            {
+                continue;
+            }
+
+            if (entries[pass] && img_stamp_blend(ims, entries[pass], &ctxs[pass], colors[pass], op,
+                                                 x * scale + matrix.e, y * scale + matrix.f))
+            {
+                continue;
+            }
+
+            plutovg_canvas_set_color(ims->canvas, colors[pass]);
+
+            if (pass)
+            {
+                plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
+                plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
+            }
+
+            img_stamp_path(ims->canvas, &shape, x, y);
+            img_paint(ims, colors[pass], pass);
+        }
+    }
+
+    return 0;
+}
+
+/* decodes one UTF-8 sequence, malformed input comes out as U+FFFD one byte at a time */
+static plutovg_codepoint_t img_utf8_next(const unsigned char **text, const unsigned char *end)
+{
+    const unsigned char *p = *text;
+    plutovg_codepoint_t cp = *p;
+    int extra = cp >= 0xF0 ? 3 : (cp >= 0xE0 ? 2 : (cp >= 0xC0 ? 1 : 0));
+
+    *text = p + 1;
+
+    if (cp >= 0x80 && (cp < 0xC0 || cp >= 0xF8 || end - p <= extra))
+    {
+        return 0xFFFD;
+    }
+
+    cp &= 0x7F >> extra;
+
+    for (int i = 1; i <= extra; i++)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            return 0xFFFD;
+        }
+
+        cp = cp << 6 | (p[i] & 0x3F);
+    }
+
+    *text = p + extra + 1;
+
+    return cp;
+}
+
+static plutovg_font_face_t *img_font_face(struct imc_image_lib_state *ims)
+{
+    const char *families[] = { "sans-serif", "DejaVu Sans", "Liberation Sans", "Arial", "Helvetica" };
+
+    for (size_t i = 0; i < sizeof(families) / sizeof(families[0]) && !ims->font_face; i++)
+    {
+        ims->font_face = plutovg_font_face_cache_get(ims->font_cache, families[i], false, false);
+    }
+
+    return ims->font_face;
+}
+
+static float img_line_height(struct imc_image_lib_state *ims, plutovg_font_face_t *face)
+{
+    float ascent;
+    float descent;
+    float line_gap;
+
+    plutovg_font_face_get_metrics(face, ims->font_size, &ascent, &descent, &line_gap, nullptr);
+
+    return ascent - descent + line_gap;
+}
+
+/* glyph outlines of the whole text with the baseline of the first line at x, y */
+static bool img_text_path(struct imc_image_lib_state *ims, plutovg_font_face_t *face, const char *text,
+                          size_t length, float x, float y, plutovg_path_t *path)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *end = p + length;
+    const float line_height = img_line_height(ims, face);
+    float pen = x;
+    bool drawn = false;
+
+    while (p < end)
+    {
+        const plutovg_codepoint_t cp = img_utf8_next(&p, end);
+
+        if (cp == '\n')
+        {
+            pen = x;
+            y += line_height;
+            continue;
+        }
+
+        pen += plutovg_font_face_get_glyph_path(face, ims->font_size, pen, y, cp, path);
+        drawn = true;
+    }
+
+    return drawn;
+}
+
+/*
+ * fills glyphs from the atlas, pens snap to a quarter pixel horizontally and to whole pixels vertically,
+ * glyphs that cannot be cached and every glyph under a matrix that does more than scale uniformly and
+ * translate go through the canvas
+ */
+static bool img_text_fill(struct imc_image_lib_state *ims, plutovg_font_face_t *face, const char *text,
+                          size_t length, float x, float y)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *end = p + length;
+    const float line_height = img_line_height(ims, face);
+    const plutovg_operator_t op = plutovg_canvas_get_operator(ims->canvas);
+    const struct img_plot_ctx ctx = img_plot_ctx_make(ims, &ims->fill_color);
+    plutovg_path_t *rest = plutovg_path_create();
+    plutovg_matrix_t matrix;
+    const unsigned char *atlas;
+    float pen = x;
+    bool pending = false;
+    float scale;
+    bool cached;
+    int stride;
+
+    if (!rest)
+    {
+        return false;
+    }
+
+    if (!ims->glyphs)
+    {
+        ims->glyphs = IMC_GLYPH_create();
+    }
+
+    plutovg_canvas_get_matrix(ims->canvas, &matrix);
+    scale = img_matrix_scale(&matrix);
+    cached = ims->glyphs && scale > 0 && (ims->fsurface || op == PLUTOVG_OPERATOR_SRC_OVER);
+
+    if (cached && ims->fsurface)
+    {
+        img_touch_float(ims);
+    }
+
+    while (p < end)
+    {
+        const plutovg_codepoint_t cp = img_utf8_next(&p, end);
+        const float px = pen * scale + matrix.e;
+        const float py = floorf(y * scale + matrix.f + 0.50);
+        const struct imc_glyph *glyph = nullptr;
+
+        if (cp == '\n')
+        {
+            pen = x;
+            y += line_height;
+            continue;
+        }
+
+        if (cached && fabsf(px) < 1e8f && fabsf(py) < 1e8f)
+        {
+            const float cx = floorf(px);
+
+            glyph = IMC_GLYPH_lookup(ims->glyphs, face, ims->font_size * scale, cp, (px - cx) * IMC_GLYPH_SUBPIXEL);
+
+            if (glyph)
+            {
+                atlas = IMC_GLYPH_atlas(ims->glyphs, &stride);
+                img_blend_mask(ims, &ctx, &ims->fill_color, op, atlas + (size_t)glyph->y * stride + glyph->x, stride,
+                               (int)cx + glyph->left, (int)py + glyph->top, glyph->width, glyph->height);
+                pen += glyph->advance / scale;
+                continue;
+            }
+        }
+
+        pen += plutovg_font_face_get_glyph_path(face, ims->font_size, pen, y, cp, rest);
+        pending = true;
+    }
+
+    if (pending)
+    {
+        plutovg_canvas_set_color(ims->canvas, &ims->fill_color);
+        plutovg_canvas_add_path(ims->canvas, rest);
+        img_paint(ims, &ims->fill_color, false);
+    }
+
+    plutovg_path_destroy(rest);
+
+    return true;
+}
+
+/* Image.text(text, x, y), x, y is the start of the first baseline and every newline starts a new line */
+static int img_text(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    size_t length;
+    const char *text = luaL_checklstring(L, 1, &length);
+    float x = luaL_checknumber(L, 2);
+    float y = luaL_checknumber(L, 3);
+    plutovg_font_face_t *face = img_font_face(ims);
+    plutovg_path_t *path;
+
+    if (!face)
+    {
+        SET_LUA_ERR("no font face available");
+        return 0;
+    }
+
+    if (ims->fill && !img_text_fill(ims, face, text, length, x, y))
+    {
+        SET_LUA_ERR("failed to draw text");
+        return 0;
+    }
+
+    if (ims->stroke)
+    {
+        path = plutovg_path_create();
+
+        if (!path)
+        {
+            SET_LUA_ERR("failed to draw text");
+            return 0;
+        }
+
+        if (img_text_path(ims, face, text, length, x, y, path))
+        {
+            plutovg_canvas_set_color(ims->canvas, &ims->stroke_color);
+            plutovg_canvas_set_line_width(ims->canvas, ims->stroke_weight);
+            plutovg_canvas_set_line_cap(ims->canvas, ims->stroke_cap);
+            plutovg_canvas_add_path(ims->canvas, path);
+            img_paint(ims, &ims->stroke_color, true);
+        }
+
+        plutovg_path_destroy(path);
+    }
+
+    return 0;
+}
+
+/* Image.text_measure(text), returns width, height, ascent and descent, descent is negative below the baseline */
+static int img_text_measure(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    size_t length;
+    const unsigned char *p = (const unsigned char *)luaL_checklstring(L, 1, &length);
+    const unsigned char *end = p + length;
+    plutovg_font_face_t *face = img_font_face(ims);
+    float ascent;
+    float descent;
+    float line_gap;
+    float width = 0.00;
+    float line = 0.00;
+    int lines = 1;
+
+    if (!face)
+    {
+        SET_LUA_ERR("no font face available");
+        return 0;
+    }
+
+    plutovg_font_face_get_metrics(face, ims->font_size, &ascent, &descent, &line_gap, nullptr);
+
+    while (p < end)
+    {
+        const plutovg_codepoint_t cp = img_utf8_next(&p, end);
+        float advance;
+
+        if (cp == '\n')
+        {
+            width = fmaxf(width, line);
+            line = 0.00;
+            lines++;
+            continue;
+        }
+
+        plutovg_font_face_get_glyph_metrics(face, ims->font_size, cp, &advance, nullptr, nullptr);
+        line += advance;
+    }
+
+    lua_pushnumber(L, fmaxf(width, line));
+    lua_pushnumber(L, (lines - 1) * (ascent - descent + line_gap) + ascent - descent);
+    lua_pushnumber(L, ascent);
+    lua_pushnumber(L, descent);
+
+    return 4;
+}
+
+/* Image.text_font(family[, bold[, italic]]), picks a face from the system fonts and loaded files */
+static int img_text_font(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    const char *family = luaL_checkstring(L, 1);
+    plutovg_font_face_t *face = plutovg_font_face_cache_get(ims->font_cache, family, lua_toboolean(L, 2),
+                                                            lua_toboolean(L, 3));
+
+    if (!face)
+    {
+        luaL_error(L, "font face '%s' not found", family);
+        return 0;
+    }
+
+    ims->font_face = face;
+
+    return 0;
+}
+
+static int img_text_size(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    float size = luaL_checknumber(L, 1);
+
+    luaL_argcheck(L, size > 0 && size < 10000, 1, "bad font size");
+    ims->font_size = size;
+
+    return 0;
+}
+
+/* records the file named at index as an input of the render, for the output cache */
+static void img_add_dep(lua_State *L, int index)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, IMC_VM_DEPS_KEY);
+
+    if (lua_istable(L, -1))
+    {
+        lua_pushvalue(L, index);
+        lua_pushboolean(L, true);
+        lua_rawset(L, -3);
+    }
+
+    lua_pop(L, 1);
+}
+
+/* Image.text_load(filename), adds the faces of a font file, returns how many there were */
+static int img_text_load(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    const char *filename = luaL_checkstring(L, 1);
+    const int count = plutovg_font_face_cache_load_file(ims->font_cache, filename);
+
+    if (count <= 0)
+    {
+        luaL_error(L, "failed to load fonts from '%s'", filename);
+        return 0;
+    }
+
+    img_add_dep(L, 1);
+    lua_pushinteger(L, count);
+
+    return 1;
+}
+
+static struct img_texture *img_check_texture(lua_State *L, int index)
+{
+    struct img_texture *tex = luaL_checkudata(L, index, IMG_TEXTURE_METATABLE);
+
+    if (!tex->asset)
+    {
+        luaL_error(L, "texture was freed");
+    }
+
+    return tex;
+}
+
+static inline img_f32x4 img_unpack(uint32_t pixel)
+{
+    const img_i32x4 channels = { pixel & 255, (pixel >> 8) & 255, (pixel >> 16) & 255, pixel >> 24 };
+
+    return __builtin_convertvector(channels, img_f32x4);
+}
+
+static inline uint32_t img_pack(img_f32x4 value)
+{
+    const img_i32x4 channels = __builtin_convertvector(value + 0.50f, img_i32x4);
+
+    return channels[0] | channels[1] << 8 | channels[2] << 16 | (uint32_t)channels[3] << 24;
+}
+
+/*
+ * samples the source rectangle straight into the target for every pixel whose center falls inside the
+ * destination, bilinear taps are clamped to the source rectangle so atlas neighbours never bleed in
+ */
+static void img_blit_direct(struct imc_image_lib_state *ims, plutovg_surface_t *tex, const float *src,
+                            const float *dst, float opacity, plutovg_operator_t op)
+{
+    const int width = plutovg_surface_get_width(ims->surface);
+    const int height = plutovg_surface_get_height(ims->surface);
+    const int tex_width = plutovg_surface_get_width(tex);
+    const int tex_height = plutovg_surface_get_height(tex);
+    /* clamped while still float, far away boxes would not fit an int */
+    const int x0 = fminf(fmaxf(ceilf(dst[0] - 0.50), 0), width);
+    const int y0 = fminf(fmaxf(ceilf(dst[1] - 0.50), 0), height);
+    const int x1 = fminf(fmaxf(ceilf(dst[0] + dst[2] - 0.50), 0), width);
+    const int y1 = fminf(fmaxf(ceilf(dst[1] + dst[3] - 0.50), 0), height);
+    const int rx0 = fminf(fmaxf(floorf(src[0]), 0), tex_width);
+    const int ry0 = fminf(fmaxf(floorf(src[1]), 0), tex_height);
+    const int rx1 = fminf(fmaxf(ceilf(src[0] + src[2]), 0), tex_width) - 1;
+    const int ry1 = fminf(fmaxf(ceilf(src[1] + src[3]), 0), tex_height) - 1;
+    const float scale_x = src[2] / dst[2];
+    const float scale_y = src[3] / dst[3];
+    const bool nearest = ims->blit_filter == IMG_FILTER_NEAREST || ims->aliased;
+    const unsigned char *texels = plutovg_surface_get_data(tex);
+    const int tex_stride = plutovg_surface_get_stride(tex);
+    plutovg_surface_t *target = ims->fsurface ? ims->scratch : ims->surface;
+    unsigned char *data = plutovg_surface_get_data(target);
+    const int stride = plutovg_surface_get_stride(target);
+
+    if (x0 >= x1 || y0 >= y1 || rx0 > rx1 || ry0 > ry1)
+    {
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+        const float v = src[1] + (y + 0.50 - dst[1]) * scale_y;
+        const float fv = nearest ? floorf(v) : v - 0.50f;
+        const int ty = fminf(fmaxf(floorf(fv), ry0 - 1), ry1 + 1);
+        const float wy = fv - ty;
+        const uint32_t *row0 = (const uint32_t *)(texels + (size_t)CONSTRAIN(ty, ry0, ry1) * tex_stride);
+        const uint32_t *row1 = (const uint32_t *)(texels + (size_t)CONSTRAIN(ty + 1, ry0, ry1) * tex_stride);
+
+        for (int x = x0; x < x1; x++)
+        {
+            const float u = src[0] + (x + 0.50 - dst[0]) * scale_x;
+            uint32_t pixel;
+
+            if (nearest)
+            {
+                pixel = row0[(int)fminf(fmaxf(floorf(u), rx0), rx1)];
+            }
+            else
+            {
+                const int tx = fminf(fmaxf(floorf(u - 0.50f), rx0 - 1), rx1 + 1);
+                const float wx = u - 0.50f - tx;
+                const int c0 = CONSTRAIN(tx, rx0, rx1);
+                const int c1 = CONSTRAIN(tx + 1, rx0, rx1);
+                const img_f32x4 top = img_unpack(row0[c0]) + (img_unpack(row0[c1]) - img_unpack(row0[c0])) * wx;
+                const img_f32x4 bottom = img_unpack(row1[c0]) + (img_unpack(row1[c1]) - img_unpack(row1[c0])) * wx;
+
+                pixel = img_pack(top + (bottom - top) * wy);
+            }
+
+            if (opacity < 1)
+            {
+                pixel = img_pack(img_unpack(pixel) * opacity);
+            }
+
+            if (ims->fsurface)
+            {
+                row[x] = pixel;
+            }
+            else if (pixel >> 24 == 255)
+            {
+                row[x] = pixel;
+            }
+            else if (pixel)
+            {
+                row[x] = img_pack(img_unpack(pixel) + img_unpack(row[x]) * ((255 - (pixel >> 24)) * (1.0f / 255.0f)));
+            }
+        }
+    }
+
+    if (ims->fsurface)
+    {
+        IMC_FSURF_blend(ims->fsurface, data, stride, x0, y0, x1 - x0, y1 - y0, op);
+    }
+}
+
+/*
+ * src and dst are x, y, width, height, anything but an axis aligned scale and translation goes through a
+ * canvas texture paint
+ */
+static void img_draw_texture(struct imc_image_lib_state *ims, plutovg_surface_t *tex, const float *src, const float *dst,
+                             float opacity)
+{
+    const plutovg_operator_t op = plutovg_canvas_get_operator(ims->canvas);
+    plutovg_matrix_t matrix;
+    plutovg_matrix_t paint;
+    plutovg_rect_t extents;
+    bool direct;
+
+    if (!(src[2] > 0 && src[3] > 0 && dst[2] != 0 && dst[3] != 0))
+    {
+        return;
+    }
+
+    plutovg_canvas_get_matrix(ims->canvas, &matrix);
+    direct = matrix.b == 0 && matrix.c == 0 && matrix.a > 0 && matrix.d > 0 && dst[2] > 0 && dst[3] > 0;
+    direct = direct && (ims->fsurface || op == PLUTOVG_OPERATOR_SRC_OVER);
+
+    if (ims->fsurface)
+    {
+        img_touch_float(ims);
+    }
+
+    if (direct)
+    {
+        const float moved[4] =
+        {
+            dst[0] * matrix.a + matrix.e,
+            dst[1] * matrix.d + matrix.f,
+            dst[2] * matrix.a,
+            dst[3] * matrix.d,
+        };
+
+        img_blit_direct(ims, tex, src, moved, opacity, op);
+        return;
+    }
+
+    plutovg_matrix_init_translate(&paint, dst[0], dst[1]);
+    plutovg_matrix_scale(&paint, dst[2] / src[2], dst[3] / src[3]);
+    plutovg_matrix_translate(&paint, -src[0], -src[1]);
+
+    plutovg_canvas_set_texture(ims->canvas, tex, PLUTOVG_TEXTURE_TYPE_PLAIN, opacity, &paint);
+    plutovg_canvas_rect(ims->canvas, dst[0], dst[1], dst[2], dst[3]);
+
+    if (!ims->fsurface)
+    {
+        plutovg_canvas_fill(ims->canvas);
+        return;
+    }
+
+    plutovg_canvas_fill_extents(ims->canvas, &extents);
+    plutovg_canvas_set_operator(ims->canvas, PLUTOVG_OPERATOR_SRC_OVER);
+    plutovg_canvas_fill(ims->canvas);
+    plutovg_canvas_set_operator(ims->canvas, op);
+
+    IMC_FSURF_blend(ims->fsurface, plutovg_surface_get_data(ims->scratch), plutovg_surface_get_stride(ims->scratch),
+                    floorf(extents.x) - 2, floorf(extents.y) - 2, ceilf(extents.w) + 5, ceilf(extents.h) + 5, op);
+}
+
+/* Image.load(filename), decoded once per process and shared until the file changes */
+static int img_load(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+    struct img_texture *tex = lua_newuserdata(L, sizeof(struct img_texture));
+
+    *tex = (struct img_texture){};
+    luaL_getmetatable(L, IMG_TEXTURE_METATABLE);
+    lua_setmetatable(L, -2);
+
+    tex->asset = IMC_ASSET_load(filename);
+
+    if (!tex->asset)
+    {
+        luaL_error(L, "failed to load image '%s'", filename);
+        return 0;
+    }
+
+    img_add_dep(L, 1);
+
+    return 1;
+}
+
+/* Image.blit(texture, x, y[, width[, height]]), a lone width keeps the aspect ratio */
+static int img_blit(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct img_texture *tex = img_check_texture(L, 1);
+    plutovg_surface_t *surface = IMC_ASSET_surface(tex->asset);
+    const float src[4] = { 0, 0, plutovg_surface_get_width(surface), plutovg_surface_get_height(surface) };
+    float dst[4] = { luaL_checknumber(L, 2), luaL_checknumber(L, 3), src[2], src[3] };
+
+    if (!lua_isnoneornil(L, 4))
+    {
+        dst[2] = luaL_checknumber(L, 4);
+        dst[3] = luaL_optnumber(L, 5, dst[2] * src[3] / src[2]);
+    }
+
+    img_draw_texture(ims, surface, src, dst, 1.00);
+
+    return 0;
+}
+
+/* Image.blit_region(texture, sx, sy, sw, sh, x, y[, width[, height]]) */
+static int img_blit_region(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct img_texture *tex = img_check_texture(L, 1);
+    const float src[4] = { luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4),
+                           luaL_checknumber(L, 5) };
+    const float dst[4] = { luaL_checknumber(L, 6), luaL_checknumber(L, 7), luaL_optnumber(L, 8, src[2]),
+                           luaL_optnumber(L, 9, src[3]) };
+
+    img_draw_texture(ims, IMC_ASSET_surface(tex->asset), src, dst, 1.00);
+
+    return 0;
+}
+
+/*
+ * Image.sprites(texture, buf[, count]), buf holds cell, x, y triples, a table or an FFI double array, cells
+ * come from texture:grid and are numbered from 1 row by row
+ */
+static int img_sprites(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct img_texture *tex = img_check_texture(L, 1);
+    plutovg_surface_t *surface = IMC_ASSET_surface(tex->asset);
+    double *array;
+    const size_t length = IMC_LBUF_check(L, 2, &array);
+    const bool table = !array;
+    lua_Integer count;
+    int columns;
+    int cells;
+
+    luaL_argcheck(L, tex->cell_width > 0 && tex->cell_height > 0, 1, "texture has no grid");
+    columns = plutovg_surface_get_width(surface) / tex->cell_width;
+    cells = columns * (plutovg_surface_get_height(surface) / tex->cell_height);
+    count = table ? luaL_optinteger(L, 3, length / 3) : luaL_checkinteger(L, 3);
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    luaL_argcheck(L, (size_t)count <= length / 3, 3, "count is larger than the buffer");
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        double sprite[3];
+        int cell;
+
+        for (int j = 0; j < 3; j++)
+        {
+            if (table)
+            {
+                lua_rawgeti(L, 2, i * 3 + j + 1);
+                sprite[j] = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            }
+            else
+            {
+                sprite[j] = array[i * 3 + j];
+            }
+        }
+
+        if (!(sprite[0] >= 1 && sprite[0] < cells + 1))
+        {
+            continue;
+        }
+
+        cell = sprite[0] - 1;
+        img_draw_texture(ims, surface,
+                         (const float[4]){ cell % columns * tex->cell_width, cell / columns * tex->cell_height,
+                                           tex->cell_width, tex->cell_height },
+                         (const float[4]){ sprite[1], sprite[2], tex->cell_width, tex->cell_height }, 1.00);
+    }
+
+    return 0;
+}
+
+static int img_blit_filter(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+
+    const char *list[] =
+    {
+        [IMG_FILTER_BILINEAR]   = "bilinear",
+        [IMG_FILTER_NEAREST]    = "nearest",
+        nullptr,
+    };
+
+    ims->blit_filter = luaL_checkoption(L, 1, "bilinear", list);
+
+    return 0;
+}
+
+static int img_texture_width(lua_State *L)
+{
+    lua_pushinteger(L, plutovg_surface_get_width(IMC_ASSET_surface(img_check_texture(L, 1)->asset)));
+
+    return 1;
+}
+
+static int img_texture_height(lua_State *L)
+{
+    lua_pushinteger(L, plutovg_surface_get_height(IMC_ASSET_surface(img_check_texture(L, 1)->asset)));
+
+    return 1;
+}
+
+/* texture:grid(cell_width, cell_height), splits the texture into sprite cells, returns how many fit */
+static int img_texture_grid(lua_State *L)
+{
+    struct img_texture *tex = img_check_texture(L, 1);
+    plutovg_surface_t *surface = IMC_ASSET_surface(tex->asset);
+    const int cell_width = luaL_checkint(L, 2);
+    const int cell_height = luaL_checkint(L, 3);
+
+    luaL_argcheck(L, cell_width > 0 && cell_width <= plutovg_surface_get_width(surface), 2, "bad cell width");
+    luaL_argcheck(L, cell_height > 0 && cell_height <= plutovg_surface_get_height(surface), 3, "bad cell height");
+
+    tex->cell_width = cell_width;
+    tex->cell_height = cell_height;
+
+    lua_pushinteger(L, (plutovg_surface_get_width(surface) / cell_width) *
+                       (plutovg_surface_get_height(surface) / cell_height));
+
+    return 1;
+}
+
+static int img_texture_gc(lua_State *L)
+{
+    struct img_texture *tex = luaL_checkudata(L, 1, IMG_TEXTURE_METATABLE);
+
+    IMC_ASSET_release(tex->asset);
+    tex->asset = nullptr;
+
+    return 0;
+}
+
+static struct img_layer *img_check_layer(lua_State *L, int index)
+{
+    struct img_layer *layer = luaL_checkudata(L, index, IMG_LAYER_METATABLE);
+
+    if (!layer->surface)
+    {
+        luaL_error(L, "layer was released");
+    }
+
+    return layer;
+}
+
+/* Image.layer([width, height]), a transparent offscreen surface with its own canvas state */
+static int img_layer(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    const int width = luaL_optint(L, 1, ims->width);
+    const int height = luaL_optint(L, 2, ims->height);
+    struct img_layer *layer;
+
+    luaL_argcheck(L, width > 0 && width <= 65536, 1, "bad layer width");
+    luaL_argcheck(L, height > 0 && height <= 65536, 2, "bad layer height");
+
+    if (!ims->pool)
+    {
+        ims->pool = IMC_POOL_new(IMG_POOL_LIMIT);
+
+        if (!ims->pool)
+        {
+            SET_LUA_ERR("failed to create the layer pool");
+            return 0;
+        }
+    }
+
+    layer = lua_newuserdata(L, sizeof(struct img_layer));
+    *layer = (struct img_layer){ .ims = ims, .width = width, .height = height };
+    luaL_getmetatable(L, IMG_LAYER_METATABLE);
+    lua_setmetatable(L, -2);
+
+    layer->surface = IMC_POOL_acquire(ims->pool, img_scaled(ims, width), img_scaled(ims, height));
+    layer->canvas = layer->surface ? plutovg_canvas_create(layer->surface) : nullptr;
+
+    if (!layer->canvas)
+    {
+        luaL_error(L, "failed to create a %dx%d layer", width, height);
+        return 0;
+    }
+
+    plutovg_canvas_scale(layer->canvas, ims->scale, ims->scale);
+
+    plutovg_canvas_set_font_face_cache(layer->canvas, ims->font_cache);
+
+    return 1;
+}
+
+/* Image.layer_begin(layer), drawing goes into the layer until the matching Image.layer_end */
+static int img_layer_begin(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct img_layer *layer = img_check_layer(L, 1);
+
+    luaL_argcheck(L, !layer->active, 1, "layer is already being drawn into");
+    luaL_argcheck(L, layer->ims == ims, 1, "layer belongs to another image");
+
+    if (ims->layer_depth >= IMG_LAYER_DEPTH)
+    {
+        SET_LUA_ERR("too many nested layers");
+        return 0;
+    }
+
+    ims->saved_targets[ims->layer_depth] = (struct img_target)
+    {
+        .surface = ims->surface,
+        .canvas = ims->canvas,
+        .fsurface = ims->fsurface,
+        .scratch = ims->scratch,
+        .resolved = ims->resolved,
+        .exported = ims->exported,
+        .width = ims->width,
+        .height = ims->height,
+    };
+    ims->layers[ims->layer_depth++] = layer;
+    layer->active = true;
+
+    /* layers are always 8-bit */
+    ims->surface = layer->surface;
+    ims->canvas = layer->canvas;
+    ims->fsurface = nullptr;
+    ims->scratch = nullptr;
+    ims->resolved = true;
+    ims->exported = false;
+    ims->width = layer->width;
+    ims->height = layer->height;
+
+    return 0;
+}
+
+static int img_layer_end(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+
+    if (ims->layer_depth <= 0)
+    {
+        SET_LUA_ERR("no layer to end");
+        return 0;
+    }
+
+    img_layer_pop(ims);
+
+    return 0;
+}
+
+/*
+ * Image.layer_composite(layer[, x, y[, opacity]]), blends the layer into whatever is being drawn into with
+ * the compositing mode and transform of its canvas
+ */
+static int img_layer_composite(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct img_layer *layer = img_check_layer(L, 1);
+    const float x = luaL_optnumber(L, 2, 0);
+    const float y = luaL_optnumber(L, 3, 0);
+    const float opacity = luaL_optnumber(L, 4, 1);
+    const float src[4] = { 0, 0, plutovg_surface_get_width(layer->surface), plutovg_surface_get_height(layer->surface) };
+    const float dst[4] = { x, y, layer->width, layer->height };
+    const enum img_filter filter = ims->blit_filter;
+
+    luaL_argcheck(L, !layer->active, 1, "layer is still being drawn into");
+
+    /* whole pixel offsets copy exactly either way, fractional ones get resampled */
+    ims->blit_filter = IMG_FILTER_BILINEAR;
+    img_draw_texture(ims, layer->surface, src, dst, CONSTRAIN(opacity, 0, 1));
+    ims->blit_filter = filter;
+
+    return 0;
+}
+
+/* Image.pool_stats(), returns hits, misses, the hit rate in percent and the bytes kept for reuse */
+static int img_pool_stats(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t bytes = 0;
+
+    if (ims->pool)
+    {
+        IMC_POOL_stats(ims->pool, &hits, &misses, &bytes);
+    }
+
+    lua_pushinteger(L, hits);
+    lua_pushinteger(L, misses);
+    lua_pushnumber(L, hits + misses ? 100.00 * hits / (hits + misses) : 0.00);
+    lua_pushinteger(L, bytes);
+
+    return 4;
+}
+
+static int img_layer_width(lua_State *L)
+{
+    lua_pushinteger(L, img_check_layer(L, 1)->width);
+
+    return 1;
+}
+
+static int img_layer_height(lua_State *L)
+{
+    lua_pushinteger(L, img_check_layer(L, 1)->height);
+
+    return 1;
+}
+
+static int img_layer_clear(lua_State *L)
+{
+    const plutovg_color_t clear = PLUTOVG_MAKE_COLOR(0, 0, 0, 0);
+
+    plutovg_surface_clear(img_check_layer(L, 1)->surface, &clear);
+
+    return 0;
+}
+
+/* layer:release(), hands the surface back to the pool right away instead of at collection */
+static int img_layer_release(lua_State *L)
+{
+    struct img_layer *layer = luaL_checkudata(L, 1, IMG_LAYER_METATABLE);
+
+    if (!layer->surface)
+    {
+        return 0;
+    }
+
+    while (layer->active)
+    {
+        img_layer_pop(layer->ims);
+    }
+
+    plutovg_canvas_destroy(layer->canvas);
+    IMC_POOL_release(layer->ims->pool, layer->surface);
+    layer->canvas = nullptr;
+    layer->surface = nullptr;
+
+    return 0;
+}
+
+/* reads up to max numbers from the table at index, returns how many there were */
+static int img_filter_values(lua_State *L, int index, int arg, float *values, int max)
+{
+    const int count = lua_objlen(L, index);
+
+    luaL_argcheck(L, count <= max, arg, "too many filter values");
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, index, i + 1);
+        luaL_argcheck(L, lua_isnumber(L, -1), arg, "filter values must be numbers");
+        values[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return count;
+}
+
+/*
+ * { "gaussian", sigma }, { "box", radius }, { "convolve", kernel[, divisor] }, { "color_matrix", matrix },
+ * { "threshold"[, level] } or { "grain", amount[, seed] }
+ */
+static void img_filter_parse(lua_State *L, struct imc_image_lib_state *ims, int index, struct imc_filter_stage *stage)
+{
+    const char *list[] =
+    {
+        [IMC_FILTER_GAUSSIAN]     = "gaussian",
+        [IMC_FILTER_BOX]          = "box",
+        [IMC_FILTER_CONVOLVE]     = "convolve",
+        [IMC_FILTER_COLOR_MATRIX] = "color_matrix",
+        [IMC_FILTER_THRESHOLD]    = "threshold",
+        [IMC_FILTER_GRAIN]        = "grain",
+        nullptr,
+    };
+
+    const int top = lua_gettop(L);
+    const char *name;
+    int kind = 0;
+
+    *stage = (struct imc_filter_stage){ .scale = img_supersample(ims) };
+
+    for (int i = 1; i <= 3; i++)
+    {
+        lua_rawgeti(L, index, i);
+    }
+
+    name = lua_tostring(L, top + 1);
+    luaL_argcheck(L, name, index, "filter stages start with a name");
+
+    while (list[kind] && strcmp(list[kind], name) != 0)
+    {
+        kind++;
+    }
+
+    if (!list[kind])
+    {
+        luaL_argerror(L, index, lua_pushfstring(L, "unknown filter '%s'", name));
+    }
+
+    stage->kind = kind;
+
+    switch (stage->kind)
+    {
+    case IMC_FILTER_GAUSSIAN:
+        stage->amount = lua_tonumber(L, top + 2) * ims->scale;
+        luaL_argcheck(L, stage->amount >= 0 && stage->amount <= IMC_FILTER_MAX_SIGMA, index,
+                      "gaussian sigma is out of range");
+        break;
+    case IMC_FILTER_BOX:
+        stage->amount = roundf(lua_tonumber(L, top + 2) * ims->scale);
+        luaL_argcheck(L, stage->amount >= 0 && stage->amount <= IMC_FILTER_MAX_RADIUS, index,
+                      "box radius is out of range");
+        break;
+    case IMC_FILTER_CONVOLVE:
+    {
+        float total = 0;
+
+        luaL_argcheck(L, lua_istable(L, top + 2), index, "convolve expects a kernel table");
+        stage->size = img_filter_values(L, top + 2, index, stage->values, 25);
+        luaL_argcheck(L, stage->size == 9 || stage->size == 25, index, "kernels are 3x3 or 5x5");
+
+        for (int i = 0; i < stage->size; i++)
+        {
+            total += stage->values[i];
+        }
+
+        /* the divisor defaults to the kernel sum so blurs keep their brightness, edge kernels sum to zero */
+        total = luaL_optnumber(L, top + 3, total != 0 ? total : 1);
+        luaL_argcheck(L, total != 0, index, "divisor must not be zero");
+
+        for (int i = 0; i < stage->size; i++)
+        {
+            stage->values[i] /= total;
+        }
+
+        stage->size = stage->size == 9 ? 3 : 5;
+        break;
+    }
+    case IMC_FILTER_COLOR_MATRIX:
+        luaL_argcheck(L, lua_istable(L, top + 2), index, "color_matrix expects a matrix table");
+        luaL_argcheck(L, img_filter_values(L, top + 2, index, stage->values, 20) == 20, index,
+                      "color matrices are 4x5");
+        break;
+    case IMC_FILTER_THRESHOLD:
+        stage->amount = luaL_optnumber(L, top + 2, 0.50);
+        break;
+    case IMC_FILTER_GRAIN:
+        stage->amount = lua_tonumber(L, top + 2);
+        stage->seed = luaL_optinteger(L, top + 3, 0);
+        break;
+    }
+
+    lua_settop(L, top);
+}
+
+/*
+ * Image.filter(name, ...) for one stage or Image.filter({ name, ... }, ...) for a chain of them, which run
+ * in order in a single pass over whatever is being drawn into
+ */
+static int img_filter(lua_State *L)
+{
+    GET_IMG_STATE(L, ims);
+    INIT_IMG_STATE(ims);
+
+    struct imc_filter_stage stages[IMG_FILTER_MAX_STAGES];
+    struct imc_filter_target target;
+    int count = lua_gettop(L);
+
+    if (lua_type(L, 1) == LUA_TSTRING)
+    {
+        lua_createtable(L, count, 0);
+
+        for (int i = 1; i <= count; i++)
+        {
+            lua_pushvalue(L, i);
+            lua_rawseti(L, -2, i);
+        }
+
+        lua_replace(L, 1);
+        lua_settop(L, 1);
+        count = 1;
+    }
+
+    luaL_argcheck(L, count > 0, 1, "expected a filter stage");
+    luaL_argcheck(L, count <= IMG_FILTER_MAX_STAGES, IMG_FILTER_MAX_STAGES + 1, "too many filter stages");
+
+    for (int i = 0; i < count; i++)
+    {
+        luaL_checktype(L, i + 1, LUA_TTABLE);
+        img_filter_parse(L, ims, i + 1, &stages[i]);
+    }
+
+    /* stages are still checked so a script that works in a draft also works in the final render */
+    if (ims->draft)
+    {
+        return 0;
+    }
+
+    target = (struct imc_filter_target)
+    {
+        .width = plutovg_surface_get_width(ims->surface),
+        .height = plutovg_surface_get_height(ims->surface),
+        .argb = plutovg_surface_get_data(ims->surface),
+        .stride = plutovg_surface_get_stride(ims->surface),
+    };
+
+    if (ims->fsurface)
+    {
+        img_touch_float(ims);
+        target.fsurface = ims->fsurface;
+    }
+
+    if (!IMC_FILTER_apply(&target, stages, count))
+    {
+        SET_LUA_ERR("failed to allocate filter buffers");
+    }
+
+    return 0;
+}
+
+static void img_set_defaults(struct imc_image_lib_state *ims)
+{
+    ims->fill = true;
+    ims->stroke = true;
+
+    ims->stroke_cap = PLUTOVG_LINE_CAP_ROUND;
+    ims->stroke_weight = 1.00;
+
+    ims->color_mode = COLOR_MODE_RGB;
+
+    ims->fill_color = PLUTOVG_MAKE_COLOR(1, 1, 1, 1);
+    ims->stroke_color = PLUTOVG_MAKE_COLOR(0, 0, 0, 1);
+
+    ims->font_face = nullptr;
+    ims->font_size = 24.00;
+
+    ims->blit_filter = IMG_FILTER_BILINEAR;
+}
+
+/* the wrapped function runs protected so an error cannot leave its name behind for later samples */
+static int img_profiled(lua_State *L)
+{
+    struct imc_image_lib_state *state = lua_touserdata(L, lua_upvalueindex(1));
+    const char *outer = state->current_call;
+    const uint64_t begin = IMC_PROF_begin();
+    int status;
+
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_insert(L, 1);
+
+    state->current_call = lua_tostring(L, lua_upvalueindex(4));
+    status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    state->current_call = outer;
+
+    IMC_PROF_add(lua_tointeger(L, lua_upvalueindex(3)), begin);
+
+    if (status != 0)
+    {
+        return lua_error(L);
+    }
+
+    return lua_gettop(L);
+}
+
+static void register_func(lua_State *L, struct imc_image_lib_state *state, const char *name, const char *prof_name,
+                          lua_CFunction func)
+{
+    lua_pushlightuserdata(L, state);
+
+    if (IMC_PROF_is_enabled())
+    {
+        lua_pushlightuserdata(L, state);
+        lua_pushcclosure(L, func, 1);
+        lua_pushinteger(L, IMC_PROF_counter(prof_name));
+        lua_pushstring(L, prof_name);
+        lua_pushcclosure(L, img_profiled, 4);
+    }
+    else
+    {
+        lua_pushcclosure(L, func, 1);
+    }
+
+    lua_setfield(L, -2, name);
+}
+
+struct imc_image_lib_state *IMC_IMG_new()
+{
+    struct imc_image_lib_state *res = calloc(1, sizeof(struct imc_image_lib_state));
+
+    if (res)
+    {
+        res->scale = 1;
+        img_set_defaults(res);
+    }
+
+    return res;
+}
+
+struct imc_image_lib_state *IMC_IMG_load(lua_State *state)
+{
+    struct imc_image_lib_state *res = state ? IMC_IMG_new() : nullptr;
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    #define REGISTER_FN(NAME) register_func(state, res, #NAME, "Image." #NAME, img_##NAME)
+
+    lua_newtable(state);
+
+    REGISTER_FN(create);
+    REGISTER_FN(get_width);
+    REGISTER_FN(get_height);
+    REGISTER_FN(state_save);
+    REGISTER_FN(state_restore);
+    REGISTER_FN(mode_set_rgb);
+    REGISTER_FN(mode_set_hsb);
+    REGISTER_FN(background);
+    REGISTER_FN(fill);
+    REGISTER_FN(no_fill);
+    REGISTER_FN(stroke);
+    REGISTER_FN(no_stroke);
+    REGISTER_FN(stroke_weight);
+    REGISTER_FN(stroke_cap);
+    REGISTER_FN(set_compositing_mode);
+    REGISTER_FN(circle);
+    REGISTER_FN(ellipse);
+    REGISTER_FN(line);
+    REGISTER_FN(point);
+    REGISTER_FN(quad);
+    REGISTER_FN(rect);
+    REGISTER_FN(square);
+    REGISTER_FN(triangle);
+    REGISTER_FN(stamp);
+    REGISTER_FN(text);
+    REGISTER_FN(text_measure);
+    REGISTER_FN(text_font);
+    REGISTER_FN(text_size);
+    REGISTER_FN(text_load);
+    REGISTER_FN(load);
+    REGISTER_FN(blit);
+    REGISTER_FN(blit_region);
+    REGISTER_FN(blit_filter);
+    REGISTER_FN(sprites);
+    REGISTER_FN(layer);
+    REGISTER_FN(layer_begin);
+    REGISTER_FN(layer_end);
+    REGISTER_FN(layer_composite);
+    REGISTER_FN(pool_stats);
+    REGISTER_FN(filter);
+
+    lua_setglobal(state, "Image");
+
+    luaL_newmetatable(state, IMG_TEXTURE_METATABLE);
+
+    lua_newtable(state);
+    lua_pushcfunction(state, img_texture_width);
+    lua_setfield(state, -2, "width");
+    lua_pushcfunction(state, img_texture_height);
+    lua_setfield(state, -2, "height");
+    lua_pushcfunction(state, img_texture_grid);
+    lua_setfield(state, -2, "grid");
+    lua_setfield(state, -2, "__index");
+
+    lua_pushcfunction(state, img_texture_gc);
+    lua_setfield(state, -2, "__gc");
+
+    lua_pop(state, 1);
+
+    luaL_newmetatable(state, IMG_LAYER_METATABLE);
+
+    lua_newtable(state);
+    lua_pushcfunction(state, img_layer_width);
+    lua_setfield(state, -2, "width");
+    lua_pushcfunction(state, img_layer_height);
+    lua_setfield(state, -2, "height");
+    lua_pushcfunction(state, img_layer_clear);
+    lua_setfield(state, -2, "clear");
+    lua_pushcfunction(state, img_layer_release);
+    lua_setfield(state, -2, "release");
+    lua_setfield(state, -2, "__index");
+
+    lua_pushcfunction(state, img_layer_release);
+    lua_setfield(state, -2, "__gc");
+
+    lua_pop(state, 1);
+
+    return res;
+}
+
+/* box filters every scale by scale block of the supersampled surface into one pixel, in premultiplied space */
+static void img_downsample(const unsigned char *src, int src_stride, uint32_t *dst, int width, int height, int scale)
+{
+    const float norm = 1.0f / (scale * scale);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            img_i32x4 sum = {};
+
+            for (int j = 0; j < scale; j++)
+            {
+                const uint32_t *row = (const uint32_t *)(src + (size_t)(y * scale + j) * src_stride) + x * scale;
+
+                for (int i = 0; i < scale; i++)
+                {
+                    const uint32_t pixel = row[i];
+
+                    sum += (img_i32x4){ pixel & 255, (pixel >> 8) & 255, (pixel >> 16) & 255, pixel >> 24 };
+                }
+            }
+
+            dst[(size_t)y * width + x] = img_pack(__builtin_convertvector(sum, img_f32x4) * norm);
+        }
+    }
+}
+
+static unsigned char *img_to_rgba(struct imc_image_lib_state *state, int *width, int *height)
+{
+    int stride;
+    uint64_t begin;
+    unsigned char *argb;
+    unsigned char *rgba;
+
+    if (!img_init_check(state))
+    {
+        return nullptr;
+    }
+
+    img_layer_unwind(state);
+    img_resolve(state);
+
+    *width = plutovg_surface_get_width(state->surface) / img_supersample(state);
+    *height = plutovg_surface_get_height(state->surface) / img_supersample(state);
+    argb = plutovg_surface_get_data(state->surface);
+    stride = plutovg_surface_get_stride(state->surface);
+
+    if (img_supersample(state) > 1)
+    {
+        stride = *width * 4;
+        argb = malloc((size_t)stride * *height);
+
+        if (!argb)
+        {
+            return nullptr;
+        }
+
+        begin = IMC_PROF_begin();
+        img_downsample(plutovg_surface_get_data(state->surface), plutovg_surface_get_stride(state->surface),
+                       (uint32_t *)argb, *width, *height, img_supersample(state));
+        IMC_PROF_end("convert.downsample", begin);
+    }
+
+    rgba = malloc((size_t)stride * *height);
+
+    if (rgba)
+    {
+        begin = IMC_PROF_begin();
+        plutovg_convert_argb_to_rgba(rgba, argb, *width, *height, stride);
+        IMC_PROF_end("convert.argb_to_rgba", begin);
+    }
+
+    if (argb != plutovg_surface_get_data(state->surface))
+    {
+        free(argb);
+    }
+
+    return rgba;
+}
+
+unsigned char *IMC_IMG_to_rgba(struct imc_image_lib_state *state, int *width, int *height)
+{
+    return state ? img_to_rgba(state, width, height) : nullptr;
+}
+
+bool IMC_IMG_write_png(struct imc_image_lib_state *state, const char *filename)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
+
+    if (!state || !filename)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_png(filename, width, height, 4, data, width * 4);
+    IMC_PROF_end("encode.png", begin);
+
+    free(data);
+
+    return result != 0;
+}
+
+bool IMC_IMG_write_png_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure)
 {
     int width;
     int height;
-    int stride;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
+
+    if (!state || !func)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_png_to_func(func, closure, width, height, 4, data, width * 4);
+    IMC_PROF_end("encode.png", begin);
+
+    free(data);
+
+    return result != 0;
+}
+
+bool IMC_IMG_write_jpg(struct imc_image_lib_state *state, const char *filename)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
     unsigned char *data;
 
     if (!state || !filename)
@@ -781,30 +2911,115 @@ bool IMC_IMG_write_bmp(struct imc_image_lib_state *state, const char *filename)
         return false;
     }
 
-    if (!img_init_check(state))
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
     {
         return false;
     }
 
-    width = plutovg_surface_get_width(state->surface);
-    height = plutovg_surface_get_height(state->surface);
-    stride = plutovg_surface_get_stride(state->surface);
-    data = plutovg_surface_get_data(state->surface);
+    begin = IMC_PROF_begin();
+    result = stbi_write_jpg(filename, width, height, 4, data, img_jpg_quality);
+    IMC_PROF_end("encode.jpg", begin);
+
+    free(data);
+
+    return result != 0;
+}
 
-    plutovg_convert_argb_to_rgba(data, data, width, height, stride);
+bool IMC_IMG_write_jpg_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
 
-    stbi_write_bmp(filename, width, height, 4, data);
+    if (!state || !func)
+    {
+        return false;
+    }
 
-    plutovg_convert_rgba_to_argb(data, data, width, height, stride);
+    data = img_to_rgba(state, &width, &height);
 
-    return true;
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_jpg_to_func(func, closure, width, height, 4, data, img_jpg_quality);
+    IMC_PROF_end("encode.jpg", begin);
+
+    free(data);
+
+    return result != 0;
+}
+
+bool IMC_IMG_write_bmp(struct imc_image_lib_state *state, const char *filename)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
+
+    if (!state || !filename)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_bmp(filename, width, height, 4, data);
+    IMC_PROF_end("encode.bmp", begin);
+
+    free(data);
+
+    return result != 0;
+}
+
+bool IMC_IMG_write_bmp_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
+
+    if (!state || !func)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_bmp_to_func(func, closure, width, height, 4, data);
+    IMC_PROF_end("encode.bmp", begin);
+
+    free(data);
+
+    return result != 0;
 }
 
 bool IMC_IMG_write_tga(struct imc_image_lib_state *state, const char *filename)
 {
     int width;
     int height;
-    int stride;
+    int result;
+    uint64_t begin;
     unsigned char *data;
 
     if (!state || !filename)
@@ -812,30 +3027,57 @@ bool IMC_IMG_write_tga(struct imc_image_lib_state *state, const char *filename)
         return false;
     }
 
-    if (!img_init_check(state))
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
     {
         return false;
     }
 
-    width = plutovg_surface_get_width(state->surface);
-    height = plutovg_surface_get_height(state->surface);
-    stride = plutovg_surface_get_stride(state->surface);
-    data = plutovg_surface_get_data(state->surface);
+    begin = IMC_PROF_begin();
+    result = stbi_write_tga(filename, width, height, 4, data);
+    IMC_PROF_end("encode.tga", begin);
 
-    plutovg_convert_argb_to_rgba(data, data, width, height, stride);
+    free(data);
 
-    stbi_write_tga(filename, width, height, 4, data);
+    return result != 0;
+}
 
-    plutovg_convert_rgba_to_argb(data, data, width, height, stride);
+bool IMC_IMG_write_tga_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure)
+{
+    int width;
+    int height;
+    int result;
+    uint64_t begin;
+    unsigned char *data;
 
-    return true;
+    if (!state || !func)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = stbi_write_tga_to_func(func, closure, width, height, 4, data);
+    IMC_PROF_end("encode.tga", begin);
+
+    free(data);
+
+    return result != 0;
 }
 
 bool IMC_IMG_write_xpm(struct imc_image_lib_state *state, const char *filename)
 {
     int width;
     int height;
-    int stride;
+    bool result;
+    uint64_t begin;
     unsigned char *data;
 
     if (!state || !filename)
@@ -843,25 +3085,294 @@ bool IMC_IMG_write_xpm(struct imc_image_lib_state *state, const char *filename)
         return false;
     }
 
-    if (!img_init_check(state))
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
     {
         return false;
     }
 
-    width = plutovg_surface_get_width(state->surface);
-    height = plutovg_surface_get_height(state->surface);
-    stride = plutovg_surface_get_stride(state->surface);
-    data = plutovg_surface_get_data(state->surface);
+    begin = IMC_PROF_begin();
+    result = IMC_write_xpm(filename, width, height, data);
+    IMC_PROF_end("encode.xpm", begin);
+
+    free(data);
+
+    return result;
+}
+
+bool IMC_IMG_write_xpm_stream(struct imc_image_lib_state *state, imc_write_func_t func, void *closure)
+{
+    int width;
+    int height;
+    bool result;
+    uint64_t begin;
+    unsigned char *data;
+
+    if (!state || !func)
+    {
+        return false;
+    }
+
+    data = img_to_rgba(state, &width, &height);
+
+    if (!data)
+    {
+        return false;
+    }
+
+    begin = IMC_PROF_begin();
+    result = IMC_write_xpm_to_func(func, closure, width, height, data);
+    IMC_PROF_end("encode.xpm", begin);
+
+    free(data);
+
+    return result;
+}
+
+/* covers thickness pixels across the line, split between the cells the band starts and ends in */
+static inline void img_plot_pair(const struct img_plot_ctx *ctx, bool steep, int major, float minor, float weight,
+                                 int thickness)
+{
+    const float start = minor - (thickness - 1) * 0.50f;
+    const int cell = floorf(start);
+    const float frac = start - cell;
+
+    for (int i = 0; i <= thickness; i++)
+    {
+        const float coverage = (i == 0 ? 1 - frac : (i == thickness ? frac : 1)) * weight;
+
+        if (steep)
+        {
+            img_plot(ctx, cell + i, major, coverage);
+        }
+        else
+        {
+            img_plot(ctx, major, cell + i, coverage);
+        }
+    }
+}
+
+/* Xiaolin Wu's line, shifted by half a pixel to match plutovg's pixel centers */
+static void img_hairline(const struct img_plot_ctx *ctx, float x0, float y0, float x1, float y1, int thickness)
+{
+    const bool steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+    const int limit = steep ? ctx->height : ctx->width;
+    float gradient;
+    float intery;
+    int first;
+    int last;
+    int begin;
+    int end;
+
+    if (!isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1))
+    {
+        return;
+    }
+
+    x0 -= 0.5f;
+    y0 -= 0.5f;
+    x1 -= 0.5f;
+    y1 -= 0.5f;
+
+    if (steep)
+    {
+        float tmp = x0;
+
+        x0 = y0;
+        y0 = tmp;
+        tmp = x1;
+        x1 = y1;
+        y1 = tmp;
+    }
+
+    if (x0 > x1)
+    {
+        float tmp = x0;
+
+        x0 = x1;
+        x1 = tmp;
+        tmp = y0;
+        y0 = y1;
+        y1 = tmp;
+    }
+
+    if (x1 < -1 || x0 > limit)
+    {
+        return;
+    }
+
+    gradient = x1 - x0 == 0 ? 1 : (y1 - y0) / (x1 - x0);
+    first = roundf(fmaxf(x0, -2));
+    last = roundf(fminf(x1, limit + 1));
+
+    img_plot_pair(ctx, steep, first, y0 + gradient * (first - x0), 1 - (x0 + 0.5f - floorf(x0 + 0.5f)), thickness);
+
+    if (last != first)
+    {
+        img_plot_pair(ctx, steep, last, y0 + gradient * (last - x0), x1 + 0.5f - floorf(x1 + 0.5f), thickness);
+    }
+
+    begin = first + 1 > 0 ? first + 1 : 0;
+    end = last - 1 < limit ? last - 1 : limit - 1;
+    intery = y0 + gradient * (begin - x0);
+
+    for (int major = begin; major <= end; major++)
+    {
+        img_plot_pair(ctx, steep, major, intery, 1, thickness);
+        intery += gradient;
+    }
+}
+
+bool IMC_IMG_hairlines(struct imc_image_lib_state *state, const float *segments, size_t count)
+{
+    struct img_plot_ctx ctx;
+    plutovg_matrix_t matrix;
+    uint64_t begin;
+
+    if (!state || !img_init_check(state))
+    {
+        return false;
+    }
+
+    if (!state->stroke)
+    {
+        return true;
+    }
+
+    ctx = img_plot_ctx_make(state, &state->stroke_color);
+    plutovg_canvas_get_matrix(state->canvas, &matrix);
+
+    if (state->fsurface)
+    {
+        img_touch_float(state);
+    }
+
+    begin = IMC_PROF_begin();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        float x0;
+        float y0;
+        float x1;
+        float y1;
+
+        plutovg_matrix_map(&matrix, segments[i * 4], segments[i * 4 + 1], &x0, &y0);
+        plutovg_matrix_map(&matrix, segments[i * 4 + 2], segments[i * 4 + 3], &x1, &y1);
+
+        /* a supersampled hairline is as many surface pixels wide so it still comes out one pixel wide */
+        img_hairline(&ctx, x0, y0, x1, y1, img_supersample(state));
+    }
+
+    IMC_PROF_end("draw.hairlines", begin);
 
-    plutovg_convert_argb_to_rgba(data, data, width, height, stride);
+    return true;
+}
+
+bool IMC_IMG_create(struct imc_image_lib_state *state, int width, int height)
+{
+    return state && img_init(state, width, height, SURFACE_PRECISION_U8);
+}
 
-    IMC_write_xpm(filename, width, height, data);
+bool IMC_IMG_get_size(struct imc_image_lib_state *state, int *width, int *height)
+{
+    if (!state || !img_init_check(state))
+    {
+        return false;
+    }
 
-    plutovg_convert_rgba_to_argb(data, data, width, height, stride);
+    *width = state->width;
+    *height = state->height;
 
     return true;
 }
 
+void IMC_IMG_set_scale(struct imc_image_lib_state *state, float scale)
+{
+    if (!state)
+    {
+        return;
+    }
+
+    img_layer_unwind(state);
+
+    state->scale = scale > 0 ? scale : 1;
+    state->initialized = false;
+}
+
+float IMC_IMG_get_scale(struct imc_image_lib_state *state)
+{
+    return state ? state->scale : 1;
+}
+
+void IMC_IMG_set_draft(struct imc_image_lib_state *state, bool draft, bool aliased)
+{
+    if (state)
+    {
+        state->draft = draft;
+        state->aliased = aliased;
+    }
+}
+
+void IMC_IMG_set_fast_encoding(bool fast)
+{
+    stbi_write_png_compression_level = fast ? 1 : 8;
+    stbi_write_force_png_filter = fast ? 0 : -1;
+    stbi_write_tga_with_rle = fast ? 0 : 1;
+    img_jpg_quality = fast ? 90 : 100;
+}
+
+unsigned char *IMC_IMG_get_data(struct imc_image_lib_state *state, int *width, int *height, int *stride)
+{
+    if (!state || !img_init_check(state))
+    {
+        return nullptr;
+    }
+
+    img_resolve(state);
+    state->exported = state->fsurface != nullptr;
+
+    *width = plutovg_surface_get_width(state->surface);
+    *height = plutovg_surface_get_height(state->surface);
+    *stride = plutovg_surface_get_stride(state->surface);
+
+    return plutovg_surface_get_data(state->surface);
+}
+
+struct imc_fsurface *IMC_IMG_get_float(struct imc_image_lib_state *state, int *width, int *height)
+{
+    if (!state || !img_init_check(state) || !state->fsurface)
+    {
+        return nullptr;
+    }
+
+    img_touch_float(state);
+
+    *width = plutovg_surface_get_width(state->surface);
+    *height = plutovg_surface_get_height(state->surface);
+
+    return state->fsurface;
+}
+
+void IMC_IMG_reset(struct imc_image_lib_state *state)
+{
+    if (!state)
+    {
+        return;
+    }
+
+    img_layer_unwind(state);
+    img_set_defaults(state);
+
+    state->initialized = false;
+    state->current_call = nullptr;
+}
+
+const char *IMC_IMG_current_call(struct imc_image_lib_state *state)
+{
+    return state ? state->current_call : nullptr;
+}
+
 void IMC_IMG_free(struct imc_image_lib_state *state)
 {
     if (!state)
@@ -869,8 +3380,23 @@ void IMC_IMG_free(struct imc_image_lib_state *state)
         return;
     }
 
+    img_layer_unwind(state);
+
     plutovg_canvas_destroy(state->canvas);
     plutovg_surface_destroy(state->surface);
+    plutovg_surface_destroy(state->scratch);
+    IMC_FSURF_free(state->fsurface);
     plutovg_font_face_cache_destroy(state->font_cache);
+    IMC_GLYPH_free(state->glyphs);
+    IMC_POOL_free(state->pool);
+
+    for (int i = 0; i < IMG_STAMP_CACHE_SIZE; i++)
+    {
+        for (int j = 0; j < IMG_STAMP_SUBPIXEL * IMG_STAMP_SUBPIXEL; j++)
+        {
+            free(state->stamps[i].masks[j]);
+        }
+    }
+
     free(state);
 }
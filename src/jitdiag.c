@@ -0,0 +1,234 @@
+#include "jitdiag.h"
+
+#include <stdio.h>
+
+#include <lauxlib.h>
+
+#define JIT_REPORT_KEY "imc.jit.report"
+
+/* same syntax as the -O and -j flags of the luajit command line */
+static const char JIT_OPTIONS_SRC[] =
+    "local options = ...\n"
+    "for flag in options:gmatch('%S+') do\n"
+    "    local kind, arg = flag:match('^%-([Oj])(.*)$')\n"
+    "    local args = {}\n"
+    "    if kind == 'O' then\n"
+    "        for opt in arg:gmatch('[^,]+') do args[#args + 1] = opt end\n"
+    "        jit.opt.start(unpack(args))\n"
+    "    elseif kind == 'j' then\n"
+    "        local cmd, cmd_args = arg:match('^([%w_-]+)=?(.*)$')\n"
+    "        if cmd == 'on' or cmd == 'off' or cmd == 'flush' then\n"
+    "            jit[cmd]()\n"
+    "        elseif cmd then\n"
+    "            for opt in cmd_args:gmatch('[^,]+') do args[#args + 1] = opt end\n"
+    "            require('jit.' .. cmd).start(unpack(args))\n"
+    "        else\n"
+    "            error(\"invalid jit option '\" .. flag .. \"'\", 0)\n"
+    "        end\n"
+    "    else\n"
+    "        error(\"invalid jit option '\" .. flag .. \"'\", 0)\n"
+    "    end\n"
+    "end\n";
+
+/*
+ * the report is two chunks to stay under the string length compilers have to support, this one collects
+ * trace events and returns what it gathered for the next one
+ */
+static const char JIT_REPORT_COLLECT_SRC[] =
+    "local jutil = require('jit.util')\n"
+    "local has_vmdef, vmdef = pcall(require, 'jit.vmdef')\n"
+    "local starts, traces, aborts = {}, {}, {}\n"
+    "local counts = { traces = 0, aborts = 0 }\n"
+    "local api_names\n"
+    "\n"
+    "local function api_name(fn)\n"
+    "    if not api_names then\n"
+    "        api_names = {}\n"
+    "        for name, api_fn in pairs(Image or {}) do api_names[api_fn] = 'Image.' .. name end\n"
+    "    end\n"
+    "    return api_names[fn]\n"
+    "end\n"
+    "\n"
+    "local function location(func, pc)\n"
+    "    local info = jutil.funcinfo(func, pc)\n"
+    "    if info.source then\n"
+    "        return info.source, info.currentline or info.linedefined\n"
+    "    end\n"
+    "    return api_name(func) or (info.ffid and has_vmdef and vmdef.ffnames[info.ffid]) or '[C]', nil\n"
+    "end\n"
+    "\n"
+    "local function format_error(err, info)\n"
+    "    local api\n"
+    "    if type(info) == 'function' then\n"
+    "        api = api_name(info)\n"
+    "        info = api or location(info)\n"
+    "    end\n"
+    "    if type(err) == 'number' then\n"
+    "        local ok, msg = pcall(string.format, has_vmdef and vmdef.traceerr[err] or 'trace error %s', has_vmdef and info or err)\n"
+    "        err = ok and msg or 'trace error ' .. err\n"
+    "    end\n"
+    "    return tostring(err), api\n"
+    "end\n"
+    "\n"
+    "local function add(list, key, entry)\n"
+    "    local found = list[key]\n"
+    "    if not found then\n"
+    "        found = entry\n"
+    "        found.count = 0\n"
+    "        list[key] = found\n"
+    "        list[#list + 1] = found\n"
+    "    end\n"
+    "    found.count = found.count + 1\n"
+    "    return found\n"
+    "end\n"
+    "\n"
+    "local function internal(source)\n"
+    "    return source:sub(1, 5) == '=jit '\n"
+    "end\n"
+    "\n"
+    "jit.attach(function(what, tr, func, pc, otr, oex)\n"
+    "    if what == 'start' then\n"
+    "        local source, line = location(func, pc)\n"
+    "        starts[tr] = { source = source, line = line }\n"
+    "    elseif what == 'stop' then\n"
+    "        local start = starts[tr] or { source = '?' }\n"
+    "        if internal(start.source) then return end\n"
+    "        local link = jutil.traceinfo(tr).linktype\n"
+    "        local entry = add(traces, start.source .. ':' .. tostring(start.line), { source = start.source, line = start.line, links = {} })\n"
+    "        entry.links[link] = (entry.links[link] or 0) + 1\n"
+    "        counts.traces = counts.traces + 1\n"
+    "    elseif what == 'abort' then\n"
+    "        local source, line = location(func, pc)\n"
+    "        if internal(source) then return end\n"
+    "        local reason, api = format_error(otr, oex)\n"
+    "        add(aborts, source .. ':' .. tostring(line) .. '\\0' .. reason, { source = source, line = line, reason = reason, api = api })\n"
+    "        counts.aborts = counts.aborts + 1\n"
+    "    end\n"
+    "end, 'trace')\n"
+    "\n"
+    "return { traces = traces, aborts = aborts, counts = counts }\n";
+
+/* takes what the collector returned and returns the function printing the report */
+static const char JIT_REPORT_PRINT_SRC[] =
+    "local report = ...\n"
+    "local traces, aborts, counts = report.traces, report.aborts, report.counts\n"
+    "local source_lines = {}\n"
+    "\n"
+    "local function line_text(source, line)\n"
+    "    if not line or source:sub(1, 1) ~= '@' then return nil end\n"
+    "    local lines = source_lines[source]\n"
+    "    if not lines then\n"
+    "        lines = {}\n"
+    "        local file = io.open(source:sub(2))\n"
+    "        if file then\n"
+    "            for text in file:lines() do lines[#lines + 1] = text end\n"
+    "            file:close()\n"
+    "        end\n"
+    "        source_lines[source] = lines\n"
+    "    end\n"
+    "    return lines[line] and lines[line]:match('^%s*(.-)%s*$')\n"
+    "end\n"
+    "\n"
+    "local function where(entry)\n"
+    "    return entry.line and entry.source:gsub('^[@=]', '') .. ':' .. entry.line or entry.source:gsub('^[@=]', '')\n"
+    "end\n"
+    "\n"
+    "local function by_count(a, b) return a.count > b.count end\n"
+    "\n"
+    "return function()\n"
+    "    local out = {}\n"
+    "    out[#out + 1] = string.format('jit: %d traces compiled, %d aborted', counts.traces, counts.aborts)\n"
+    "    table.sort(traces, by_count)\n"
+    "    table.sort(aborts, by_count)\n"
+    "    if #traces > 0 then out[#out + 1] = 'traces:' end\n"
+    "    for _, entry in ipairs(traces) do\n"
+    "        local links = {}\n"
+    "        for link, count in pairs(entry.links) do links[#links + 1] = link .. ' ' .. count end\n"
+    "        table.sort(links)\n"
+    "        out[#out + 1] = string.format('  %-40s %6d  (%s)', where(entry), entry.count, table.concat(links, ', '))\n"
+    "    end\n"
+    "    if #aborts > 0 then out[#out + 1] = 'aborts:' end\n"
+    "    for _, entry in ipairs(aborts) do\n"
+    "        local text = line_text(entry.source, entry.line)\n"
+    "        local api = entry.api or (text and text:match('Image%.[%w_]+'))\n"
+    "        out[#out + 1] = string.format('  %-40s %6dx %s%s', where(entry), entry.count, entry.reason, api and '  [' .. api .. ']' or '')\n"
+    "        if text then out[#out + 1] = '      | ' .. text end\n"
+    "    end\n"
+    "    io.stderr:write(table.concat(out, '\\n'), '\\n')\n"
+    "end\n";
+
+/* runs a chunk with the args values on top of the stack as its arguments, they are consumed either way */
+static bool jit_run(lua_State *L, const char *src, size_t size, const char *name, int args, int results)
+{
+    int pending = args;
+
+    if (luaL_loadbuffer(L, src, size, name) != LUA_OK)
+    {
+        goto failure;
+    }
+
+    lua_insert(L, -(args + 1));
+    pending = 0;
+
+    if (lua_pcall(L, args, results, 0) != LUA_OK)
+    {
+        goto failure;
+    }
+
+    return true;
+failure:
+    printf("error: %s!!\n", lua_tostring(L, -1));
+    lua_pop(L, pending + 1);
+    return false;
+}
+
+bool IMC_JIT_configure(lua_State *L, const char *options)
+{
+    if (!L || !options)
+    {
+        return false;
+    }
+
+    lua_pushstring(L, options);
+
+    return jit_run(L, JIT_OPTIONS_SRC, sizeof(JIT_OPTIONS_SRC) - 1, "=jit options", 1, 0);
+}
+
+bool IMC_JIT_report_attach(lua_State *L)
+{
+    if (!L || !jit_run(L, JIT_REPORT_COLLECT_SRC, sizeof(JIT_REPORT_COLLECT_SRC) - 1, "=jit report", 0, 1))
+    {
+        return false;
+    }
+
+    if (!jit_run(L, JIT_REPORT_PRINT_SRC, sizeof(JIT_REPORT_PRINT_SRC) - 1, "=jit report", 1, 1))
+    {
+        return false;
+    }
+
+    lua_setfield(L, LUA_REGISTRYINDEX, JIT_REPORT_KEY);
+
+    return true;
+}
+
+void IMC_JIT_report_print(lua_State *L)
+{
+    if (!L)
+    {
+        return;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, JIT_REPORT_KEY);
+
+    if (!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+    {
+        printf("error: %s!!\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
@@ -1,61 +1,420 @@
 #include "langvm.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <stc/cstr.h>
+
+#include "arena.h"
+#include "bccache.h"
+#include "jitdiag.h"
+#include "luaprof.h"
+#include "luabuf.h"
 #include "imagelib.h"
+#include "noise.h"
+#include "density.h"
+#include "spatial.h"
+#include "geometry.h"
+#include "particles.h"
+#include "profile.h"
+
+#define DEPS_REGISTRY_KEY IMC_VM_DEPS_KEY
+#define BASELINE_GLOBALS_KEY "imc.baseline.globals"
+#define BASELINE_LOADED_KEY "imc.baseline.loaded"
 
 struct imc_lang_vm
 {
     lua_State *l_state;
     struct imc_image_lib_state *imgst;
+    struct imc_noise_state *noisest;
+    struct imc_arena *arena;
+    struct imc_lua_prof *lua_prof;
+    struct imc_vm_conf conf;
+    cstr error;
 };
 
-struct imc_lang_vm *IMC_VM_new()
+static int vm_module_loader(lua_State *L)
+{
+    struct imc_lang_vm *vm = lua_touserdata(L, lua_upvalueindex(1));
+    const char *name = luaL_checkstring(L, 1);
+    const char *filename;
+    uint64_t begin;
+    int status;
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+
+    if (!lua_isfunction(L, -1))
+    {
+        return 0;
+    }
+
+    lua_pushstring(L, name);
+    lua_getfield(L, -3, "path");
+    lua_call(L, 2, 1);
+
+    if (!lua_isstring(L, -1))
+    {
+        return 0;
+    }
+
+    filename = lua_tostring(L, -1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, DEPS_REGISTRY_KEY);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, true);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (!vm->conf.bytecode_cache)
+    {
+        return 0;
+    }
+
+    begin = IMC_PROF_begin();
+    status = IMC_BC_loadfile(vm->conf.bytecode_cache, L, filename);
+    IMC_PROF_end("module.load", begin);
+
+    if (status != LUA_OK)
+    {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, filename, lua_tostring(L, -1));
+    }
+
+    return 1;
+}
+
+static void vm_install_module_loader(struct imc_lang_vm *vm)
+{
+    lua_State *L = vm->l_state;
+    int num_loaders;
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, DEPS_REGISTRY_KEY);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaders");
+
+    num_loaders = lua_objlen(L, -1);
+
+    for (int i = num_loaders; i >= 2; i--)
+    {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushlightuserdata(L, vm);
+    lua_pushcclosure(L, vm_module_loader, 1);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 2);
+}
+
+static void vm_snapshot_table(lua_State *L, int idx, const char *baseline_key)
+{
+    lua_newtable(L);
+    lua_pushnil(L);
+
+    while (lua_next(L, idx))
+    {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    lua_setfield(L, LUA_REGISTRYINDEX, baseline_key);
+}
+
+static void vm_restore_table(lua_State *L, int idx, const char *baseline_key)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, baseline_key);
+    lua_pushnil(L);
+
+    while (lua_next(L, idx))
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+
+        if (lua_isnil(L, -1))
+        {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, idx);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    /* adding keys while walking the table is not allowed, so overwritten and removed ones come back after */
+    lua_pushnil(L);
+
+    while (lua_next(L, -2))
+    {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, idx);
+    }
+
+    lua_pop(L, 1);
+}
+
+static void vm_snapshot(lua_State *L)
+{
+    vm_snapshot_table(L, LUA_GLOBALSINDEX, BASELINE_GLOBALS_KEY);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    vm_snapshot_table(L, lua_gettop(L), BASELINE_LOADED_KEY);
+    lua_pop(L, 2);
+}
+
+static int vm_panic(lua_State *L)
+{
+    printf("error: unprotected error in lua (%s)!!\n", lua_tostring(L, -1));
+    return 0;
+}
+
+static bool vm_open_state(struct imc_lang_vm *vm)
+{
+    if (vm->arena)
+    {
+        vm->l_state = lua_newstate(IMC_ARENA_lua_alloc, vm->arena);
+
+        if (vm->l_state)
+        {
+            lua_atpanic(vm->l_state, vm_panic);
+        }
+        else if (!vm->conf.mem_limit)
+        {
+            /* luajit without GC64 only runs on its own allocator */
+            printf("warning: lua state can not use the arena allocator, falling back to the default one!!\n");
+            IMC_ARENA_free(vm->arena);
+            vm->arena = nullptr;
+        }
+    }
+
+    if (!vm->arena)
+    {
+        vm->l_state = luaL_newstate();
+    }
+
+    if (!vm->l_state)
+    {
+        return false;
+    }
+
+    luaL_openlibs(vm->l_state);
+
+    vm_install_module_loader(vm);
+
+    if (!IMC_LBUF_load(vm->l_state))
+    {
+        return false;
+    }
+
+    vm->imgst = IMC_IMG_load(vm->l_state);
+
+    if (!vm->imgst)
+    {
+        return false;
+    }
+
+    IMC_IMG_set_scale(vm->imgst, vm->conf.preview > 0 ? vm->conf.preview : vm->conf.supersample);
+    IMC_IMG_set_draft(vm->imgst, vm->conf.preview > 0, vm->conf.aliased);
+
+    vm->noisest = IMC_NOISE_load(vm->l_state);
+
+    if (!vm->noisest)
+    {
+        return false;
+    }
+
+    if (!IMC_DENSITY_load(vm->l_state, vm->imgst))
+    {
+        return false;
+    }
+
+    if (!IMC_SPATIAL_load(vm->l_state))
+    {
+        return false;
+    }
+
+    if (!IMC_GEOMETRY_load(vm->l_state))
+    {
+        return false;
+    }
+
+    if (!IMC_PARTICLES_load(vm->l_state, vm->imgst, vm->noisest))
+    {
+        return false;
+    }
+
+    if (vm->conf.jit_options && !IMC_JIT_configure(vm->l_state, vm->conf.jit_options))
+    {
+        return false;
+    }
+
+    if (vm->conf.jit_report && !IMC_JIT_report_attach(vm->l_state))
+    {
+        return false;
+    }
+
+    vm_snapshot(vm->l_state);
+
+    IMC_LPROF_start(vm->lua_prof, vm->l_state, vm->imgst);
+
+    return true;
+}
+
+static void vm_close_state(struct imc_lang_vm *vm)
+{
+    if (vm->l_state)
+    {
+        IMC_LPROF_stop(vm->lua_prof, vm->l_state);
+        lua_close(vm->l_state);
+        vm->l_state = nullptr;
+    }
+
+    IMC_IMG_free(vm->imgst);
+    vm->imgst = nullptr;
+
+    IMC_NOISE_free(vm->noisest);
+    vm->noisest = nullptr;
+}
+
+struct imc_lang_vm *IMC_VM_new(const struct imc_vm_conf *conf)
 {
-    struct imc_lang_vm *res = malloc(sizeof(struct imc_lang_vm));
+    const uint64_t begin = IMC_PROF_begin();
+    struct imc_lang_vm *res = calloc(1, sizeof(struct imc_lang_vm));
 
     if (!res)
     {
         goto failure;
     }
 
-    res->l_state = luaL_newstate();
+    if (conf)
+    {
+        res->conf = *conf;
+    }
 
-    if (!res->l_state)
+    if (res->conf.use_arena || res->conf.mem_limit)
     {
-        goto failure;
+        res->arena = IMC_ARENA_new(res->conf.mem_limit);
+
+        if (!res->arena)
+        {
+            goto failure;
+        }
     }
 
-    luaL_openlibs(res->l_state);
+    if (res->conf.lua_profile)
+    {
+        res->lua_prof = IMC_LPROF_new();
 
-    res->imgst = IMC_IMG_load(res->l_state);
+        if (!res->lua_prof)
+        {
+            goto failure;
+        }
+    }
 
-    if (!res->imgst)
+    if (!vm_open_state(res))
     {
+        if (res->arena && !res->l_state)
+        {
+            printf("error: failed to create lua state with a memory limit of %zu bytes!!\n", res->conf.mem_limit);
+        }
+
         goto failure;
     }
 
+    IMC_PROF_end("vm.new", begin);
+
     return res;
 failure:
     IMC_VM_free(res);
     return nullptr;
 }
 
+bool IMC_VM_recycle(struct imc_lang_vm *vm)
+{
+    if (!vm)
+    {
+        return false;
+    }
+
+    /* without an arena there is nothing to drop in bulk, restoring the baseline is cheaper than a new state */
+    if (!vm->arena)
+    {
+        return IMC_VM_reset(vm);
+    }
+
+    vm_close_state(vm);
+    IMC_ARENA_reset(vm->arena);
+
+    return vm_open_state(vm);
+}
+
+bool IMC_VM_reset(struct imc_lang_vm *vm)
+{
+    lua_State *L;
+
+    if (!vm || !vm->l_state)
+    {
+        return false;
+    }
+
+    L = vm->l_state;
+
+    lua_settop(L, 0);
+
+    vm_restore_table(L, LUA_GLOBALSINDEX, BASELINE_GLOBALS_KEY);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    vm_restore_table(L, lua_gettop(L), BASELINE_LOADED_KEY);
+    lua_pop(L, 2);
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, DEPS_REGISTRY_KEY);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    IMC_IMG_reset(vm->imgst);
+    IMC_NOISE_reset(vm->noisest);
+
+    return true;
+}
+
+static void vm_report_error(struct imc_lang_vm *vm)
+{
+    const char *msg = lua_tostring(vm->l_state, lua_gettop(vm->l_state));
+
+    cstr_assign(&vm->error, msg ? msg : "unknown error");
+    puts(cstr_str(&vm->error));
+    lua_pop(vm->l_state, lua_gettop(vm->l_state));
+}
+
 bool IMC_VM_run_src(struct imc_lang_vm *vm, const char *src)
 {
-    if (!vm || !src)
+    int status;
+    uint64_t begin;
+
+    if (!vm || !vm->l_state || !src)
     {
         return false;
     }
 
-    if (luaL_dostring(vm->l_state, src) != LUA_OK)
+    begin = IMC_PROF_begin();
+    status = luaL_dostring(vm->l_state, src);
+    IMC_PROF_end("script", begin);
+
+    if (status != LUA_OK)
     {
-        puts(lua_tostring(vm->l_state, lua_gettop(vm->l_state)));
-        lua_pop(vm->l_state, lua_gettop(vm->l_state));
+        vm_report_error(vm);
         return false;
     }
 
@@ -64,46 +423,203 @@ bool IMC_VM_run_src(struct imc_lang_vm *vm, const char *src)
 
 bool IMC_VM_run_src_file(struct imc_lang_vm *vm, const char *filename)
 {
-    if (!vm || !filename)
+    int status;
+    uint64_t begin;
+
+    if (!vm || !vm->l_state || !filename)
     {
         return false;
     }
 
-    if (luaL_dofile(vm->l_state, filename) != LUA_OK)
+    begin = IMC_PROF_begin();
+    status = IMC_BC_loadfile(vm->conf.bytecode_cache, vm->l_state, filename);
+    IMC_PROF_end("script.load", begin);
+
+    if (status == LUA_OK)
+    {
+        begin = IMC_PROF_begin();
+        status = lua_pcall(vm->l_state, 0, LUA_MULTRET, 0);
+        IMC_PROF_end("script", begin);
+    }
+
+    if (status != LUA_OK)
     {
-        puts(lua_tostring(vm->l_state, lua_gettop(vm->l_state)));
-        lua_pop(vm->l_state, lua_gettop(vm->l_state));
+        vm_report_error(vm);
         return false;
     }
 
     return true;
 }
 
+const char *IMC_VM_get_error(struct imc_lang_vm *vm)
+{
+    return vm ? cstr_str(&vm->error) : nullptr;
+}
+
+bool IMC_VM_set_param(struct imc_lang_vm *vm, const char *name, const char *value)
+{
+    if (!vm || !name || !value)
+    {
+        return false;
+    }
+
+    lua_getglobal(vm->l_state, "Params");
+
+    if (!lua_istable(vm->l_state, -1))
+    {
+        lua_pop(vm->l_state, 1);
+        lua_newtable(vm->l_state);
+        lua_pushvalue(vm->l_state, -1);
+        lua_setglobal(vm->l_state, "Params");
+    }
+
+    lua_pushstring(vm->l_state, value);
+    lua_setfield(vm->l_state, -2, name);
+    lua_pop(vm->l_state, 1);
+
+    return true;
+}
+
+/* stays set until IMC_VM_clear_interrupt so a script can not pcall its way past it */
+static void vm_interrupt_hook(lua_State *L, lua_Debug *ar)
+{
+    (void)ar;
+
+    luaL_error(L, "interrupted");
+}
+
+void IMC_VM_interrupt(struct imc_lang_vm *vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+
+    lua_sethook(vm->l_state, vm_interrupt_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
+void IMC_VM_clear_interrupt(struct imc_lang_vm *vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+
+    lua_sethook(vm->l_state, nullptr, 0, 0);
+}
+
+bool IMC_VM_foreach_dep(struct imc_lang_vm *vm, imc_dep_func_t func, void *closure)
+{
+    bool result = true;
+
+    if (!vm || !func)
+    {
+        return false;
+    }
+
+    lua_getfield(vm->l_state, LUA_REGISTRYINDEX, DEPS_REGISTRY_KEY);
+    lua_pushnil(vm->l_state);
+
+    while (lua_next(vm->l_state, -2))
+    {
+        if (result && lua_type(vm->l_state, -2) == LUA_TSTRING)
+        {
+            result = func(closure, lua_tostring(vm->l_state, -2));
+        }
+
+        lua_pop(vm->l_state, 1);
+    }
+
+    lua_pop(vm->l_state, 1);
+
+    return result;
+}
+
+void IMC_VM_print_mem_stats(struct imc_lang_vm *vm)
+{
+    struct imc_arena_stats stats;
+
+    if (!vm || !vm->arena)
+    {
+        return;
+    }
+
+    stats = IMC_ARENA_get_stats(vm->arena);
+
+    printf("memory: peak %.1f KiB, %.1f KiB allocated in %zu allocations, %.1f KiB reserved\n",
+           stats.peak / 1024.0, stats.total / 1024.0, stats.allocations, stats.reserved / 1024.0);
+}
+
+void IMC_VM_print_jit_report(struct imc_lang_vm *vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+
+    IMC_JIT_report_print(vm->l_state);
+}
+
+bool IMC_VM_write_lua_profile(struct imc_lang_vm *vm, const char *filename)
+{
+    return vm ? IMC_LPROF_write(vm->lua_prof, filename) : false;
+}
+
+inline unsigned char *IMC_VM_to_rgba(struct imc_lang_vm *vm, int *width, int *height)
+{
+    return IMC_IMG_to_rgba(vm->imgst, width, height);
+}
+
 inline bool IMC_VM_write_png(struct imc_lang_vm *vm, const char *filename)
 {
     return IMC_IMG_write_png(vm->imgst, filename);
 }
 
+inline bool IMC_VM_write_png_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure)
+{
+    return IMC_IMG_write_png_stream(vm->imgst, func, closure);
+}
+
 inline bool IMC_VM_write_jpg(struct imc_lang_vm *vm, const char *filename)
 {
     return IMC_IMG_write_jpg(vm->imgst, filename);
 }
 
+inline bool IMC_VM_write_jpg_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure)
+{
+    return IMC_IMG_write_jpg_stream(vm->imgst, func, closure);
+}
+
 inline bool IMC_VM_write_bmp(struct imc_lang_vm *vm, const char *filename)
 {
     return IMC_IMG_write_bmp(vm->imgst, filename);
 }
 
+inline bool IMC_VM_write_bmp_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure)
+{
+    return IMC_IMG_write_bmp_stream(vm->imgst, func, closure);
+}
+
 inline bool IMC_VM_write_tga(struct imc_lang_vm *vm, const char *filename)
 {
     return IMC_IMG_write_tga(vm->imgst, filename);
 }
 
+inline bool IMC_VM_write_tga_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure)
+{
+    return IMC_IMG_write_tga_stream(vm->imgst, func, closure);
+}
+
 inline bool IMC_VM_write_xpm(struct imc_lang_vm *vm, const char *filename)
 {
     return IMC_IMG_write_xpm(vm->imgst, filename);
 }
 
+inline bool IMC_VM_write_xpm_stream(struct imc_lang_vm *vm, imc_write_func_t func, void *closure)
+{
+    return IMC_IMG_write_xpm_stream(vm->imgst, func, closure);
+}
+
 void IMC_VM_free(struct imc_lang_vm *vm)
 {
     if (!vm)
@@ -111,7 +627,9 @@ void IMC_VM_free(struct imc_lang_vm *vm)
         return;
     }
 
-    lua_close(vm->l_state);
-    IMC_IMG_free(vm->imgst);
+    vm_close_state(vm);
+    IMC_LPROF_free(vm->lua_prof);
+    IMC_ARENA_free(vm->arena);
+    cstr_drop(&vm->error);
     free(vm);
 }
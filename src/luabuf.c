@@ -0,0 +1,97 @@
+#include "luabuf.h"
+
+#include <lauxlib.h>
+
+/* LUA_TCDATA, LuaJIT does not export it */
+#define LBUF_TCDATA 10
+
+/* the address is the registry key of the checker */
+static const char lbuf_checker_key;
+
+/*
+ * returns the element count of a double array or nil for any other cdata, the FFI and the functions it
+ * uses are bound when the state is set up so scripts cannot swap them
+ */
+static const char LBUF_CHECKER[] =
+    "local ffi, tostring, match = ...\n"
+    "return function(value)\n"
+    "    local element = match(tostring(ffi.typeof(value)), '^ctype<(.-) ?%[[%d?]*%]>$')\n"
+    "    if element ~= 'double' then\n"
+    "        return nil\n"
+    "    end\n"
+    "    return ffi.sizeof(value) / ffi.sizeof('double')\n"
+    "end\n";
+
+bool IMC_LBUF_load(lua_State *state)
+{
+    if (!state)
+    {
+        return false;
+    }
+
+    lua_pushlightuserdata(state, (void *)&lbuf_checker_key);
+
+    if (luaL_loadbuffer(state, LBUF_CHECKER, sizeof(LBUF_CHECKER) - 1, "=luabuf") != 0)
+    {
+        lua_pop(state, 2);
+        return false;
+    }
+
+    lua_getfield(state, LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(state, -1, "ffi");
+    lua_remove(state, -2);
+    lua_getglobal(state, "tostring");
+    lua_getglobal(state, "string");
+    lua_getfield(state, -1, "match");
+    lua_remove(state, -2);
+
+    if (lua_pcall(state, 3, 1, 0) != 0)
+    {
+        lua_pop(state, 2);
+        return false;
+    }
+
+    lua_rawset(state, LUA_REGISTRYINDEX);
+
+    return true;
+}
+
+size_t IMC_LBUF_check(lua_State *state, int idx, double **data)
+{
+    size_t length;
+
+    *data = nullptr;
+
+    if (lua_istable(state, idx))
+    {
+        return lua_objlen(state, idx);
+    }
+
+    luaL_argcheck(state, lua_type(state, idx) == LBUF_TCDATA && lua_topointer(state, idx), idx,
+                  "expected a table or a double array");
+
+    if (idx < 0 && idx > LUA_REGISTRYINDEX)
+    {
+        idx = lua_gettop(state) + idx + 1;
+    }
+
+    luaL_checkstack(state, 2, nullptr);
+    lua_pushlightuserdata(state, (void *)&lbuf_checker_key);
+    lua_rawget(state, LUA_REGISTRYINDEX);
+
+    if (lua_isnil(state, -1))
+    {
+        luaL_error(state, "double arrays are not available");
+        return 0;
+    }
+
+    lua_pushvalue(state, idx);
+    lua_call(state, 1, 1);
+    luaL_argcheck(state, lua_isnumber(state, -1), idx, "expected a double array of known length");
+    length = lua_tointeger(state, -1);
+    lua_pop(state, 1);
+
+    *data = (double *)lua_topointer(state, idx);
+
+    return length;
+}
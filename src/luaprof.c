@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+
+#include "luaprof.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <luajit.h>
+
+#include "hash.h"
+#include "imagelib.h"
+
+#define LPROF_MODE "i1"
+#define LPROF_STACK_FORMAT "pFZ;"
+#define LPROF_MAX_DEPTH 64
+#define LPROF_MAX_STACK 4096
+
+struct lprof_entry
+{
+    uint64_t hash;
+    char *stack;
+    size_t samples;
+};
+
+struct imc_lua_prof
+{
+    struct imc_image_lib_state *imgst;
+    struct lprof_entry *entries;
+    size_t num_entries;
+    size_t capacity;
+};
+
+static bool lprof_grow(struct imc_lua_prof *prof)
+{
+    const size_t capacity = prof->capacity ? prof->capacity * 2 : 256;
+    struct lprof_entry *entries = calloc(capacity, sizeof(struct lprof_entry));
+
+    if (!entries)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < prof->capacity; i++)
+    {
+        size_t slot;
+
+        if (!prof->entries[i].stack)
+        {
+            continue;
+        }
+
+        slot = prof->entries[i].hash & (capacity - 1);
+
+        while (entries[slot].stack)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        entries[slot] = prof->entries[i];
+    }
+
+    free(prof->entries);
+    prof->entries = entries;
+    prof->capacity = capacity;
+
+    return true;
+}
+
+static void lprof_add(struct imc_lua_prof *prof, const char *stack, size_t len, int samples)
+{
+    size_t slot;
+    const uint64_t hash = IMC_hash(IMC_HASH_INIT, stack, len);
+
+    if ((prof->num_entries + 1) * 4 > prof->capacity * 3 && !lprof_grow(prof))
+    {
+        return;
+    }
+
+    slot = hash & (prof->capacity - 1);
+
+    while (prof->entries[slot].stack)
+    {
+        struct lprof_entry *entry = &prof->entries[slot];
+
+        if (entry->hash == hash && strncmp(entry->stack, stack, len) == 0 && entry->stack[len] == '\0')
+        {
+            entry->samples += samples;
+            return;
+        }
+
+        slot = (slot + 1) & (prof->capacity - 1);
+    }
+
+    prof->entries[slot].stack = strndup(stack, len);
+
+    if (prof->entries[slot].stack)
+    {
+        prof->entries[slot].hash = hash;
+        prof->entries[slot].samples = samples;
+        prof->num_entries++;
+    }
+}
+
+static void lprof_callback(void *data, lua_State *L, int samples, int vmstate)
+{
+    size_t len;
+    char stack[LPROF_MAX_STACK];
+    struct imc_lua_prof *prof = data;
+    const char *leaf = nullptr;
+    const char *dump = luaJIT_profile_dumpstack(L, LPROF_STACK_FORMAT, -LPROF_MAX_DEPTH, &len);
+
+    len = len < sizeof(stack) - 64 ? len : sizeof(stack) - 64;
+    memcpy(stack, dump, len);
+
+    switch (vmstate)
+    {
+        case 'C':
+            leaf = IMC_IMG_current_call(prof->imgst);
+
+            /* replace the "@0x..." frames of the C function and its profiling wrapper with its Image.* name */
+            while (leaf && len)
+            {
+                char *last = memrchr(stack, ';', len);
+                char *frame = last ? last + 1 : stack;
+
+                if (frame >= stack + len || *frame != '@')
+                {
+                    break;
+                }
+
+                len = last ? (size_t)(last - stack) : 0;
+            }
+            break;
+        case 'G':
+            leaf = "[GC]";
+            break;
+        case 'J':
+            leaf = "[JIT compiler]";
+            break;
+    }
+
+    if (leaf)
+    {
+        len += snprintf(stack + len, sizeof(stack) - len, "%s%s", len ? ";" : "", leaf);
+    }
+
+    lprof_add(prof, stack, len, samples);
+}
+
+struct imc_lua_prof *IMC_LPROF_new()
+{
+    return calloc(1, sizeof(struct imc_lua_prof));
+}
+
+void IMC_LPROF_start(struct imc_lua_prof *prof, lua_State *L, struct imc_image_lib_state *imgst)
+{
+    if (!prof || !L)
+    {
+        return;
+    }
+
+    prof->imgst = imgst;
+    luaJIT_profile_start(L, LPROF_MODE, lprof_callback, prof);
+}
+
+void IMC_LPROF_stop(struct imc_lua_prof *prof, lua_State *L)
+{
+    if (!prof || !L)
+    {
+        return;
+    }
+
+    luaJIT_profile_stop(L);
+    prof->imgst = nullptr;
+}
+
+bool IMC_LPROF_write(struct imc_lua_prof *prof, const char *filename)
+{
+    FILE *out;
+
+    if (!prof || !filename)
+    {
+        return false;
+    }
+
+    out = fopen(filename, "w");
+
+    if (!out)
+    {
+        printf("error: failed to open lua profile output '%s' (%m)!!\n", filename);
+        return false;
+    }
+
+    for (size_t i = 0; i < prof->capacity; i++)
+    {
+        if (prof->entries[i].stack)
+        {
+            fprintf(out, "%s %zu\n", prof->entries[i].stack, prof->entries[i].samples);
+        }
+    }
+
+    return fclose(out) == 0;
+}
+
+void IMC_LPROF_free(struct imc_lua_prof *prof)
+{
+    if (!prof)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < prof->capacity; i++)
+    {
+        free(prof->entries[i].stack);
+    }
+
+    free(prof->entries);
+    free(prof);
+}
@@ -1,8 +1,21 @@
 #include <stdio.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <stc/csview.h>
 
+#include "cache.h"
+#include "assets.h"
+#include "compare.h"
+#include "watch.h"
+#include "bccache.h"
+#include "server.h"
 #include "langvm.h"
+#include "timing.h"
+#include "trace.h"
+#include "profile.h"
 #include "arg_parse.h"
 
 enum file_format
@@ -19,6 +32,32 @@ struct state
 {
     cstr input_file;
     cstr output_file;
+    cstr cache_dir;
+    bool cache_stats;
+    bool watch;
+    cstr serve_socket;
+    cstr jobs;
+    cstr serve_queue;
+    cstr serve_deadline;
+    cstr bytecode_cache_dir;
+    bool arena;
+    cstr mem_limit;
+    bool mem_stats;
+    bool profile;
+    cstr profile_out;
+    cstr trace_out;
+    cstr lua_profile_out;
+    bool jit_report;
+    cstr jit_options;
+    cstr compare_ref;
+    cstr compare_list;
+    cstr tolerance;
+    cstr max_mismatch;
+    cstr heatmap_dir;
+    cstr ssaa;
+    cstr preview;
+    bool preview_aliased;
+    struct imc_vm_conf vm_conf;
     enum file_format format;
 };
 
@@ -72,6 +111,158 @@ static bool parse_args(struct state *state, int argc, char **argv)
             .description = "Image file output.",
             .type = ARG_TYPE_ARG_REQUIRED,
         },
+        {
+            .string_val = &state->cache_dir,
+            .long_opt = "cache-dir",
+            .description = "Reuse previous renders from this directory when the script, its modules and the options are unchanged.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .flag_val = &state->cache_stats,
+            .long_opt = "cache-stats",
+            .description = "Print the render cache hit rate.",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .flag_val = &state->watch,
+            .short_opt = 'w',
+            .long_opt = "watch",
+            .description = "Re-render whenever the input script or one of its modules changes.",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .string_val = &state->serve_socket,
+            .long_opt = "serve",
+            .description = "Serve render requests on this unix socket instead of rendering a single file.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->jobs,
+            .short_opt = 'j',
+            .long_opt = "jobs",
+            .description = "Number of worker threads (default: number of processors).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->serve_queue,
+            .long_opt = "serve-queue",
+            .description = "Maximum number of pending requests before new ones are rejected (default: 64).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->serve_deadline,
+            .long_opt = "serve-deadline",
+            .description = "Default per-request deadline in milliseconds, 0 disables it (default: 10000).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->bytecode_cache_dir,
+            .long_opt = "bytecode-cache",
+            .description = "Keep compiled LuaJIT bytecode of scripts and modules in this directory.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .flag_val = &state->arena,
+            .long_opt = "arena",
+            .description = "Allocate Lua memory from size-class pools that are released in bulk.",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .string_val = &state->mem_limit,
+            .long_opt = "mem-limit",
+            .description = "Fail scripts that use more than this many MiB of Lua memory (implies --arena).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .flag_val = &state->mem_stats,
+            .long_opt = "mem-stats",
+            .description = "Print peak and total Lua memory allocated (implies --arena).",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .flag_val = &state->profile,
+            .long_opt = "profile",
+            .description = "Print time spent in VM setup, the script, each Image function and each encoder to stderr.",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .string_val = &state->profile_out,
+            .long_opt = "profile-out",
+            .description = "Write the profile as JSON to this file instead (implies --profile).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->trace_out,
+            .long_opt = "trace",
+            .description = "Write a Chrome trace-event timeline of the run to this file.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->lua_profile_out,
+            .long_opt = "lua-profile",
+            .description = "Sample Lua stacks with the LuaJIT profiler and write them as collapsed stacks to this file.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .flag_val = &state->jit_report,
+            .long_opt = "jit-report",
+            .description = "Print compiled JIT traces and trace aborts with their source lines to stderr.",
+            .type = ARG_TYPE_FLAG,
+        },
+        {
+            .string_val = &state->jit_options,
+            .long_opt = "jit-opt",
+            .description = "LuaJIT flags as on the luajit command line, e.g. \"-O3 -Ohotloop=10 -joff\".",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->compare_ref,
+            .long_opt = "compare",
+            .description = "Compare the rendered input against this reference image instead of writing an output file.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->compare_list,
+            .long_opt = "compare-list",
+            .description = "Compare many renders on --jobs threads, one \"<script> <reference>\" pair per line of this file.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->tolerance,
+            .long_opt = "tolerance",
+            .description = "Per-channel difference a compared pixel may have, 0 to 255 (default: 0).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->max_mismatch,
+            .long_opt = "max-mismatch",
+            .description = "Number of pixels allowed over the tolerance before a comparison fails (default: 0).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->heatmap_dir,
+            .long_opt = "heatmap-dir",
+            .description = "Write heatmaps of failed comparisons here instead of next to the reference.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->ssaa,
+            .long_opt = "ssaa",
+            .description = "Draw at this many times the image size and box filter it down before encoding, 1 to 8 (default: 1).",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .string_val = &state->preview,
+            .long_opt = "preview",
+            .description = "Draft render at this fraction of the image size, above 0 up to 1, with fast encoding and no Image.filter.",
+            .type = ARG_TYPE_ARG_REQUIRED,
+        },
+        {
+            .flag_val = &state->preview_aliased,
+            .long_opt = "preview-aliased",
+            .description = "Also plot lines, stamps, text and blits without antialiasing in --preview renders.",
+            .type = ARG_TYPE_FLAG,
+        },
         {},
     };
 
@@ -89,11 +280,36 @@ static bool parse_args(struct state *state, int argc, char **argv)
         return false;
     }
 
+    if (state->cache_stats && cstr_is_empty(&state->cache_dir))
+    {
+        printf("error: cache directory required (--cache-dir)!!\n");
+        return false;
+    }
+
+    if (state->cache_stats && cstr_is_empty(&state->input_file) && cstr_is_empty(&state->output_file))
+    {
+        return true;
+    }
+
+    if (!cstr_is_empty(&state->serve_socket) || !cstr_is_empty(&state->compare_list))
+    {
+        return true;
+    }
+
     if (cstr_is_empty(&state->input_file))
     {
         printf("error: input file required (-i,--input)!!\n");
         return false;
     }
+    else if (!cstr_is_empty(&state->compare_ref) && !cstr_is_empty(&state->output_file))
+    {
+        printf("error: --compare does not write an output file!!\n");
+        return false;
+    }
+    else if (!cstr_is_empty(&state->compare_ref))
+    {
+        return true;
+    }
     else if (cstr_is_empty(&state->output_file))
     {
         printf("error: output file required (-o,--output)!!\n");
@@ -127,50 +343,443 @@ static bool parse_args(struct state *state, int argc, char **argv)
     return true;
 }
 
-int main(int argc, char **argv)
+static bool parse_int_opt(const cstr *opt, const char *name, int min, int *val)
 {
-    struct imc_lang_vm *vm;
-    struct state state =
+    char *end;
+    long parsed;
+
+    if (cstr_is_empty(opt))
     {
-    };
+        return true;
+    }
 
-    if (!parse_args(&state, argc, argv))
+    parsed = strtol(cstr_str(opt), &end, 10);
+
+    if (*end != '\0' || parsed < min || parsed > INT_MAX)
+    {
+        printf("error: invalid value for --%s!!\n", name);
+        return false;
+    }
+
+    *val = parsed;
+
+    return true;
+}
+
+static bool parse_float_opt(const cstr *opt, const char *name, float min, float max, float *val)
+{
+    char *end;
+    float parsed;
+
+    if (cstr_is_empty(opt))
+    {
+        return true;
+    }
+
+    parsed = strtof(cstr_str(opt), &end);
+
+    if (*end != '\0' || !(parsed > min && parsed <= max))
+    {
+        printf("error: invalid value for --%s!!\n", name);
+        return false;
+    }
+
+    *val = parsed;
+
+    return true;
+}
+
+static int serve(struct state *state)
+{
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int queue = 64;
+    int deadline = 10000;
+
+    if (state->vm_conf.lua_profile)
+    {
+        /* the LuaJIT profiler samples a single lua state per process */
+        printf("error: --lua-profile can not be used with --serve!!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!parse_int_opt(&state->jobs, "jobs", 1, &jobs) ||
+        !parse_int_opt(&state->serve_queue, "serve-queue", 1, &queue) ||
+        !parse_int_opt(&state->serve_deadline, "serve-deadline", 0, &deadline))
     {
         return EXIT_FAILURE;
     }
 
-    vm = IMC_VM_new();
+    return IMC_SERVER_run(&state->vm_conf, cstr_str(&state->serve_socket), jobs > 0 ? jobs : 1, queue, deadline) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    if (!vm)
+static int compare(struct state *state)
+{
+    bool ok;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int tolerance = 0;
+    int max_mismatch = 0;
+    struct imc_cmp_conf conf = {};
+
+    if (state->vm_conf.lua_profile && !cstr_is_empty(&state->compare_list))
     {
+        printf("error: --lua-profile can not be used with --compare-list!!\n");
         return EXIT_FAILURE;
     }
 
-    IMC_VM_run_src_file(vm, cstr_str(&state.input_file));
+    if (!parse_int_opt(&state->jobs, "jobs", 1, &jobs) ||
+        !parse_int_opt(&state->tolerance, "tolerance", 0, &tolerance) ||
+        !parse_int_opt(&state->max_mismatch, "max-mismatch", 0, &max_mismatch))
+    {
+        return EXIT_FAILURE;
+    }
 
-    switch (state.format)
+    if (tolerance > 255)
+    {
+        printf("error: invalid value for --tolerance!!\n");
+        return EXIT_FAILURE;
+    }
+
+    conf.tolerance = tolerance;
+    conf.max_mismatch = max_mismatch;
+    conf.heatmap_dir = cstr_is_empty(&state->heatmap_dir) ? nullptr : cstr_str(&state->heatmap_dir);
+
+    if (!cstr_is_empty(&state->compare_list))
+    {
+        ok = IMC_CMP_run_list(&state->vm_conf, &conf, cstr_str(&state->compare_list), jobs > 0 ? jobs : 1);
+    }
+    else
+    {
+        ok = IMC_CMP_run(&state->vm_conf, &conf, cstr_str(&state->input_file), cstr_str(&state->compare_ref));
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static cstr cache_params(const struct state *state)
+{
+    return cstr_from_fmt("format=%d ssaa=%d preview=%g aliased=%d jit=%s", state->format, state->vm_conf.supersample,
+                         state->vm_conf.preview, state->vm_conf.aliased, cstr_str(&state->jit_options));
+}
+
+static bool cache_add_dep(void *closure, const char *filename)
+{
+    return IMC_CACHE_add_dep(closure, filename);
+}
+
+static bool write_output(struct imc_lang_vm *vm, const struct state *state)
+{
+    switch (state->format)
     {
         case FORMAT_PNG:
-            IMC_VM_write_png(vm, cstr_str(&state.output_file));
-            break;
+            return IMC_VM_write_png(vm, cstr_str(&state->output_file));
         case FORMAT_JPG:
-            IMC_VM_write_jpg(vm, cstr_str(&state.output_file));
-            break;
+            return IMC_VM_write_jpg(vm, cstr_str(&state->output_file));
         case FORMAT_BMP:
-            IMC_VM_write_bmp(vm, cstr_str(&state.output_file));
-            break;
+            return IMC_VM_write_bmp(vm, cstr_str(&state->output_file));
         case FORMAT_TGA:
-            IMC_VM_write_tga(vm, cstr_str(&state.output_file));
-            break;
+            return IMC_VM_write_tga(vm, cstr_str(&state->output_file));
         case FORMAT_XPM:
-            IMC_VM_write_xpm(vm, cstr_str(&state.output_file));
-            break;
+            return IMC_VM_write_xpm(vm, cstr_str(&state->output_file));
         default:
+            return false;
     }
+}
 
-    cstr_drop(&state.input_file);
-    cstr_drop(&state.output_file);
+static int render(struct state *state, struct imc_cache *cache)
+{
+    bool ok;
+    struct imc_lang_vm *vm;
+
+    if (cache)
+    {
+        cstr params = cache_params(state);
+        bool hit = IMC_CACHE_lookup(cache, cstr_str(&state->input_file), cstr_str(&params),
+                                    cstr_str(&state->output_file));
+
+        cstr_drop(&params);
+
+        if (hit)
+        {
+            return EXIT_SUCCESS;
+        }
+
+        unlink(cstr_str(&state->output_file));
+    }
+
+    vm = IMC_VM_new(&state->vm_conf);
+
+    if (!vm)
+    {
+        return EXIT_FAILURE;
+    }
+
+    ok = IMC_VM_run_src_file(vm, cstr_str(&state->input_file));
+    ok = write_output(vm, state) && ok;
+
+    if (cache && ok && IMC_VM_foreach_dep(vm, cache_add_dep, cache))
+    {
+        IMC_CACHE_store(cache, cstr_str(&state->output_file));
+    }
+
+    if (state->mem_stats)
+    {
+        IMC_VM_print_mem_stats(vm);
+    }
+
+    if (state->vm_conf.lua_profile)
+    {
+        IMC_VM_write_lua_profile(vm, cstr_str(&state->lua_profile_out));
+    }
+
+    if (state->jit_report)
+    {
+        IMC_VM_print_jit_report(vm);
+    }
 
     IMC_VM_free(vm);
     return EXIT_SUCCESS;
 }
+
+static bool watch_add_dep(void *closure, const char *filename)
+{
+    return IMC_WATCH_add(closure, filename);
+}
+
+static volatile sig_atomic_t watch_stopped;
+
+static void watch_stop(int sig)
+{
+    (void)sig;
+    watch_stopped = 1;
+}
+
+static int watch(struct state *state)
+{
+    uint64_t start = IMC_time_ns();
+    bool ok = true;
+    struct imc_watch *watch = IMC_WATCH_new();
+    struct imc_lang_vm *vm = IMC_VM_new(&state->vm_conf);
+    /* no SA_RESTART so the wait sees the stop, a second signal kills a render that is still running */
+    struct sigaction stop =
+    {
+        .sa_handler = watch_stop,
+        .sa_flags = SA_RESETHAND,
+    };
+
+    if (!watch || !vm)
+    {
+        IMC_WATCH_free(watch);
+        IMC_VM_free(vm);
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+
+    printf("watch: vm %.2f ms\n", IMC_time_ms(IMC_time_ns() - start));
+
+    do
+    {
+        uint64_t reset_begin = IMC_time_ns();
+        uint64_t script_begin;
+        uint64_t write_begin;
+        uint64_t end;
+
+        /* a recycle would rebuild the surface and the font cache, which is what watch is there to keep */
+        if (!IMC_VM_reset(vm))
+        {
+            ok = false;
+            break;
+        }
+
+        script_begin = IMC_time_ns();
+        IMC_VM_run_src_file(vm, cstr_str(&state->input_file));
+
+        write_begin = IMC_time_ns();
+        write_output(vm, state);
+
+        end = IMC_time_ns();
+
+        printf("watch: reset %.2f ms, script %.2f ms, write %.2f ms, total %.2f ms\n",
+               IMC_time_ms(script_begin - reset_begin),
+               IMC_time_ms(write_begin - script_begin),
+               IMC_time_ms(end - write_begin),
+               IMC_time_ms(end - reset_begin));
+
+        if (state->mem_stats)
+        {
+            IMC_VM_print_mem_stats(vm);
+        }
+
+        if (state->vm_conf.lua_profile)
+        {
+            IMC_VM_write_lua_profile(vm, cstr_str(&state->lua_profile_out));
+        }
+
+        if (state->jit_report)
+        {
+            IMC_VM_print_jit_report(vm);
+        }
+
+        fflush(stdout);
+        IMC_TRACE_flush();
+
+        IMC_WATCH_clear(watch);
+
+        if (!IMC_WATCH_add(watch, cstr_str(&state->input_file)))
+        {
+            ok = false;
+            break;
+        }
+
+        IMC_VM_foreach_dep(vm, watch_add_dep, watch);
+    }
+    while (IMC_WATCH_wait(watch, &watch_stopped));
+
+    IMC_WATCH_free(watch);
+    IMC_VM_free(vm);
+    return ok && watch_stopped ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    int result = EXIT_SUCCESS;
+    int mem_limit = 0;
+    int ssaa = 1;
+    float preview = 0;
+    struct imc_cache *cache = nullptr;
+    struct state state =
+    {
+    };
+
+    if (!parse_args(&state, argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (!parse_int_opt(&state.mem_limit, "mem-limit", 1, &mem_limit) ||
+        !parse_int_opt(&state.ssaa, "ssaa", 1, &ssaa) ||
+        !parse_float_opt(&state.preview, "preview", 0, 1, &preview))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (state.preview_aliased && preview == 0)
+    {
+        printf("error: --preview-aliased requires --preview!!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ssaa > 8)
+    {
+        printf("error: invalid value for --ssaa!!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!cstr_is_empty(&state.ssaa) && !cstr_is_empty(&state.preview))
+    {
+        printf("error: --preview can not be used with --ssaa!!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!cstr_is_empty(&state.trace_out) && !IMC_TRACE_open(cstr_str(&state.trace_out)))
+    {
+        return EXIT_FAILURE;
+    }
+
+    state.vm_conf.lua_profile = !cstr_is_empty(&state.lua_profile_out);
+    state.vm_conf.jit_report = state.jit_report;
+    state.vm_conf.jit_options = cstr_is_empty(&state.jit_options) ? nullptr : cstr_str(&state.jit_options);
+
+    if (state.profile || !cstr_is_empty(&state.profile_out) || IMC_TRACE_is_enabled() || state.vm_conf.lua_profile)
+    {
+        IMC_PROF_enable();
+    }
+
+    state.vm_conf.mem_limit = (size_t)mem_limit * 1024 * 1024;
+    state.vm_conf.supersample = ssaa;
+    state.vm_conf.preview = preview;
+    state.vm_conf.aliased = state.preview_aliased;
+
+    /* a preview is thrown away after a look, so it is not worth compressing well */
+    IMC_IMG_set_fast_encoding(preview > 0);
+    state.vm_conf.use_arena = state.arena || state.mem_stats;
+
+    if (!cstr_is_empty(&state.cache_dir))
+    {
+        cache = IMC_CACHE_open(cstr_str(&state.cache_dir));
+
+        if (!cache)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!cstr_is_empty(&state.bytecode_cache_dir))
+    {
+        state.vm_conf.bytecode_cache = IMC_BC_open(cstr_str(&state.bytecode_cache_dir));
+
+        if (!state.vm_conf.bytecode_cache)
+        {
+            IMC_CACHE_free(cache);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!cstr_is_empty(&state.serve_socket))
+    {
+        result = serve(&state);
+    }
+    else if (!cstr_is_empty(&state.compare_list) || !cstr_is_empty(&state.compare_ref))
+    {
+        result = compare(&state);
+    }
+    else if (!cstr_is_empty(&state.input_file) && state.watch)
+    {
+        result = watch(&state);
+    }
+    else if (!cstr_is_empty(&state.input_file))
+    {
+        result = render(&state, cache);
+    }
+
+    if (state.cache_stats)
+    {
+        IMC_CACHE_print_stats(cache);
+        IMC_ASSET_print_stats();
+    }
+
+    if (state.profile || !cstr_is_empty(&state.profile_out))
+    {
+        IMC_PROF_report(cstr_is_empty(&state.profile_out) ? nullptr : cstr_str(&state.profile_out));
+    }
+
+    IMC_TRACE_close();
+
+    cstr_drop(&state.input_file);
+    cstr_drop(&state.output_file);
+    cstr_drop(&state.cache_dir);
+    cstr_drop(&state.serve_socket);
+    cstr_drop(&state.jobs);
+    cstr_drop(&state.serve_queue);
+    cstr_drop(&state.serve_deadline);
+    cstr_drop(&state.bytecode_cache_dir);
+    cstr_drop(&state.mem_limit);
+    cstr_drop(&state.profile_out);
+    cstr_drop(&state.trace_out);
+    cstr_drop(&state.lua_profile_out);
+    cstr_drop(&state.jit_options);
+    cstr_drop(&state.compare_ref);
+    cstr_drop(&state.compare_list);
+    cstr_drop(&state.tolerance);
+    cstr_drop(&state.max_mismatch);
+    cstr_drop(&state.heatmap_dir);
+    cstr_drop(&state.ssaa);
+    cstr_drop(&state.preview);
+
+    IMC_BC_free(state.vm_conf.bytecode_cache);
+    IMC_CACHE_free(cache);
+    IMC_ASSET_purge();
+    return result;
+}
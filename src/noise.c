@@ -0,0 +1,678 @@
+#include "noise.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+
+#include "luabuf.h"
+
+#define NOISE_LANES 2
+
+#define GET_NOISE_STATE(L, NAME) \
+struct imc_noise_state *NAME = lua_touserdata(L, lua_upvalueindex(1));      \
+if (!NAME)                                                                  \
+{                                                                           \
+    luaL_error(L, "failed to get internal state");                          \
+    return 0;                                                               \
+}
+
+/* two doubles fill an SSE2/NEON register, wider vectors would need -mavx to keep the ABI */
+typedef double noise_f64x2 __attribute__((vector_size(NOISE_LANES * sizeof(double))));
+typedef int64_t noise_i64x2 __attribute__((vector_size(NOISE_LANES * sizeof(int64_t))));
+typedef uint64_t noise_u64x2 __attribute__((vector_size(NOISE_LANES * sizeof(uint64_t))));
+
+enum noise_kind
+{
+    NOISE_SIMPLEX,
+    NOISE_VALUE,
+    NOISE_WORLEY,
+};
+
+struct imc_noise_state
+{
+    uint32_t seed;
+    uint64_t rng[4];
+};
+
+static const uint32_t NOISE_PRIMES[4] = { 0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F };
+
+static const double F2 = 0.36602540378443864676;
+static const double G2 = 0.21132486540518711775;
+static const double F3 = 1.0 / 3.0;
+static const double G3 = 1.0 / 6.0;
+static const double F4 = 0.30901699437494742410;
+static const double G4 = 0.13819660112501051518;
+
+static inline uint32_t noise_mix(uint32_t h)
+{
+    h ^= h >> 15;
+    h *= 0x2C1B3C6D;
+    h ^= h >> 12;
+    h *= 0x297A2D39;
+    h ^= h >> 15;
+
+    return h;
+}
+
+static inline uint32_t noise_hash(uint32_t seed, const int64_t *cell, int dims)
+{
+    uint32_t h = seed;
+
+    for (int d = 0; d < dims; d++)
+    {
+        h += (uint32_t)cell[d] * NOISE_PRIMES[d];
+    }
+
+    return noise_mix(h);
+}
+
+static inline double noise_grad2(uint32_t h, double x, double y)
+{
+    const uint32_t a = h & 7;
+    const double u = a < 4 ? x : y;
+    const double v = a < 4 ? y : x;
+
+    return ((a & 1) ? -u : u) + ((a & 2) ? -2.0 * v : 2.0 * v);
+}
+
+static inline double noise_grad3(uint32_t h, double x, double y, double z)
+{
+    const uint32_t a = h & 15;
+    const double u = a < 8 ? x : y;
+    const double v = a < 4 ? y : (a == 12 || a == 14 ? x : z);
+
+    return ((a & 1) ? -u : u) + ((a & 2) ? -v : v);
+}
+
+static inline double noise_grad4(uint32_t h, double x, double y, double z, double w)
+{
+    const uint32_t a = h & 31;
+    const double u = a < 24 ? x : y;
+    const double v = a < 16 ? y : z;
+    const double s = a < 8 ? z : w;
+
+    return ((a & 1) ? -u : u) + ((a & 2) ? -v : v) + ((a & 4) ? -s : s);
+}
+
+static double noise_simplex2(uint32_t seed, double x, double y)
+{
+    double n = 0;
+    const double s = (x + y) * F2;
+    const double i = floor(x + s);
+    const double j = floor(y + s);
+    const double t = (i + j) * G2;
+    const double x0 = x - (i - t);
+    const double y0 = y - (j - t);
+    const double i1 = x0 > y0 ? 1.0 : 0.0;
+    const double j1 = 1.0 - i1;
+    const double xs[3] = { x0, x0 - i1 + G2, x0 - 1.0 + 2.0 * G2 };
+    const double ys[3] = { y0, y0 - j1 + G2, y0 - 1.0 + 2.0 * G2 };
+    const int64_t cells[3][2] =
+    {
+        { (int64_t)i, (int64_t)j },
+        { (int64_t)i + (int64_t)i1, (int64_t)j + (int64_t)j1 },
+        { (int64_t)i + 1, (int64_t)j + 1 },
+    };
+
+    for (int c = 0; c < 3; c++)
+    {
+        double r = 0.5 - xs[c] * xs[c] - ys[c] * ys[c];
+
+        if (r > 0)
+        {
+            r *= r;
+            n += r * r * noise_grad2(noise_hash(seed, cells[c], 2), xs[c], ys[c]);
+        }
+    }
+
+    return 45.0 * n;
+}
+
+static double noise_simplex3(uint32_t seed, double x, double y, double z)
+{
+    /* first and second corner offsets of the six simplices in a cube */
+    static const int ORDERS[6][6] =
+    {
+        { 1, 0, 0, 1, 1, 0 },
+        { 1, 0, 0, 1, 0, 1 },
+        { 0, 0, 1, 1, 0, 1 },
+        { 0, 0, 1, 0, 1, 1 },
+        { 0, 1, 0, 0, 1, 1 },
+        { 0, 1, 0, 1, 1, 0 },
+    };
+    const int *order;
+    double n = 0;
+    const double s = (x + y + z) * F3;
+    const double i = floor(x + s);
+    const double j = floor(y + s);
+    const double k = floor(z + s);
+    const double t = (i + j + k) * G3;
+    const double p[3] = { x - (i - t), y - (j - t), z - (k - t) };
+
+    if (p[0] >= p[1])
+    {
+        order = ORDERS[p[1] >= p[2] ? 0 : (p[0] >= p[2] ? 1 : 2)];
+    }
+    else
+    {
+        order = ORDERS[p[1] < p[2] ? 3 : (p[0] < p[2] ? 4 : 5)];
+    }
+
+    for (int c = 0; c < 4; c++)
+    {
+        double d[3];
+        double r = 0.5;
+        int64_t cell[3] = { (int64_t)i, (int64_t)j, (int64_t)k };
+
+        for (int a = 0; a < 3; a++)
+        {
+            const int off = c == 0 ? 0 : (c == 3 ? 1 : order[(c - 1) * 3 + a]);
+
+            d[a] = p[a] - off + c * G3;
+            cell[a] += off;
+            r -= d[a] * d[a];
+        }
+
+        if (r > 0)
+        {
+            r *= r;
+            n += r * r * noise_grad3(noise_hash(seed, cell, 3), d[0], d[1], d[2]);
+        }
+    }
+
+    return 76.0 * n;
+}
+
+static double noise_simplex4(uint32_t seed, double x, double y, double z, double w)
+{
+    int rank[4] = {};
+    double n = 0;
+    const double s = (x + y + z + w) * F4;
+    const double cell0[4] = { floor(x + s), floor(y + s), floor(z + s), floor(w + s) };
+    const double t = (cell0[0] + cell0[1] + cell0[2] + cell0[3]) * G4;
+    const double p[4] = { x - (cell0[0] - t), y - (cell0[1] - t), z - (cell0[2] - t), w - (cell0[3] - t) };
+
+    /* the order of the offsets picks which of the 24 simplices of the hypercube p is in */
+    for (int a = 0; a < 4; a++)
+    {
+        for (int b = a + 1; b < 4; b++)
+        {
+            rank[p[a] > p[b] ? a : b]++;
+        }
+    }
+
+    for (int c = 0; c < 5; c++)
+    {
+        double d[4];
+        double r = 0.5;
+        int64_t cell[4];
+
+        for (int a = 0; a < 4; a++)
+        {
+            const int off = rank[a] >= 4 - c;
+
+            d[a] = p[a] - off + c * G4;
+            cell[a] = (int64_t)cell0[a] + off;
+            r -= d[a] * d[a];
+        }
+
+        if (r > 0)
+        {
+            r *= r;
+            n += r * r * noise_grad4(noise_hash(seed, cell, 4), d[0], d[1], d[2], d[3]);
+        }
+    }
+
+    return 62.0 * n;
+}
+
+static double noise_simplex(uint32_t seed, int dims, const double *p)
+{
+    switch (dims)
+    {
+        case 2:
+            return noise_simplex2(seed, p[0], p[1]);
+        case 3:
+            return noise_simplex3(seed, p[0], p[1], p[2]);
+        default:
+            return noise_simplex4(seed, p[0], p[1], p[2], p[3]);
+    }
+}
+
+/* lattice values in [-1, 1] blended with the quintic fade curve */
+static double noise_value(uint32_t seed, int dims, const double *p)
+{
+    double n = 0;
+    double fade[4];
+    int64_t base[4];
+
+    for (int d = 0; d < dims; d++)
+    {
+        const double cell = floor(p[d]);
+        const double f = p[d] - cell;
+
+        base[d] = (int64_t)cell;
+        fade[d] = f * f * f * (f * (f * 6.0 - 15.0) + 10.0);
+    }
+
+    for (int corner = 0; corner < (1 << dims); corner++)
+    {
+        double weight = 1.0;
+        int64_t cell[4];
+
+        for (int d = 0; d < dims; d++)
+        {
+            const bool upper = corner & (1 << d);
+
+            cell[d] = base[d] + upper;
+            weight *= upper ? fade[d] : 1.0 - fade[d];
+        }
+
+        n += weight * ((noise_hash(seed, cell, dims) >> 8) * (2.0 / 16777216.0) - 1.0);
+    }
+
+    return n;
+}
+
+/* distance to the closest of one feature point per cell */
+static double noise_worley(uint32_t seed, int dims, const double *p)
+{
+    double best = INFINITY;
+    int64_t base[4];
+    int neighbors = 1;
+
+    for (int d = 0; d < dims; d++)
+    {
+        base[d] = (int64_t)floor(p[d]);
+        neighbors *= 3;
+    }
+
+    for (int neighbor = 0; neighbor < neighbors; neighbor++)
+    {
+        int rest = neighbor;
+        double dist = 0;
+        int64_t cell[4];
+        uint32_t h;
+
+        for (int d = 0; d < dims; d++)
+        {
+            cell[d] = base[d] + rest % 3 - 1;
+            rest /= 3;
+        }
+
+        h = noise_hash(seed, cell, dims);
+
+        for (int d = 0; d < dims; d++)
+        {
+            const double delta = cell[d] + (h >> 8) / 16777216.0 - p[d];
+
+            dist += delta * delta;
+            h = noise_mix(h + NOISE_PRIMES[d]);
+        }
+
+        best = dist < best ? dist : best;
+    }
+
+    return sqrt(best);
+}
+
+static double noise_eval(uint32_t seed, enum noise_kind kind, int dims, const double *p)
+{
+    switch (kind)
+    {
+        case NOISE_SIMPLEX:
+            return noise_simplex(seed, dims, p);
+        case NOISE_VALUE:
+            return noise_value(seed, dims, p);
+        default:
+            return noise_worley(seed, dims, p);
+    }
+}
+
+static inline noise_f64x2 noise_select(noise_i64x2 mask, noise_f64x2 a, noise_f64x2 b)
+{
+    return (noise_f64x2)(((noise_i64x2)a & mask) | ((noise_i64x2)b & ~mask));
+}
+
+static inline noise_f64x2 noise_floor(noise_f64x2 x, noise_i64x2 *cell)
+{
+    noise_i64x2 i = __builtin_convertvector(x, noise_i64x2);
+
+    i += (noise_i64x2)(x < __builtin_convertvector(i, noise_f64x2));
+    *cell = i;
+
+    return __builtin_convertvector(i, noise_f64x2);
+}
+
+static inline noise_f64x2 noise_corner2(uint32_t seed, noise_i64x2 i, noise_i64x2 j, noise_f64x2 x, noise_f64x2 y)
+{
+    /* noise_hash in 64-bit lanes, masking keeps the low 32 bits identical */
+    const uint64_t mask = UINT32_MAX;
+    noise_u64x2 h = (seed + (noise_u64x2)i * NOISE_PRIMES[0] + (noise_u64x2)j * NOISE_PRIMES[1]) & mask;
+    noise_f64x2 u;
+    noise_f64x2 v;
+    noise_f64x2 r = 0.5 - x * x - y * y;
+    noise_i64x2 low;
+
+    h ^= h >> 15;
+    h = (h * 0x2C1B3C6D) & mask;
+    h ^= h >> 12;
+    h = (h * 0x297A2D39) & mask;
+    h ^= h >> 15;
+    h &= 7;
+
+    low = (noise_i64x2)(h < 4);
+    u = noise_select(low, x, y);
+    v = 2.0 * noise_select(low, y, x);
+    u = noise_select((noise_i64x2)((h & 1) != 0), -u, u);
+    v = noise_select((noise_i64x2)((h & 2) != 0), -v, v);
+
+    r = noise_select((noise_i64x2)(r > 0), r, (noise_f64x2){});
+    r *= r;
+
+    return r * r * (u + v);
+}
+
+/* the same steps as noise_simplex2, a vector of points at a time */
+static void noise_simplex2_vec(uint32_t seed, double *out, noise_f64x2 x, noise_f64x2 y)
+{
+    const noise_f64x2 s = (x + y) * F2;
+    noise_i64x2 ci;
+    noise_i64x2 cj;
+    const noise_f64x2 i = noise_floor(x + s, &ci);
+    const noise_f64x2 j = noise_floor(y + s, &cj);
+    const noise_f64x2 t = (i + j) * G2;
+    const noise_f64x2 x0 = x - (i - t);
+    const noise_f64x2 y0 = y - (j - t);
+    const noise_i64x2 upper = (noise_i64x2)(x0 > y0);
+    const noise_f64x2 i1 = noise_select(upper, (noise_f64x2){} + 1.0, (noise_f64x2){});
+    const noise_f64x2 j1 = 1.0 - i1;
+    noise_f64x2 n = noise_corner2(seed, ci, cj, x0, y0);
+
+    n += noise_corner2(seed, ci - upper, cj - ~upper, x0 - i1 + G2, y0 - j1 + G2);
+    n += noise_corner2(seed, ci + 1, cj + 1, x0 - 1.0 + 2.0 * G2, y0 - 1.0 + 2.0 * G2);
+    n *= 45.0;
+
+    memcpy(out, &n, sizeof(n));
+}
+
+static void noise_fill_row(uint32_t seed, enum noise_kind kind, int dims, double *out, int width, const double *p,
+                           double step)
+{
+    int x = 0;
+
+    if (kind == NOISE_SIMPLEX && dims == 2)
+    {
+        for (; x + NOISE_LANES <= width; x += NOISE_LANES)
+        {
+            const noise_f64x2 xs = p[0] + (noise_f64x2){ x, x + 1 } * step;
+
+            noise_simplex2_vec(seed, out + x, xs, (noise_f64x2){} + p[1]);
+        }
+    }
+
+    for (; x < width; x++)
+    {
+        const double point[4] = { p[0] + x * step, p[1], p[2], p[3] };
+
+        out[x] = noise_eval(seed, kind, dims, point);
+    }
+}
+
+static inline uint64_t noise_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** */
+static uint64_t noise_next(struct imc_noise_state *ns)
+{
+    uint64_t *s = ns->rng;
+    const uint64_t result = noise_rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = noise_rotl(s[3], 45);
+
+    return result;
+}
+
+static void noise_seed(struct imc_noise_state *ns, uint64_t seed)
+{
+    ns->seed = noise_mix((uint32_t)seed ^ noise_mix(seed >> 32));
+
+    /* splitmix64 spreads the seed over the whole xoshiro state */
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        ns->rng[i] = z ^ (z >> 31);
+    }
+}
+
+static int noise_args(lua_State *L, int first, double *p)
+{
+    const int dims = lua_gettop(L) - first + 1;
+
+    luaL_argcheck(L, dims >= 2 && dims <= 4, first, "expected 2 to 4 coordinates");
+
+    for (int d = 0; d < dims; d++)
+    {
+        p[d] = luaL_checknumber(L, first + d);
+    }
+
+    return dims;
+}
+
+static int noise_lua_eval(lua_State *L, enum noise_kind kind)
+{
+    GET_NOISE_STATE(L, ns);
+
+    double p[4];
+    const int dims = noise_args(L, 1, p);
+
+    lua_pushnumber(L, noise_eval(ns->seed, kind, dims, p));
+
+    return 1;
+}
+
+static int noise_simplex_fn(lua_State *L)
+{
+    return noise_lua_eval(L, NOISE_SIMPLEX);
+}
+
+static int noise_value_fn(lua_State *L)
+{
+    return noise_lua_eval(L, NOISE_VALUE);
+}
+
+static int noise_worley_fn(lua_State *L)
+{
+    return noise_lua_eval(L, NOISE_WORLEY);
+}
+
+static int noise_seed_fn(lua_State *L)
+{
+    GET_NOISE_STATE(L, ns);
+
+    noise_seed(ns, (uint64_t)(int64_t)luaL_checknumber(L, 1));
+
+    return 0;
+}
+
+/* same arguments and ranges as math.random */
+static int noise_random_fn(lua_State *L)
+{
+    GET_NOISE_STATE(L, ns);
+
+    const uint64_t bits = noise_next(ns);
+    lua_Number low = 1;
+    lua_Number high;
+
+    switch (lua_gettop(L))
+    {
+        case 0:
+            lua_pushnumber(L, (bits >> 11) * 0x1.0p-53);
+            return 1;
+        case 1:
+            high = luaL_checknumber(L, 1);
+            break;
+        default:
+            low = luaL_checknumber(L, 1);
+            high = luaL_checknumber(L, 2);
+            break;
+    }
+
+    low = floor(low);
+    high = floor(high);
+
+    luaL_argcheck(L, low <= high, lua_gettop(L), "interval is empty");
+
+    lua_pushnumber(L, low + (lua_Number)(bits % (uint64_t)(high - low + 1)));
+
+    return 1;
+}
+
+/*
+ * Noise.fill(buf, kind, width, height, x, y, step[, z[, w]])
+ *
+ * buf is a Lua table or an FFI double array of at least width * height elements, filled row by row
+ */
+static int noise_fill_fn(lua_State *L)
+{
+    GET_NOISE_STATE(L, ns);
+
+    static const char *const KINDS[] = { "simplex", "value", "worley", nullptr };
+    const enum noise_kind kind = luaL_checkoption(L, 2, nullptr, KINDS);
+    const int width = luaL_checkint(L, 3);
+    const int height = luaL_checkint(L, 4);
+    double *out;
+    const size_t length = IMC_LBUF_check(L, 1, &out);
+    const bool table = !out;
+    double *row = nullptr;
+    double p[4];
+    double step;
+    int dims;
+
+    luaL_argcheck(L, width > 0, 3, "width must be positive");
+    luaL_argcheck(L, height > 0, 4, "height must be positive");
+    luaL_argcheck(L, table || length >= (size_t)width * height, 1, "array is shorter than width * height");
+
+    p[0] = luaL_checknumber(L, 5);
+    p[1] = luaL_checknumber(L, 6);
+    step = luaL_checknumber(L, 7);
+    dims = 2 + !lua_isnoneornil(L, 8) + !lua_isnoneornil(L, 9);
+    p[2] = luaL_optnumber(L, 8, 0);
+    p[3] = luaL_optnumber(L, 9, 0);
+
+    if (table && !(row = malloc(width * sizeof(double))))
+    {
+        luaL_error(L, "failed to allocate noise row");
+        return 0;
+    }
+
+    for (int y = 0; y < height; y++)
+    {
+        const double point[4] = { p[0], p[1] + y * step, p[2], p[3] };
+
+        if (!table)
+        {
+            noise_fill_row(ns->seed, kind, dims, out + (size_t)y * width, width, point, step);
+            continue;
+        }
+
+        noise_fill_row(ns->seed, kind, dims, row, width, point, step);
+
+        for (int x = 0; x < width; x++)
+        {
+            lua_pushnumber(L, row[x]);
+            lua_rawseti(L, 1, y * width + x + 1);
+        }
+    }
+
+    free(row);
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static void register_func(lua_State *L, struct imc_noise_state *state, const char *name, lua_CFunction func)
+{
+    lua_pushlightuserdata(L, state);
+    lua_pushcclosure(L, func, 1);
+    lua_setfield(L, -2, name);
+}
+
+struct imc_noise_state *IMC_NOISE_load(lua_State *state)
+{
+    struct imc_noise_state *res = calloc(1, sizeof(struct imc_noise_state));
+
+    if (!state || !res)
+    {
+        free(res);
+        return nullptr;
+    }
+
+    noise_seed(res, 0);
+
+    lua_newtable(state);
+
+    register_func(state, res, "seed", noise_seed_fn);
+    register_func(state, res, "random", noise_random_fn);
+    register_func(state, res, "simplex", noise_simplex_fn);
+    register_func(state, res, "value", noise_value_fn);
+    register_func(state, res, "worley", noise_worley_fn);
+    register_func(state, res, "fill", noise_fill_fn);
+
+    lua_setglobal(state, "Noise");
+
+    return res;
+}
+
+double IMC_NOISE_simplex2(const struct imc_noise_state *state, double x, double y)
+{
+    return state ? noise_simplex2(state->seed, x, y) : 0;
+}
+
+void IMC_NOISE_simplex2_many(const struct imc_noise_state *state, const double *x, const double *y, double *out,
+                             size_t count)
+{
+    size_t i = 0;
+
+    for (; state && i + NOISE_LANES <= count; i += NOISE_LANES)
+    {
+        noise_f64x2 xs;
+        noise_f64x2 ys;
+
+        memcpy(&xs, x + i, sizeof(xs));
+        memcpy(&ys, y + i, sizeof(ys));
+        noise_simplex2_vec(state->seed, out + i, xs, ys);
+    }
+
+    for (; i < count; i++)
+    {
+        out[i] = IMC_NOISE_simplex2(state, x[i], y[i]);
+    }
+}
+
+void IMC_NOISE_reset(struct imc_noise_state *state)
+{
+    if (state)
+    {
+        noise_seed(state, 0);
+    }
+}
+
+void IMC_NOISE_free(struct imc_noise_state *state)
+{
+    free(state);
+}
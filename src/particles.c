@@ -0,0 +1,564 @@
+#include "particles.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+
+#include "noise.h"
+#include "imagelib.h"
+#include "luabuf.h"
+#include "profile.h"
+
+#define PARTICLES_METATABLE "imc.particles"
+#define PARTICLES_LANES 4
+#define PARTICLES_MAX_COUNT 100000000
+
+typedef float particles_f32x4 __attribute__((vector_size(PARTICLES_LANES * sizeof(float))));
+typedef int32_t particles_i32x4 __attribute__((vector_size(PARTICLES_LANES * sizeof(int32_t))));
+
+enum particles_field
+{
+    PARTICLES_FIELD_NONE,
+    PARTICLES_FIELD_NOISE,
+    PARTICLES_FIELD_GRID,
+};
+
+enum particles_edge
+{
+    PARTICLES_EDGE_WRAP,
+    PARTICLES_EDGE_RESPAWN,
+    PARTICLES_EDGE_KEEP,
+};
+
+/* positions are kept as separate x and y arrays padded to whole vectors */
+struct particles
+{
+    size_t count;
+    size_t padded;
+    float *x;
+    float *y;
+    float *segments;
+
+    enum particles_field field;
+    float scale;
+    float turns;
+    float *grid;
+    int cols;
+    int rows;
+    float grid_box[4];
+
+    float bounds[4];
+    enum particles_edge edge;
+    uint64_t rng;
+};
+
+struct particles_upvalues
+{
+    struct imc_image_lib_state *imgst;
+    struct imc_noise_state *noisest;
+};
+
+static inline float particles_random(struct particles *ps)
+{
+    uint64_t z = (ps->rng += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return ((z ^ (z >> 31)) >> 40) * 0x1.0p-24f;
+}
+
+static inline particles_f32x4 particles_floor(particles_f32x4 v)
+{
+    const particles_f32x4 whole = __builtin_convertvector(__builtin_convertvector(v, particles_i32x4), particles_f32x4);
+
+    return whole - (particles_f32x4)((particles_i32x4)((particles_f32x4){} + 1.0f) & (whole > v));
+}
+
+static inline particles_f32x4 particles_clamp(particles_f32x4 v, float lo, float hi)
+{
+    const particles_f32x4 low = (particles_f32x4){} + lo;
+    const particles_f32x4 high = (particles_f32x4){} + hi;
+
+    v = (particles_f32x4)(((particles_i32x4)v & (v >= low)) | ((particles_i32x4)low & (v < low)));
+
+    return (particles_f32x4)(((particles_i32x4)v & (v <= high)) | ((particles_i32x4)high & (v > high)));
+}
+
+/* bilinear over the user grid, positions outside it take the nearest edge */
+static void particles_sample_grid(const struct particles *ps, particles_f32x4 x, particles_f32x4 y,
+                                  particles_f32x4 *vx, particles_f32x4 *vy)
+{
+    const particles_f32x4 gx = particles_clamp((x - ps->grid_box[0]) / ps->grid_box[2] * (float)(ps->cols - 1), 0, ps->cols - 1);
+    const particles_f32x4 gy = particles_clamp((y - ps->grid_box[1]) / ps->grid_box[3] * (float)(ps->rows - 1), 0, ps->rows - 1);
+    const particles_f32x4 cx = particles_floor(gx);
+    const particles_f32x4 cy = particles_floor(gy);
+    const particles_f32x4 fx = gx - cx;
+    const particles_f32x4 fy = gy - cy;
+    particles_f32x4 corners[2][4];
+
+    for (int l = 0; l < PARTICLES_LANES; l++)
+    {
+        const int x0 = cx[l];
+        const int y0 = cy[l];
+        const int x1 = x0 + 1 < ps->cols ? x0 + 1 : x0;
+        const int y1 = y0 + 1 < ps->rows ? y0 + 1 : y0;
+        const size_t row0 = (size_t)y0 * ps->cols;
+        const size_t row1 = (size_t)y1 * ps->cols;
+        const size_t cells[4] = { row0 + x0, row0 + x1, row1 + x0, row1 + x1 };
+
+        for (int c = 0; c < 4; c++)
+        {
+            corners[0][c][l] = ps->grid[cells[c] * 2];
+            corners[1][c][l] = ps->grid[cells[c] * 2 + 1];
+        }
+    }
+
+    for (int axis = 0; axis < 2; axis++)
+    {
+        const particles_f32x4 top = corners[axis][0] + (corners[axis][1] - corners[axis][0]) * fx;
+        const particles_f32x4 bottom = corners[axis][2] + (corners[axis][3] - corners[axis][2]) * fx;
+
+        *(axis ? vy : vx) = top + (bottom - top) * fy;
+    }
+}
+
+/* simplex noise read as a heading, turns full rotations over the noise range */
+/* sine and cosine to about 1e-7 after reducing to a quarter turn around 0 */
+static inline void particles_sincos(particles_f32x4 angle, particles_f32x4 *sin, particles_f32x4 *cos)
+{
+    const particles_f32x4 quarter = particles_floor(angle * (float)M_2_PI + 0.5f);
+    const particles_i32x4 q = __builtin_convertvector(quarter, particles_i32x4);
+    const particles_f32x4 r = angle - quarter * 1.5703125f - quarter * 4.837512969970703125e-4f -
+                              quarter * 7.549789948768648e-8f;
+    const particles_f32x4 r2 = r * r;
+    const particles_f32x4 s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+    const particles_f32x4 c = 1.0f - 0.5f * r2 +
+                              r2 * r2 * (4.166664568e-2f + r2 * (-1.388731625e-3f + r2 * 2.443315711e-5f));
+    const particles_i32x4 sign = (particles_i32x4){} + INT32_MIN;
+    const particles_i32x4 swap = (q & 1) != 0;
+    const particles_i32x4 sin_sign = ((q & 2) != 0) & sign;
+    const particles_i32x4 cos_sign = (((q + 1) & 2) != 0) & sign;
+
+    *sin = (particles_f32x4)((((particles_i32x4)c & swap) | ((particles_i32x4)s & ~swap)) ^ sin_sign);
+    *cos = (particles_f32x4)((((particles_i32x4)s & swap) | ((particles_i32x4)c & ~swap)) ^ cos_sign);
+}
+
+static void particles_sample_noise(const struct particles *ps, const struct imc_noise_state *noisest,
+                                   particles_f32x4 x, particles_f32x4 y, particles_f32x4 *vx, particles_f32x4 *vy)
+{
+    double xs[PARTICLES_LANES];
+    double ys[PARTICLES_LANES];
+    double ns[PARTICLES_LANES];
+    particles_f32x4 angle;
+
+    for (int l = 0; l < PARTICLES_LANES; l++)
+    {
+        xs[l] = x[l] * ps->scale;
+        ys[l] = y[l] * ps->scale;
+    }
+
+    IMC_NOISE_simplex2_many(noisest, xs, ys, ns, PARTICLES_LANES);
+
+    for (int l = 0; l < PARTICLES_LANES; l++)
+    {
+        angle[l] = ns[l];
+    }
+
+    particles_sincos(angle * (ps->turns * (float)M_PI), vy, vx);
+}
+
+static void particles_step(struct particles *ps, const struct imc_noise_state *noisest, float length, bool draw)
+{
+    const particles_f32x4 bx = (particles_f32x4){} + ps->bounds[0];
+    const particles_f32x4 by = (particles_f32x4){} + ps->bounds[1];
+    const particles_f32x4 bw = (particles_f32x4){} + ps->bounds[2];
+    const particles_f32x4 bh = (particles_f32x4){} + ps->bounds[3];
+
+    for (size_t i = 0; i < ps->padded; i += PARTICLES_LANES)
+    {
+        const particles_f32x4 x = *(particles_f32x4 *)&ps->x[i];
+        const particles_f32x4 y = *(particles_f32x4 *)&ps->y[i];
+        particles_f32x4 vx = {};
+        particles_f32x4 vy = {};
+        particles_f32x4 nx;
+        particles_f32x4 ny;
+
+        if (ps->field == PARTICLES_FIELD_NOISE)
+        {
+            particles_sample_noise(ps, noisest, x, y, &vx, &vy);
+        }
+        else if (ps->field == PARTICLES_FIELD_GRID)
+        {
+            particles_sample_grid(ps, x, y, &vx, &vy);
+        }
+
+        nx = x + vx * length;
+        ny = y + vy * length;
+
+        if (draw)
+        {
+            for (int l = 0; l < PARTICLES_LANES && i + l < ps->count; l++)
+            {
+                float *segment = &ps->segments[(i + l) * 4];
+
+                segment[0] = x[l];
+                segment[1] = y[l];
+                segment[2] = nx[l];
+                segment[3] = ny[l];
+            }
+        }
+
+        if (ps->edge == PARTICLES_EDGE_WRAP && ps->bounds[2] > 0 && ps->bounds[3] > 0)
+        {
+            nx -= particles_floor((nx - bx) / bw) * bw;
+            ny -= particles_floor((ny - by) / bh) * bh;
+        }
+        else if (ps->edge == PARTICLES_EDGE_RESPAWN)
+        {
+            const particles_i32x4 outside = (nx < bx) | (nx >= bx + bw) | (ny < by) | (ny >= by + bh);
+
+            for (int l = 0; l < PARTICLES_LANES; l++)
+            {
+                if (outside[l])
+                {
+                    nx[l] = ps->bounds[0] + particles_random(ps) * ps->bounds[2];
+                    ny[l] = ps->bounds[1] + particles_random(ps) * ps->bounds[3];
+                }
+            }
+        }
+
+        *(particles_f32x4 *)&ps->x[i] = nx;
+        *(particles_f32x4 *)&ps->y[i] = ny;
+    }
+}
+
+static struct particles *particles_check(lua_State *L)
+{
+    struct particles *ps = luaL_checkudata(L, 1, PARTICLES_METATABLE);
+
+    if (!ps->x)
+    {
+        luaL_error(L, "particle system was freed");
+    }
+
+    return ps;
+}
+
+static void particles_box_args(lua_State *L, int first, float *box)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        box[i] = luaL_checknumber(L, first + i);
+    }
+
+    luaL_argcheck(L, box[2] > 0, first + 2, "width must be positive");
+    luaL_argcheck(L, box[3] > 0, first + 3, "height must be positive");
+}
+
+/* p:scatter(x, y, width, height[, seed]), also makes the box the bounds */
+static int particles_scatter_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    const lua_Number seed = luaL_optnumber(L, 6, 0);
+
+    luaL_argcheck(L, seed >= -0x1p63 && seed < 0x1p63, 6, "seed out of range");
+    particles_box_args(L, 2, ps->bounds);
+    ps->rng = (uint64_t)(int64_t)seed;
+
+    for (size_t i = 0; i < ps->count; i++)
+    {
+        ps->x[i] = ps->bounds[0] + particles_random(ps) * ps->bounds[2];
+        ps->y[i] = ps->bounds[1] + particles_random(ps) * ps->bounds[3];
+    }
+
+    return 0;
+}
+
+/* p:bounds(x, y, width, height[, "wrap" | "respawn" | "keep"]) */
+static int particles_bounds_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    const char *list[] =
+    {
+        [PARTICLES_EDGE_WRAP]       = "wrap",
+        [PARTICLES_EDGE_RESPAWN]    = "respawn",
+        [PARTICLES_EDGE_KEEP]       = "keep",
+        nullptr,
+    };
+
+    particles_box_args(L, 2, ps->bounds);
+    ps->edge = luaL_checkoption(L, 6, "wrap", list);
+
+    return 0;
+}
+
+/* p:noise_field(scale[, turns]), headings follow Noise.simplex at x * scale, y * scale */
+static int particles_noise_field_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+
+    ps->scale = luaL_checknumber(L, 2);
+    ps->turns = luaL_optnumber(L, 3, 1);
+    ps->field = PARTICLES_FIELD_NOISE;
+
+    return 0;
+}
+
+/* p:grid_field(buf, cols, rows, x, y, width, height), buf holds a vx, vy pair per grid point, row by row */
+static int particles_grid_field_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    const int cols = luaL_checkint(L, 3);
+    const int rows = luaL_checkint(L, 4);
+    double *array;
+    const size_t length = IMC_LBUF_check(L, 2, &array);
+    const bool table = !array;
+    float *grid;
+
+    luaL_argcheck(L, cols > 0 && cols < 65536, 3, "bad column count");
+    luaL_argcheck(L, rows > 0 && rows < 65536, 4, "bad row count");
+    luaL_argcheck(L, length >= (size_t)cols * rows * 2, 2, "buffer holds fewer than cols * rows vectors");
+    particles_box_args(L, 5, ps->grid_box);
+
+    grid = malloc((size_t)cols * rows * 2 * sizeof(float));
+
+    if (!grid)
+    {
+        luaL_error(L, "failed to allocate a %dx%d field", cols, rows);
+        return 0;
+    }
+
+    for (size_t i = 0; i < (size_t)cols * rows * 2; i++)
+    {
+        if (table)
+        {
+            lua_rawgeti(L, 2, i + 1);
+            grid[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        else
+        {
+            grid[i] = array[i];
+        }
+    }
+
+    free(ps->grid);
+    ps->grid = grid;
+    ps->cols = cols;
+    ps->rows = rows;
+    ps->field = PARTICLES_FIELD_GRID;
+
+    return 0;
+}
+
+/* p:step([steps[, length[, draw]]]), draws each move as a hairline in the stroke color unless draw is false */
+static int particles_step_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    const struct particles_upvalues *up = lua_touserdata(L, lua_upvalueindex(1));
+    const int steps = luaL_optint(L, 2, 1);
+    const float length = luaL_optnumber(L, 3, 1);
+    const bool draw = lua_isnoneornil(L, 4) || lua_toboolean(L, 4);
+    const uint64_t begin = IMC_PROF_begin();
+
+    luaL_argcheck(L, steps >= 0, 2, "steps must not be negative");
+
+    if (draw && !ps->segments)
+    {
+        ps->segments = malloc(ps->padded * 4 * sizeof(float));
+
+        if (!ps->segments)
+        {
+            luaL_error(L, "failed to allocate particle trails");
+            return 0;
+        }
+    }
+
+    for (int s = 0; s < steps; s++)
+    {
+        particles_step(ps, up->noisest, length, draw);
+
+        if (draw && !IMC_IMG_hairlines(up->imgst, ps->segments, ps->count))
+        {
+            luaL_error(L, "failed to initialize internal state");
+            return 0;
+        }
+    }
+
+    IMC_PROF_end("Particles.step", begin);
+
+    return 0;
+}
+
+/* p:get([out]), x, y pairs into a new table, a table or an FFI double array */
+static int particles_get_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    double *array = nullptr;
+
+    if (lua_isnoneornil(L, 2))
+    {
+        lua_settop(L, 1);
+        lua_createtable(L, ps->count * 2, 0);
+    }
+    else
+    {
+        const size_t length = IMC_LBUF_check(L, 2, &array);
+
+        luaL_argcheck(L, !array || length >= ps->count * 2, 2, "array holds fewer than two numbers per particle");
+    }
+
+    lua_settop(L, 2);
+
+    for (size_t i = 0; i < ps->count; i++)
+    {
+        if (array)
+        {
+            array[i * 2] = ps->x[i];
+            array[i * 2 + 1] = ps->y[i];
+            continue;
+        }
+
+        lua_pushnumber(L, ps->x[i]);
+        lua_rawseti(L, 2, i * 2 + 1);
+        lua_pushnumber(L, ps->y[i]);
+        lua_rawseti(L, 2, i * 2 + 2);
+    }
+
+    return 1;
+}
+
+/* p:set(buf), x, y pairs from a table or an FFI double array */
+static int particles_set_fn(lua_State *L)
+{
+    struct particles *ps = particles_check(L);
+    double *array;
+    const size_t length = IMC_LBUF_check(L, 2, &array);
+    const bool table = !array;
+
+    luaL_argcheck(L, length >= ps->count * 2, 2, "buffer holds fewer than two numbers per particle");
+
+    for (size_t i = 0; i < ps->count * 2; i++)
+    {
+        float value;
+
+        if (table)
+        {
+            lua_rawgeti(L, 2, i + 1);
+            value = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        else
+        {
+            value = array[i];
+        }
+
+        (i % 2 ? ps->y : ps->x)[i / 2] = value;
+    }
+
+    return 0;
+}
+
+static int particles_count_fn(lua_State *L)
+{
+    lua_pushinteger(L, particles_check(L)->count);
+
+    return 1;
+}
+
+static int particles_gc_fn(lua_State *L)
+{
+    struct particles *ps = luaL_checkudata(L, 1, PARTICLES_METATABLE);
+
+    free(ps->x);
+    free(ps->segments);
+    free(ps->grid);
+    *ps = (struct particles){};
+
+    return 0;
+}
+
+/* Particles.new(count), everything starts at the origin with no field */
+static int particles_new_fn(lua_State *L)
+{
+    const lua_Integer count = luaL_checkinteger(L, 1);
+    struct particles *ps;
+
+    luaL_argcheck(L, count > 0 && count <= PARTICLES_MAX_COUNT, 1, "bad particle count");
+
+    ps = lua_newuserdata(L, sizeof(struct particles));
+    *ps = (struct particles)
+    {
+        .count = count,
+        .padded = (count + PARTICLES_LANES - 1) / PARTICLES_LANES * PARTICLES_LANES,
+        .scale = 0.01,
+        .turns = 1,
+    };
+
+    luaL_getmetatable(L, PARTICLES_METATABLE);
+    lua_setmetatable(L, -2);
+
+    ps->x = aligned_alloc(sizeof(particles_f32x4), ps->padded * 2 * sizeof(float));
+
+    if (!ps->x)
+    {
+        luaL_error(L, "failed to allocate %d particles", (int)count);
+        return 0;
+    }
+
+    memset(ps->x, 0, ps->padded * 2 * sizeof(float));
+    ps->y = ps->x + ps->padded;
+
+    return 1;
+}
+
+static void register_func(lua_State *L, struct particles_upvalues *up, const char *name, lua_CFunction func)
+{
+    lua_pushlightuserdata(L, up);
+    lua_pushcclosure(L, func, 1);
+    lua_setfield(L, -2, name);
+}
+
+bool IMC_PARTICLES_load(lua_State *state, struct imc_image_lib_state *imgst, struct imc_noise_state *noisest)
+{
+    struct particles_upvalues *up;
+
+    if (!state || !imgst || !noisest)
+    {
+        return false;
+    }
+
+    /* lives as long as the Lua state */
+    up = lua_newuserdata(state, sizeof(struct particles_upvalues));
+    up->imgst = imgst;
+    up->noisest = noisest;
+    lua_setfield(state, LUA_REGISTRYINDEX, PARTICLES_METATABLE ".upvalues");
+
+    luaL_newmetatable(state, PARTICLES_METATABLE);
+
+    lua_newtable(state);
+    register_func(state, up, "scatter", particles_scatter_fn);
+    register_func(state, up, "bounds", particles_bounds_fn);
+    register_func(state, up, "noise_field", particles_noise_field_fn);
+    register_func(state, up, "grid_field", particles_grid_field_fn);
+    register_func(state, up, "step", particles_step_fn);
+    register_func(state, up, "get", particles_get_fn);
+    register_func(state, up, "set", particles_set_fn);
+    register_func(state, up, "count", particles_count_fn);
+    lua_setfield(state, -2, "__index");
+
+    lua_pushcfunction(state, particles_gc_fn);
+    lua_setfield(state, -2, "__gc");
+
+    lua_pop(state, 1);
+
+    lua_newtable(state);
+    register_func(state, up, "new", particles_new_fn);
+    lua_setglobal(state, "Particles");
+
+    return true;
+}
@@ -0,0 +1,204 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#include "trace.h"
+#include "timing.h"
+
+#define PROF_MAX_COUNTERS 256
+
+struct prof_counter
+{
+    const char *name;
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t time_ns;
+};
+
+struct prof_entry
+{
+    const char *name;
+    uint64_t calls;
+    uint64_t time_ns;
+};
+
+static struct
+{
+    bool enabled;
+    uint64_t start;
+    atomic_int num_counters;
+    pthread_mutex_t lock;
+    struct prof_counter counters[PROF_MAX_COUNTERS];
+} prof =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int prof_find(const char *name, int num_counters)
+{
+    for (int i = 0; i < num_counters; i++)
+    {
+        if (strcmp(prof.counters[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int prof_compare(const void *a, const void *b)
+{
+    const struct prof_entry *entry_a = a;
+    const struct prof_entry *entry_b = b;
+
+    return (entry_a->time_ns < entry_b->time_ns) - (entry_a->time_ns > entry_b->time_ns);
+}
+
+void IMC_PROF_enable()
+{
+    prof.start = IMC_time_ns();
+    prof.enabled = true;
+}
+
+bool IMC_PROF_is_enabled()
+{
+    return prof.enabled;
+}
+
+int IMC_PROF_counter(const char *name)
+{
+    int res;
+    int num_counters;
+
+    if (!prof.enabled || !name)
+    {
+        return -1;
+    }
+
+    res = prof_find(name, atomic_load_explicit(&prof.num_counters, memory_order_acquire));
+
+    if (res >= 0)
+    {
+        return res;
+    }
+
+    pthread_mutex_lock(&prof.lock);
+
+    num_counters = atomic_load_explicit(&prof.num_counters, memory_order_relaxed);
+    res = prof_find(name, num_counters);
+
+    if (res < 0 && num_counters < PROF_MAX_COUNTERS)
+    {
+        prof.counters[num_counters].name = name;
+        res = num_counters;
+        atomic_store_explicit(&prof.num_counters, num_counters + 1, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&prof.lock);
+
+    return res;
+}
+
+uint64_t IMC_PROF_begin()
+{
+    return prof.enabled ? IMC_time_ns() : 0;
+}
+
+void IMC_PROF_add(int counter, uint64_t begin)
+{
+    uint64_t end;
+
+    if (!begin || counter < 0)
+    {
+        return;
+    }
+
+    end = IMC_time_ns();
+
+    atomic_fetch_add_explicit(&prof.counters[counter].calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&prof.counters[counter].time_ns, end - begin, memory_order_relaxed);
+
+    if (IMC_TRACE_is_enabled())
+    {
+        IMC_TRACE_event(prof.counters[counter].name, begin, end);
+    }
+}
+
+void IMC_PROF_end(const char *name, uint64_t begin)
+{
+    if (!begin)
+    {
+        return;
+    }
+
+    IMC_PROF_add(IMC_PROF_counter(name), begin);
+}
+
+bool IMC_PROF_report(const char *json_file)
+{
+    FILE *out = stderr;
+    struct prof_entry entries[PROF_MAX_COUNTERS];
+    const int num_entries = atomic_load_explicit(&prof.num_counters, memory_order_acquire);
+    const uint64_t wall_ns = IMC_time_ns() - prof.start;
+    struct rusage usage = {};
+
+    if (!prof.enabled)
+    {
+        return false;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    for (int i = 0; i < num_entries; i++)
+    {
+        entries[i].name = prof.counters[i].name;
+        entries[i].calls = atomic_load_explicit(&prof.counters[i].calls, memory_order_relaxed);
+        entries[i].time_ns = atomic_load_explicit(&prof.counters[i].time_ns, memory_order_relaxed);
+    }
+
+    qsort(entries, num_entries, sizeof(struct prof_entry), prof_compare);
+
+    if (json_file)
+    {
+        out = fopen(json_file, "w");
+
+        if (!out)
+        {
+            printf("error: failed to open profile output '%s' (%m)!!\n", json_file);
+            return false;
+        }
+
+        fprintf(out, "{\n  \"wall_ms\": %.3f,\n  \"peak_rss_kb\": %ld,\n  \"counters\": [", IMC_time_ms(wall_ns),
+                usage.ru_maxrss);
+
+        for (int i = 0; i < num_entries; i++)
+        {
+            fprintf(out, "%s\n    { \"name\": \"%s\", \"calls\": %" PRIu64 ", \"total_ms\": %.3f, \"avg_us\": %.3f }",
+                    i ? "," : "", entries[i].name, entries[i].calls, IMC_time_ms(entries[i].time_ns),
+                    entries[i].calls ? entries[i].time_ns / 1000.00 / entries[i].calls : 0.00);
+        }
+
+        fprintf(out, "\n  ]\n}\n");
+
+        return fclose(out) == 0;
+    }
+
+    fprintf(out, "profile: %.2f ms wall, %ld KiB peak rss\n", IMC_time_ms(wall_ns), usage.ru_maxrss);
+    fprintf(out, "  %-28s %10s %12s %12s %8s\n", "name", "calls", "total ms", "avg us", "wall %");
+
+    for (int i = 0; i < num_entries; i++)
+    {
+        fprintf(out, "  %-28s %10" PRIu64 " %12.3f %12.3f %8.1f\n", entries[i].name, entries[i].calls,
+                IMC_time_ms(entries[i].time_ns),
+                entries[i].calls ? entries[i].time_ns / 1000.00 / entries[i].calls : 0.00,
+                wall_ns ? entries[i].time_ns * 100.00 / wall_ns : 0.00);
+    }
+
+    return true;
+}
@@ -0,0 +1,661 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <stc/cstr.h>
+
+#include "trace.h"
+#include "langvm.h"
+#include "timing.h"
+#include "profile.h"
+
+#define SERVER_MAX_SOURCE (64 * 1024 * 1024)
+#define SERVER_WATCHDOG_INTERVAL_US 5000
+#define SERVER_READ_TIMEOUT_S 5
+
+struct server_format
+{
+    const char *name;
+    bool (*write)(struct imc_lang_vm *vm, imc_write_func_t func, void *closure);
+} static const SERVER_FORMATS[] =
+{
+    {
+        .name = "png",
+        .write = IMC_VM_write_png_stream,
+    },
+    {
+        .name = "jpg",
+        .write = IMC_VM_write_jpg_stream,
+    },
+    {
+        .name = "jpeg",
+        .write = IMC_VM_write_jpg_stream,
+    },
+    {
+        .name = "bmp",
+        .write = IMC_VM_write_bmp_stream,
+    },
+    {
+        .name = "tga",
+        .write = IMC_VM_write_tga_stream,
+    },
+    {
+        .name = "xpm",
+        .write = IMC_VM_write_xpm_stream,
+    },
+    {},
+};
+
+struct server_buffer
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+};
+
+struct imc_server;
+
+struct server_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct imc_server *server;
+    struct imc_lang_vm *vm;
+    uint64_t deadline;
+    bool busy;
+    bool timed_out;
+};
+
+struct imc_server
+{
+    int listen_fd;
+    int deadline_ms;
+
+    int num_workers;
+    struct server_worker *workers;
+
+    pthread_t watchdog;
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    int *queue;
+    size_t queue_head;
+    size_t queue_size;
+    size_t queue_capacity;
+};
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+    const char *bytes = data;
+
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (sent <= 0)
+        {
+            return false;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+static void send_error(int fd, const char *msg)
+{
+    cstr line = cstr_from_fmt("error %s\n", msg);
+
+    for (isize i = 0; i < cstr_size(&line) - 1; i++)
+    {
+        if (cstr_str(&line)[i] == '\n')
+        {
+            cstr_data(&line)[i] = ' ';
+        }
+    }
+
+    send_all(fd, cstr_str(&line), cstr_size(&line));
+    cstr_drop(&line);
+}
+
+static void buffer_write(void *closure, void *data, int size)
+{
+    struct server_buffer *buf = closure;
+
+    if (buf->failed || size <= 0)
+    {
+        return;
+    }
+
+    if (buf->size + size > buf->capacity)
+    {
+        size_t capacity = buf->capacity ? buf->capacity : 65536;
+        char *grown;
+
+        while (capacity < buf->size + size)
+        {
+            capacity *= 2;
+        }
+
+        grown = realloc(buf->data, capacity);
+
+        if (!grown)
+        {
+            buf->failed = true;
+            return;
+        }
+
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static const struct server_format *find_format(const char *name)
+{
+    for (int i = 0; SERVER_FORMATS[i].name; i++)
+    {
+        if (strcmp(SERVER_FORMATS[i].name, name) == 0)
+        {
+            return &SERVER_FORMATS[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static void lock_worker(struct server_worker *worker)
+{
+    const uint64_t begin = IMC_PROF_begin();
+
+    pthread_mutex_lock(&worker->lock);
+    IMC_PROF_end("server.lock.worker", begin);
+}
+
+static bool server_run_request(struct server_worker *worker, FILE *in, int fd)
+{
+    bool ok = false;
+    bool timed_out;
+    char *line = nullptr;
+    char *source = nullptr;
+    size_t line_cap = 0;
+    cstr filename = cstr_init();
+    int deadline_ms = worker->server->deadline_ms;
+    const struct server_format *format = find_format("png");
+    struct server_buffer out = {};
+
+    IMC_VM_reset(worker->vm);
+
+    while (!source && cstr_is_empty(&filename))
+    {
+        char *value;
+        ssize_t len = getline(&line, &line_cap, in);
+
+        if (len <= 0)
+        {
+            send_error(fd, "incomplete request");
+            goto out;
+        }
+
+        line[strcspn(line, "\n")] = '\0';
+        value = strchr(line, ' ');
+
+        if (!value)
+        {
+            send_error(fd, "malformed request");
+            goto out;
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(line, "format") == 0)
+        {
+            format = find_format(value);
+
+            if (!format)
+            {
+                send_error(fd, "unknown format");
+                goto out;
+            }
+        }
+        else if (strcmp(line, "deadline") == 0)
+        {
+            const int requested = atoi(value);
+            const int limit = worker->server->deadline_ms;
+
+            /* clients may only shorten the server deadline, never lift it */
+            deadline_ms = requested > 0 && (limit <= 0 || requested < limit) ? requested : limit;
+        }
+        else if (strcmp(line, "param") == 0)
+        {
+            char *param_value = strchr(value, ' ');
+
+            if (param_value)
+            {
+                *param_value++ = '\0';
+            }
+
+            IMC_VM_set_param(worker->vm, value, param_value ? param_value : "");
+        }
+        else if (strcmp(line, "file") == 0)
+        {
+            filename = cstr_from(value);
+        }
+        else if (strcmp(line, "source") == 0)
+        {
+            long size = atol(value);
+
+            if (size <= 0 || size > SERVER_MAX_SOURCE)
+            {
+                send_error(fd, "invalid source length");
+                goto out;
+            }
+
+            source = malloc(size + 1);
+
+            if (!source)
+            {
+                send_error(fd, "out of memory");
+                goto out;
+            }
+
+            if (fread(source, 1, size, in) != (size_t)size)
+            {
+                send_error(fd, "incomplete source");
+                goto out;
+            }
+
+            source[size] = '\0';
+        }
+        else
+        {
+            send_error(fd, "unknown request field");
+            goto out;
+        }
+    }
+
+    lock_worker(worker);
+    worker->busy = true;
+    worker->timed_out = false;
+    worker->deadline = deadline_ms > 0 ? IMC_time_ns() + (uint64_t)deadline_ms * 1000000 : 0;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (source)
+    {
+        ok = IMC_VM_run_src(worker->vm, source);
+    }
+    else
+    {
+        ok = IMC_VM_run_src_file(worker->vm, cstr_str(&filename));
+    }
+
+    lock_worker(worker);
+    worker->busy = false;
+    timed_out = worker->timed_out;
+    IMC_VM_clear_interrupt(worker->vm);
+    pthread_mutex_unlock(&worker->lock);
+
+    if (!ok)
+    {
+        send_error(fd, timed_out ? "deadline exceeded" : IMC_VM_get_error(worker->vm));
+
+        if (strcmp(IMC_VM_get_error(worker->vm), "not enough memory") == 0)
+        {
+            lock_worker(worker);
+
+            /* the worker keeps answering, but every run fails until the process is restarted */
+            if (!IMC_VM_recycle(worker->vm))
+            {
+                printf("error: failed to recycle the vm of a serve worker!!\n");
+            }
+
+            IMC_VM_run_src(worker->vm, "Image.create()");
+            pthread_mutex_unlock(&worker->lock);
+        }
+
+        goto out;
+    }
+
+    if (!format->write(worker->vm, buffer_write, &out) || out.failed)
+    {
+        send_error(fd, "failed to encode image");
+        goto out;
+    }
+
+    cstr_drop(&filename);
+    filename = cstr_from_fmt("ok %zu\n", out.size);
+
+    ok = send_all(fd, cstr_str(&filename), cstr_size(&filename)) && send_all(fd, out.data, out.size);
+out:
+    free(line);
+    free(source);
+    free(out.data);
+    cstr_drop(&filename);
+    return ok;
+}
+
+static int queue_pop(struct imc_server *server)
+{
+    int fd;
+    uint64_t begin = IMC_PROF_begin();
+
+    pthread_mutex_lock(&server->queue_lock);
+    IMC_PROF_end("server.lock.queue", begin);
+
+    begin = IMC_PROF_begin();
+
+    while (!server->queue_size)
+    {
+        pthread_cond_wait(&server->queue_cond, &server->queue_lock);
+    }
+
+    IMC_PROF_end("server.idle", begin);
+
+    fd = server->queue[server->queue_head];
+    server->queue_head = (server->queue_head + 1) % server->queue_capacity;
+    server->queue_size--;
+
+    pthread_mutex_unlock(&server->queue_lock);
+
+    return fd;
+}
+
+static bool queue_push(struct imc_server *server, int fd)
+{
+    bool pushed = false;
+    const uint64_t begin = IMC_PROF_begin();
+
+    pthread_mutex_lock(&server->queue_lock);
+    IMC_PROF_end("server.lock.queue", begin);
+
+    if (server->queue_size < server->queue_capacity)
+    {
+        const size_t tail = (server->queue_head + server->queue_size) % server->queue_capacity;
+
+        server->queue[tail] = fd;
+        server->queue_size++;
+        pushed = true;
+
+        pthread_cond_signal(&server->queue_cond);
+    }
+
+    pthread_mutex_unlock(&server->queue_lock);
+
+    return pushed;
+}
+
+static void *server_worker_main(void *arg)
+{
+    struct server_worker *worker = arg;
+    cstr name = cstr_from_fmt("worker %d", (int)(worker - worker->server->workers));
+
+    IMC_TRACE_thread_name(cstr_str(&name));
+    cstr_drop(&name);
+
+    for (;;)
+    {
+        uint64_t begin;
+        int fd = queue_pop(worker->server);
+        FILE *in = fdopen(fd, "r");
+
+        if (!in)
+        {
+            close(fd);
+            continue;
+        }
+
+        begin = IMC_PROF_begin();
+        server_run_request(worker, in, fd);
+        fclose(in);
+        IMC_PROF_end("server.request", begin);
+
+        IMC_TRACE_flush();
+    }
+
+    return nullptr;
+}
+
+static void *server_watchdog_main(void *arg)
+{
+    struct imc_server *server = arg;
+
+    IMC_TRACE_thread_name("watchdog");
+
+    for (;;)
+    {
+        const uint64_t now = IMC_time_ns();
+
+        for (int i = 0; i < server->num_workers; i++)
+        {
+            struct server_worker *worker = &server->workers[i];
+
+            pthread_mutex_lock(&worker->lock);
+
+            if (worker->busy && !worker->timed_out && worker->deadline && now > worker->deadline)
+            {
+                worker->timed_out = true;
+                IMC_VM_interrupt(worker->vm);
+            }
+
+            pthread_mutex_unlock(&worker->lock);
+        }
+
+        usleep(SERVER_WATCHDOG_INTERVAL_US);
+    }
+
+    return nullptr;
+}
+
+static int server_listen(const char *socket_path, int backlog)
+{
+    int fd;
+    bool bound;
+    mode_t mask;
+    struct stat st;
+    struct sockaddr_un addr =
+    {
+        .sun_family = AF_UNIX,
+    };
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        printf("error: socket path too long!!\n");
+        return -1;
+    }
+
+    strcpy(addr.sun_path, socket_path);
+
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socket_path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        printf("error: failed to create socket (%m)!!\n");
+        return -1;
+    }
+
+    /* the socket is created 0600 so there is no window in which others can connect */
+    mask = umask(0177);
+    bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+
+    if (!bound || listen(fd, backlog) != 0)
+    {
+        printf("error: failed to listen on '%s' (%m)!!\n", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* scripts run with io and os loaded, so only the user running the server and root may submit them */
+static bool server_peer_allowed(int fd)
+{
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0)
+    {
+        return false;
+    }
+
+    return cred.uid == geteuid() || cred.uid == 0;
+}
+
+static void server_free(struct imc_server *server)
+{
+    for (int i = 0; server->workers && i < server->num_workers; i++)
+    {
+        IMC_VM_free(server->workers[i].vm);
+    }
+
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+    }
+
+    free(server->workers);
+    free(server->queue);
+    free(server);
+}
+
+bool IMC_SERVER_run(const struct imc_vm_conf *conf, const char *socket_path, int num_workers, int queue_size, int deadline_ms)
+{
+    struct imc_server *server;
+
+    if (!socket_path || num_workers <= 0 || queue_size <= 0)
+    {
+        return false;
+    }
+
+    server = calloc(1, sizeof(struct imc_server));
+
+    if (!server)
+    {
+        return false;
+    }
+
+    server->listen_fd = -1;
+    server->deadline_ms = deadline_ms;
+    server->num_workers = num_workers;
+    server->queue_capacity = queue_size;
+    server->workers = calloc(num_workers, sizeof(struct server_worker));
+    server->queue = calloc(queue_size, sizeof(int));
+
+    if (!server->workers || !server->queue)
+    {
+        server_free(server);
+        return false;
+    }
+
+    pthread_mutex_init(&server->queue_lock, nullptr);
+    pthread_cond_init(&server->queue_cond, nullptr);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        struct server_worker *worker = &server->workers[i];
+
+        worker->server = server;
+        worker->vm = IMC_VM_new(conf);
+
+        if (!worker->vm)
+        {
+            server_free(server);
+            return false;
+        }
+
+        IMC_VM_run_src(worker->vm, "Image.create()");
+        pthread_mutex_init(&worker->lock, nullptr);
+    }
+
+    server->listen_fd = server_listen(socket_path, queue_size);
+
+    if (server->listen_fd < 0)
+    {
+        server_free(server);
+        return false;
+    }
+
+    /* once a thread runs the server is never torn down, the process exits instead */
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (pthread_create(&server->workers[i].thread, nullptr, server_worker_main, &server->workers[i]) != 0)
+        {
+            printf("error: failed to start worker thread!!\n");
+            return false;
+        }
+    }
+
+    if (pthread_create(&server->watchdog, nullptr, server_watchdog_main, server) != 0)
+    {
+        printf("error: failed to start watchdog thread!!\n");
+        return false;
+    }
+
+    printf("serve: listening on %s with %d workers\n", socket_path, num_workers);
+    fflush(stdout);
+
+    for (;;)
+    {
+        struct timeval timeout =
+        {
+            .tv_sec = SERVER_READ_TIMEOUT_S,
+        };
+        int fd = accept4(server->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+        {
+            continue;
+        }
+        else if (fd < 0 && (errno == EMFILE || errno == ENFILE))
+        {
+            usleep(SERVER_WATCHDOG_INTERVAL_US);
+            continue;
+        }
+        else if (fd < 0)
+        {
+            printf("error: failed to accept connection (%m)!!\n");
+            return false;
+        }
+
+        if (!server_peer_allowed(fd))
+        {
+            send_error(fd, "forbidden");
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        if (!queue_push(server, fd))
+        {
+            send_error(fd, "busy");
+            close(fd);
+        }
+    }
+}
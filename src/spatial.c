@@ -0,0 +1,1114 @@
+#include "spatial.h"
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+
+#include "luabuf.h"
+#include "profile.h"
+
+#define SPATIAL_METATABLE "imc.spatial"
+#define SPATIAL_NONE -1
+#define SPATIAL_MAX_DEPTH 16
+#define SPATIAL_MAX_COORD 1073741824.0
+
+enum spatial_kind
+{
+    SPATIAL_GRID,
+    SPATIAL_QUADTREE,
+};
+
+/* circles, chained into the cell or leaf holding their center */
+struct spatial_item
+{
+    double x;
+    double y;
+    double r;
+    int32_t next;
+};
+
+struct spatial_cell
+{
+    int32_t x;
+    int32_t y;
+    int32_t head;
+};
+
+struct spatial_node
+{
+    double x;
+    double y;
+    double w;
+    double h;
+    int32_t children;
+    int32_t head;
+    int32_t count;
+    int32_t depth;
+};
+
+struct spatial
+{
+    enum spatial_kind kind;
+
+    struct spatial_item *items;
+    size_t num_items;
+    size_t cap_items;
+    double max_radius;
+
+    double cell_size;
+    struct spatial_cell *cells;
+    size_t num_cells;
+    size_t cap_cells;
+    int32_t min_cell[2];
+    int32_t max_cell[2];
+
+    struct spatial_node *nodes;
+    size_t num_nodes;
+    size_t cap_nodes;
+    int capacity;
+    int32_t outside;
+};
+
+/* return false to stop the walk */
+typedef bool (*spatial_visit_fn)(void *ctx, const struct spatial *sp, int32_t id);
+
+static inline int32_t spatial_cell_coord(const struct spatial *sp, double v)
+{
+    v = floor(v / sp->cell_size);
+
+    return v < -SPATIAL_MAX_COORD ? -SPATIAL_MAX_COORD : (v > SPATIAL_MAX_COORD ? SPATIAL_MAX_COORD : v);
+}
+
+static inline size_t spatial_cell_hash(int32_t x, int32_t y)
+{
+    return ((uint32_t)x * 0x9E3779B1u) ^ ((uint32_t)y * 0x85EBCA77u);
+}
+
+static bool spatial_grow_cells(struct spatial *sp)
+{
+    const size_t cap = sp->cap_cells ? sp->cap_cells * 2 : 256;
+    struct spatial_cell *cells = malloc(cap * sizeof(struct spatial_cell));
+
+    if (!cells)
+    {
+        return false;
+    }
+
+    memset(cells, 0xFF, cap * sizeof(struct spatial_cell));
+
+    for (size_t i = 0; i < sp->cap_cells; i++)
+    {
+        size_t slot;
+
+        if (sp->cells[i].head == SPATIAL_NONE)
+        {
+            continue;
+        }
+
+        slot = spatial_cell_hash(sp->cells[i].x, sp->cells[i].y) & (cap - 1);
+
+        while (cells[slot].head != SPATIAL_NONE)
+        {
+            slot = (slot + 1) & (cap - 1);
+        }
+
+        cells[slot] = sp->cells[i];
+    }
+
+    free(sp->cells);
+    sp->cells = cells;
+    sp->cap_cells = cap;
+
+    return true;
+}
+
+static struct spatial_cell *spatial_find_cell(const struct spatial *sp, int32_t x, int32_t y)
+{
+    size_t slot;
+
+    if (!sp->cap_cells)
+    {
+        return nullptr;
+    }
+
+    slot = spatial_cell_hash(x, y) & (sp->cap_cells - 1);
+
+    while (sp->cells[slot].head != SPATIAL_NONE)
+    {
+        if (sp->cells[slot].x == x && sp->cells[slot].y == y)
+        {
+            return &sp->cells[slot];
+        }
+
+        slot = (slot + 1) & (sp->cap_cells - 1);
+    }
+
+    return nullptr;
+}
+
+static bool spatial_grid_insert(struct spatial *sp, int32_t id)
+{
+    const int32_t x = spatial_cell_coord(sp, sp->items[id].x);
+    const int32_t y = spatial_cell_coord(sp, sp->items[id].y);
+    struct spatial_cell *cell = spatial_find_cell(sp, x, y);
+    size_t slot;
+
+    if (cell)
+    {
+        sp->items[id].next = cell->head;
+        cell->head = id;
+        return true;
+    }
+
+    if ((sp->num_cells + 1) * 2 > sp->cap_cells && !spatial_grow_cells(sp))
+    {
+        return false;
+    }
+
+    slot = spatial_cell_hash(x, y) & (sp->cap_cells - 1);
+
+    while (sp->cells[slot].head != SPATIAL_NONE)
+    {
+        slot = (slot + 1) & (sp->cap_cells - 1);
+    }
+
+    sp->cells[slot] = (struct spatial_cell){ .x = x, .y = y, .head = id };
+    sp->items[id].next = SPATIAL_NONE;
+
+    if (sp->num_cells++ == 0)
+    {
+        sp->min_cell[0] = sp->max_cell[0] = x;
+        sp->min_cell[1] = sp->max_cell[1] = y;
+    }
+    else
+    {
+        sp->min_cell[0] = x < sp->min_cell[0] ? x : sp->min_cell[0];
+        sp->min_cell[1] = y < sp->min_cell[1] ? y : sp->min_cell[1];
+        sp->max_cell[0] = x > sp->max_cell[0] ? x : sp->max_cell[0];
+        sp->max_cell[1] = y > sp->max_cell[1] ? y : sp->max_cell[1];
+    }
+
+    return true;
+}
+
+static inline bool spatial_node_contains(const struct spatial_node *node, double x, double y)
+{
+    return x >= node->x && x < node->x + node->w && y >= node->y && y < node->y + node->h;
+}
+
+static inline int32_t spatial_node_child(const struct spatial_node *node, double x, double y)
+{
+    return node->children + (y >= node->y + node->h / 2) * 2 + (x >= node->x + node->w / 2);
+}
+
+static bool spatial_split(struct spatial *sp, int32_t index)
+{
+    struct spatial_node node;
+    int32_t id;
+
+    if (sp->num_nodes + 4 > sp->cap_nodes)
+    {
+        const size_t cap = sp->cap_nodes * 2;
+        struct spatial_node *nodes = realloc(sp->nodes, cap * sizeof(struct spatial_node));
+
+        if (!nodes)
+        {
+            return false;
+        }
+
+        sp->nodes = nodes;
+        sp->cap_nodes = cap;
+    }
+
+    node = sp->nodes[index];
+    node.children = sp->num_nodes;
+
+    for (int i = 0; i < 4; i++)
+    {
+        sp->nodes[sp->num_nodes++] = (struct spatial_node)
+        {
+            .x = node.x + (i & 1) * node.w / 2,
+            .y = node.y + (i >> 1) * node.h / 2,
+            .w = node.w / 2,
+            .h = node.h / 2,
+            .children = SPATIAL_NONE,
+            .head = SPATIAL_NONE,
+            .depth = node.depth + 1,
+        };
+    }
+
+    for (id = node.head; id != SPATIAL_NONE;)
+    {
+        const int32_t next = sp->items[id].next;
+        struct spatial_node *child = &sp->nodes[spatial_node_child(&node, sp->items[id].x, sp->items[id].y)];
+
+        sp->items[id].next = child->head;
+        child->head = id;
+        child->count++;
+        id = next;
+    }
+
+    node.head = SPATIAL_NONE;
+    node.count = 0;
+    sp->nodes[index] = node;
+
+    return true;
+}
+
+static bool spatial_quadtree_insert(struct spatial *sp, int32_t id)
+{
+    const double x = sp->items[id].x;
+    const double y = sp->items[id].y;
+    int32_t index = 0;
+    struct spatial_node *node;
+
+    if (!spatial_node_contains(&sp->nodes[0], x, y))
+    {
+        sp->items[id].next = sp->outside;
+        sp->outside = id;
+        return true;
+    }
+
+    while (sp->nodes[index].children != SPATIAL_NONE)
+    {
+        index = spatial_node_child(&sp->nodes[index], x, y);
+    }
+
+    node = &sp->nodes[index];
+    sp->items[id].next = node->head;
+    node->head = id;
+    node->count++;
+
+    /* a failed split only leaves the leaf oversized */
+    if (node->count > sp->capacity && node->depth < SPATIAL_MAX_DEPTH)
+    {
+        spatial_split(sp, index);
+    }
+
+    return true;
+}
+
+static bool spatial_insert(struct spatial *sp, double x, double y, double r)
+{
+    const int32_t id = sp->num_items;
+
+    if (sp->num_items >= INT32_MAX)
+    {
+        return false;
+    }
+
+    if (sp->num_items == sp->cap_items)
+    {
+        const size_t cap = sp->cap_items ? sp->cap_items * 2 : 1024;
+        struct spatial_item *items = realloc(sp->items, cap * sizeof(struct spatial_item));
+
+        if (!items)
+        {
+            return false;
+        }
+
+        sp->items = items;
+        sp->cap_items = cap;
+    }
+
+    sp->items[id] = (struct spatial_item){ .x = x, .y = y, .r = r, .next = SPATIAL_NONE };
+
+    if (!(sp->kind == SPATIAL_GRID ? spatial_grid_insert(sp, id) : spatial_quadtree_insert(sp, id)))
+    {
+        return false;
+    }
+
+    sp->num_items++;
+    sp->max_radius = r > sp->max_radius ? r : sp->max_radius;
+
+    return true;
+}
+
+static bool spatial_visit_list(const struct spatial *sp, int32_t id, spatial_visit_fn fn, void *ctx)
+{
+    for (; id != SPATIAL_NONE; id = sp->items[id].next)
+    {
+        if (!fn(ctx, sp, id))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline double spatial_box_dist2(double x, double y, double bx, double by, double bw, double bh)
+{
+    const double dx = x < bx ? bx - x : (x > bx + bw ? x - bx - bw : 0);
+    const double dy = y < by ? by - y : (y > by + bh ? y - by - bh : 0);
+
+    return dx * dx + dy * dy;
+}
+
+static void spatial_visit_grid(const struct spatial *sp, double x, double y, double reach, spatial_visit_fn fn,
+                               void *ctx)
+{
+    const int32_t x0 = spatial_cell_coord(sp, x - reach);
+    const int32_t y0 = spatial_cell_coord(sp, y - reach);
+    const int32_t x1 = spatial_cell_coord(sp, x + reach);
+    const int32_t y1 = spatial_cell_coord(sp, y + reach);
+
+    /* a reach covering more cells than are populated walks the table instead */
+    if (((double)x1 - x0 + 1) * ((double)y1 - y0 + 1) > (double)sp->num_cells)
+    {
+        for (size_t i = 0; i < sp->cap_cells; i++)
+        {
+            const struct spatial_cell *cell = &sp->cells[i];
+
+            if (cell->head != SPATIAL_NONE && cell->x >= x0 && cell->x <= x1 && cell->y >= y0 && cell->y <= y1
+                && !spatial_visit_list(sp, cell->head, fn, ctx))
+            {
+                return;
+            }
+        }
+
+        return;
+    }
+
+    for (int32_t cy = y0; cy <= y1; cy++)
+    {
+        for (int32_t cx = x0; cx <= x1; cx++)
+        {
+            const struct spatial_cell *cell = spatial_find_cell(sp, cx, cy);
+
+            if (cell && !spatial_visit_list(sp, cell->head, fn, ctx))
+            {
+                return;
+            }
+        }
+    }
+}
+
+static void spatial_visit_quadtree(const struct spatial *sp, double x, double y, double reach, spatial_visit_fn fn,
+                                   void *ctx)
+{
+    int32_t stack[SPATIAL_MAX_DEPTH * 3 + 4];
+    int top = 0;
+
+    if (!spatial_visit_list(sp, sp->outside, fn, ctx))
+    {
+        return;
+    }
+
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const struct spatial_node *node = &sp->nodes[stack[--top]];
+
+        if (spatial_box_dist2(x, y, node->x, node->y, node->w, node->h) > reach * reach)
+        {
+            continue;
+        }
+
+        if (node->children == SPATIAL_NONE)
+        {
+            if (!spatial_visit_list(sp, node->head, fn, ctx))
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+            stack[top++] = node->children + i;
+        }
+    }
+}
+
+/* calls fn for every item whose center is within reach of x, y, and maybe a few more */
+static void spatial_visit(const struct spatial *sp, double x, double y, double reach, spatial_visit_fn fn, void *ctx)
+{
+    if (sp->kind == SPATIAL_GRID)
+    {
+        spatial_visit_grid(sp, x, y, reach, fn, ctx);
+    }
+    else
+    {
+        spatial_visit_quadtree(sp, x, y, reach, fn, ctx);
+    }
+}
+
+struct spatial_overlap_ctx
+{
+    double x;
+    double y;
+    double r;
+    bool found;
+};
+
+static bool spatial_overlap_cb(void *arg, const struct spatial *sp, int32_t id)
+{
+    struct spatial_overlap_ctx *ctx = arg;
+    const struct spatial_item *item = &sp->items[id];
+    const double dx = item->x - ctx->x;
+    const double dy = item->y - ctx->y;
+
+    ctx->found = dx * dx + dy * dy < (ctx->r + item->r) * (ctx->r + item->r);
+
+    return !ctx->found;
+}
+
+static bool spatial_overlaps(const struct spatial *sp, double x, double y, double r)
+{
+    struct spatial_overlap_ctx ctx = { .x = x, .y = y, .r = r };
+
+    spatial_visit(sp, x, y, r + sp->max_radius, spatial_overlap_cb, &ctx);
+
+    return ctx.found;
+}
+
+struct spatial_query_ctx
+{
+    lua_State *L;
+    double x;
+    double y;
+    double radius;
+    int count;
+};
+
+static bool spatial_query_cb(void *arg, const struct spatial *sp, int32_t id)
+{
+    struct spatial_query_ctx *ctx = arg;
+    const struct spatial_item *item = &sp->items[id];
+    const double dx = item->x - ctx->x;
+    const double dy = item->y - ctx->y;
+
+    if (dx * dx + dy * dy <= (ctx->radius + item->r) * (ctx->radius + item->r))
+    {
+        lua_pushinteger(ctx->L, id + 1);
+        lua_rawseti(ctx->L, -2, ++ctx->count);
+    }
+
+    return true;
+}
+
+struct spatial_nearest_ctx
+{
+    double x;
+    double y;
+    double best;
+    int32_t id;
+};
+
+static bool spatial_nearest_cb(void *arg, const struct spatial *sp, int32_t id)
+{
+    struct spatial_nearest_ctx *ctx = arg;
+    const double dx = sp->items[id].x - ctx->x;
+    const double dy = sp->items[id].y - ctx->y;
+    const double dist = dx * dx + dy * dy;
+
+    if (dist < ctx->best)
+    {
+        ctx->best = dist;
+        ctx->id = id;
+    }
+
+    return true;
+}
+
+static void spatial_nearest_grid(const struct spatial *sp, struct spatial_nearest_ctx *ctx)
+{
+    const int32_t cx = spatial_cell_coord(sp, ctx->x);
+    const int32_t cy = spatial_cell_coord(sp, ctx->y);
+    /* cell coordinates span 2^31, so distances between them and ring edges need 64 bits */
+    const int64_t reach[4] =
+    {
+        (int64_t)cx - sp->min_cell[0], (int64_t)sp->max_cell[0] - cx,
+        (int64_t)cy - sp->min_cell[1], (int64_t)sp->max_cell[1] - cy,
+    };
+    int64_t rings = 0;
+    double lookups = 0;
+
+    if (!sp->num_cells)
+    {
+        return;
+    }
+
+    /* rings past the populated bounds can not hold anything */
+    for (int i = 0; i < 4; i++)
+    {
+        rings = llabs(reach[i]) > rings ? llabs(reach[i]) : rings;
+    }
+
+    for (int64_t ring = 0; ring <= rings; ring++)
+    {
+        /* everything in this ring is at least this far away */
+        const double edge = ring > 0 ? (ring - 1) * sp->cell_size : 0;
+
+        if (edge * edge >= ctx->best && ring > 1)
+        {
+            return;
+        }
+
+        lookups += ring > 0 ? ring * 8.0 : 1.0;
+
+        /* far from a sparse grid, checking every populated cell is cheaper than walking empty rings */
+        if (lookups > (double)sp->cap_cells)
+        {
+            for (size_t i = 0; i < sp->cap_cells; i++)
+            {
+                const struct spatial_cell *cell = &sp->cells[i];
+
+                if (cell->head != SPATIAL_NONE
+                    && spatial_box_dist2(ctx->x, ctx->y, cell->x * sp->cell_size, cell->y * sp->cell_size,
+                                         sp->cell_size, sp->cell_size) < ctx->best)
+                {
+                    spatial_visit_list(sp, cell->head, spatial_nearest_cb, ctx);
+                }
+            }
+
+            return;
+        }
+
+        for (int64_t y = cy - ring; y <= cy + ring; y++)
+        {
+            const int64_t step = (y == cy - ring || y == cy + ring) ? 1 : ring * 2;
+
+            if (y < -SPATIAL_MAX_COORD || y > SPATIAL_MAX_COORD)
+            {
+                continue;
+            }
+
+            for (int64_t x = cx - ring; x <= cx + ring; x += step)
+            {
+                const struct spatial_cell *cell;
+
+                if (x < -SPATIAL_MAX_COORD || x > SPATIAL_MAX_COORD)
+                {
+                    continue;
+                }
+
+                cell = spatial_find_cell(sp, x, y);
+
+                if (cell)
+                {
+                    spatial_visit_list(sp, cell->head, spatial_nearest_cb, ctx);
+                }
+            }
+        }
+    }
+}
+
+static void spatial_nearest_quadtree(const struct spatial *sp, struct spatial_nearest_ctx *ctx)
+{
+    int32_t stack[SPATIAL_MAX_DEPTH * 3 + 4];
+    int top = 0;
+
+    spatial_visit_list(sp, sp->outside, spatial_nearest_cb, ctx);
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const struct spatial_node *node = &sp->nodes[stack[--top]];
+        int32_t order[4];
+        double dists[4];
+
+        if (spatial_box_dist2(ctx->x, ctx->y, node->x, node->y, node->w, node->h) >= ctx->best)
+        {
+            continue;
+        }
+
+        if (node->children == SPATIAL_NONE)
+        {
+            spatial_visit_list(sp, node->head, spatial_nearest_cb, ctx);
+            continue;
+        }
+
+        /* push the farthest child first so the nearest one is searched first */
+        for (int i = 0; i < 4; i++)
+        {
+            const struct spatial_node *child = &sp->nodes[node->children + i];
+            int j = i;
+
+            dists[i] = spatial_box_dist2(ctx->x, ctx->y, child->x, child->y, child->w, child->h);
+
+            for (; j > 0 && dists[order[j - 1]] < dists[i]; j--)
+            {
+                order[j] = order[j - 1];
+            }
+
+            order[j] = i;
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+            stack[top++] = node->children + order[i];
+        }
+    }
+}
+
+static void spatial_clear(struct spatial *sp)
+{
+    sp->num_items = 0;
+    sp->max_radius = 0;
+
+    if (sp->kind == SPATIAL_GRID)
+    {
+        if (sp->cells)
+        {
+            memset(sp->cells, 0xFF, sp->cap_cells * sizeof(struct spatial_cell));
+        }
+
+        sp->num_cells = 0;
+        return;
+    }
+
+    sp->num_nodes = 1;
+    sp->nodes[0].children = SPATIAL_NONE;
+    sp->nodes[0].head = SPATIAL_NONE;
+    sp->nodes[0].count = 0;
+    sp->outside = SPATIAL_NONE;
+}
+
+static struct spatial *spatial_check(lua_State *L)
+{
+    return luaL_checkudata(L, 1, SPATIAL_METATABLE);
+}
+
+/* nan would reach the cell coordinate conversion */
+static double spatial_number_arg(lua_State *L, int idx)
+{
+    const double value = luaL_checknumber(L, idx);
+
+    luaL_argcheck(L, !isnan(value), idx, "number must not be nan");
+
+    return value;
+}
+
+static double spatial_opt_number_arg(lua_State *L, int idx, double def)
+{
+    return lua_isnoneornil(L, idx) ? def : spatial_number_arg(L, idx);
+}
+
+/* records come as a table or FFI double array, tables are copied into owned */
+static const double *spatial_records(lua_State *L, int idx, lua_Integer count, int stride, double **owned)
+{
+    double *array;
+    const size_t length = IMC_LBUF_check(L, idx, &array);
+
+    *owned = nullptr;
+    luaL_argcheck(L, (size_t)count <= length / stride, idx, "buffer holds fewer records than count");
+
+    if (array)
+    {
+        for (lua_Integer i = 0; i < count * stride; i++)
+        {
+            luaL_argcheck(L, !isnan(array[i]), idx, "records must not hold nan");
+        }
+
+        return array;
+    }
+
+    *owned = malloc((count * stride + 1) * sizeof(double));
+
+    if (!*owned)
+    {
+        luaL_error(L, "failed to allocate %f records", (lua_Number)count);
+        return nullptr;
+    }
+
+    for (lua_Integer i = 0; i < count * stride; i++)
+    {
+        lua_rawgeti(L, idx, i + 1);
+        (*owned)[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        if (isnan((*owned)[i]))
+        {
+            free(*owned);
+            *owned = nullptr;
+            luaL_argerror(L, idx, "records must not hold nan");
+            return nullptr;
+        }
+    }
+
+    return *owned;
+}
+
+/* flags go into a table as booleans or into an FFI double array as 1 and 0 */
+static void spatial_set_flag(lua_State *L, int idx, double *array, lua_Integer i, bool flag)
+{
+    if (array)
+    {
+        array[i] = flag;
+        return;
+    }
+
+    lua_pushboolean(L, flag);
+    lua_rawseti(L, idx, i + 1);
+}
+
+static double *spatial_flags_arg(lua_State *L, int idx, lua_Integer count)
+{
+    double *array;
+    size_t length;
+
+    if (lua_isnoneornil(L, idx))
+    {
+        lua_settop(L, idx - 1);
+        lua_newtable(L);
+        return nullptr;
+    }
+
+    length = IMC_LBUF_check(L, idx, &array);
+    luaL_argcheck(L, !array || length >= (size_t)count, idx, "array holds fewer flags than count");
+    lua_settop(L, idx);
+
+    return array;
+}
+
+static int spatial_insert_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const double x = spatial_number_arg(L, 2);
+    const double y = spatial_number_arg(L, 3);
+    const double r = luaL_optnumber(L, 4, 0);
+
+    luaL_argcheck(L, r >= 0, 4, "radius must not be negative");
+
+    if (!spatial_insert(sp, x, y, r))
+    {
+        luaL_error(L, "failed to grow spatial index");
+        return 0;
+    }
+
+    lua_pushinteger(L, sp->num_items);
+
+    return 1;
+}
+
+/* idx:insert_many(buf, n), buf holds x, y, r records, returns the id of the first one */
+static int spatial_insert_many_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const lua_Integer count = luaL_checkinteger(L, 3);
+    const lua_Integer first = sp->num_items + 1;
+    const uint64_t begin = IMC_PROF_begin();
+    double *owned;
+    const double *records;
+
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    records = spatial_records(L, 2, count, 3, &owned);
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        const double *record = records + i * 3;
+
+        if (!spatial_insert(sp, record[0], record[1], record[2] > 0 ? record[2] : 0))
+        {
+            free(owned);
+            luaL_error(L, "failed to grow spatial index");
+            return 0;
+        }
+    }
+
+    free(owned);
+    IMC_PROF_end("Spatial.insert_many", begin);
+
+    lua_pushinteger(L, first);
+
+    return 1;
+}
+
+/* ids of the circles touching the query circle */
+static int spatial_query_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    struct spatial_query_ctx ctx =
+    {
+        .L = L,
+        .x = spatial_number_arg(L, 2),
+        .y = spatial_number_arg(L, 3),
+        .radius = spatial_number_arg(L, 4),
+    };
+
+    lua_newtable(L);
+    spatial_visit(sp, ctx.x, ctx.y, ctx.radius + sp->max_radius, spatial_query_cb, &ctx);
+
+    return 1;
+}
+
+static int spatial_nearest_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const double max_dist = luaL_optnumber(L, 4, HUGE_VAL);
+    struct spatial_nearest_ctx ctx =
+    {
+        .x = spatial_number_arg(L, 2),
+        .y = spatial_number_arg(L, 3),
+        .best = max_dist < sqrt(DBL_MAX) ? max_dist * max_dist : DBL_MAX,
+        .id = SPATIAL_NONE,
+    };
+
+    if (sp->kind == SPATIAL_GRID)
+    {
+        spatial_nearest_grid(sp, &ctx);
+    }
+    else
+    {
+        spatial_nearest_quadtree(sp, &ctx);
+    }
+
+    if (ctx.id == SPATIAL_NONE)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, ctx.id + 1);
+    lua_pushnumber(L, sqrt(ctx.best));
+
+    return 2;
+}
+
+static int spatial_overlaps_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+
+    const double x = spatial_number_arg(L, 2);
+    const double y = spatial_number_arg(L, 3);
+
+    lua_pushboolean(L, spatial_overlaps(sp, x, y, spatial_opt_number_arg(L, 4, 0)));
+
+    return 1;
+}
+
+/* idx:overlaps_many(buf, n[, out]), tests x, y, r records against the index without inserting them */
+static int spatial_overlaps_many_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const lua_Integer count = luaL_checkinteger(L, 3);
+    const uint64_t begin = IMC_PROF_begin();
+    double *owned;
+    const double *records;
+    double *flags;
+
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    flags = spatial_flags_arg(L, 4, count);
+    records = spatial_records(L, 2, count, 3, &owned);
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        const double *record = records + i * 3;
+
+        spatial_set_flag(L, 4, flags, i, spatial_overlaps(sp, record[0], record[1], record[2]));
+    }
+
+    free(owned);
+    IMC_PROF_end("Spatial.overlaps_many", begin);
+
+    return 1;
+}
+
+/*
+ * idx:pack(buf, n[, out]), inserts every x, y, r record that does not overlap anything already in the
+ * index, earlier records included, returns the inserted count and the accepted flags
+ */
+static int spatial_pack_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const lua_Integer count = luaL_checkinteger(L, 3);
+    const uint64_t begin = IMC_PROF_begin();
+    lua_Integer inserted = 0;
+    double *owned;
+    const double *records;
+    double *flags;
+
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    flags = spatial_flags_arg(L, 4, count);
+    records = spatial_records(L, 2, count, 3, &owned);
+
+    for (lua_Integer i = 0; i < count; i++)
+    {
+        const double *record = records + i * 3;
+        const double r = record[2] > 0 ? record[2] : 0;
+        const bool accepted = !spatial_overlaps(sp, record[0], record[1], r);
+
+        if (accepted && !spatial_insert(sp, record[0], record[1], r))
+        {
+            free(owned);
+            luaL_error(L, "failed to grow spatial index");
+            return 0;
+        }
+
+        inserted += accepted;
+        spatial_set_flag(L, 4, flags, i, accepted);
+    }
+
+    free(owned);
+    IMC_PROF_end("Spatial.pack", begin);
+
+    lua_pushinteger(L, inserted);
+    lua_insert(L, -2);
+
+    return 2;
+}
+
+static int spatial_get_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+    const lua_Integer id = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, id >= 1 && (size_t)id <= sp->num_items, 2, "unknown id");
+
+    lua_pushnumber(L, sp->items[id - 1].x);
+    lua_pushnumber(L, sp->items[id - 1].y);
+    lua_pushnumber(L, sp->items[id - 1].r);
+
+    return 3;
+}
+
+static int spatial_count_fn(lua_State *L)
+{
+    lua_pushinteger(L, spatial_check(L)->num_items);
+
+    return 1;
+}
+
+static int spatial_clear_fn(lua_State *L)
+{
+    spatial_clear(spatial_check(L));
+
+    return 0;
+}
+
+static int spatial_gc_fn(lua_State *L)
+{
+    struct spatial *sp = spatial_check(L);
+
+    free(sp->items);
+    free(sp->cells);
+    free(sp->nodes);
+    *sp = (struct spatial){};
+
+    return 0;
+}
+
+static struct spatial *spatial_new(lua_State *L, enum spatial_kind kind)
+{
+    struct spatial *sp = lua_newuserdata(L, sizeof(struct spatial));
+
+    *sp = (struct spatial){ .kind = kind, .outside = SPATIAL_NONE };
+
+    luaL_getmetatable(L, SPATIAL_METATABLE);
+    lua_setmetatable(L, -2);
+
+    return sp;
+}
+
+/* Spatial.grid(cell_size), about twice the typical radius works best */
+static int spatial_grid_fn(lua_State *L)
+{
+    const double cell_size = luaL_checknumber(L, 1);
+    struct spatial *sp;
+
+    luaL_argcheck(L, cell_size > 0, 1, "cell size must be positive");
+
+    sp = spatial_new(L, SPATIAL_GRID);
+    sp->cell_size = cell_size;
+
+    return 1;
+}
+
+/* Spatial.quadtree(x, y, width, height[, capacity]), items outside the bounds are kept in a flat list */
+static int spatial_quadtree_fn(lua_State *L)
+{
+    const double x = spatial_number_arg(L, 1);
+    const double y = spatial_number_arg(L, 2);
+    const double width = luaL_checknumber(L, 3);
+    const double height = luaL_checknumber(L, 4);
+    const int capacity = luaL_optint(L, 5, 8);
+    struct spatial *sp;
+
+    luaL_argcheck(L, width > 0, 3, "width must be positive");
+    luaL_argcheck(L, height > 0, 4, "height must be positive");
+    luaL_argcheck(L, capacity > 0, 5, "capacity must be positive");
+
+    sp = spatial_new(L, SPATIAL_QUADTREE);
+    sp->capacity = capacity;
+    sp->nodes = malloc(64 * sizeof(struct spatial_node));
+
+    if (!sp->nodes)
+    {
+        luaL_error(L, "failed to allocate quadtree");
+        return 0;
+    }
+
+    sp->cap_nodes = 64;
+    sp->num_nodes = 1;
+    sp->nodes[0] = (struct spatial_node)
+    {
+        .x = x,
+        .y = y,
+        .w = width,
+        .h = height,
+        .children = SPATIAL_NONE,
+        .head = SPATIAL_NONE,
+    };
+
+    return 1;
+}
+
+bool IMC_SPATIAL_load(lua_State *state)
+{
+    const luaL_Reg methods[] =
+    {
+        { "insert", spatial_insert_fn },
+        { "insert_many", spatial_insert_many_fn },
+        { "query", spatial_query_fn },
+        { "nearest", spatial_nearest_fn },
+        { "overlaps", spatial_overlaps_fn },
+        { "overlaps_many", spatial_overlaps_many_fn },
+        { "pack", spatial_pack_fn },
+        { "get", spatial_get_fn },
+        { "count", spatial_count_fn },
+        { "clear", spatial_clear_fn },
+        { nullptr, nullptr },
+    };
+
+    if (!state)
+    {
+        return false;
+    }
+
+    luaL_newmetatable(state, SPATIAL_METATABLE);
+
+    lua_newtable(state);
+
+    for (const luaL_Reg *method = methods; method->name; method++)
+    {
+        lua_pushcfunction(state, method->func);
+        lua_setfield(state, -2, method->name);
+    }
+
+    lua_setfield(state, -2, "__index");
+
+    lua_pushcfunction(state, spatial_gc_fn);
+    lua_setfield(state, -2, "__gc");
+
+    lua_pop(state, 1);
+
+    lua_newtable(state);
+
+    lua_pushcfunction(state, spatial_grid_fn);
+    lua_setfield(state, -2, "grid");
+
+    lua_pushcfunction(state, spatial_quadtree_fn);
+    lua_setfield(state, -2, "quadtree");
+
+    lua_setglobal(state, "Spatial");
+
+    return true;
+}
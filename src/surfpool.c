@@ -0,0 +1,206 @@
+#include "surfpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_BUCKET 64
+
+struct pool_buffer
+{
+    int width;
+    int height;
+    unsigned char *data;
+    struct pool_buffer *next;
+};
+
+struct imc_surface_pool
+{
+    size_t limit;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+
+    /* buffers handed out are found again on release by their data pointer */
+    struct pool_buffer *used;
+
+    /* most recently released first */
+    struct pool_buffer *free;
+};
+
+static inline int pool_bucket(int size)
+{
+    return (size + POOL_BUCKET - 1) / POOL_BUCKET * POOL_BUCKET;
+}
+
+static inline size_t pool_buffer_size(const struct pool_buffer *buffer)
+{
+    return (size_t)buffer->width * buffer->height * 4;
+}
+
+static void pool_buffer_free(struct pool_buffer *buffer)
+{
+    free(buffer->data);
+    free(buffer);
+}
+
+static struct pool_buffer *pool_take(struct pool_buffer **list, int width, int height, const unsigned char *data)
+{
+    for (struct pool_buffer **link = list; *link; link = &(*link)->next)
+    {
+        struct pool_buffer *buffer = *link;
+
+        if (data ? buffer->data == data : buffer->width == width && buffer->height == height)
+        {
+            *link = buffer->next;
+            buffer->next = nullptr;
+            return buffer;
+        }
+    }
+
+    return nullptr;
+}
+
+/* drops the least recently released buffers past the limit */
+static void pool_trim(struct imc_surface_pool *pool)
+{
+    struct pool_buffer **link = &pool->free;
+    size_t kept = 0;
+
+    while (*link)
+    {
+        struct pool_buffer *buffer = *link;
+
+        if (kept + pool_buffer_size(buffer) > pool->limit)
+        {
+            *link = buffer->next;
+            pool->bytes -= pool_buffer_size(buffer);
+            pool_buffer_free(buffer);
+            continue;
+        }
+
+        kept += pool_buffer_size(buffer);
+        link = &buffer->next;
+    }
+}
+
+struct imc_surface_pool *IMC_POOL_new(size_t limit)
+{
+    struct imc_surface_pool *pool = calloc(1, sizeof(struct imc_surface_pool));
+
+    if (pool)
+    {
+        pool->limit = limit;
+    }
+
+    return pool;
+}
+
+plutovg_surface_t *IMC_POOL_acquire(struct imc_surface_pool *pool, int width, int height)
+{
+    struct pool_buffer *buffer;
+    plutovg_surface_t *surface;
+
+    if (width <= 0 || height <= 0)
+    {
+        return nullptr;
+    }
+
+    buffer = pool_take(&pool->free, pool_bucket(width), pool_bucket(height), nullptr);
+
+    if (buffer)
+    {
+        pool->hits++;
+        pool->bytes -= pool_buffer_size(buffer);
+    }
+    else
+    {
+        pool->misses++;
+        buffer = calloc(1, sizeof(struct pool_buffer));
+
+        if (!buffer)
+        {
+            return nullptr;
+        }
+
+        buffer->width = pool_bucket(width);
+        buffer->height = pool_bucket(height);
+        buffer->data = aligned_alloc(16, pool_buffer_size(buffer));
+
+        if (!buffer->data)
+        {
+            free(buffer);
+            return nullptr;
+        }
+    }
+
+    memset(buffer->data, 0, pool_buffer_size(buffer));
+    surface = plutovg_surface_create_for_data(buffer->data, width, height, buffer->width * 4);
+
+    if (!surface)
+    {
+        pool_buffer_free(buffer);
+        return nullptr;
+    }
+
+    buffer->next = pool->used;
+    pool->used = buffer;
+
+    return surface;
+}
+
+void IMC_POOL_release(struct imc_surface_pool *pool, plutovg_surface_t *surface)
+{
+    struct pool_buffer *buffer;
+
+    if (!surface)
+    {
+        return;
+    }
+
+    buffer = pool_take(&pool->used, 0, 0, plutovg_surface_get_data(surface));
+    plutovg_surface_destroy(surface);
+
+    if (!buffer)
+    {
+        return;
+    }
+
+    buffer->next = pool->free;
+    pool->free = buffer;
+    pool->bytes += pool_buffer_size(buffer);
+
+    pool_trim(pool);
+}
+
+void IMC_POOL_stats(const struct imc_surface_pool *pool, size_t *hits, size_t *misses, size_t *bytes)
+{
+    *hits = pool->hits;
+    *misses = pool->misses;
+    *bytes = pool->bytes;
+}
+
+void IMC_POOL_free(struct imc_surface_pool *pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+
+    while (pool->used)
+    {
+        struct pool_buffer *next = pool->used->next;
+
+        pool_buffer_free(pool->used);
+        pool->used = next;
+    }
+
+    while (pool->free)
+    {
+        struct pool_buffer *next = pool->free->next;
+
+        pool_buffer_free(pool->free);
+        pool->free = next;
+    }
+
+    free(pool);
+}
@@ -0,0 +1,243 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "timing.h"
+
+#define TRACE_BUFFER_EVENTS 4096
+#define TRACE_BURST_GAP_NS 50000
+#define TRACE_BURST_PREFIX "Image."
+
+struct trace_event
+{
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    uint32_t calls;
+};
+
+struct trace_thread
+{
+    int tid;
+    int num_events;
+    bool burst_open;
+    struct trace_event burst;
+    struct trace_thread *next;
+    struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+static struct
+{
+    FILE *out;
+    bool enabled;
+    int next_tid;
+    size_t num_written;
+    uint64_t origin;
+    pthread_mutex_t lock;
+    struct trace_thread *threads;
+} trace =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static thread_local struct trace_thread *trace_self;
+
+static struct trace_thread *trace_thread_get()
+{
+    struct trace_thread *thread = trace_self;
+
+    if (thread)
+    {
+        return thread;
+    }
+
+    thread = calloc(1, sizeof(struct trace_thread));
+
+    if (!thread)
+    {
+        return nullptr;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    thread->tid = ++trace.next_tid;
+    thread->next = trace.threads;
+    trace.threads = thread;
+    pthread_mutex_unlock(&trace.lock);
+
+    trace_self = thread;
+
+    return thread;
+}
+
+static void trace_write_events(struct trace_thread *thread)
+{
+    for (int i = 0; i < thread->num_events; i++)
+    {
+        const struct trace_event *event = &thread->events[i];
+
+        fprintf(trace.out, "%s{\"name\":\"%s\",\"cat\":\"imc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+                trace.num_written++ ? ",\n" : "", event->calls > 1 ? "draw burst" : event->name,
+                (event->begin - trace.origin) / 1000.00, (event->end - event->begin) / 1000.00, thread->tid);
+
+        if (event->calls)
+        {
+            fprintf(trace.out, ",\"args\":{\"calls\":%u}", event->calls);
+        }
+
+        fprintf(trace.out, "}");
+    }
+
+    thread->num_events = 0;
+}
+
+static void trace_push(struct trace_thread *thread, const struct trace_event *event, bool locked)
+{
+    if (thread->num_events == TRACE_BUFFER_EVENTS)
+    {
+        if (!locked)
+        {
+            pthread_mutex_lock(&trace.lock);
+        }
+
+        trace_write_events(thread);
+
+        if (!locked)
+        {
+            pthread_mutex_unlock(&trace.lock);
+        }
+    }
+
+    thread->events[thread->num_events++] = *event;
+}
+
+static void trace_close_burst(struct trace_thread *thread, bool locked)
+{
+    if (thread->burst_open)
+    {
+        thread->burst_open = false;
+        trace_push(thread, &thread->burst, locked);
+    }
+}
+
+bool IMC_TRACE_open(const char *filename)
+{
+    trace.out = fopen(filename, "w");
+
+    if (!trace.out)
+    {
+        printf("error: failed to open trace output '%s' (%m)!!\n", filename);
+        return false;
+    }
+
+    fprintf(trace.out, "[\n");
+
+    trace.origin = IMC_time_ns();
+    trace.enabled = true;
+
+    IMC_TRACE_thread_name("main");
+
+    return true;
+}
+
+bool IMC_TRACE_is_enabled()
+{
+    return trace.enabled;
+}
+
+void IMC_TRACE_thread_name(const char *name)
+{
+    struct trace_thread *thread;
+
+    if (!trace.enabled || !(thread = trace_thread_get()))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    fprintf(trace.out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            trace.num_written++ ? ",\n" : "", thread->tid, name);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void IMC_TRACE_event(const char *name, uint64_t begin, uint64_t end)
+{
+    struct trace_thread *thread;
+    struct trace_event event =
+    {
+        .name = name,
+        .begin = begin,
+        .end = end,
+    };
+
+    if (!trace.enabled || !(thread = trace_thread_get()))
+    {
+        return;
+    }
+
+    if (strncmp(name, TRACE_BURST_PREFIX, strlen(TRACE_BURST_PREFIX)) != 0)
+    {
+        trace_close_burst(thread, false);
+        trace_push(thread, &event, false);
+        return;
+    }
+
+    if (thread->burst_open && begin - thread->burst.end <= TRACE_BURST_GAP_NS)
+    {
+        thread->burst.end = end;
+        thread->burst.calls++;
+        return;
+    }
+
+    trace_close_burst(thread, false);
+
+    event.calls = 1;
+    thread->burst = event;
+    thread->burst_open = true;
+}
+
+void IMC_TRACE_flush()
+{
+    struct trace_thread *thread = trace_self;
+
+    if (!trace.enabled || !thread)
+    {
+        return;
+    }
+
+    trace_close_burst(thread, false);
+
+    pthread_mutex_lock(&trace.lock);
+    trace_write_events(thread);
+    fflush(trace.out);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void IMC_TRACE_close()
+{
+    struct trace_thread *thread;
+
+    if (!trace.enabled)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+
+    trace.enabled = false;
+
+    for (thread = trace.threads; thread; thread = thread->next)
+    {
+        trace_close_burst(thread, true);
+        trace_write_events(thread);
+    }
+
+    /* without the closing bracket the file still loads, which is what a killed server leaves behind */
+    fprintf(trace.out, "\n]\n");
+    fclose(trace.out);
+    trace.out = nullptr;
+
+    pthread_mutex_unlock(&trace.lock);
+}
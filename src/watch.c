@@ -0,0 +1,200 @@
+#include "watch.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include <stc/cstr.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+#define WATCH_SETTLE_MS 50
+
+struct watch_entry
+{
+    int wd;
+    cstr name;
+};
+
+struct imc_watch
+{
+    int fd;
+    size_t size;
+    size_t capacity;
+    struct watch_entry *entries;
+};
+
+struct imc_watch *IMC_WATCH_new()
+{
+    struct imc_watch *res = calloc(1, sizeof(struct imc_watch));
+
+    if (!res)
+    {
+        return nullptr;
+    }
+
+    res->fd = inotify_init1(IN_CLOEXEC);
+
+    if (res->fd < 0)
+    {
+        printf("error: failed to initialize inotify (%m)!!\n");
+        free(res);
+        return nullptr;
+    }
+
+    return res;
+}
+
+bool IMC_WATCH_add(struct imc_watch *watch, const char *filename)
+{
+    int wd;
+    char *dir_buf;
+    char *name_buf;
+
+    if (!watch || !filename)
+    {
+        return false;
+    }
+
+    if (watch->size >= watch->capacity)
+    {
+        size_t capacity = watch->capacity ? watch->capacity * 2 : 8;
+        struct watch_entry *entries = realloc(watch->entries, capacity * sizeof(struct watch_entry));
+
+        if (!entries)
+        {
+            return false;
+        }
+
+        watch->entries = entries;
+        watch->capacity = capacity;
+    }
+
+    dir_buf = strdup(filename);
+    name_buf = strdup(filename);
+
+    if (!dir_buf || !name_buf)
+    {
+        free(dir_buf);
+        free(name_buf);
+        return false;
+    }
+
+    wd = inotify_add_watch(watch->fd, dirname(dir_buf), WATCH_EVENTS);
+
+    if (wd < 0)
+    {
+        printf("error: failed to watch '%s' (%m)!!\n", filename);
+    }
+    else
+    {
+        watch->entries[watch->size].wd = wd;
+        watch->entries[watch->size].name = cstr_from(basename(name_buf));
+        watch->size++;
+    }
+
+    free(dir_buf);
+    free(name_buf);
+
+    return wd >= 0;
+}
+
+void IMC_WATCH_clear(struct imc_watch *watch)
+{
+    if (!watch)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < watch->size; i++)
+    {
+        inotify_rm_watch(watch->fd, watch->entries[i].wd);
+        cstr_drop(&watch->entries[i].name);
+    }
+
+    watch->size = 0;
+}
+
+static bool watch_matches(struct imc_watch *watch, const struct inotify_event *event)
+{
+    for (size_t i = 0; event->len && i < watch->size; i++)
+    {
+        if (watch->entries[i].wd == event->wd && cstr_equals(&watch->entries[i].name, event->name))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool IMC_WATCH_wait(struct imc_watch *watch, const volatile sig_atomic_t *stop)
+{
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd =
+    {
+        .fd = watch ? watch->fd : -1,
+        .events = POLLIN,
+    };
+
+    if (!watch || *stop)
+    {
+        return false;
+    }
+
+    while (!changed)
+    {
+        ssize_t len = read(watch->fd, buf, sizeof(buf));
+
+        if (len < 0 && errno == EINTR)
+        {
+            if (*stop)
+            {
+                return false;
+            }
+
+            continue;
+        }
+        else if (len <= 0)
+        {
+            printf("error: failed to read inotify events (%m)!!\n");
+            return false;
+        }
+
+        for (ssize_t off = 0; off < len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(buf + off);
+
+            changed = changed || watch_matches(watch, event);
+            off += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    /* editors tend to write in several steps, let them finish */
+    while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0)
+    {
+        if (read(watch->fd, buf, sizeof(buf)) <= 0)
+        {
+            break;
+        }
+    }
+
+    return !*stop;
+}
+
+void IMC_WATCH_free(struct imc_watch *watch)
+{
+    if (!watch)
+    {
+        return;
+    }
+
+    IMC_WATCH_clear(watch);
+    close(watch->fd);
+    free(watch->entries);
+    free(watch);
+}
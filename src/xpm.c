@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "xpm.h"
 
 #include <ctype.h>
@@ -34,6 +36,12 @@ struct color_palette
     struct color colors[VALID_KEY_CHARS_LEN * 2];
 };
 
+struct xpm_stream
+{
+    imc_xpm_write_func_t func;
+    void *closure;
+};
+
 #define CONSTRAIN_COLOR(col) do { if (col.a == 0) { cur.full = 0; } else { col.a = 255; } } while (false)
 
 void filter_c_iden(cstr *s)
@@ -95,31 +103,31 @@ bool palettize(struct color_palette *pal, int width, int height, const void *dat
     return true;
 }
 
-bool IMC_write_xpm(const char *filename, int width, int height, const void *data)
+bool IMC_palettize_xpm(int width, int height, const void *data, size_t *num_colors)
 {
-    bool result = true;
-    bool doublekey = false;
-    char *image_name = strdup(filename);
-    cstr image_name_str = cstr_init();
-    isize image_name_ext_begin = -1;
     struct color_palette palette = {};
-    FILE *out = fopen(filename, "w");
 
-    if (!out)
+    if (!palettize(&palette, width, height, data))
     {
-        printf("error: failed to open file (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
-    if (!image_name)
+    if (num_colors)
     {
-        printf("error: failed to create xpm image name!!\n");
-        goto handle_failure;
+        *num_colors = palette.size + (palette.define_none ? 1 : 0);
     }
 
+    return true;
+}
+
+static bool write_xpm(FILE *out, const char *image_name, int width, int height, const void *data)
+{
+    bool doublekey = false;
+    struct color_palette palette = {};
+
     if (!palettize(&palette, width, height, data))
     {
-        goto handle_failure;
+        return false;
     }
 
     if (palette.size >= VALID_KEY_CHARS_LEN)
@@ -127,57 +135,47 @@ bool IMC_write_xpm(const char *filename, int width, int height, const void *data
         doublekey = true;
     }
 
-    image_name_str = cstr_from(basename(image_name));
-
-    image_name_ext_begin = cstr_find(&image_name_str, ".");
-
-    if (image_name_ext_begin > 0)
-    {
-        cstr_resize(&image_name_str, image_name_ext_begin, ' ');
-    }
-
-    filter_c_iden(&image_name_str);
-
     if (!fprintf(out, "/* XPM */\n"))
     {
         printf("error: failed to write (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
-    if (!fprintf(out, "static char *%s[] = {\n", cstr_str(&image_name_str)))
+    if (!fprintf(out, "static char *%s[] = {\n", image_name))
     {
         printf("error: failed to write (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
-    if (!fprintf(out, "    \"%d %d %lu 1\",\n", width, height, palette.size + (palette.define_none ? 1 : 0)))
+    if (!fprintf(out, "    \"%d %d %lu %d\",\n", width, height, palette.size + (palette.define_none ? 1 : 0),
+                      doublekey ? 2 : 1))
     {
         printf("error: failed to write (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
-    if (palette.define_none && !fprintf(out, "%s    \"  c None\",\n", doublekey ? " " : ""))
+    if (palette.define_none && !fprintf(out, "    \"%s c None\",\n", doublekey ? "  " : " "))
     {
         printf("error: failed to write (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
     for (size_t i = 0; i < palette.size; i++)
     {
-        const char k1 = VALID_KEY_CHARS[i/(VALID_KEY_CHARS_LEN * 2)];
-        const char k2 = VALID_KEY_CHARS[i%(VALID_KEY_CHARS_LEN * 2)];
+        const char k1 = VALID_KEY_CHARS[i/VALID_KEY_CHARS_LEN];
+        const char k2 = VALID_KEY_CHARS[i%VALID_KEY_CHARS_LEN];
         struct color *cur = &palette.colors[i];
 
         if (doublekey && !fprintf(out, "    \"%c%c c #%02X%02X%02X\",\n", k1, k2, cur->r, cur->g, cur->b))
         {
             printf("error: failed to write (%m)!!\n");
-            goto handle_failure;
+            return false;
         }
 
         if (!doublekey && !fprintf(out, "    \"%c c #%02X%02X%02X\",\n", k2, cur->r, cur->g, cur->b))
         {
             printf("error: failed to write (%m)!!\n");
-            goto handle_failure;
+            return false;
         }
     }
 
@@ -186,7 +184,7 @@ bool IMC_write_xpm(const char *filename, int width, int height, const void *data
         if (!fprintf(out, "    \""))
         {
             printf("error: failed to write (%m)!!\n");
-            goto handle_failure;
+            return false;
         }
 
         for (int x = 0; x < width; x++)
@@ -206,18 +204,18 @@ bool IMC_write_xpm(const char *filename, int width, int height, const void *data
 
             if (doublekey)
             {
-                const char k1 = VALID_KEY_CHARS[id/(VALID_KEY_CHARS_LEN * 2)];
-                const char k2 = VALID_KEY_CHARS[id%(VALID_KEY_CHARS_LEN * 2)];
+                const char k1 = VALID_KEY_CHARS[id/VALID_KEY_CHARS_LEN];
+                const char k2 = VALID_KEY_CHARS[id%VALID_KEY_CHARS_LEN];
 
                 if (!cur.full && !fprintf(out, "  "))
                 {
                     printf("error: failed to write (%m)!!\n");
-                    goto handle_failure;
+                    return false;
                 }
                 else if (cur.full && !fprintf(out, "%c%c", k1, k2))
                 {
                     printf("error: failed to write (%m)!!\n");
-                    goto handle_failure;
+                    return false;
                 }
             }
             else
@@ -227,12 +225,12 @@ bool IMC_write_xpm(const char *filename, int width, int height, const void *data
                 if (!cur.full && !fprintf(out, " "))
                 {
                     printf("error: failed to write (%m)!!\n");
-                    goto handle_failure;
+                    return false;
                 }
                 else if (cur.full && !fprintf(out, "%c", k))
                 {
                     printf("error: failed to write (%m)!!\n");
-                    goto handle_failure;
+                    return false;
                 }
             }
         }
@@ -240,22 +238,91 @@ bool IMC_write_xpm(const char *filename, int width, int height, const void *data
         if (!fprintf(out, "\",\n"))
         {
             printf("error: failed to write (%m)!!\n");
-            goto handle_failure;
+            return false;
         }
     }
 
     if (!fprintf(out, "};\n"))
     {
         printf("error: failed to write (%m)!!\n");
-        goto handle_failure;
+        return false;
     }
 
+    return true;
+}
+
+static ssize_t xpm_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    struct xpm_stream *stream = cookie;
+
+    stream->func(stream->closure, (void *)buf, size);
+
+    return size;
+}
+
+bool IMC_write_xpm(const char *filename, int width, int height, const void *data)
+{
+    bool result = false;
+    char *image_name = strdup(filename);
+    cstr image_name_str = cstr_init();
+    isize image_name_ext_begin = -1;
+    FILE *out = fopen(filename, "w");
+
+    if (!out)
+    {
+        printf("error: failed to open file (%m)!!\n");
+        goto out;
+    }
+
+    if (!image_name)
+    {
+        printf("error: failed to create xpm image name!!\n");
+        goto out;
+    }
+
+    image_name_str = cstr_from(basename(image_name));
+
+    image_name_ext_begin = cstr_find(&image_name_str, ".");
+
+    if (image_name_ext_begin > 0)
+    {
+        cstr_resize(&image_name_str, image_name_ext_begin, ' ');
+    }
+
+    filter_c_iden(&image_name_str);
+
+    result = write_xpm(out, cstr_str(&image_name_str), width, height, data);
+
 out:
-    fclose(out);
+    if (out)
+    {
+        fclose(out);
+    }
     free(image_name);
     cstr_drop(&image_name_str);
     return result;
-handle_failure:
-    result = false;
-    goto out;
+}
+
+bool IMC_write_xpm_to_func(imc_xpm_write_func_t func, void *closure, int width, int height, const void *data)
+{
+    bool result;
+    struct xpm_stream stream =
+    {
+        .func = func,
+        .closure = closure,
+    };
+    cookie_io_functions_t io =
+    {
+        .write = xpm_cookie_write,
+    };
+    FILE *out = fopencookie(&stream, "w", io);
+
+    if (!out)
+    {
+        return false;
+    }
+
+    result = write_xpm(out, "image", width, height, data);
+
+    return fclose(out) == 0 && result;
 }